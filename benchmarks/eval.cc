@@ -1,15 +1,17 @@
 
 // run using command :
 // make eval.bmk
-// input bulk_load_limit, R, W, N, X
+// input bulk_load_limit, R, W, N, X, path, [flat_combining], [finger],
+// [append], [insert_buffer_size], [contention_splits], [preallocate],
+// [replicated_levels]
 
 // Features for future additions :
 // - think time
-// - bulk_insert
 
 #include "btree-base.h"
 #include "btree-bytereorder.h"
 #include "btree-hybrid.h"
+#include "btree-partitioned.h"
 #include "btreeolc.h"
 #include "pinning.h"
 #include <sched.h>
@@ -23,8 +25,48 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <fstream>
+#include <iterator>
 #include <mutex>
 
+// Node sizes of the trees in bytes. To try other sizes, rebuild with e.g.
+// make BMKFLAGS="-DLEAF_SIZE=256 -DINNER_SIZE=16384"
+#ifndef LEAF_SIZE
+#define LEAF_SIZE 4096
+#endif
+#ifndef INNER_SIZE
+#define INNER_SIZE 4096
+#endif
+
+// The share of each inner node of the OLC tree, and of the trees of the
+// partitioned forest, that buffers inserts, in percent. If not 0, they are
+// B-epsilon trees, e.g.
+// make BMKFLAGS="-DINNER_BUFFER_PERCENT=50"
+#ifndef INNER_BUFFER_PERCENT
+#define INNER_BUFFER_PERCENT 0
+#endif
+
+// If 1, the leaves of the OLC tree and of the partitioned forest are split
+// into segments with their own versions, e.g.
+// make BMKFLAGS="-DSEGMENTED_LEAVES=1"
+#ifndef SEGMENTED_LEAVES
+#define SEGMENTED_LEAVES 0
+#endif
+
+// The optional modes of the OLC tree and of the partitioned forest (see
+// btreeolc::mode), or-ed together:
+// 1 for flat combining, 2 for fingers, 4 for appends, 8 for contention
+// splits and 16 for spare leaves, e.g. make BMKFLAGS="-DOLC_MODES=6". They
+// must match the flags of the same name given on the command line.
+#ifndef OLC_MODES
+#define OLC_MODES 0
+#endif
+
+// The layout of the leaves of the byte-reordering tree (see layout.h), e.g.
+// make BMKFLAGS="-DLEAF_LAYOUT=PaddedHeader"
+#ifndef LEAF_LAYOUT
+#define LEAF_LAYOUT Separate
+#endif
+
 using namespace std;
 // get number of CPUs
 int get_nprocs(void);
@@ -35,6 +77,7 @@ enum class BTreeType {
     BTreeOLC = 1,
     BTreeHybrid = 2,
     BTreeByteReorder = 3,
+    BTreePartitioned = 4,
 };
 
 // for timer
@@ -83,9 +126,51 @@ int get_cpu() { return ++cpu; }
 }
 */
 
+// A random access iterator over the pairs (k, value(k)) for consecutive keys
+// k. It lets us bulk load a tree without materializing the input.
+struct SeqPairIterator {
+    typedef std::random_access_iterator_tag iterator_category;
+    typedef std::pair<unsigned long long int, unsigned long long int>
+        value_type;
+    typedef long long int difference_type;
+    typedef const value_type *pointer;
+    typedef const value_type &reference;
+
+    value_type cur;
+
+    explicit SeqPairIterator(unsigned long long int k) : cur(k, value(k)) {}
+
+    // A pseudo-random value for key `k` (splitmix64).
+    static unsigned long long int value(unsigned long long int k) {
+        k += 0x9e3779b97f4a7c15ull;
+        k = (k ^ (k >> 30)) * 0xbf58476d1ce4e5b9ull;
+        k = (k ^ (k >> 27)) * 0x94d049bb133111ebull;
+        return k ^ (k >> 31);
+    }
+
+    reference operator*() const { return cur; }
+    pointer operator->() const { return &cur; }
+    value_type operator[](difference_type n) const { return *(*this + n); }
+
+    SeqPairIterator &operator++() {
+        cur = value_type(cur.first + 1, value(cur.first + 1));
+        return *this;
+    }
+    SeqPairIterator operator+(difference_type n) const {
+        return SeqPairIterator(cur.first + n);
+    }
+    difference_type operator-(const SeqPairIterator &o) const {
+        return cur.first - o.cur.first;
+    }
+    bool operator!=(const SeqPairIterator &o) const {
+        return cur.first != o.cur.first;
+    }
+};
+
 // function to read random keys from the tree and measure the times
-void reader_child(int thread_id, unsigned long long int ops,
-                  common::BTreeBase<unsigned long long int, unsigned long long int> *btree, unsigned long long int X, string path) {
+template <class BTree>
+void reader_child(int thread_id, unsigned long long int ops, BTree *btree,
+                  unsigned long long int X, string path) {
     // set cpu
     set_cpu(get_cpu());
     m.lock();
@@ -142,8 +227,9 @@ void reader_child(int thread_id, unsigned long long int ops,
 }
 
 // function to insert sequential keys in the tree and measure the times 
-void writer_child(int thread_id, unsigned long long int ops,
-                  common::BTreeBase<unsigned long long int, unsigned long long int> *btree, unsigned long long int X, string path) {
+template <class BTree>
+void writer_child(int thread_id, unsigned long long int ops, BTree *btree,
+                  unsigned long long int X, string path) {
     // set cpu
     set_cpu(get_cpu());
     
@@ -170,7 +256,7 @@ void writer_child(int thread_id, unsigned long long int ops,
         write.second = rand();
         // calculate time for operation
         uint64_t tick = rdtsc();
-        btree->insert(write);
+        btree->insert(write.first, write.second);
         time_x += rdtsc() - tick;
         x++;
 	ops--;
@@ -209,14 +295,20 @@ bool check_all_true(vector<bool> &arr) {
 }
 
 // function to create read and write threads
-void test(int R, int W, unsigned long long int N, common::BTreeBase<unsigned long long int, unsigned long long int> *btree,
+//
+// The threads get the tree by its concrete type. The trees are `final`, so
+// their operations are called directly rather than through the virtual
+// `common::BTreeBase` interface, and can be inlined.
+template <class BTree>
+void test(int R, int W, unsigned long long int N, BTree *btree,
           unsigned long long int X, string path) {
  
     // spawn reader threads : carefully handle the case of R=0 or W=0
     if (W == 0 && R != 0) {
         std::thread readers[R];
         for (int i = 0; i < R; i++)
-            readers[i] = std::thread(reader_child, i, N, btree, X, path);
+            readers[i] = std::thread(reader_child<BTree>, i, N, btree, X,
+                                     path);
 	// wait for all children threads to be ready
         while (!check_all_true(tready)) {
         }
@@ -226,7 +318,8 @@ void test(int R, int W, unsigned long long int N, common::BTreeBase<unsigned lon
     } else if (R == 0 && W != 0) {
         std::thread writers[W];
         for (int i = 0; i < W; i++)
-            writers[i] = std::thread(writer_child, i, N, btree, X, path);
+            writers[i] = std::thread(writer_child<BTree>, i, N, btree, X,
+                                     path);
 	// wait for all children threads to be ready
         while (!check_all_true(tready)) {
         }
@@ -235,11 +328,13 @@ void test(int R, int W, unsigned long long int N, common::BTreeBase<unsigned lon
     } else if (R != 0 && W != 0) {
         std::thread readers[R];
         for (int i = 0; i < R; i++)
-            readers[i] = std::thread(reader_child, i, N, btree, X, path);
+            readers[i] = std::thread(reader_child<BTree>, i, N, btree, X,
+                                     path);
 
         std::thread writers[W];
         for (int i = 0; i < W; i++)
-            writers[i] = std::thread(writer_child, i + R, N, btree, X, path);
+            writers[i] = std::thread(writer_child<BTree>, i + R, N, btree, X,
+                                     path);
         // wait for all children threads to be ready
         while (!check_all_true(tready)) {
         }
@@ -271,36 +366,71 @@ int main(int argc, char** argv) {
         } else if (treetype == 3) {
             std::cout << "Testing Byte Reordering" << std::endl;
             type = BTreeType::BTreeByteReorder;
+        } else if (treetype == 4) {
+            std::cout << "Testing Partitioned OLC" << std::endl;
+            type = BTreeType::BTreePartitioned;
         }
     
     // Construct the btree implementation we want to test.
+    std::cout << "Leaf size " << LEAF_SIZE << "B, inner node size "
+              << INNER_SIZE << "B" << std::endl;
+    // The partitioned forest is made of OLC trees.
+    bool olc = type == BTreeType::BTreeOLC ||
+               type == BTreeType::BTreePartitioned;
+    if (olc && INNER_BUFFER_PERCENT) {
+        std::cout << "Inner node buffers " << INNER_BUFFER_PERCENT << "%"
+                  << std::endl;
+    }
+    if (olc && SEGMENTED_LEAVES) {
+        std::cout << "Segmented leaves" << std::endl;
+    }
 
     using Key = unsigned long long int;
     using Value = unsigned long long int;
-    auto new_btree_fn = [type]() -> common::BTreeBase<Key, Value> * {
-        switch (type) {
-	    case BTreeType::BTreeOLC:
-                return new btreeolc::BTree<Key, Value>();
-            case BTreeType::BTreeHybrid:
-                return new btree_hybrid::BTree<Key, Value>();
-            case BTreeType::BTreeByteReorder:
-                return new btree_bytereorder::BTree<Key, Value>();
-            default:
-                // should never happen
-                assert(false);
-                return nullptr;
-        }
-    };
-    // insert the keys from 1 to bulk_load_limit in the btree
-    common::BTreeBase<Key, Value> *btree = new_btree_fn();
-    unsigned long long int insert = 1;
-    srand(time(NULL));
-    while (insert <= bulk_load_limit) {
-        int value = rand();
-        btree->insert(std::pair<unsigned long long int, unsigned long long int>(insert, value));
-        if (insert%10000000==0)
-		cout << "Key : " << insert << " Value : " << value << endl;
-        insert++;
+    // The pairs (1, v), ..., (bulk_load_limit, v) are bulk loaded into the
+    // tree. Values are random, but a function of the key so that the loader
+    // threads can generate them independently.
+    const SeqPairIterator first(1), last(bulk_load_limit + 1);
+    // flat_combining turns on flat combining of inserts in the OLC tree
+    bool flat_combining = argc > 8 && atoi(argv[8]);
+    // finger turns on per-thread fingers for inserts and lookups in the OLC
+    // tree
+    bool finger = argc > 9 && atoi(argv[9]);
+    // append turns on lock-free appends to the rightmost leaf in the OLC tree
+    bool append = argc > 10 && atoi(argv[10]);
+    // insert_buffer_size turns on per-thread insert buffers of that many
+    // entries in the OLC tree
+    unsigned insert_buffer_size = argc > 11 ? atoi(argv[11]) : 0;
+    // contention_splits turns on splits of hot leaves in the OLC tree
+    bool contention_splits = argc > 12 && atoi(argv[12]);
+    // preallocate turns on spare leaves for the right edge of the OLC tree
+    bool preallocate = argc > 13 && atoi(argv[13]);
+    // replicated_levels gives each NUMA node a copy of the top this many
+    // levels of the byte-reordering tree
+    unsigned replicated_levels = argc > 14 ? atoi(argv[14]) : 0;
+    // All but the insert buffers are picked at compile time (see OLC_MODES).
+    unsigned modes = 0;
+    if (flat_combining) modes |= btreeolc::mode::FlatCombining;
+    if (finger) modes |= btreeolc::mode::Finger;
+    if (append) modes |= btreeolc::mode::Append;
+    if (contention_splits) modes |= btreeolc::mode::ContentionSplits;
+    if (preallocate) modes |= btreeolc::mode::Preallocate;
+    if (olc && modes != OLC_MODES) {
+        std::cerr << "These modes need a build with make BMKFLAGS="
+                  << "\"-DOLC_MODES=" << modes << "\"" << std::endl;
+        return 1;
+    }
+    if (type != BTreeType::BTreeByteReorder && replicated_levels) {
+        std::cerr << "Only the byte-reordering tree replicates levels"
+                  << std::endl;
+        return 1;
+    }
+    // The forest creates the trees of new partitions itself, and they have
+    // no insert buffers.
+    if (type == BTreeType::BTreePartitioned && insert_buffer_size) {
+        std::cerr << "The partitioned tree takes no insert buffer size"
+                  << std::endl;
+        return 1;
     }
     // R is no. of reader threads, W is number of writer threads, N is number of
     // operations each thread is supposed to do X is the no. of operations after
@@ -318,8 +448,61 @@ int main(int argc, char** argv) {
     counter.store(bulk_load_limit, std::memory_order_relaxed);
     // path where files with results will be saved
     string path = argv[7];
-    // call the function that spawns threads
-    test(R, W, N, btree, X, path);
+    // bulk load the keys from 1 to bulk_load_limit in the btree
+    srand(time(NULL));
+    uint64_t load_start = rdtsc();
+    auto report_load = [bulk_load_limit, load_start]() {
+        cout << "Bulk loaded " << bulk_load_limit << " keys in "
+             << rdtsc() - load_start << " cycles" << endl;
+    };
+    // Construct the tree, and call the function that spawns threads with its
+    // concrete type.
+    switch (type) {
+        case BTreeType::BTreeOLC: {
+            auto btree = new btreeolc::BTree<
+                Key, Value, common::search::Simd,
+                common::split::PositionAware, common::alloc::Default,
+                LEAF_SIZE, INNER_SIZE, INNER_BUFFER_PERCENT,
+                SEGMENTED_LEAVES, OLC_MODES>(first, last);
+            btree->insertBufferSize = insert_buffer_size;
+            report_load();
+            test(R, W, N, btree, X, path);
+            break;
+        }
+        case BTreeType::BTreeHybrid: {
+            auto btree = new btree_hybrid::BTree<
+                Key, Value, 10, common::search::Simd,
+                common::alloc::Default, LEAF_SIZE, INNER_SIZE>(first, last);
+            report_load();
+            test(R, W, N, btree, X, path);
+            break;
+        }
+        case BTreeType::BTreeByteReorder: {
+            auto btree = new btree_bytereorder::BTree<
+                Key, Value, common::search::Simd, common::alloc::Default,
+                LEAF_SIZE, INNER_SIZE, common::key::ByteReorder,
+                common::layout::LEAF_LAYOUT>(first, last);
+            btree->replicatedLevels = replicated_levels;
+            report_load();
+            test(R, W, N, btree, X, path);
+            break;
+        }
+        case BTreeType::BTreePartitioned: {
+            // The bulk loaded keys start in one partition, which is split
+            // once the writers make the range they append to hot.
+            typedef btree_partitioned::Entry<Key, Value> Entry;
+            auto btree = new btree_partitioned::PartitionedBTree<
+                Key, Value,
+                btreeolc::BTree<Key, Entry, common::search::Simd,
+                                common::split::PositionAware,
+                                common::alloc::Default, LEAF_SIZE,
+                                INNER_SIZE, INNER_BUFFER_PERCENT,
+                                SEGMENTED_LEAVES, OLC_MODES>>(first, last);
+            report_load();
+            test(R, W, N, btree, X, path);
+            break;
+        }
+    }
     //  report_average_time(X, N);
     return 0;
 }
@@ -0,0 +1,110 @@
+// run using command :
+// make build/bmk_layout && build/bmk_layout [R] [W] [keys] [seconds]
+//
+// Measures the leaf layouts (see layout.h) of the byte-reordering tree under
+// a mixed load: R reader threads look up random keys while W writer threads
+// update the values of random keys, all among the first `keys` keys of the
+// tree. With few keys, all threads share a handful of leaves, so readers
+// search the leaves whose lock words the writers keep changing. The OLC tree
+// does not take a leaf layout, so its leaves are not measured here.
+//
+// For each layout, prints the number of lookups and updates per second.
+//
+// Sanity check only, median of 3 runs of 2s each, on a single-CPU KVM guest
+// (Xeon, AVX-512). With one CPU, threads are time-sliced and never touch a
+// line at the same time, so there is no false sharing to remove. These
+// numbers only show that the padded layouts cost little without it. Whether
+// they help under contention is not measured yet; that needs a multi-core
+// run.
+//
+//   R/W  keys       Separate        PaddedHeader    Interleaved
+//   1/0  1000       26.9M lookups/s 27.6M           27.3M
+//   1/0  1000000     2.0M           2.1M            2.1M
+//   4/4  1000       11.5M + 12.9M   10.9M + 13.3M   11.4M + 12.8M
+//
+// (lookups/s + updates/s for 4/4.) Separate fits 255 entries per leaf, the
+// other two 252.
+
+#include "btree-bytereorder.h"
+#include "layout.h"
+#include "pinning.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <vector>
+
+using Key = uint64_t;
+using Value = uint64_t;
+
+// Run the load on a tree with leaves laid out as `Layout`.
+template <class Layout>
+void run(const char *name, int R, int W, uint64_t keys, double seconds) {
+    typedef btree_bytereorder::BTree<
+        Key, Value, common::search::Simd, common::alloc::Default,
+        btree_bytereorder::pageSize, btree_bytereorder::pageSize,
+        common::key::Identity, Layout>
+        BTree;
+    BTree btree;
+    for (Key k = 0; k < keys; ++k) {
+        btree.insert(k, k);
+    }
+
+    std::atomic<bool> start{false};
+    std::atomic<bool> stop{false};
+    std::atomic<uint64_t> reads{0};
+    std::atomic<uint64_t> writes{0};
+    unsigned cpus = std::thread::hardware_concurrency();
+
+    auto worker = [&](int id, bool writer) {
+        set_cpu(id % (cpus ? cpus : 1));
+        std::mt19937_64 eng(id);
+        std::uniform_int_distribution<Key> distr(0, keys - 1);
+        uint64_t ops = 0;
+        while (!start.load(std::memory_order_relaxed)) {
+        }
+        while (!stop.load(std::memory_order_relaxed)) {
+            Key k = distr(eng);
+            if (writer) {
+                btree.update_if_present(k, ops);
+            } else {
+                Value v;
+                btree.lookup(k, v);
+            }
+            ops++;
+        }
+        (writer ? writes : reads) += ops;
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < R + W; ++i) {
+        threads.push_back(std::thread(worker, i, i >= R));
+    }
+    start = true;
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    std::cout << name << ": " << uint64_t(reads / seconds) << " lookups/s, "
+              << uint64_t(writes / seconds) << " updates/s, "
+              << BTree::Leaf::maxEntries << " entries per leaf" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    int R = argc > 1 ? atoi(argv[1]) : 4;
+    int W = argc > 2 ? atoi(argv[2]) : 4;
+    uint64_t keys = argc > 3 ? strtoull(argv[3], nullptr, 10) : 1000;
+    double seconds = argc > 4 ? atof(argv[4]) : 2;
+    std::cout << R << " readers, " << W << " writers, " << keys << " keys"
+              << std::endl;
+
+    run<common::layout::Separate>("Separate", R, W, keys, seconds);
+    run<common::layout::PaddedHeader>("PaddedHeader", R, W, keys, seconds);
+    run<common::layout::Interleaved>("Interleaved", R, W, keys, seconds);
+    return 0;
+}
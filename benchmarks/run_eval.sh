@@ -9,6 +9,13 @@
 #      B : Initial bulk load                                         #
 #      N : Number of operations per thread                           #
 #      X : Number of operations after which each thread reports      #
+#      F : Flat combining of inserts in the OLC tree (0 or 1)        #
+#      G : Per-thread fingers in the OLC tree (0 or 1)               #
+#      A : Lock-free appends in the OLC tree (0 or 1)                #
+#      U : Per-thread insert buffer size in the OLC tree (0 = none)  #
+#      S : Splits of hot leaves in the OLC tree (0 or 1)             #
+#      P : Spare leaves for the right edge of the OLC tree (0 or 1)  #
+#      L : Top levels of the BR tree copied per NUMA node (0 = none) #
 #                                                                    #
 #  References:                                                       #
 #      - http://tuxtweaks.com/2014/05/bash-getopts/                  #
@@ -26,6 +33,13 @@ T=1
 B=1000000000
 N=1000000000
 X=100000
+F=0
+G=0
+A=0
+U=0
+S=0
+P=0
+L=0
 
 # Set fonts for Help.
 NORM=`tput sgr0`
@@ -35,16 +49,24 @@ REV=`tput smso`
 # Help function
 function HELP {
   echo -e \\n"Help documentation for ${BOLD}${SCRIPT}.${NORM}"\\n
-  echo -e "${REV}Basic usage:${NORM} ${BOLD}$SCRIPT [-i R1] [-j R2] [-c W1] [-d W2] [-t T] [-b B] [-n N] [-x X]${NORM}"\\n
+  echo -e "${REV}Basic usage:${NORM} ${BOLD}$SCRIPT [-i R1] [-j R2] [-c W1] [-d W2] [-t T] [-b B] [-n N] [-x X] [-f F] [-g G] [-a A] [-u U] [-s S] [-p P] [-l L]${NORM}"\\n
   echo "Command line switches are optional. The following switches are recognized."
   echo "${REV}-i${NORM}  --Sets the start value for the number of read threads ${BOLD}i${NORM}. Default is ${BOLD}1${NORM}."
   echo "${REV}-j${NORM}  --Sets the end value for the number of read threads ${BOLD}j${NORM}. Default is ${BOLD}1${NORM}."
   echo "${REV}-c${NORM}  --Sets the start value for the number of write threads ${BOLD}c${NORM}. Default is ${BOLD}1${NORM}."
   echo "${REV}-d${NORM}  --Sets the end value for the number of write threads ${BOLD}d${NORM}. Default is ${BOLD}1${NORM}."
-  echo "${REV}-t${NORM}  --Sets the value for tree type ${BOLD}t${NORM}, where [1 - OLC, 2 - Auxiliary Structure, 3 - Byte-Reordering]. Default is ${BOLD}1${NORM}."
+  echo "${REV}-t${NORM}  --Sets the value for tree type ${BOLD}t${NORM}, where [1 - OLC, 2 - Auxiliary Structure, 3 - Byte-Reordering, 4 - Partitioned OLC]. Default is ${BOLD}1${NORM}."
   echo "${REV}-b${NORM}  --Sets the value for bulk load limit ${BOLD}b${NORM}. Default is ${BOLD}1000000000${NORM}."
   echo "${REV}-n${NORM}  --Sets the value for number of operations per thread ${BOLD}n${NORM}. Default is ${BOLD}1000000000${NORM}."
   echo "${REV}-x${NORM}  --Sets the value for number of operations to report time for ${BOLD}n${NORM}. Default is ${BOLD}100000${NORM}."
+  echo "${REV}-f${NORM}  --Turns flat combining of inserts in the OLC tree on (1) or off (0) ${BOLD}f${NORM}. Default is ${BOLD}0${NORM}."
+  echo "${REV}-g${NORM}  --Turns per-thread fingers in the OLC tree on (1) or off (0) ${BOLD}g${NORM}. Default is ${BOLD}0${NORM}."
+  echo "${REV}-a${NORM}  --Turns lock-free appends to the rightmost leaf in the OLC tree on (1) or off (0) ${BOLD}a${NORM}. Default is ${BOLD}0${NORM}."
+  echo "${REV}-u${NORM}  --Sets the size of the per-thread insert buffers in the OLC tree ${BOLD}u${NORM}, or 0 for none. Default is ${BOLD}0${NORM}."
+  echo "${REV}-s${NORM}  --Turns splits of hot, non-full leaves in the OLC tree on (1) or off (0) ${BOLD}s${NORM}. Default is ${BOLD}0${NORM}."
+  echo "${REV}-p${NORM}  --Turns spare leaves for the right edge of the OLC tree on (1) or off (0) ${BOLD}p${NORM}. Default is ${BOLD}0${NORM}."
+  echo "${REV}-l${NORM}  --Sets the number of top levels of the byte-reordering tree copied to each NUMA node ${BOLD}l${NORM}, or 0 for none. Default is ${BOLD}0${NORM}."
+  echo "The OLC modes of -f, -g, -a, -s and -p are compiled into bmk_eval. Build it with the matching ${BOLD}make BMKFLAGS=\"-DOLC_MODES=...\"${NORM} first (see benchmarks/eval.cc)."
   echo -e "${REV}-h${NORM}  --Displays this help message. No further functions are performed."\\n
   echo -e "Example: ${BOLD}$SCRIPT -r1 10 -r2 20 -w1 10 -w2 20 -t 3${NORM}"\\n
   exit 1
@@ -64,7 +86,7 @@ fi
 #Notice there is no ":" after "h". The leading ":" suppresses error messages from
 #getopts. This is required to get my unrecognized option code to work.
 
-while getopts :i:j:c:d:t:b:n:x:h FLAG; do
+while getopts :i:j:c:d:t:b:n:x:f:g:a:u:s:p:l:h FLAG; do
   case $FLAG in
     i)  #set option "i"
       R1=$OPTARG
@@ -106,6 +128,41 @@ while getopts :i:j:c:d:t:b:n:x:h FLAG; do
       echo "-x used: $OPTARG"
       echo "X = $X"
       ;;
+    f)  #set option "f"
+      F=$OPTARG
+      echo "-f used: $OPTARG"
+      echo "F = $F"
+      ;;
+    g)  #set option "g"
+      G=$OPTARG
+      echo "-g used: $OPTARG"
+      echo "G = $G"
+      ;;
+    a)  #set option "a"
+      A=$OPTARG
+      echo "-a used: $OPTARG"
+      echo "A = $A"
+      ;;
+    u)  #set option "u"
+      U=$OPTARG
+      echo "-u used: $OPTARG"
+      echo "U = $U"
+      ;;
+    s)  #set option "s"
+      S=$OPTARG
+      echo "-s used: $OPTARG"
+      echo "S = $S"
+      ;;
+    p)  #set option "p"
+      P=$OPTARG
+      echo "-p used: $OPTARG"
+      echo "P = $P"
+      ;;
+    l)  #set option "l"
+      L=$OPTARG
+      echo "-l used: $OPTARG"
+      echo "L = $L"
+      ;;
     h)  #show help
       HELP
       ;;
@@ -142,10 +199,10 @@ do
     do
 	# Set the directory into which the experiment data will be stored
 	EXPT_TIME=`date '+%Y-%m-%d-%H-%M-%S'`
-	EXPT_DIR="${RESULTS_DIR}/${EXPT_TIME}_r${i}_w${j}_t${T}_b${B}_n${N}_x${X}"
+	EXPT_DIR="${RESULTS_DIR}/${EXPT_TIME}_r${i}_w${j}_t${T}_b${B}_n${N}_x${X}_f${F}_g${G}_a${A}_u${U}_s${S}_p${P}_l${L}"
 	sudo mkdir $EXPT_DIR
 	echo "Starting experiment $EXPT_DIR"
-        sudo su -c "../build/bmk_eval $T $B $i $j $N $X \"$EXPT_DIR/\" > \"${EXPT_DIR}/expt.log\""
+        sudo su -c "../build/bmk_eval $T $B $i $j $N $X \"$EXPT_DIR/\" $F $G $A $U $S $P $L > \"${EXPT_DIR}/expt.log\""
 	echo "Experiment $EXPT_DIR ended"
     done
 done
@@ -0,0 +1,299 @@
+#ifndef _BTREE_ALLOC_H_
+#define _BTREE_ALLOC_H_
+
+/*
+ * Node allocators.
+ *
+ * Every split allocates a node, and every node is a page-sized object. Going
+ * through malloc for each of them is slow in split-heavy phases, and it
+ * scatters the nodes of a big tree over regular 4KB pages, so that most
+ * node accesses miss in the TLB.
+ *
+ * The node types take one of the following policies as a template argument
+ * and use it for their `operator new` and `operator delete`:
+ * - `Malloc`: plain global `new` and `delete`.
+ * - `HugePages<NumaNode>`: nodes are carved out of 2MB arenas that are
+ *   mmap'ed 2MB-aligned and madvise'd to be backed by transparent huge
+ *   pages. If `NumaNode` is not -1, the arenas are bound to that NUMA node.
+ *
+ * `HugePages` keeps a cache per thread: a free list per size class and the
+ * arena the thread is currently carving nodes from. Allocation and
+ * deallocation only touch the cache of the calling thread, except when a
+ * free list runs empty and is refilled from the shared pool. When a thread
+ * exits, its free lists and the rest of its arena go back to the shared pool.
+ *
+ * Memory is never given back to the OS. Freed nodes are reused for new nodes
+ * of the same size class instead. Size classes are powers of two from 64B to
+ * the arena size.
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace common {
+
+namespace alloc {
+
+// Plain global `new` and `delete`.
+struct Malloc {
+    static void *allocate(size_t size) { return ::operator new(size); }
+    static void deallocate(void *p, size_t size) {
+        (void)size;
+        ::operator delete(p);
+    }
+};
+
+namespace detail {
+
+// The size of an arena.
+static const size_t ArenaSize = 2 * 1024 * 1024;
+
+// Size classes are the powers of two from 2^MinClassShift to the arena size.
+static const unsigned MinClassShift = 6;
+static const unsigned NumClasses = 21 - MinClassShift + 1;
+
+// The number of nodes moved between a thread's free list and the shared pool
+// at once.
+static const size_t BatchSize = 64;
+
+// The size class of an object of `size` bytes.
+inline unsigned sizeClass(size_t size) {
+    assert(size <= ArenaSize);
+    unsigned shift = MinClassShift;
+    while ((size_t(1) << shift) < size) shift++;
+    return shift - MinClassShift;
+}
+
+// The size of the objects in size class `cls`.
+inline size_t classSize(unsigned cls) {
+    return size_t(1) << (cls + MinClassShift);
+}
+
+// A freed object, linked into a free list.
+struct FreeNode {
+    FreeNode *next;
+};
+
+// Map a new arena, aligned to its size so that it can be backed by a single
+// huge page, and bind it to `numaNode` unless that is -1.
+inline char *mapArena(int numaNode) {
+    // Map twice the size and cut off the unaligned ends.
+    size_t len = 2 * ArenaSize;
+    void *p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) throw std::bad_alloc();
+
+    uintptr_t start = reinterpret_cast<uintptr_t>(p);
+    uintptr_t aligned = (start + ArenaSize - 1) & ~(ArenaSize - 1);
+    if (aligned > start) {
+        munmap(p, aligned - start);
+    }
+    uintptr_t end = start + len;
+    if (end > aligned + ArenaSize) {
+        munmap(reinterpret_cast<void *>(aligned + ArenaSize),
+               end - aligned - ArenaSize);
+    }
+
+    char *arena = reinterpret_cast<char *>(aligned);
+
+    // Both are only hints; without THP or NUMA support, we still get memory.
+    madvise(arena, ArenaSize, MADV_HUGEPAGE);
+    if (numaNode >= 0 && numaNode < 64) {
+        const int MpolBind = 2;  // MPOL_BIND from <linux/mempolicy.h>
+        unsigned long mask = 1ul << numaNode;
+        syscall(SYS_mbind, arena, ArenaSize, MpolBind, &mask,
+                sizeof(mask) * 8, 0);
+    }
+
+    return arena;
+}
+
+// The cache of a thread. It is trivially destructible, so that it can still
+// be used (through the shared pool) while the thread is being torn down.
+struct ThreadCache {
+    FreeNode *freeLists[NumClasses];
+    size_t freeCounts[NumClasses];
+
+    // The part of the current arena that has not been handed out yet.
+    char *cur;
+    char *end;
+
+    // Set once the cache has been given back to the pool.
+    bool dead;
+};
+
+// The state shared by all threads using the same `HugePages` allocator.
+class Pool {
+    std::mutex lock;
+
+    // Nodes given back by threads.
+    std::vector<FreeNode *> freeLists[NumClasses];
+
+    // The unused ends of the arenas of exited threads.
+    std::vector<std::pair<char *, char *>> spares;
+
+    int numaNode;
+
+public:
+    explicit Pool(int numaNode) : numaNode(numaNode) {}
+
+    // Move up to `BatchSize` nodes of class `cls` to `cache`. Returns false
+    // if there were none.
+    bool refill(ThreadCache &cache, unsigned cls) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto &list = freeLists[cls];
+        if (list.empty()) return false;
+        for (size_t i = 0; i < BatchSize && !list.empty(); ++i) {
+            FreeNode *node = list.back();
+            list.pop_back();
+            node->next = cache.freeLists[cls];
+            cache.freeLists[cls] = node;
+            cache.freeCounts[cls]++;
+        }
+        return true;
+    }
+
+    // Give a new arena (or the rest of an old one) to `cache`.
+    void newArena(ThreadCache &cache) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (!spares.empty()) {
+                cache.cur = spares.back().first;
+                cache.end = spares.back().second;
+                spares.pop_back();
+                return;
+            }
+        }
+        cache.cur = mapArena(numaNode);
+        cache.end = cache.cur + ArenaSize;
+    }
+
+    // Take back a single node of class `cls`.
+    void put(FreeNode *node, unsigned cls) {
+        std::lock_guard<std::mutex> guard(lock);
+        freeLists[cls].push_back(node);
+    }
+
+    // Take back `n` nodes of class `cls` from the free list of `cache`.
+    void drain(ThreadCache &cache, unsigned cls, size_t n) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t i = 0; i < n && cache.freeLists[cls]; ++i) {
+            FreeNode *node = cache.freeLists[cls];
+            cache.freeLists[cls] = node->next;
+            cache.freeCounts[cls]--;
+            freeLists[cls].push_back(node);
+        }
+    }
+
+    // Take back everything in `cache`, whose thread is exiting.
+    void donate(ThreadCache &cache) {
+        for (unsigned cls = 0; cls < NumClasses; ++cls) {
+            drain(cache, cls, cache.freeCounts[cls]);
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        if (cache.cur != cache.end) {
+            spares.push_back(std::make_pair(cache.cur, cache.end));
+        }
+        cache.cur = cache.end = nullptr;
+    }
+};
+
+}  // namespace detail
+
+// Nodes are carved out of 2MB huge-page arenas, optionally bound to NUMA node
+// `NumaNode`. Each value of `NumaNode` has its own pool of memory.
+template <int NumaNode = -1>
+struct HugePages {
+    static void *allocate(size_t size) {
+        unsigned cls = detail::sizeClass(size);
+        detail::ThreadCache &cache = threadCache();
+
+        if (!cache.freeLists[cls] && !cache.dead) {
+            pool().refill(cache, cls);
+        }
+        if (cache.freeLists[cls]) {
+            detail::FreeNode *node = cache.freeLists[cls];
+            cache.freeLists[cls] = node->next;
+            cache.freeCounts[cls]--;
+            return node;
+        }
+
+        // Carve a new node out of the arena, aligned to its size (or to a
+        // page for bigger nodes).
+        size_t objSize = detail::classSize(cls);
+        uintptr_t align = objSize < 4096 ? objSize : 4096;
+        uintptr_t cur = reinterpret_cast<uintptr_t>(cache.cur);
+        cur = (cur + align - 1) & ~(align - 1);
+        if (!cache.cur ||
+            cur + objSize > reinterpret_cast<uintptr_t>(cache.end)) {
+            pool().newArena(cache);
+            cur = reinterpret_cast<uintptr_t>(cache.cur);
+            cur = (cur + align - 1) & ~(align - 1);
+        }
+        cache.cur = reinterpret_cast<char *>(cur + objSize);
+        return reinterpret_cast<void *>(cur);
+    }
+
+    static void deallocate(void *p, size_t size) {
+        unsigned cls = detail::sizeClass(size);
+        detail::FreeNode *node = static_cast<detail::FreeNode *>(p);
+        detail::ThreadCache &cache = threadCache();
+
+        // Threads that are exiting give their nodes straight to the pool.
+        if (cache.dead) {
+            pool().put(node, cls);
+            return;
+        }
+
+        node->next = cache.freeLists[cls];
+        cache.freeLists[cls] = node;
+        cache.freeCounts[cls]++;
+
+        // Don't let a thread that frees more than it allocates hoard nodes.
+        if (cache.freeCounts[cls] >= 4 * detail::BatchSize) {
+            pool().drain(cache, cls, 2 * detail::BatchSize);
+        }
+    }
+
+private:
+    // The pool is never destroyed, because nodes may still be freed while
+    // static objects are destroyed at exit.
+    static detail::Pool &pool() {
+        static detail::Pool *p = new detail::Pool(NumaNode);
+        return *p;
+    }
+
+    // Gives the cache of a thread back to the pool when the thread exits.
+    struct CacheOwner {
+        detail::ThreadCache *cache;
+        ~CacheOwner() {
+            pool().donate(*cache);
+            cache->dead = true;
+        }
+    };
+
+    static detail::ThreadCache &threadCache() {
+        // Zero-initialized, so it needs no constructor.
+        static thread_local detail::ThreadCache cache;
+        static thread_local CacheOwner owner{&cache};
+        (void)owner;
+        return cache;
+    }
+};
+
+// The allocator used by the trees unless told otherwise.
+typedef HugePages<> Default;
+
+}  // namespace alloc
+
+}  // namespace common
+
+#endif
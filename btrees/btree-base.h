@@ -1,8 +1,11 @@
 #ifndef _BTREE_BTREE_BASE_H
 #define _BTREE_BTREE_BASE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#include <functional>
+
 namespace common {
 
 /*
@@ -13,14 +16,52 @@ namespace common {
  */
 template <class Key, class Value>
 struct BTreeBase {
+    virtual ~BTreeBase() {}
+
     // Insert the (k, v) pair into the tree.
     virtual void insert(Key k, Value v) = 0;
 
+    // The following operations each find `k` once and read and write its
+    // value as a single step, so that no other writer of `k` can come in
+    // between.
+
+    // Insert the (k, v) pair unless `k` is in the btree already. Return true
+    // if the pair was inserted.
+    virtual bool insert_if_absent(Key k, Value v) = 0;
+
+    // Set the value associated with `k` to `v` if `k` is in the btree.
+    // Return true if it was.
+    virtual bool update_if_present(Key k, Value v) = 0;
+
+    // If `k` is in the btree, set `result` to the value associated with it.
+    // Otherwise, insert the (k, v) pair and set `result` to `v`. Return true
+    // if the pair was inserted.
+    virtual bool get_or_insert(Key k, Value v, Value &result) = 0;
+
+    // Apply `fn` to the value associated with `k` in place. If `k` is not in
+    // the btree, it is inserted with a value-initialized `Value` that `fn` is
+    // applied to. Return true if `k` was inserted.
+    virtual bool upsert(Key k, const std::function<void(Value &)> &fn) = 0;
+
     // Lookup key `k` in the btree. If `k` is in the btree, set `result` to the
     // value associated with `k` and return true. If `k` is not in the btree,
     // return false.
     virtual bool lookup(Key k, Value &result) = 0;
 
+    // Lookup the `n` keys in `keys`. For each `i`, set `found[i]` and
+    // `results[i]` as `lookup(keys[i], results[i])` would. Implementations may
+    // override this to overlap the cache misses of independent lookups.
+    virtual void lookup_batch(const Key *keys, size_t n, Value *results,
+                              bool *found) {
+        for (size_t i = 0; i < n; ++i) {
+            found[i] = lookup(keys[i], results[i]);
+        }
+    }
+
+    // Remove key `k` and its value from the btree. Return true if `k` was in
+    // the btree.
+    virtual bool remove(Key k) = 0;
+
     // Do a range query on the btree. Starting with the least key greater than
     // or equal to `k`, scan at most `range` values into the buffer pointed to
     // by `output`. Return the number of elements read. Note that we may read
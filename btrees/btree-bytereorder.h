@@ -11,403 +11,434 @@
  * contention between cores, thus achieving higher performance and scalability.
  *
  * See the `OptLock` type for more on optimistic locking.
+ *
+ * This is the only tree that can replicate its top levels per NUMA node (see
+ * `replicatedLevels`). The OLC tree cannot: its inner nodes are linked to
+ * their right siblings and may hold message buffers, which a read-only copy
+ * would have to keep up to date. Its top levels stay single copies, on
+ * whichever node allocated them.
  */
 
+#include "alloc.h"
 #include "btree-base.h"
+#include "bulk-load.h"
+#include "epoch.h"
+#include "key-transform.h"
+#include "layout.h"
+#include "numa.h"
+#include "olc-nodes.h"
+#include "optlock.h"
+#include "search.h"
 
 #include <immintrin.h>
 #include <sched.h>
+#include <algorithm>
 #include <atomic>
 #include <cassert>
 #include <cstring>
+#include <functional>
+#include <utility>
+#include <vector>
 
 namespace btree_bytereorder {
-// Each page in the Btree can be either an inner node or a leaf node.
-enum class PageType : uint8_t { BTreeInner = 1, BTreeLeaf = 2 };
-
-// Use 4KB pages
-static const uint64_t pageSize = 4 * 1024;
-
-// An optimistic lock implementation.
-//
-// An optimistic lock has two parts: a lock and a version counter. The lock is
-// acquired by all writers, as in a normal RW-locking scheme. However, a reader
-// only waits for the lock to be free and gets the version number. On a
-// WriteUnlock, we increment the version number. On a ReadUnlock, we check that
-// the version number has not changed since we acquired the lock. If it has, we
-// restart.
-//
-// Optimistic locking works best when conflicts are rare.
-//
-// This implementation comes more or less straight from the pseudo-code in
-// appendix A of this paper: https://db.in.tum.de/~leis/papers/artsync.pdf.
-struct OptLock {
-    // In this implementation, both the lock and the version counter are
-    // represented using this 64-bit word.
-    //
-    // Bit 0 represents that the locked value is obsolete (1 = obsolete).
-    // Bit 1 represents that the value is locked (1 = locked).
-    // Bits 2-63 represent the version counter.
-    std::atomic<uint64_t> typeVersionLockObsolete{0b100};
+// The nodes are shared with the hybrid tree. See `olc-nodes.h`.
+using common::OptLock;
+using common::node::PageType;
+using common::node::pageSize;
+using common::node::NodeBase;
+using common::node::BTreeLeafBase;
+using common::node::BTreeLeaf;
+using common::node::BTreeInnerBase;
+using common::node::BTreeInner;
+
+// A generic, thread-safe btree using OLC. `Alloc` picks where nodes come from
+// (see `alloc.h`). `LeafSize` and `InnerSize` are the sizes of the nodes in
+// bytes. `KeyTransform` maps the given keys to the stored keys (see
+// `key-transform.h`); with `common::key::Identity`, this is a plain OLC tree.
+// `LeafLayout` lays out the entries of the leaves (see `layout.h`).
+template <class Key, class Value, class Search = common::search::Simd,
+          class Alloc = common::alloc::Default, uint64_t LeafSize = pageSize,
+          uint64_t InnerSize = pageSize,
+          class KeyTransform = common::key::ByteReorder,
+          class LeafLayout = common::layout::Separate>
+struct BTree final : public common::BTreeBase<Key, Value> {
+    typedef BTreeLeaf<Key, Value, Search, Alloc, LeafSize, LeafLayout> Leaf;
+    typedef BTreeInner<Key, Search, Alloc, InnerSize> Inner;
 
-    // Returns true if the given version represents a locked state.
-    bool isLocked(uint64_t version) { return ((version & 0b10) == 0b10); }
+private:
+    // The root node of the btree.
+    std::atomic<NodeBase *> root;
 
-    // Grab an optimistic read lock.
-    //
-    // If the current version is locked, set `needRestart` to true and return
-    // the current version. The reader should restart if `needRestart` is set to
-    // true after calling this method.
-    uint64_t readLockOrRestart(bool &needRestart) {
-        uint64_t version;
-        version = typeVersionLockObsolete.load();
-        if (isLocked(version) || isObsolete(version)) {
-            // PAUSE compiler intrinsic. See
-            // https://software.intel.com/en-us/node/524249.
-            _mm_pause();
-            needRestart = true;
-        }
-        return version;
+    // Create a new root node with the two given nodes as children separated by
+    // the given key. Atomically replace the current root with the new one.
+    void makeRoot(Key k, NodeBase *leftChild, NodeBase *rightChild) {
+        auto inner = new Inner();
+        inner->count = 1;
+        inner->keys[0] = k;
+        inner->children[0] = leftChild;
+        inner->children[1] = rightChild;
+        root = inner;
     }
 
-    // Grab the write lock.
-    //
-    // This is done by first grabbing the optimistic read lock, and then
-    // attempting to upgrade it to a write lock. If this attempt fails,
-    // `needRestart` is set to true, and the caller needs to restart.
-    void writeLockOrRestart(bool &needRestart) {
-        uint64_t version;
-        version = readLockOrRestart(needRestart);
-        if (needRestart) return;
-
-        upgradeToWriteLockOrRestart(version, needRestart);
-        if (needRestart) return;
+    // Depending on the value of `count`, either yield the processor to the OS
+    // scheduler or inform the processor you are waiting for a spin lock.
+    void yield(int count) {
+        if (count > 3)
+            sched_yield();
+        else
+            _mm_pause();
     }
 
-    // Upgrade the given read lock to a write lock.
-    //
-    // `version` should be the version at the time a read lock was acquired.
-    //
-    // If the version has changed since the read lock was acquired,
-    // `needRestart` is set to true, and the caller needs to restart.
-    void upgradeToWriteLockOrRestart(uint64_t &version, bool &needRestart) {
-        if (typeVersionLockObsolete.compare_exchange_strong(version,
-                                                            version + 0b10)) {
-            version = version + 0b10;
-        } else {
-            _mm_pause();
-            needRestart = true;
+    // A node built by the bulk loader, and the max key in its subtree.
+    typedef std::pair<NodeBase *, Key> Built;
+
+    // Pack the sorted (key, value) pairs in `[begin, end)` into a new leaf.
+    template <class It>
+    static Built packLeaf(It begin, It end) {
+        auto leaf = new Leaf();
+        for (It it = begin; it != end; ++it) {
+            assert(leaf->count < leaf->maxEntries);
+            assert(!leaf->count || leaf->key(leaf->count - 1) < it->first);
+            leaf->key(leaf->count) = it->first;
+            leaf->payload(leaf->count) = it->second;
+            leaf->count++;
         }
+        return Built(leaf, leaf->count ? leaf->key(leaf->count - 1) : Key());
     }
 
-    // Release the write lock.
-    //
-    // This should only be called if you successfully acquired the write
-    // lock. This method releases the lock and increments the version.
-    void writeUnlock() { typeVersionLockObsolete.fetch_add(0b10); }
-
-    // Return the obsolete bit of the given version.
-    bool isObsolete(uint64_t version) { return (version & 1) == 1; }
-
-    // The same as `readUnlockOrRestart`.
-    void checkOrRestart(uint64_t startRead, bool &needRestart) const {
-        readUnlockOrRestart(startRead, needRestart);
+    // Pack the children in `[begin, end)` into a new inner node. Each child
+    // is separated from the next one by its max key.
+    static Built packInner(const Built *begin, const Built *end) {
+        auto inner = new Inner();
+        assert(end - begin >= 2 &&
+               uint64_t(end - begin) <= inner->maxEntries);
+        inner->count = end - begin - 1;
+        for (unsigned i = 0; i <= inner->count; ++i) {
+            inner->children[i] = begin[i].first;
+            inner->keys[i] = begin[i].second;
+        }
+        return Built(inner, end[-1].second);
     }
 
-    // Release the read lock.
-    //
-    // `startRead` is the version at the time the read lock was acquired.
-    //
-    // If the version has changed since the read lock was acquired,
-    // `needRestart` is set to true, and the caller should restart.
-    void readUnlockOrRestart(uint64_t startRead, bool &needRestart) const {
-        needRestart = (startRead != typeVersionLockObsolete.load());
+    // Free the subtree rooted at `node`. Only safe once no other thread can
+    // access the tree.
+    static void freeSubtree(NodeBase *node) {
+        if (node->type == PageType::BTreeInner) {
+            auto inner = static_cast<Inner *>(node);
+            for (unsigned i = 0; i <= inner->count; ++i) {
+                freeSubtree(inner->children[i]);
+            }
+        }
+        deleteNode(node);
     }
 
-    // Release the write lock _and_ set the obsolete bit.
-    //
-    // This is like `writeUnlock` except that it also sets the obsolete bit.
-    void writeUnlockObsolete() { typeVersionLockObsolete.fetch_add(0b11); }
-};
-
-// A base type for all btree nodes. Each node hasi an optimisitc lock.
-struct NodeBase : public OptLock {
-    // Leaf or inner?
-    PageType type;
-
-    // The number of entries in this btree node.
-    uint16_t count;
-};
-
-// Leaf superclass so that we don't have to keep defining the type.
-struct BTreeLeafBase : public NodeBase {
-    static const PageType typeMarker = PageType::BTreeLeaf;
-};
+    // Free a single node of this tree. Nodes are only freed with the whole
+    // tree: removes leave underfull leaves in place, so no node is ever
+    // unlinked and retired while the tree is in use. Only stale replicas
+    // are retired (see `Replica`).
+    static void deleteNode(void *p) {
+        NodeBase *node = static_cast<NodeBase *>(p);
+        if (node->type == PageType::BTreeInner) {
+            delete static_cast<Inner *>(node);
+        } else {
+            delete static_cast<Leaf *>(node);
+        }
+    }
 
-// A single leaf node in the btree. Note that anyone doing operations on these
-// nodes should already be holding a lock.
-template <class Key, class Payload>
-struct BTreeLeaf : public BTreeLeafBase {
-    // Represents a key and value associated with that key.
-    struct Entry {
-        Key k;
-        Payload p;
+    // A copy of the top `levels` levels of the tree on NUMA node `node`, as
+    // of `topVersion`. The children of its bottom level are the nodes of the
+    // tree below them. Replicas are never changed; a stale one is replaced.
+    struct Replica {
+        uint64_t topVersion;
+        unsigned levels;
+        Inner *root;
+        int node;
+
+        // All copied nodes, to free them.
+        std::vector<Inner *> nodes;
     };
 
-    // The max number of entries in a leaf node (based on the size of keys
-    // and pages). We also need to account for the space of the locks.
-    static const uint64_t maxEntries =
-        (pageSize - sizeof(NodeBase)) / (sizeof(Key) + sizeof(Payload));
-
-    // The keys for each child.
-    Key keys[maxEntries];
-
-    // The (key, value) pairs inserted into the tree.
-    Payload payloads[maxEntries];
-
-    // Construct an empty leaf node.
-    BTreeLeaf() {
-        count = 0;
-        type = typeMarker;
+    // Bumped by every split that changes one of the top `replicatedLevels`
+    // levels, while the split nodes are still locked.
+    std::atomic<uint64_t> topVersion{0};
+
+    // The replica of each NUMA node, if any, and whether a thread is building
+    // one.
+    std::atomic<Replica *> replicas[common::numa::maxNodes] = {};
+    std::atomic<bool> building[common::numa::maxNodes] = {};
+
+    // Free a replica and its nodes. Used as the deleter for epoch-based
+    // reclamation.
+    static void deleteReplica(void *p) {
+        Replica *replica = static_cast<Replica *>(p);
+        for (Inner *node : replica->nodes) {
+            common::numa::deallocate(replica->node, node, sizeof(Inner));
+        }
+        delete replica;
     }
 
-    // Returns true if this leaf is full. It needs to be split before we can
-    // take any more entries.
-    bool isFull() { return count == maxEntries; };
-
-    // Returns the index into this node of the least key that is greater than
-    // or equal to `k`.
-    unsigned lowerBound(Key k) {
-        unsigned lower = 0;
-        unsigned upper = count;
-        do {
-            unsigned mid = ((upper - lower) / 2) + lower;
-            if (k < keys[mid]) {
-                upper = mid;
-            } else if (k > keys[mid]) {
-                lower = mid + 1;
-            } else {
-                return mid;
+    // Copy `src` and the `levels - 1` levels below it into `replica`. Each
+    // node is read optimistically; returns nullptr if one of them changed.
+    Inner *copyInner(Replica *replica, Inner *src, unsigned levels) {
+        void *mem = common::numa::allocate(replica->node, sizeof(Inner));
+        Inner *copy = ::new (mem) Inner();
+        replica->nodes.push_back(copy);
+
+        bool needRestart = false;
+        uint64_t version = src->readLockOrRestart(needRestart);
+        if (needRestart) return nullptr;
+        unsigned count = src->count;
+        if (count >= Inner::maxEntries) return nullptr;
+        copy->count = count;
+        memcpy(copy->keys, src->keys, sizeof(Key) * (count + 1));
+        memcpy(copy->children, src->children, sizeof(NodeBase *) * (count + 1));
+        src->readUnlockOrRestart(version, needRestart);
+        if (needRestart) return nullptr;
+
+        if (levels > 1) {
+            for (unsigned i = 0; i <= count; ++i) {
+                NodeBase *child = copy->children[i];
+                if (child->type != PageType::BTreeInner) return nullptr;
+                child = copyInner(replica, static_cast<Inner *>(child),
+                                  levels - 1);
+                if (!child) return nullptr;
+                copy->children[i] = child;
             }
-        } while (lower < upper);
-        return lower;
+        }
+        return copy;
     }
 
-    // Alternate implementation of `lowerBound`. This function is not used anywhere.
-    unsigned lowerBoundBF(Key k) {
-        auto base = keys;
-        unsigned n = count;
-        while (n > 1) {
-            const unsigned half = n / 2;
-            base = (base[half] < k) ? (base + half) : base;
-            n -= half;
+    // Build a replica of the top levels of the tree as of `top` on NUMA node
+    // `node`. Only as many levels are copied as leave at least one level of
+    // inner nodes below them, so that leaf splits never change a replica.
+    // Returns nullptr if the tree is too low, or if it changed meanwhile.
+    Replica *buildReplica(int node, uint64_t top) {
+        // The height of the tree, along its left edge.
+        unsigned height = 1;
+        bool needRestart = false;
+        for (NodeBase *n = root; n->type == PageType::BTreeInner; ++height) {
+            uint64_t version = n->readLockOrRestart(needRestart);
+            if (needRestart) return nullptr;
+            NodeBase *child = static_cast<Inner *>(n)->children[0];
+            n->readUnlockOrRestart(version, needRestart);
+            if (needRestart) return nullptr;
+            n = child;
+        }
+        if (height < 3) return nullptr;
+
+        Replica *replica = new Replica();
+        replica->topVersion = top;
+        replica->levels = std::min(replicatedLevels, height - 2);
+        replica->node = node;
+        replica->root = copyInner(replica, static_cast<Inner *>(root.load()),
+                                  replica->levels);
+        if (!replica->root || topVersion != top) {
+            deleteReplica(replica);
+            return nullptr;
         }
-        return (*base < k) + base - keys;
+        return replica;
     }
 
-    // Insert the new (key, value) pair into this leaf. The caller should make
-    // sure that the node has space and split it if necessary.
-    void insert(Key k, Payload p) {
-        assert(count < maxEntries);
-        if (count) {
-            unsigned pos = lowerBound(k);
-            if ((pos < count) && (keys[pos] == k)) {
-                // Upsert
-                payloads[pos] = p;
-                return;
+    // Find the node to start the descent for `k` from, and read-lock it. That
+    // is the root, at `level` 0, or, if replication is on and the replica of
+    // the NUMA node of the calling thread is current, the node below that
+    // replica, at `level` `replicatedLevels` or less. Sets `needRestart` if
+    // the node changed meanwhile.
+    NodeBase *enter(Key k, uint64_t &version, unsigned &level,
+                    bool &needRestart) {
+        if (replicatedLevels) {
+            int n = common::numa::currentNode();
+            uint64_t top = topVersion;
+            Replica *replica = replicas[n];
+            if (replica && replica->topVersion == top) {
+                NodeBase *node = replica->root;
+                for (unsigned i = 0; i < replica->levels; ++i) {
+                    auto inner = static_cast<Inner *>(node);
+                    node = inner->children[inner->lowerBound(k)];
+                }
+                version = node->readLockOrRestart(needRestart);
+                if (needRestart) return nullptr;
+                // No split has changed the replicated levels since we read
+                // `top`, so `node` is still the right one for `k`.
+                if (topVersion == top) {
+                    level = replica->levels;
+                    return node;
+                }
+            } else if (!building[n].exchange(true)) {
+                // Replace the missing or stale replica. Everyone else uses
+                // the root meanwhile.
+                Replica *fresh = buildReplica(n, top);
+                if (fresh) {
+                    Replica *old = replicas[n].exchange(fresh);
+                    if (old) common::epoch::retire(old, deleteReplica);
+                }
+                building[n] = false;
             }
-            memmove(keys + pos + 1, keys + pos, sizeof(Key) * (count - pos));
-            memmove(payloads + pos + 1, payloads + pos,
-                    sizeof(Payload) * (count - pos));
-            keys[pos] = k;
-            payloads[pos] = p;
-        } else {
-            keys[0] = k;
-            payloads[0] = p;
         }
-        count++;
-    }
 
-    // Split this leaf node in half, and return the new leaf node. The new node
-    // comes _after_ this node.
-    BTreeLeaf *split(Key &sep) {
-        BTreeLeaf *newLeaf = new BTreeLeaf();
-        newLeaf->count = count - (count / 2);
-        count = count - newLeaf->count;
-        memcpy(newLeaf->keys, keys + count, sizeof(Key) * newLeaf->count);
-        memcpy(newLeaf->payloads, payloads + count,
-               sizeof(Payload) * newLeaf->count);
-        sep = keys[count - 1];
-        return newLeaf;
+        level = 0;
+        NodeBase *node = root;
+        version = node->readLockOrRestart(needRestart);
+        if (needRestart || (node != root)) {
+            needRestart = true;
+            return nullptr;
+        }
+        return node;
     }
-};
 
-// Inner node superclass so that we don't have to keep defining the type.
-struct BTreeInnerBase : public NodeBase {
-    static const PageType typeMarker = PageType::BTreeInner;
-};
+public:
+    // Construct a new btree with exactly one node, which is an empty leaf node.
+    BTree() { root = new Leaf(); }
 
-// A single inner node in the btree. Note that anyone doing operations on these
-// nodes should already be holding a lock.
-template <class Key>
-struct BTreeInner : public BTreeInnerBase {
-    // The max number of entries in an inner node (based on the size of keys
-    // and pages). We also need to account for the space of the locks.
-    static const uint64_t maxEntries =
-        (pageSize - sizeof(NodeBase)) / (sizeof(Key) + sizeof(NodeBase *));
-
-    // Pointers to the child nodes.
-    NodeBase *children[maxEntries];
-
-    // The keys for each child.
-    Key keys[maxEntries];
-
-    // Construct an empty inner node.
-    BTreeInner() {
-        count = 0;
-        type = typeMarker;
-    }
+    // Construct a new btree from the (key, value) pairs in `[first, last)`,
+    // which must be sorted by key and free of duplicates. The tree is built
+    // bottom-up by `threads` threads (0 means one per core), and each node is
+    // filled to `fill` times its capacity. See `bulk-load.h`.
+    //
+    // If the key transform does not preserve the order of the keys, the pairs
+    // are copied with transformed keys and sorted again before building the
+    // tree.
+    template <class It>
+    BTree(It first, It last, double fill = 1.0, unsigned threads = 0) {
+        std::vector<std::pair<Key, Value>> pairs(last - first);
+        common::bulk::parallelFor(
+            pairs.size(), threads, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    pairs[i].first = KeyTransform::apply(first[i].first);
+                    pairs[i].second = first[i].second;
+                }
+            });
+        if (!KeyTransform::preservesOrder) {
+            common::bulk::parallelSort(
+                pairs, threads, [](const std::pair<Key, Value> &a,
+                                   const std::pair<Key, Value> &b) {
+                    return a.first < b.first;
+                });
+        }
 
-    // Returns true if adding one more key would fill the node.
-    bool isFull() { return count == (maxEntries - 1); };
-
-    // Returns the index into this node of the least key that is greater than
-    // or equal to `k`.
-    unsigned lowerBound(Key k) {
-        unsigned lower = 0;
-        unsigned upper = count;
-        do {
-            unsigned mid = ((upper - lower) / 2) + lower;
-            if (k < keys[mid]) {
-                upper = mid;
-            } else if (k > keys[mid]) {
-                lower = mid + 1;
-            } else {
-                return mid;
-            }
-        } while (lower < upper);
-        return lower;
+        typedef typename std::vector<std::pair<Key, Value>>::const_iterator
+            PairIt;
+        root = common::bulk::build<NodeBase *, Key>(
+            pairs.cbegin(), pairs.size(), Leaf::maxEntries, Inner::maxEntries,
+            fill, threads, packLeaf<PairIt>, packInner);
     }
 
-    // Alternate implementation of `lowerBound`. This function is not used anywhere.
-    unsigned lowerBoundBF(Key k) {
-        auto base = keys;
-        unsigned n = count;
-        while (n > 1) {
-            const unsigned half = n / 2;
-            base = (base[half] < k) ? (base + half) : base;
-            n -= half;
+    // Free all nodes. The caller must make sure no other thread is still
+    // using the tree.
+    ~BTree() {
+        freeSubtree(root);
+        for (auto &replica : replicas) {
+            if (replica) deleteReplica(replica);
         }
-        return (*base < k) + base - keys;
     }
 
-    // Split this inner node in half, and return the new inner node. The new
-    // node comes _after_ this node.
-    BTreeInner *split(Key &sep) {
-        BTreeInner *newInner = new BTreeInner();
-        newInner->count = count - (count / 2);
-        count = count - newInner->count - 1;
-        sep = keys[count];
-        memcpy(newInner->keys, keys + count + 1,
-               sizeof(Key) * (newInner->count + 1));
-        memcpy(newInner->children, children + count + 1,
-               sizeof(NodeBase *) * (newInner->count + 1));
-        return newInner;
-    }
+    // If not 0, each NUMA node gets its own copy of the top this many levels
+    // of inner nodes, allocated on that node (see `numa.h`), and each thread
+    // descends through the copy of the node it runs on, so that the most
+    // read nodes of the tree are never fetched from another socket. Leaves,
+    // and at least the lowest level of inner nodes, stay single copies.
+    //
+    // A split that changes one of these levels makes all copies stale, and
+    // threads use the tree itself until the next thread on their node has
+    // copied the levels again. Splits that high up are rare, but each copy
+    // costs a page per copied node, so keep this small. Set it before the
+    // tree is used.
+    unsigned replicatedLevels = 0;
 
-    // Insert the new child with the given key into this inner node. The caller
-    // should make sure that the node has space and split it if necessary.
-    void insert(Key k, NodeBase *child) {
-        assert(count < maxEntries - 1);
-        unsigned pos = lowerBound(k);
-        memmove(keys + pos + 1, keys + pos, sizeof(Key) * (count - pos + 1));
-        memmove(children + pos + 1, children + pos,
-                sizeof(NodeBase *) * (count - pos + 1));
-        keys[pos] = k;
-        children[pos] = child;
-        std::swap(children[pos], children[pos + 1]);
-        count++;
+    // Insert the (k, v) pair into the tree.
+    void insert(Key key, Value v) {
+        modify(key, [&v](bool, Value &value) {
+            value = v;
+            return true;
+        });
     }
-};
 
-// A generic, thread-safe btree using OLC.
-template <class Key, class Value>
-struct BTree : public common::BTreeBase<Key, Value> {
-private:
-    // Given a key `k`, return the byte-reordered version of `k`. This function
-    // assumes that we can safely reorder bytes in the key.
-    Key reorder(Key k) const {
-        // A page has 4KB, so even for an 1B key, we can have at most 4KB
-        // entries per page. Thus, to avoid hot pages, we can swap the first
-        // two and last two bytes (16 bits == 32K entries).
-
-        // How many bytes in the key?
-        size_t size = sizeof(k);
-
-        // Pointer to last 16 bits of key.
-        uint16_t *lsb = reinterpret_cast<uint16_t *>(
-                            &reinterpret_cast<uint8_t *>(&k)[size-2]);
-        uint16_t *msb = reinterpret_cast<uint16_t *>(&k);
-
-        // Swap them
-        uint16_t tmp = *lsb;
-        *lsb = *msb;
-        *msb = tmp;
-
-        return k;
+    // Insert (k, v) unless `k` is in the tree already. Returns true if it
+    // was inserted.
+    bool insert_if_absent(Key key, Value v) {
+        return modify(key, [&v](bool present, Value &value) {
+            if (!present) value = v;
+            return true;
+        });
     }
 
-    // The root node of the btree.
-    std::atomic<NodeBase *> root;
+    // Set the value of `k` to `v` if `k` is in the tree. Returns true if it
+    // was.
+    bool update_if_present(Key key, Value v) {
+        bool found = false;
+        modify(key, [&v, &found](bool present, Value &value) {
+            if (present) value = v;
+            found = present;
+            return false;
+        });
+        return found;
+    }
 
-    // Create a new root node with the two given nodes as children separated by
-    // the given key. Atomically replace the current root with the new one.
-    void makeRoot(Key k, NodeBase *leftChild, NodeBase *rightChild) {
-        auto inner = new BTreeInner<Key>();
-        inner->count = 1;
-        inner->keys[0] = k;
-        inner->children[0] = leftChild;
-        inner->children[1] = rightChild;
-        root = inner;
+    // Set `result` to the value of `k`, or insert (k, v) and set `result` to
+    // `v` if `k` is not in the tree. Returns true if (k, v) was inserted.
+    bool get_or_insert(Key key, Value v, Value &result) {
+        return modify(key, [&v, &result](bool present, Value &value) {
+            if (!present) value = v;
+            result = value;
+            return true;
+        });
     }
 
-    // Depending on the value of `count`, either yield the processor to the OS
-    // scheduler or inform the processor you are waiting for a spin lock.
-    void yield(int count) {
-        if (count > 3)
-            sched_yield();
-        else
-            _mm_pause();
+    // Apply `fn` to the value of `k` in place, inserting `k` with a
+    // value-initialized value first if it is not in the tree. Returns true
+    // if `k` was inserted.
+    bool upsert(Key key, const std::function<void(Value &)> &fn) {
+        return modify(key, [&fn](bool, Value &value) {
+            fn(value);
+            return true;
+        });
     }
 
-public:
-    // Construct a new btree with exactly one node, which is an empty leaf node.
-    BTree() { root = new BTreeLeaf<Key, Value>(); }
+    // The core of all inserts: call `fn(present, value)` exactly once, under
+    // the write lock of the leaf for `k`. If `k` is in the leaf, `present`
+    // is true and `value` is its value, which `fn` changes in place.
+    // Otherwise, `value` is value-initialized, and (k, value) is inserted if
+    // `fn` returns true. Returns true if it was.
+    template <class Fn>
+    bool modify(Key key, Fn fn) {
+        common::epoch::Guard guard;
 
-    // Insert the (k, v) pair into the tree.
-    void insert(Key key, Value v) {
-        // First, reorder the key.
-        Key k = reorder(key);
+        // First, transform the key.
+        Key k = KeyTransform::apply(key);
+
+        // Set once a split below a replica needs the parent of the node the
+        // replica leads to, which only the tree itself has.
+        bool fromRoot = false;
 
         int restartCount = 0;
     restart:
         if (restartCount++) yield(restartCount);
         bool needRestart = false;
 
-        // Current node
-        NodeBase *node = root;
-        uint64_t versionNode = node->readLockOrRestart(needRestart);
-        if (needRestart || (node != root)) goto restart;
+        // Current node, and its depth in the tree
+        uint64_t versionNode = 0;
+        unsigned level = 0;
+        NodeBase *node = fromRoot ? root.load()
+                                  : enter(k, versionNode, level, needRestart);
+        if (needRestart) goto restart;
+        if (fromRoot) {
+            versionNode = node->readLockOrRestart(needRestart);
+            if (needRestart || (node != root)) goto restart;
+        }
 
         // Parent of current node
-        BTreeInner<Key> *parent = nullptr;
+        Inner *parent = nullptr;
         uint64_t versionParent = 0;
 
         while (node->type == PageType::BTreeInner) {
-            auto inner = static_cast<BTreeInner<Key> *>(node);
+            auto inner = static_cast<Inner *>(node);
 
             // Split eagerly if full
             if (inner->isFull()) {
+                if (!parent && level > 0) {  // entered from a replica
+                    fromRoot = true;
+                    goto restart;
+                }
                 // Lock
                 if (parent) {
                     parent->upgradeToWriteLockOrRestart(versionParent,
@@ -425,11 +456,13 @@ public:
                 }
                 // Split
                 Key sep;
-                BTreeInner<Key> *newInner = inner->split(sep);
+                Inner *newInner = inner->split(sep);
                 if (parent)
                     parent->insert(sep, newInner);
                 else
                     makeRoot(sep, inner, newInner);
+                // Replicas of the changed levels are stale now
+                if (level <= replicatedLevels) topVersion++;
                 // Unlock and restart
                 node->writeUnlock();
                 if (parent) parent->writeUnlock();
@@ -449,76 +482,94 @@ public:
             if (needRestart) goto restart;
             versionNode = node->readLockOrRestart(needRestart);
             if (needRestart) goto restart;
+            level++;
         }
 
-        auto leaf = static_cast<BTreeLeaf<Key, Value> *>(node);
+        auto leaf = static_cast<Leaf *>(node);
+
+        // Lock the leaf, and see whether `k` is there
+        node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+        if (needRestart) goto restart;
+        unsigned pos = leaf->lowerBound(k);
+        bool present = (pos < leaf->count) && (leaf->key(pos) == k);
 
-        // Split leaf if full
-        if (leaf->count == leaf->maxEntries) {
-            // Lock
+        // Split the leaf only if it is full and `k` may be inserted. That
+        // needs the lock of the parent, too, before `fn` is asked.
+        if (!present && leaf->isFull()) {
             if (parent) {
                 parent->upgradeToWriteLockOrRestart(versionParent, needRestart);
-                if (needRestart) goto restart;
-            }
-            node->upgradeToWriteLockOrRestart(versionNode, needRestart);
-            if (needRestart) {
-                if (parent) parent->writeUnlock();
-                goto restart;
-            }
-            if (!parent && (node != root)) {  // there's a new parent
+                if (needRestart) {
+                    node->writeUnlock();
+                    goto restart;
+                }
+            } else if (node != root) {  // there's a new parent
                 node->writeUnlock();
                 goto restart;
             }
-            // Split
-            Key sep;
-            BTreeLeaf<Key, Value> *newLeaf = leaf->split(sep);
-            if (parent)
-                parent->insert(sep, newLeaf);
-            else
-                makeRoot(sep, leaf, newLeaf);
-            // Unlock and restart
+            Value value = Value();
+            bool inserted = fn(false, value);
+            if (inserted) {
+                // Split, and insert into the half for `k`
+                Key sep;
+                Leaf *newLeaf = leaf->split(sep);
+                (k > sep ? newLeaf : leaf)->insert(k, value);
+                if (parent)
+                    parent->insert(sep, newLeaf);
+                else
+                    makeRoot(sep, leaf, newLeaf);
+            }
+            // Unlock
             node->writeUnlock();
             if (parent) parent->writeUnlock();
-            goto restart;
+            return inserted;
+        }
+
+        if (parent) {
+            parent->readUnlockOrRestart(versionParent, needRestart);
+            if (needRestart) {
+                node->writeUnlock();
+                goto restart;
+            }
+        }
+        bool inserted = false;
+        if (present) {
+            fn(true, leaf->payload(pos));
         } else {
-            // only lock leaf node
-            node->upgradeToWriteLockOrRestart(versionNode, needRestart);
-            if (needRestart) goto restart;
-            if (parent) {
-                parent->readUnlockOrRestart(versionParent, needRestart);
-                if (needRestart) {
-                    node->writeUnlock();
-                    goto restart;
-                }
+            Value value = Value();
+            if (fn(false, value)) {
+                leaf->insert(k, value);
+                inserted = true;
             }
-            leaf->insert(k, v);
-            node->writeUnlock();
-            return;  // success
         }
+        node->writeUnlock();
+        return inserted;  // success
     }
 
     // Lookup key `k` in the btree. If `k` is in the btree, set `result` to the
     // value associated with `k` and return true. If `k` is not in the btree,
     // return false.
     bool lookup(Key key, Value &result) {
-        // First, reorder the key.
-        Key k = reorder(key);
+        common::epoch::Guard guard;
+
+        // First, transform the key.
+        Key k = KeyTransform::apply(key);
 
         int restartCount = 0;
     restart:
         if (restartCount++) yield(restartCount);
         bool needRestart = false;
 
-        NodeBase *node = root;
-        uint64_t versionNode = node->readLockOrRestart(needRestart);
-        if (needRestart || (node != root)) goto restart;
+        uint64_t versionNode = 0;
+        unsigned level = 0;
+        NodeBase *node = enter(k, versionNode, level, needRestart);
+        if (needRestart) goto restart;
 
         // Parent of current node
-        BTreeInner<Key> *parent = nullptr;
+        Inner *parent = nullptr;
         uint64_t versionParent = 0;
 
         while (node->type == PageType::BTreeInner) {
-            auto inner = static_cast<BTreeInner<Key> *>(node);
+            auto inner = static_cast<Inner *>(node);
 
             if (parent) {
                 parent->readUnlockOrRestart(versionParent, needRestart);
@@ -535,13 +586,12 @@ public:
             if (needRestart) goto restart;
         }
 
-        BTreeLeaf<Key, Value> *leaf =
-            static_cast<BTreeLeaf<Key, Value> *>(node);
+        Leaf *leaf = static_cast<Leaf *>(node);
         unsigned pos = leaf->lowerBound(k);
-        bool success;
-        if ((pos < leaf->count) && (leaf->keys[pos] == k)) {
+        bool success = false;
+        if ((pos < leaf->count) && (leaf->key(pos) == k)) {
             success = true;
-            result = leaf->payloads[pos];
+            result = leaf->payload(pos);
         }
         if (parent) {
             parent->readUnlockOrRestart(versionParent, needRestart);
@@ -553,6 +603,69 @@ public:
         return success;
     }
 
+    // Remove key `k` and its value from the btree. Returns true if `k` was in
+    // the btree.
+    //
+    // NOTE: underfull leaves are not merged in this implementation.
+    bool remove(Key key) {
+        common::epoch::Guard guard;
+
+        // First, transform the key.
+        Key k = KeyTransform::apply(key);
+
+        int restartCount = 0;
+    restart:
+        if (restartCount++) yield(restartCount);
+        bool needRestart = false;
+
+        uint64_t versionNode = 0;
+        unsigned level = 0;
+        NodeBase *node = enter(k, versionNode, level, needRestart);
+        if (needRestart) goto restart;
+
+        // Parent of current node
+        Inner *parent = nullptr;
+        uint64_t versionParent = 0;
+
+        while (node->type == PageType::BTreeInner) {
+            auto inner = static_cast<Inner *>(node);
+
+            if (parent) {
+                parent->readUnlockOrRestart(versionParent, needRestart);
+                if (needRestart) goto restart;
+            }
+
+            parent = inner;
+            versionParent = versionNode;
+
+            node = inner->children[inner->lowerBound(k)];
+            inner->checkOrRestart(versionNode, needRestart);
+            if (needRestart) goto restart;
+            versionNode = node->readLockOrRestart(needRestart);
+            if (needRestart) goto restart;
+        }
+
+        auto leaf = static_cast<Leaf *>(node);
+
+        // only lock leaf node
+        node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+        if (needRestart) goto restart;
+        if (parent) {
+            parent->readUnlockOrRestart(versionParent, needRestart);
+            if (needRestart) {
+                node->writeUnlock();
+                goto restart;
+            }
+        }
+        unsigned pos = leaf->lowerBound(k);
+        bool found = (pos < leaf->count) && (leaf->key(pos) == k);
+        if (found) {
+            leaf->removeAt(pos);
+        }
+        node->writeUnlock();
+        return found;
+    }
+
     // Do a range query on the btree. Starting with the least key greater than
     // or equal to `k`, scan at most `range` values into the buffer pointed to
     // by `output`. Return the number of elements read. Note that we may read
@@ -560,26 +673,29 @@ public:
     // could scan.  The caller should keep calling `scan` until no records are
     // read.
     //
-    // NOTE: for the byte-reordering implementation, this returns keys in no
+    // NOTE: unless the key transform preserves order, this returns keys in no
     // particular order and starting from an arbitrary point in the tree.
     uint64_t scan(Key key, int range, Value *output) {
-        Key k = reorder(key);
+        common::epoch::Guard guard;
+
+        Key k = KeyTransform::apply(key);
 
         int restartCount = 0;
     restart:
         if (restartCount++) yield(restartCount);
         bool needRestart = false;
 
-        NodeBase *node = root;
-        uint64_t versionNode = node->readLockOrRestart(needRestart);
-        if (needRestart || (node != root)) goto restart;
+        uint64_t versionNode = 0;
+        unsigned level = 0;
+        NodeBase *node = enter(k, versionNode, level, needRestart);
+        if (needRestart) goto restart;
 
         // Parent of current node
-        BTreeInner<Key> *parent = nullptr;
+        Inner *parent = nullptr;
         uint64_t versionParent = 0;
 
         while (node->type == PageType::BTreeInner) {
-            auto inner = static_cast<BTreeInner<Key> *>(node);
+            auto inner = static_cast<Inner *>(node);
 
             if (parent) {
                 parent->readUnlockOrRestart(versionParent, needRestart);
@@ -596,13 +712,12 @@ public:
             if (needRestart) goto restart;
         }
 
-        BTreeLeaf<Key, Value> *leaf =
-            static_cast<BTreeLeaf<Key, Value> *>(node);
+        Leaf *leaf = static_cast<Leaf *>(node);
         unsigned pos = leaf->lowerBound(k);
         int count = 0;
         for (unsigned i = pos; i < leaf->count; i++) {
             if (count == range) break;
-            output[count++] = leaf->payloads[i];
+            output[count++] = leaf->payload(i);
         }
 
         if (parent) {
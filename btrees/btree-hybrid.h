@@ -13,7 +13,14 @@
  * See the `OptLock` type for more on optimistic locking.
  */
 
+#include "alloc.h"
 #include "btree-base.h"
+#include "bulk-load.h"
+#include "epoch.h"
+#include "layout.h"
+#include "olc-nodes.h"
+#include "optlock.h"
+#include "search.h"
 #include "ws.h"
 #include "util.h"
 
@@ -24,347 +31,38 @@
 #include <atomic>
 #include <cassert>
 #include <cstring>
+#include <functional>
 #include <vector>
 #include <pthread.h>
 
 namespace btree_hybrid {
-// Each page in the Btree can be either an inner node or a leaf node.
-enum class PageType : uint8_t { BTreeInner = 1, BTreeLeaf = 2 };
-
-// Use 4KB pages
-static const uint64_t pageSize = 4 * 1024;
-
-// An optimistic lock implementation.
-//
-// An optimistic lock has two parts: a lock and a version counter. The lock is
-// acquired by all writers, as in a normal RW-locking scheme. However, a reader
-// only waits for the lock to be free and gets the version number. On a
-// WriteUnlock, we increment the version number. On a ReadUnlock, we check that
-// the version number has not changed since we acquired the lock. If it has, we
-// restart.
-//
-// Optimistic locking works best when conflicts are rare.
-//
-// This implementation comes more or less straight from the pseudo-code in
-// appendix A of this paper: https://db.in.tum.de/~leis/papers/artsync.pdf.
-struct OptLock {
-    // In this implementation, both the lock and the version counter are
-    // represented using this 64-bit word.
-    //
-    // Bit 0 represents that the locked value is obsolete (1 = obsolete).
-    // Bit 1 represents that the value is locked (1 = locked).
-    // Bits 2-63 represent the version counter.
-    std::atomic<uint64_t> typeVersionLockObsolete{0b100};
-
-    // Returns true if the given version represents a locked state.
-    bool isLocked(uint64_t version) { return ((version & 0b10) == 0b10); }
-
-    // Grab an optimistic read lock.
-    //
-    // If the current version is locked, set `needRestart` to true and return
-    // the current version. The reader should restart if `needRestart` is set to
-    // true after calling this method.
-    uint64_t readLockOrRestart(bool &needRestart) {
-        uint64_t version;
-        version = typeVersionLockObsolete.load();
-        if (isLocked(version) || isObsolete(version)) {
-            // PAUSE compiler intrinsic. See
-            // https://software.intel.com/en-us/node/524249.
-            _mm_pause();
-            needRestart = true;
-        }
-        return version;
-    }
-
-    // Grab the write lock.
-    //
-    // This is done by first grabbing the optimistic read lock, and then
-    // attempting to upgrade it to a write lock. If this attempt fails,
-    // `needRestart` is set to true, and the caller needs to restart.
-    void writeLockOrRestart(bool &needRestart) {
-        uint64_t version;
-        version = readLockOrRestart(needRestart);
-        if (needRestart) return;
-
-        upgradeToWriteLockOrRestart(version, needRestart);
-        if (needRestart) return;
-    }
-
-    // Upgrade the given read lock to a write lock.
-    //
-    // `version` should be the version at the time a read lock was acquired.
-    //
-    // If the version has changed since the read lock was acquired,
-    // `needRestart` is set to true, and the caller needs to restart.
-    void upgradeToWriteLockOrRestart(uint64_t &version, bool &needRestart) {
-        if (typeVersionLockObsolete.compare_exchange_strong(version,
-                                                            version + 0b10)) {
-            version = version + 0b10;
-        } else {
-            _mm_pause();
-            needRestart = true;
-        }
-    }
-
-    // Release the write lock.
-    //
-    // This should only be called if you successfully acquired the write
-    // lock. This method releases the lock and increments the version.
-    void writeUnlock() { typeVersionLockObsolete.fetch_add(0b10); }
-
-    // Return the obsolete bit of the given version.
-    bool isObsolete(uint64_t version) { return (version & 1) == 1; }
-
-    // The same as `readUnlockOrRestart`.
-    void checkOrRestart(uint64_t startRead, bool &needRestart) const {
-        readUnlockOrRestart(startRead, needRestart);
-    }
-
-    // Release the read lock.
-    //
-    // `startRead` is the version at the time the read lock was acquired.
-    //
-    // If the version has changed since the read lock was acquired,
-    // `needRestart` is set to true, and the caller should restart.
-    void readUnlockOrRestart(uint64_t startRead, bool &needRestart) const {
-        needRestart = (startRead != typeVersionLockObsolete.load());
-    }
-
-    // Release the write lock _and_ set the obsolete bit.
-    //
-    // This is like `writeUnlock` except that it also sets the obsolete bit.
-    void writeUnlockObsolete() { typeVersionLockObsolete.fetch_add(0b11); }
-};
-
-// A base type for all btree nodes. Each node hasi an optimisitc lock.
-struct NodeBase : public OptLock {
-    // Leaf or inner?
-    PageType type;
-
-    // The number of entries in this btree node.
-    uint16_t count;
-};
-
-// Leaf superclass so that we don't have to keep defining the type.
-struct BTreeLeafBase : public NodeBase {
-    static const PageType typeMarker = PageType::BTreeLeaf;
-};
-
-// A single leaf node in the btree. Note that anyone doing operations on these
-// nodes should already be holding a lock.
-template <class Key, class Payload>
-struct BTreeLeaf : public BTreeLeafBase {
-    // Represents a key and value associated with that key.
-    struct Entry {
-        Key k;
-        Payload p;
-    };
-
-    // The max number of entries in a leaf node (based on the size of keys
-    // and pages). We also need to account for the space of the locks.
-    static const uint64_t maxEntries =
-        (pageSize - sizeof(NodeBase)) / (sizeof(Key) + sizeof(Payload));
-
-    // The keys for each child.
-    Key keys[maxEntries];
-
-    // The (key, value) pairs inserted into the tree.
-    Payload payloads[maxEntries];
-
-    // Construct an empty leaf node.
-    BTreeLeaf() {
-        count = 0;
-        type = typeMarker;
-
-        // // debugging
-        // for (size_t i = 0; i < maxEntries; ++i) {
-        //     keys[i] = 0xDEADBEEF;
-        //     payloads[i] = 0xDEADBEEF;
-        // }
-    }
-
-    // Returns true if this leaf is full. It needs to be split before we can
-    // take any more entries.
-    bool isFull() { return count == maxEntries; };
-
-    // Returns the index into this node of the least key that is greater than
-    // or equal to `k`.
-    unsigned lowerBound(Key k) {
-        unsigned lower = 0;
-        unsigned upper = count;
-        do {
-            unsigned mid = ((upper - lower) / 2) + lower;
-            if (k < keys[mid]) {
-                upper = mid;
-            } else if (k > keys[mid]) {
-                lower = mid + 1;
-            } else {
-                return mid;
-            }
-        } while (lower < upper);
-        return lower;
-    }
-
-    // Alternate implementation of `lowerBound`. This function is not used anywhere.
-    unsigned lowerBoundBF(Key k) {
-        auto base = keys;
-        unsigned n = count;
-        while (n > 1) {
-            const unsigned half = n / 2;
-            base = (base[half] < k) ? (base + half) : base;
-            n -= half;
-        }
-        return (*base < k) + base - keys;
-    }
-
-    // Insert the new (key, value) pair into this leaf. The caller should make
-    // sure that the node has space and split it if necessary.
-    void insert(Key k, Payload p) {
-        assert(count < maxEntries);
-        if (count) {
-            unsigned pos = lowerBound(k);
-            if ((pos < count) && (keys[pos] == k)) {
-                // Upsert
-                payloads[pos] = p;
-                return;
-            }
-            memmove(keys + pos + 1, keys + pos, sizeof(Key) * (count - pos));
-            memmove(payloads + pos + 1, payloads + pos,
-                    sizeof(Payload) * (count - pos));
-            keys[pos] = k;
-            payloads[pos] = p;
-        } else {
-            keys[0] = k;
-            payloads[0] = p;
-        }
-        count++;
-    }
-
-    // Split this leaf node in half, and return the new leaf node. The new node
-    // comes _after_ this node.
-    BTreeLeaf *split(Key &sep) {
-        BTreeLeaf *newLeaf = new BTreeLeaf();
-        newLeaf->count = count - (count / 2);
-        count = count - newLeaf->count;
-        memcpy(newLeaf->keys, keys + count, sizeof(Key) * newLeaf->count);
-        memcpy(newLeaf->payloads, payloads + count,
-               sizeof(Payload) * newLeaf->count);
-        sep = keys[count - 1];
-
-        // // debugging
-        // for (size_t i = count; i < maxEntries; ++i) {
-        //     keys[i] = 0xDEADBEEF;
-        //     payloads[i] = 0xDEADBEEF;
-        // }
-
-        return newLeaf;
-    }
-};
-
-// Inner node superclass so that we don't have to keep defining the type.
-struct BTreeInnerBase : public NodeBase {
-    static const PageType typeMarker = PageType::BTreeInner;
-};
-
-// A single inner node in the btree. Note that anyone doing operations on these
-// nodes should already be holding a lock.
-template <class Key>
-struct BTreeInner : public BTreeInnerBase {
-    // The max number of entries in an inner node (based on the size of keys
-    // and pages). We also need to account for the space of the locks.
-    static const uint64_t maxEntries =
-        (pageSize - sizeof(NodeBase)) / (sizeof(Key) + sizeof(NodeBase *));
-
-    // Pointers to the child nodes.
-    NodeBase *children[maxEntries];
-
-    // The keys for each child.
-    Key keys[maxEntries];
-
-    // Construct an empty inner node.
-    BTreeInner() {
-        count = 0;
-        type = typeMarker;
-
-        // // debugging
-        // for (size_t i = 0; i < maxEntries; ++i) {
-        //     keys[i] = 0xDEADBEEF;
-        // }
-    }
-
-    // Returns true if adding one more key would fill the node.
-    bool isFull() { return count == (maxEntries - 1); };
-
-    // Returns the index into this node of the least key that is greater than
-    // or equal to `k`.
-    unsigned lowerBound(Key k) {
-        unsigned lower = 0;
-        unsigned upper = count;
-        do {
-            unsigned mid = ((upper - lower) / 2) + lower;
-            if (k < keys[mid]) {
-                upper = mid;
-            } else if (k > keys[mid]) {
-                lower = mid + 1;
-            } else {
-                return mid;
-            }
-        } while (lower < upper);
-        return lower;
-    }
-
-    // Alternate implementation of `lowerBound`. This function is not used anywhere.
-    unsigned lowerBoundBF(Key k) {
-        auto base = keys;
-        unsigned n = count;
-        while (n > 1) {
-            const unsigned half = n / 2;
-            base = (base[half] < k) ? (base + half) : base;
-            n -= half;
-        }
-        return (*base < k) + base - keys;
-    }
-
-    // Split this inner node in half, and return the new inner node. The new
-    // node comes _after_ this node.
-    BTreeInner *split(Key &sep) {
-        BTreeInner *newInner = new BTreeInner();
-        newInner->count = count - (count / 2);
-        count = count - newInner->count - 1;
-        sep = keys[count];
-        memcpy(newInner->keys, keys + count + 1,
-               sizeof(Key) * (newInner->count + 1));
-        memcpy(newInner->children, children + count + 1,
-               sizeof(NodeBase *) * (newInner->count + 1));
-
-        // // debugging
-        // for (size_t i = count; i < maxEntries; ++i) {
-        //     keys[i] = 0xDEADBEEF;
-        // }
-
-        return newInner;
-    }
-
-    // Insert the new child with the given key into this inner node. The caller
-    // should make sure that the node has space and split it if necessary.
-    void insert(Key k, NodeBase *child) {
-        assert(count < maxEntries - 1);
-        unsigned pos = lowerBound(k);
-        memmove(keys + pos + 1, keys + pos, sizeof(Key) * (count - pos + 1));
-        memmove(children + pos + 1, children + pos,
-                sizeof(NodeBase *) * (count - pos + 1));
-        keys[pos] = k;
-        children[pos] = child;
-        std::swap(children[pos], children[pos + 1]);
-        count++;
-    }
-};
+// The nodes are shared with the byte reordering tree. See `olc-nodes.h`.
+using common::OptLock;
+using common::node::PageType;
+using common::node::pageSize;
+using common::node::NodeBase;
+using common::node::BTreeLeafBase;
+using common::node::BTreeLeaf;
+using common::node::BTreeInnerBase;
+using common::node::BTreeInner;
 
 // A generic, thread-safe btree using OLC and our cache. It is a modification
-// of the OLC implementation from the CMU Bw-tree critique paper.
-template <class Key, class Value, size_t WSSize = 10>
+// of the OLC implementation from the CMU Bw-tree critique paper. `Alloc` picks
+// where nodes come from (see `alloc.h`). `LeafSize` and `InnerSize` are the
+// sizes of the nodes in bytes.
+template <class Key, class Value, size_t WSSize = 10,
+          class Search = common::search::Simd,
+          class Alloc = common::alloc::Default, uint64_t LeafSize = pageSize,
+          uint64_t InnerSize = pageSize>
+
+struct BTree final : public common::BTreeBase<Key, Value> {
+    // Purges merge into the key and payload arrays of a leaf, so the leaves
+    // keep the `Separate` layout.
+    typedef BTreeLeaf<Key, Value, Search, Alloc, LeafSize,
+                      common::layout::Separate>
+        Leaf;
+    typedef BTreeInner<Key, Search, Alloc, InnerSize> Inner;
 
-struct BTree : public common::BTreeBase<Key, Value> {
     // The root node of the btree.
     std::atomic<NodeBase *> root;
 
@@ -386,13 +84,31 @@ struct BTree : public common::BTreeBase<Key, Value> {
 
     // Construct a new btree with exactly one node, which is an empty leaf node.
     BTree() {
-        root = new BTreeLeaf<Key, Value>();
+        root = new Leaf();
+
+        int ret = pthread_rwlock_init(&big_lock, NULL);
+        assert(ret == 0);
+    }
+
+    // Construct a new btree with an empty cache from the (key, value) pairs in `[first, last)`,
+    // which must be sorted by key and free of duplicates. The tree is built
+    // bottom-up by `threads` threads (0 means one per core), and each node is
+    // filled to `fill` times its capacity. See `bulk-load.h`.
+    template <class It>
+    BTree(It first, It last, double fill = 1.0, unsigned threads = 0) {
+        root = common::bulk::build<NodeBase *, Key>(
+            first, last - first, Leaf::maxEntries, Inner::maxEntries, fill,
+            threads, packLeaf<It>, packInner);
 
         int ret = pthread_rwlock_init(&big_lock, NULL);
         assert(ret == 0);
     }
 
+    // Free all nodes. The caller must make sure no other thread is still
+    // using the tree.
     ~BTree() {
+        freeSubtree(root);
+
         int ret = pthread_rwlock_destroy(&big_lock);
         assert(ret == 0);
     }
@@ -400,7 +116,7 @@ struct BTree : public common::BTreeBase<Key, Value> {
     // Create a new root node with the two given nodes as children separated by
     // the given key. Atomically replace the current root with the new one.
     void makeRoot(Key k, NodeBase *leftChild, NodeBase *rightChild) {
-        auto inner = new BTreeInner<Key>();
+        auto inner = new Inner();
         inner->count = 1;
         inner->keys[0] = k;
         inner->children[0] = leftChild;
@@ -417,8 +133,63 @@ struct BTree : public common::BTreeBase<Key, Value> {
             _mm_pause();
     }
 
+    // A node built by the bulk loader, and the max key in its subtree.
+    typedef std::pair<NodeBase *, Key> Built;
+
+    // Pack the sorted (key, value) pairs in `[begin, end)` into a new leaf.
+    template <class It>
+    static Built packLeaf(It begin, It end) {
+        auto leaf = new Leaf();
+        for (It it = begin; it != end; ++it) {
+            assert(leaf->count < leaf->maxEntries);
+            assert(!leaf->count || leaf->key(leaf->count - 1) < it->first);
+            leaf->key(leaf->count) = it->first;
+            leaf->payload(leaf->count) = it->second;
+            leaf->count++;
+        }
+        return Built(leaf, leaf->count ? leaf->key(leaf->count - 1) : Key());
+    }
+
+    // Pack the children in `[begin, end)` into a new inner node. Each child
+    // is separated from the next one by its max key.
+    static Built packInner(const Built *begin, const Built *end) {
+        auto inner = new Inner();
+        assert(end - begin >= 2 &&
+               uint64_t(end - begin) <= inner->maxEntries);
+        inner->count = end - begin - 1;
+        for (unsigned i = 0; i <= inner->count; ++i) {
+            inner->children[i] = begin[i].first;
+            inner->keys[i] = begin[i].second;
+        }
+        return Built(inner, end[-1].second);
+    }
+
+    // Free the subtree rooted at `node`. Only safe once no other thread can
+    // access the tree.
+    static void freeSubtree(NodeBase *node) {
+        if (node->type == PageType::BTreeInner) {
+            auto inner = static_cast<Inner *>(node);
+            for (unsigned i = 0; i <= inner->count; ++i) {
+                freeSubtree(inner->children[i]);
+            }
+        }
+        deleteNode(node);
+    }
+
+    // Free a single node of this tree. Nodes are only freed with the whole
+    // tree: removes leave underfull leaves in place, so no node is ever
+    // unlinked and retired while the tree is in use.
+    static void deleteNode(void *p) {
+        NodeBase *node = static_cast<NodeBase *>(p);
+        if (node->type == PageType::BTreeInner) {
+            delete static_cast<Inner *>(node);
+        } else {
+            delete static_cast<Leaf *>(node);
+        }
+    }
+
     // A helper to traverse the B-tree, grabbing appropriate locks. It is used by
-    // the `bulk_insert` routine, which is used for purges.
+    // the `bulk_insert` routine, which is used for purges, and by `modify`.
     //
     // This routine returns the page that key `k` would be on. It grabs the
     // page's write lock before returning it. The caller is responsible for
@@ -430,7 +201,7 @@ struct BTree : public common::BTreeBase<Key, Value> {
     //
     // The `no_split` flag is used for debugging. A panic occurs if this flag
     // is true and a node is split by this routine.
-    std::pair<BTreeLeaf<Key, Value>*, util::maybe::Maybe<Key>>
+    std::pair<Leaf*, util::maybe::Maybe<Key>>
     bulk_insert_traverse(Key k, bool no_split = false) {
          int restartCount = 0;
     restart:
@@ -443,13 +214,17 @@ struct BTree : public common::BTreeBase<Key, Value> {
         if (needRestart || (node != root)) goto restart;
 
         // Parent of current node
-        BTreeInner<Key> *parent = nullptr;
+        Inner *parent = nullptr;
         uint64_t versionParent = 0;
         uint16_t parent_idx;
-        bool is_rightmost = true;
+
+        // The least separator to the right of the path we descend, i.e. the
+        // max key of the leaf. Only valid if `has_max`.
+        Key max_key = Key();
+        bool has_max = false;
 
         while (node->type == PageType::BTreeInner) {
-            auto inner = static_cast<BTreeInner<Key> *>(node);
+            auto inner = static_cast<Inner *>(node);
 
             // Split eagerly if full
             if (inner->isFull()) {
@@ -472,7 +247,7 @@ struct BTree : public common::BTreeBase<Key, Value> {
                 }
                 // Split
                 Key sep;
-                BTreeInner<Key> *newInner = inner->split(sep);
+                Inner *newInner = inner->split(sep);
                 if (parent)
                     parent->insert(sep, newInner);
                 else
@@ -492,9 +267,11 @@ struct BTree : public common::BTreeBase<Key, Value> {
             versionParent = versionNode;
             parent_idx = inner->lowerBound(k);
 
-            // descend to the left
-            if (parent_idx < inner->count - 1) {
-                is_rightmost = false;
+            // Not descending to the rightmost child, so there is a separator
+            // bounding the leaf. Deeper separators are always tighter.
+            if (parent_idx < inner->count) {
+                max_key = inner->keys[parent_idx];
+                has_max = true;
             }
 
             node = inner->children[parent_idx];
@@ -504,7 +281,7 @@ struct BTree : public common::BTreeBase<Key, Value> {
             if (needRestart) goto restart;
         }
 
-        auto leaf = static_cast<BTreeLeaf<Key, Value> *>(node);
+        auto leaf = static_cast<Leaf *>(node);
 
         // Split leaf if full
         if (leaf->count == leaf->maxEntries) {
@@ -526,7 +303,7 @@ struct BTree : public common::BTreeBase<Key, Value> {
             }
             // Split
             Key sep;
-            BTreeLeaf<Key, Value> *newLeaf = leaf->split(sep);
+            Leaf *newLeaf = leaf->split(sep);
             if (parent)
                 parent->insert(sep, newLeaf);
             else
@@ -540,18 +317,17 @@ struct BTree : public common::BTreeBase<Key, Value> {
             node->upgradeToWriteLockOrRestart(versionNode, needRestart);
             if (needRestart) goto restart;
             util::maybe::Maybe<Key> leaf_max; // Nothing by default
+            if (has_max) {
+                leaf_max = util::maybe::Maybe<Key>(max_key);
+            }
             if (parent) {
-                if(!is_rightmost) {
-                    // Set max value before potentially returning
-                    leaf_max = util::maybe::Maybe<Key>(parent->keys[parent_idx]);
-                }
                 parent->readUnlockOrRestart(versionParent, needRestart);
                 if (needRestart) {
                     node->writeUnlock();
                     goto restart;
                 }
             }
-            return std::pair<BTreeLeaf<Key, Value>*, util::maybe::Maybe<Key>>{leaf, leaf_max};  // success
+            return std::pair<Leaf*, util::maybe::Maybe<Key>>{leaf, leaf_max};  // success
         }
     }
 
@@ -559,6 +335,8 @@ struct BTree : public common::BTreeBase<Key, Value> {
     // B-tree. This routine is _only_ to be called if the caller is holding the
     // `big_lock`. It is only used for purges.
     void bulk_insert(std::vector<std::pair<Key, Value>> key_values) {
+        common::epoch::Guard guard;
+
         if (key_values.empty()) {
             return;
         }
@@ -570,54 +348,27 @@ struct BTree : public common::BTreeBase<Key, Value> {
         auto it = key_values.begin();
         while(it != key_values.end()) {
             // Find leaf of insertion... locked
-            BTreeLeaf<Key, Value>* l;
+            Leaf* l;
             util::maybe::Maybe<Key> leaf_max;
             std::tie(l, leaf_max) = bulk_insert_traverse(it->first);
 
             auto new_elements = 0;
-            auto end = it;
+            auto begin = it;
 
             // Find the elements we can insert now while respecting the amount
             // of free space and the max key.
             while (it != key_values.end()
                     && (l->maxEntries - l->count) - new_elements > 0
                     && !(leaf_max && it->first >= *leaf_max)) {
-                ++it; ++end;
+                ++it;
                 ++new_elements;
             }
 
-            --end;
-
-            // it == first element we haven't looked at yet
-            // end == last element to insert in this iteration
-            // new_elements == number elements to insert
-
             // Merge the existing entries with the purged entries in sorted
-            // order from the end.  Doing it from the end means that we always
-            // have space and only need to move each element once.
-            //
-            // "end" idx == l->count + new_elements - 1
-            auto keys_end_idx = l->count + new_elements - 1; // ultimately will be the end idx
-            auto to_insert = new_elements; // number elements remaining to insert from purged
-            int existing_end_idx = l->count - 1; // current last inserted idx
-
-            while (to_insert > 0) {
-                if (existing_end_idx < 0 || end->first > l->keys[existing_end_idx]) { // insert *end
-                    l->keys[keys_end_idx] = std::move(end->first);
-                    l->payloads[keys_end_idx] = std::move(end->second);
-                    --end;
-                    --to_insert;
-                } else {
-                    l->keys[keys_end_idx] = std::move(l->keys[existing_end_idx]);
-                    l->payloads[keys_end_idx] = std::move(l->payloads[existing_end_idx]);
-                    --existing_end_idx;
-                }
-
-                --keys_end_idx;
-            }
-
-            // Update stats
-            l->count += new_elements;
+            // order from the end.
+            l->count = common::bulk::mergeFromEnd(
+                l->entries.keys, l->entries.payloads, l->count, begin,
+                new_elements);
 
             // unlock leaf
             l->writeUnlock();
@@ -654,6 +405,95 @@ struct BTree : public common::BTreeBase<Key, Value> {
         insert_inner(k, v, false);
     }
 
+    // Insert (k, v) unless `k` is in the tree already. Returns true if it
+    // was inserted.
+    bool insert_if_absent(Key k, Value v) {
+        return modify(k, [&v](bool present, Value &value) {
+            if (!present) value = v;
+            return true;
+        });
+    }
+
+    // Set the value of `k` to `v` if `k` is in the tree. Returns true if it
+    // was.
+    bool update_if_present(Key k, Value v) {
+        bool found = false;
+        modify(k, [&v, &found](bool present, Value &value) {
+            if (present) value = v;
+            found = present;
+            return false;
+        });
+        return found;
+    }
+
+    // Set `result` to the value of `k`, or insert (k, v) and set `result` to
+    // `v` if `k` is not in the tree. Returns true if (k, v) was inserted.
+    bool get_or_insert(Key k, Value v, Value &result) {
+        return modify(k, [&v, &result](bool present, Value &value) {
+            if (!present) value = v;
+            result = value;
+            return true;
+        });
+    }
+
+    // Apply `fn` to the value of `k` in place, inserting `k` with a
+    // value-initialized value first if it is not in the tree. Returns true
+    // if `k` was inserted.
+    bool upsert(Key k, const std::function<void(Value &)> &fn) {
+        return modify(k, [&fn](bool, Value &value) {
+            fn(value);
+            return true;
+        });
+    }
+
+    // The core of the read-modify-write operations: call `fn(present,
+    // value)` exactly once, on the newest value of `k`. If `k` is there,
+    // `present` is true and `value` is that value, which `fn` changes in
+    // place. Otherwise, `value` is value-initialized, and (k, value) is
+    // inserted if `fn` returns true. Returns true if it was.
+    //
+    // The newest value is in the cache if the cache has `k`, and `fn` is
+    // then applied there under the lock of the hash map. Otherwise, it is
+    // applied under the write lock of the leaf. New keys always go to the
+    // tree, bypassing the policy. We hold the `big_lock` as a reader, so
+    // that a purge cannot move `k` from the cache to the tree in the middle.
+    template <class Fn>
+    bool modify(Key k, Fn fn) {
+        common::epoch::Guard guard;
+
+        big_read_lock();
+        while (true) {
+            if (hc.update_fn(k, [&fn](Value &value) { fn(true, value); })) {
+                big_unlock();
+                return false;
+            }
+
+            Leaf *leaf = bulk_insert_traverse(k).first;
+
+            // A hot insert may have put `k` into the cache in the meantime.
+            // If it does so from now on, it simply goes after us.
+            if (hc.contains(k)) {
+                leaf->writeUnlock();
+                continue;
+            }
+
+            bool inserted = false;
+            unsigned pos = leaf->lowerBound(k);
+            if ((pos < leaf->count) && (leaf->key(pos) == k)) {
+                fn(true, leaf->payload(pos));
+            } else {
+                Value value = Value();
+                if (fn(false, value)) {
+                    leaf->insert(k, value);
+                    inserted = true;
+                }
+            }
+            leaf->writeUnlock();
+            big_unlock();
+            return inserted;
+        }
+    }
+
     // Insert the (k, v) pair into the tree thread-safely. If `in_bulk_insert`
     // is true, avoid all paths that may interact with the policy or cache
     // layers. In other words, if `in_bulk_insert`, this routine behaves just
@@ -663,6 +503,8 @@ struct BTree : public common::BTreeBase<Key, Value> {
     // See the comment at that point. For simplicity, we always traverse the
     // tree before doing anything with the cache.
     void insert_inner(Key k, Value v, bool in_bulk_insert) {
+        common::epoch::Guard guard;
+
         int restartCount = 0;
     restart:
         if (restartCount++) yield(restartCount);
@@ -674,7 +516,7 @@ struct BTree : public common::BTreeBase<Key, Value> {
         if (needRestart || (node != root)) goto restart;
 
         // Parent of current node
-        BTreeInner<Key> *parent = nullptr;
+        Inner *parent = nullptr;
         uint64_t versionParent = 0;
 
         // Keep track of some properties as we descend the tree
@@ -686,7 +528,7 @@ struct BTree : public common::BTreeBase<Key, Value> {
             max_parent_key = 0; // only valid if not root or leftmost
 
         while (node->type == PageType::BTreeInner) {
-            auto inner = static_cast<BTreeInner<Key> *>(node);
+            auto inner = static_cast<Inner *>(node);
 
             // The leaf cannot be the root
             is_root = false;
@@ -710,7 +552,7 @@ struct BTree : public common::BTreeBase<Key, Value> {
                 }
                 // Split
                 Key sep;
-                BTreeInner<Key> *newInner = inner->split(sep);
+                Inner *newInner = inner->split(sep);
                 if (parent)
                     parent->insert(sep, newInner);
                 else
@@ -761,7 +603,7 @@ struct BTree : public common::BTreeBase<Key, Value> {
             if (needRestart) goto restart;
         }
 
-        auto leaf = static_cast<BTreeLeaf<Key, Value> *>(node);
+        auto leaf = static_cast<Leaf *>(node);
 
         // Split leaf if full
         if (leaf->count == leaf->maxEntries) {
@@ -781,7 +623,7 @@ struct BTree : public common::BTreeBase<Key, Value> {
             }
             // Split
             Key sep;
-            BTreeLeaf<Key, Value> *newLeaf = leaf->split(sep);
+            Leaf *newLeaf = leaf->split(sep);
             if (parent)
                 parent->insert(sep, newLeaf);
             else
@@ -942,6 +784,8 @@ struct BTree : public common::BTreeBase<Key, Value> {
     // value associated with `k` and return true. If `k` is not in the btree,
     // return false.
     bool lookup(Key k, Value &result) {
+        common::epoch::Guard guard;
+
         // No locks needed. Concurrency is handled by the hash map :P
         if (hc.find(k, result)) {
             return true;
@@ -963,11 +807,11 @@ struct BTree : public common::BTreeBase<Key, Value> {
         if (needRestart || (node != root)) goto restart;
 
         // Parent of current node
-        BTreeInner<Key> *parent = nullptr;
+        Inner *parent = nullptr;
         uint64_t versionParent = 0;
 
         while (node->type == PageType::BTreeInner) {
-            auto inner = static_cast<BTreeInner<Key> *>(node);
+            auto inner = static_cast<Inner *>(node);
 
             if (parent) {
                 parent->readUnlockOrRestart(versionParent, needRestart);
@@ -984,14 +828,13 @@ struct BTree : public common::BTreeBase<Key, Value> {
             if (needRestart) goto restart;
         }
 
-        BTreeLeaf<Key, Value> *leaf =
-            static_cast<BTreeLeaf<Key, Value> *>(node);
+        Leaf *leaf = static_cast<Leaf *>(node);
 
         unsigned pos = leaf->lowerBound(k);
-        bool success;
-        if ((pos < leaf->count) && (leaf->keys[pos] == k)) {
+        bool success = false;
+        if ((pos < leaf->count) && (leaf->key(pos) == k)) {
             success = true;
-            result = leaf->payloads[pos];
+            result = leaf->payload(pos);
         }
         if (parent) {
             parent->readUnlockOrRestart(versionParent, needRestart);
@@ -1003,6 +846,78 @@ struct BTree : public common::BTreeBase<Key, Value> {
         return success;
     }
 
+    // Remove key `k` and its value from the btree. Returns true if `k` was in
+    // the btree.
+    //
+    // NOTE: underfull leaves are not merged in this implementation.
+    //
+    // The key is removed from both the cache and the B-tree while holding the
+    // `big_lock` as a reader, so that a purge cannot move it from one to the
+    // other in the middle.
+    bool remove(Key k) {
+        common::epoch::Guard guard;
+
+        big_read_lock();
+        bool found = hc.erase(k);
+        found = remove_from_tree(k) || found;
+        big_unlock();
+        return found;
+    }
+
+    // Remove `k` from the B-tree part of the structure only.
+    bool remove_from_tree(Key k) {
+        int restartCount = 0;
+    restart:
+        if (restartCount++) yield(restartCount);
+        bool needRestart = false;
+
+        NodeBase *node = root;
+        uint64_t versionNode = node->readLockOrRestart(needRestart);
+        if (needRestart || (node != root)) goto restart;
+
+        // Parent of current node
+        Inner *parent = nullptr;
+        uint64_t versionParent = 0;
+
+        while (node->type == PageType::BTreeInner) {
+            auto inner = static_cast<Inner *>(node);
+
+            if (parent) {
+                parent->readUnlockOrRestart(versionParent, needRestart);
+                if (needRestart) goto restart;
+            }
+
+            parent = inner;
+            versionParent = versionNode;
+
+            node = inner->children[inner->lowerBound(k)];
+            inner->checkOrRestart(versionNode, needRestart);
+            if (needRestart) goto restart;
+            versionNode = node->readLockOrRestart(needRestart);
+            if (needRestart) goto restart;
+        }
+
+        auto leaf = static_cast<Leaf *>(node);
+
+        // only lock leaf node
+        node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+        if (needRestart) goto restart;
+        if (parent) {
+            parent->readUnlockOrRestart(versionParent, needRestart);
+            if (needRestart) {
+                node->writeUnlock();
+                goto restart;
+            }
+        }
+        unsigned pos = leaf->lowerBound(k);
+        bool found = (pos < leaf->count) && (leaf->key(pos) == k);
+        if (found) {
+            leaf->removeAt(pos);
+        }
+        node->writeUnlock();
+        return found;
+    }
+
     // NOTE: This does not work. It's just a copy of the implementation from
     // the OLC. This implementation does not actually account for the cache.
     //
@@ -1013,6 +928,8 @@ struct BTree : public common::BTreeBase<Key, Value> {
     // could scan.  The caller should keep calling `scan` until no records are
     // read.
     uint64_t scan(Key k, int range, Value *output) {
+        common::epoch::Guard guard;
+
         int restartCount = 0;
     restart:
         if (restartCount++) yield(restartCount);
@@ -1023,11 +940,11 @@ struct BTree : public common::BTreeBase<Key, Value> {
         if (needRestart || (node != root)) goto restart;
 
         // Parent of current node
-        BTreeInner<Key> *parent = nullptr;
+        Inner *parent = nullptr;
         uint64_t versionParent = 0;
 
         while (node->type == PageType::BTreeInner) {
-            auto inner = static_cast<BTreeInner<Key> *>(node);
+            auto inner = static_cast<Inner *>(node);
 
             if (parent) {
                 parent->readUnlockOrRestart(versionParent, needRestart);
@@ -1044,13 +961,12 @@ struct BTree : public common::BTreeBase<Key, Value> {
             if (needRestart) goto restart;
         }
 
-        BTreeLeaf<Key, Value> *leaf =
-            static_cast<BTreeLeaf<Key, Value> *>(node);
+        Leaf *leaf = static_cast<Leaf *>(node);
         unsigned pos = leaf->lowerBound(k);
         int count = 0;
         for (unsigned i = pos; i < leaf->count; i++) {
             if (count == range) break;
-            output[count++] = leaf->payloads[i];
+            output[count++] = leaf->payload(i);
         }
 
         if (parent) {
@@ -0,0 +1,495 @@
+#ifndef _BTREE_BTREE_PARTITIONED_H
+#define _BTREE_BTREE_PARTITIONED_H
+
+/*
+ * A forest of independent btrees, each of which holds one range of keys.
+ *
+ * Every operation on a single tree starts at its root, so all threads meet
+ * there and in the nodes along the hottest key ranges. A `PartitionedBTree`
+ * splits the key space into partitions, each with a tree of its own, and
+ * routes each operation to the tree of its key. The router is an immutable
+ * sorted array of the least keys of the partitions behind an atomic pointer:
+ * threads read it without any locks, and repartitioning publishes a new one
+ * and retires the old one with epoch-based reclamation (see `epoch.h`).
+ *
+ * A partition is split in two, online, when it gets a much bigger share of
+ * the operations than the others (see `splitHot`). Operations sample their
+ * keys, and the partition is split at the median of its recently sampled
+ * keys. A hot append range, e.g. increasing time stamps, thus ends up in a
+ * small partition of its own, apart from the cold historical data.
+ *
+ * Unlike byte reordering, partitioning keeps the keys in order: `scan`
+ * continues from one partition into the next.
+ *
+ * The trees store each key along with its value (see `Entry`), so that the
+ * entries of a partition can be moved with `scan`. This stores every key
+ * twice.
+ */
+
+#include "btree-base.h"
+#include "epoch.h"
+
+#include <immintrin.h>
+#include <sched.h>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <functional>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace btree_partitioned {
+
+// What the tree of a partition maps each key to: the key itself and its
+// value. The key is there so that a split can move entries with `scan`, which
+// only returns values.
+//
+// It costs space: every key is stored twice, once as the key of the tree and
+// once in its entry. With 8-byte keys and values, an entry takes 24 bytes of
+// a leaf instead of 16, e.g. a 4KB leaf of the OLC tree holds 168 entries
+// instead of 253.
+template <class Key, class Value>
+struct Entry {
+    Key key;
+    Value value;
+};
+
+// Entries are ordered by key, for the trees that sort their values along with
+// their keys.
+template <class Key, class Value>
+bool operator<(const Entry<Key, Value> &a, const Entry<Key, Value> &b) {
+    return a.key < b.key;
+}
+
+// A thread-safe btree map made of a tree of type `Tree` per partition of the
+// key space. `Tree` must be a `common::BTreeBase<Key, Entry<Key, Value>>`,
+// e.g. `btreeolc::BTree<Key, Entry<Key, Value>>`.
+//
+// Repartitioning moves entries with `Tree::scan`, so it needs a tree whose
+// scans return all entries in key order until the end of the tree, as the
+// OLC tree's do. The scans of the hybrid tree miss its cache, those of the
+// byte-reordering tree stop at the end of a leaf, and unless its key
+// transform is `common::key::Identity`, they are not in key order. With
+// those trees, turn `splitHot` off and pick the partitions up front.
+template <class Key, class Value, class Tree>
+struct PartitionedBTree final : public common::BTreeBase<Key, Value> {
+    typedef btree_partitioned::Entry<Key, Value> Entry;
+
+    static_assert(std::is_integral<Key>::value,
+                  "keys must be integers to scan on from the next key");
+    static_assert(std::is_base_of<common::BTreeBase<Key, Entry>, Tree>::value,
+                  "the trees must map keys to entries");
+
+private:
+    // The number of the latest sampled keys of each partition.
+    static const unsigned recentKeys = 64;
+
+    // One partition: a key range and its tree.
+    struct Partition {
+        // The tree of the partition. It belongs to the forest, not to the
+        // partition: partitions are recreated with each router, trees are not.
+        Tree *tree;
+
+        // Set once the partition is being split. Operations that find it set
+        // wait for the router that replaces it.
+        std::atomic<bool> frozen{false};
+
+        // The number of sampled operations on this partition, and the keys of
+        // the latest of them.
+        std::atomic<uint64_t> samples{0};
+        std::atomic<Key> recent[recentKeys] = {};
+
+        explicit Partition(Tree *t) : tree(t) {}
+    };
+
+    // The partitions, by key range. Partition `i` holds the keys in
+    // `[lows[i], lows[i + 1])`, and the last one all keys from `lows.back()`.
+    // `lows[0]` is the least `Key`. Never changed once published.
+    struct Router {
+        std::vector<Key> lows;
+        std::vector<Partition *> partitions;
+
+        // The number of sampled operations on all partitions.
+        std::atomic<uint64_t> samples{0};
+
+        // The index of the partition that holds `k`.
+        unsigned find(Key k) const {
+            return std::upper_bound(lows.begin() + 1, lows.end(), k) -
+                   lows.begin() - 1;
+        }
+
+        // Whether partition `i` has an upper bound, and what it is.
+        bool bounded(unsigned i) const { return i + 1 < lows.size(); }
+        Key high(unsigned i) const { return lows[i + 1]; }
+    };
+
+    // The current router.
+    std::atomic<Router *> router;
+
+    // Set while a thread repartitions. There is one repartitioning at a time.
+    std::atomic<bool> repartitioning{false};
+
+    // Free a router and its partitions, but not their trees. Used as the
+    // deleter for epoch-based reclamation.
+    static void deleteRouter(void *p) {
+        Router *r = static_cast<Router *>(p);
+        for (Partition *partition : r->partitions) {
+            delete partition;
+        }
+        delete r;
+    }
+
+    // A router for the given trees, separated by the given keys.
+    static Router *newRouter(const std::vector<Key> &bounds,
+                             const std::vector<Tree *> &trees) {
+        assert(trees.size() == bounds.size() + 1);
+        Router *r = new Router();
+        r->lows.push_back(std::numeric_limits<Key>::min());
+        r->lows.insert(r->lows.end(), bounds.begin(), bounds.end());
+        for (Tree *tree : trees) {
+            r->partitions.push_back(new Partition(tree));
+        }
+        return r;
+    }
+
+    // Depending on the value of `count`, either yield the processor to the OS
+    // scheduler or inform the processor you are waiting for a spin lock.
+    void yield(int count) {
+        if (count > 3)
+            sched_yield();
+        else
+            _mm_pause();
+    }
+
+    // The number of operations of the calling thread on any forest.
+    static unsigned &ticks() {
+        static thread_local unsigned t = 0;
+        return t;
+    }
+
+    // Call `fn` on the tree of the partition that holds `k`. Every
+    // `sampleEvery`th operation of each thread is sampled; if that shows a
+    // hot partition, it is split afterwards.
+    template <class Fn>
+    void route(Key k, Fn fn) {
+        bool hot = false;
+        int restartCount = 0;
+        while (true) {
+            {
+                common::epoch::Guard guard;
+                Router *r = router;
+                Partition *partition = r->partitions[r->find(k)];
+                if (!partition->frozen) {
+                    fn(*partition->tree);
+                    if (splitHot && ++ticks() % sampleEvery == 0) {
+                        hot = sample(r, partition, k);
+                    }
+                    break;
+                }
+            }
+            // Wait for the split outside of the epoch, which it waits for.
+            yield(++restartCount);
+        }
+        if (hot) splitHottest();
+    }
+
+    // Count an operation on `k` in `partition`. Returns true if it is time
+    // to look for a hot partition.
+    bool sample(Router *r, Partition *partition, Key k) {
+        uint64_t n = partition->samples.fetch_add(1, std::memory_order_relaxed);
+        partition->recent[n % recentKeys].store(k, std::memory_order_relaxed);
+        uint64_t total = r->samples.fetch_add(1, std::memory_order_relaxed);
+        return (total + 1) % checkEvery == 0 &&
+               r->partitions.size() < maxPartitions;
+    }
+
+    // Split the partition with the most samples if it is hot, i.e. it has at
+    // least twice the share it would have with one more partition. It is
+    // split at the median of its recent keys, unless that is its least key,
+    // e.g. because all of its operations are on the same key.
+    void splitHottest() {
+        if (repartitioning.exchange(true)) return;
+
+        Key sep = Key();
+        bool split = false;
+        {
+            common::epoch::Guard guard;
+            Router *r = router;
+            unsigned hottest = 0;
+            for (unsigned i = 1; i < r->partitions.size(); ++i) {
+                if (r->partitions[i]->samples >
+                    r->partitions[hottest]->samples) {
+                    hottest = i;
+                }
+            }
+            Partition *partition = r->partitions[hottest];
+            uint64_t samples = partition->samples;
+            uint64_t n = r->partitions.size();
+            if (samples >= recentKeys &&
+                samples * (n + 1) >= 2 * r->samples.load()) {
+                std::vector<Key> keys;
+                for (unsigned i = 0; i < recentKeys; ++i) {
+                    keys.push_back(partition->recent[i]);
+                }
+                std::nth_element(keys.begin(), keys.begin() + recentKeys / 2,
+                                 keys.end());
+                sep = keys[recentKeys / 2];
+                split = sep != r->lows[hottest];
+            }
+        }
+        if (split) splitLocked(sep);
+
+        repartitioning = false;
+    }
+
+    // Split the partition that holds `sep` so that `sep` is the least key of
+    // a new partition. The caller must be the one that repartitions, and must
+    // not be in an epoch. Returns false if `sep` is the least key of a
+    // partition already.
+    bool splitLocked(Key sep) {
+        // Only we replace the router, so it stays put.
+        Router *r = router;
+        unsigned i = r->find(sep);
+        if (sep == r->lows[i]) return false;
+        Partition *partition = r->partitions[i];
+
+        // Once every operation that may have missed the flag is done, the
+        // tree is ours.
+        partition->frozen = true;
+        common::epoch::manager().synchronize();
+
+        // Move the entries from `sep` on into a new tree.
+        std::vector<std::pair<Key, Entry>> moved;
+        std::vector<Entry> entries(scanChunk);
+        Key from = sep;
+        while (true) {
+            uint64_t n = partition->tree->scan(from, scanChunk, entries.data());
+            uint64_t taken = 0;
+            while (taken < n && (!r->bounded(i) ||
+                                 entries[taken].key < r->high(i))) {
+                moved.push_back(std::make_pair(entries[taken].key,
+                                               entries[taken]));
+                taken++;
+            }
+            if (taken < n || n == 0 ||
+                entries[n - 1].key == std::numeric_limits<Key>::max()) {
+                break;
+            }
+            from = entries[n - 1].key + 1;
+        }
+        Tree *tree = new Tree(moved.begin(), moved.end());
+        for (const auto &pair : moved) {
+            partition->tree->remove(pair.first);
+        }
+
+        // Publish a router with the new partition.
+        std::vector<Key> bounds(r->lows.begin() + 1, r->lows.end());
+        std::vector<Tree *> trees;
+        for (Partition *p : r->partitions) {
+            trees.push_back(p->tree);
+        }
+        bounds.insert(bounds.begin() + i, sep);
+        trees.insert(trees.begin() + i + 1, tree);
+        router = newRouter(bounds, trees);
+        common::epoch::retire(r, deleteRouter);
+        return true;
+    }
+
+public:
+    // Construct an empty forest with a partition for each range between the
+    // given keys, which must be sorted and free of duplicates. Without any,
+    // there is one partition, which is split once it gets hot.
+    explicit PartitionedBTree(const std::vector<Key> &bounds = {}) {
+        std::vector<Tree *> trees;
+        for (size_t i = 0; i <= bounds.size(); ++i) {
+            trees.push_back(new Tree());
+        }
+        router = newRouter(bounds, trees);
+    }
+
+    // Construct a forest from the (key, value) pairs in `[first, last)`,
+    // which must be sorted by key and free of duplicates, with the
+    // partitions between the given keys. The tree of each partition is bulk
+    // loaded with `fill` (see `bulk-load.h`).
+    template <class It>
+    PartitionedBTree(It first, It last, const std::vector<Key> &bounds = {},
+                     double fill = 1.0) {
+        std::vector<Tree *> trees;
+        It it = first;
+        for (size_t i = 0; i <= bounds.size(); ++i) {
+            std::vector<std::pair<Key, Entry>> pairs;
+            for (; it != last && (i == bounds.size() || it->first < bounds[i]);
+                 ++it) {
+                pairs.push_back(
+                    std::make_pair(it->first, Entry{it->first, it->second}));
+            }
+            trees.push_back(new Tree(pairs.begin(), pairs.end(), fill));
+        }
+        router = newRouter(bounds, trees);
+    }
+
+    // Free all trees. The caller must make sure no other thread is still
+    // using the forest.
+    ~PartitionedBTree() {
+        Router *r = router;
+        for (Partition *partition : r->partitions) {
+            delete partition->tree;
+        }
+        deleteRouter(r);
+    }
+
+    // If set, a partition that gets a lot more operations than the others
+    // is split (see `splitHottest`), until there are `maxPartitions`. Each
+    // thread samples every `sampleEvery`th of its operations, and the
+    // partitions are checked every `checkEvery` samples.
+    //
+    // A split holds up all operations on the split partition while the
+    // entries from the split key on move to their new tree. See `Tree` for
+    // the trees this works with.
+    bool splitHot = true;
+    unsigned maxPartitions = 64;
+    static const unsigned sampleEvery = 64;
+    static const unsigned checkEvery = 1024;
+
+    // The number of entries read per `scan` of a tree during a split.
+    static const int scanChunk = 256;
+
+    // Split the partition that holds `sep` so that `sep` is the least key of
+    // a new partition. Returns false if it is the least key of a partition
+    // already. Must not be called inside an epoch (see `epoch.h`).
+    bool split(Key sep) {
+        int restartCount = 0;
+        while (repartitioning.exchange(true)) yield(++restartCount);
+        bool split = splitLocked(sep);
+        repartitioning = false;
+        return split;
+    }
+
+    // The least keys of all partitions but the first.
+    std::vector<Key> bounds() {
+        common::epoch::Guard guard;
+        Router *r = router;
+        return std::vector<Key>(r->lows.begin() + 1, r->lows.end());
+    }
+
+    // Insert the (k, v) pair into the tree.
+    void insert(Key k, Value v) {
+        route(k, [k, &v](Tree &tree) { tree.insert(k, Entry{k, v}); });
+    }
+
+    // Insert (k, v) unless `k` is in the tree already. Returns true if it
+    // was inserted.
+    bool insert_if_absent(Key k, Value v) {
+        bool inserted = false;
+        route(k, [k, &v, &inserted](Tree &tree) {
+            inserted = tree.insert_if_absent(k, Entry{k, v});
+        });
+        return inserted;
+    }
+
+    // Set the value of `k` to `v` if `k` is in the tree. Returns true if it
+    // was.
+    bool update_if_present(Key k, Value v) {
+        bool found = false;
+        route(k, [k, &v, &found](Tree &tree) {
+            found = tree.update_if_present(k, Entry{k, v});
+        });
+        return found;
+    }
+
+    // Set `result` to the value of `k`, or insert (k, v) and set `result` to
+    // `v` if `k` is not in the tree. Returns true if (k, v) was inserted.
+    bool get_or_insert(Key k, Value v, Value &result) {
+        bool inserted = false;
+        route(k, [k, &v, &result, &inserted](Tree &tree) {
+            Entry entry;
+            inserted = tree.get_or_insert(k, Entry{k, v}, entry);
+            result = entry.value;
+        });
+        return inserted;
+    }
+
+    // Apply `fn` to the value of `k` in place, inserting `k` with a
+    // value-initialized value first if it is not in the tree. Returns true
+    // if `k` was inserted.
+    bool upsert(Key k, const std::function<void(Value &)> &fn) {
+        bool inserted = false;
+        route(k, [k, &fn, &inserted](Tree &tree) {
+            inserted = tree.upsert(k, [k, &fn](Entry &entry) {
+                entry.key = k;
+                fn(entry.value);
+            });
+        });
+        return inserted;
+    }
+
+    // Lookup key `k` in the btree. If `k` is in the btree, set `result` to the
+    // value associated with `k` and return true. If `k` is not in the btree,
+    // return false.
+    bool lookup(Key k, Value &result) {
+        bool found = false;
+        route(k, [k, &result, &found](Tree &tree) {
+            Entry entry;
+            found = tree.lookup(k, entry);
+            if (found) result = entry.value;
+        });
+        return found;
+    }
+
+    // Remove key `k` and its value from the btree. Returns true if `k` was in
+    // the btree.
+    bool remove(Key k) {
+        bool found = false;
+        route(k, [k, &found](Tree &tree) { found = tree.remove(k); });
+        return found;
+    }
+
+    // Do a range query on the btree. Starting with the least key greater than
+    // or equal to `k`, scan at most `range` values into the buffer pointed to
+    // by `output`. Return the number of elements read. Once a partition has
+    // no more entries, the scan goes on in the next one, so fewer than
+    // `range` elements are only read if the scans of the trees stop early
+    // (see `Tree`), or if the end of the last partition is reached.
+    uint64_t scan(Key k, int range, Value *output) {
+        std::vector<Entry> entries(range);
+        int count = 0;
+        Key from = k;
+        int restartCount = 0;
+        while (count < range) {
+            {
+                common::epoch::Guard guard;
+                Router *r = router;
+                unsigned i = r->find(from);
+                Partition *partition = r->partitions[i];
+                if (!partition->frozen) {
+                    uint64_t n = partition->tree->scan(from, range - count,
+                                                       entries.data());
+                    uint64_t taken = 0;
+                    while (taken < n && (!r->bounded(i) ||
+                                         entries[taken].key < r->high(i))) {
+                        output[count++] = entries[taken++].value;
+                    }
+                    if (taken == n && n > 0 &&
+                        entries[n - 1].key != std::numeric_limits<Key>::max()) {
+                        // There may be more in this partition.
+                        from = entries[n - 1].key + 1;
+                    } else if (r->bounded(i)) {
+                        from = r->high(i);
+                    } else {
+                        break;
+                    }
+                    continue;
+                }
+            }
+            // Wait for the split outside of the epoch, which it waits for.
+            yield(++restartCount);
+        }
+        return count;
+    }
+};
+
+}  // namespace btree_partitioned
+
+#endif
@@ -0,0 +1,866 @@
+#ifndef _BTREE_BTREE_VARKEY_H
+#define _BTREE_BTREE_VARKEY_H
+
+/*
+ * A concurrent B-tree for variable-length keys: strings, or composite keys
+ * encoded as byte strings in which byte order is key order (e.g. big-endian
+ * integers). Keys are compared bytewise, like `std::string`.
+ *
+ * The other trees keep `Key keys[maxEntries]`, which needs fixed-size keys.
+ * Here, every node is a slotted page instead:
+ *
+ *   | header | slot 0 | slot 1 | ... ->    free    <- ... heap |
+ *
+ * - The slot array grows up from the header. Slot `i` points to the `i`th
+ *   smallest key of the node in the heap, and holds its first four bytes (the
+ *   "head") as a big-endian integer.
+ * - The heap grows down from the end of the page. It holds the bytes of each
+ *   key followed by its payload (a value in a leaf, a child pointer in an
+ *   inner node), and the fence keys of the node.
+ *
+ * Binary search mostly compares heads, which are right there in the slot
+ * array, and only goes to the heap to break ties between equal heads.
+ *
+ * Prefix truncation: every node stores its fence keys, i.e. the separators
+ * left and right of it in its parent. All keys in the node lie between them,
+ * so they all share the common prefix of the two fences. The prefix is kept
+ * once, as the start of the low fence, and the keys are stored without it.
+ * Deeper in the tree, where keys share longer prefixes, this saves space and
+ * makes the heads tell more keys apart.
+ *
+ * Concurrency control is optimistic lock coupling with eager splits on the
+ * way down, as in `btree-bytereorder.h`. Optimistic readers may look at a
+ * node while it is being changed, so every offset and length read from a page
+ * is checked to lie within the page before it is used; the version check
+ * afterwards throws away whatever was computed from a torn read.
+ *
+ * Keys can be at most `maxKeyLength` bytes long. Values must be trivially
+ * copyable, since they are stored unaligned in the heap.
+ *
+ * NOTE: underfull nodes are not merged in this implementation, so nodes are
+ * never freed while the tree is in use.
+ */
+
+#include "alloc.h"
+#include "btree-base.h"
+#include "optlock.h"
+
+#include <immintrin.h>
+#include <sched.h>
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <type_traits>
+
+namespace btree_varkey {
+// Each page in the Btree can be either an inner node or a leaf node.
+enum class PageType : uint8_t { BTreeInner = 1, BTreeLeaf = 2 };
+
+// The default size of a node.
+static const uint64_t pageSize = 4 * 1024;
+
+// An optimistic lock. See `optlock.h`.
+using common::OptLock;
+
+// The fixed-size header of every node, in front of its slots and heap.
+struct NodeBase : public OptLock {
+    // Leaf or inner?
+    PageType type;
+
+    // True for the rightmost node of each level, which has no high fence.
+    bool rightmost;
+
+    // The number of keys in the node.
+    uint16_t count;
+
+    // The offset of the lowest byte of the heap, which grows down from the end
+    // of the page. Like all offsets, it is relative to the end of the header.
+    uint16_t heapStart;
+
+    // The number of heap bytes left behind by removed keys. They are reclaimed
+    // when the node is compacted.
+    uint16_t garbage;
+
+    // The length of the prefix that all keys in the node share. It is stored
+    // only once, as the start of the low fence.
+    uint16_t prefixLength;
+
+    // The fence keys in the heap. Every key `k` in the node has
+    // `lowFence < k <= highFence`.
+    uint16_t lowFenceOffset;
+    uint16_t lowFenceLength;
+    uint16_t highFenceOffset;
+    uint16_t highFenceLength;
+
+    // In an inner node, the child for the keys greater than all keys in the
+    // node.
+    NodeBase *upper;
+};
+
+// A single node in the btree. Leaves and inner nodes share the same layout
+// and only differ in their payloads: a `Value` per key in a leaf, and a child
+// pointer per key in an inner node.
+//
+// Anyone changing a node should hold its write lock. The methods that are
+// safe for optimistic readers are marked as such; they return garbage rather
+// than read outside the page if the node changes under them.
+template <class Value, class Alloc = common::alloc::Default,
+          uint64_t PageSize = pageSize>
+struct BTreeNode : public NodeBase {
+    static_assert(std::is_trivially_copyable<Value>::value,
+                  "values are copied bytewise in and out of the heap");
+
+    // The slot of a key.
+    struct Slot {
+        // Where the key (without the prefix) is in the heap. Its payload
+        // follows right after it.
+        uint16_t offset;
+        uint16_t keyLength;
+
+        // The first four bytes of the key (without the prefix), big-endian
+        // and padded with zeroes.
+        uint32_t head;
+    };
+
+    // The size of the slots and heap together.
+    static const unsigned dataSize = PageSize - sizeof(NodeBase);
+    static_assert(PageSize <= 65536, "offsets into a page must fit 16 bits");
+
+    // The max number of slots that fit in a page.
+    static const unsigned maxSlots = dataSize / sizeof(Slot);
+
+    // The max length of a key. A node takes at least a dozen keys of this
+    // length, even with both fences at the max length too.
+    static const unsigned maxKeyLength = dataSize / 16;
+    static_assert(maxKeyLength >= 16, "the pages are too small");
+
+    union {
+        Slot slots[maxSlots];
+        uint8_t data[dataSize];
+    };
+
+    // Construct an empty node with the given fence keys.
+    BTreeNode(PageType type, const std::string &lowFence,
+              const std::string &highFence, bool rightmost) {
+        assert(lowFence.size() <= maxKeyLength);
+        assert(highFence.size() <= maxKeyLength);
+        this->type = type;
+        this->rightmost = rightmost;
+        count = 0;
+        heapStart = dataSize;
+        garbage = 0;
+        upper = nullptr;
+        lowFenceOffset = store(lowFence.data(), lowFence.size());
+        lowFenceLength = lowFence.size();
+        highFenceOffset = store(highFence.data(), highFence.size());
+        highFenceLength = highFence.size();
+
+        prefixLength = 0;
+        if (!rightmost) {
+            while (prefixLength < lowFence.size() &&
+                   prefixLength < highFence.size() &&
+                   lowFence[prefixLength] == highFence[prefixLength]) {
+                prefixLength++;
+            }
+        }
+    }
+
+    // Nodes come from the node allocator (see `alloc.h`).
+    static void *operator new(size_t size) { return Alloc::allocate(size); }
+    static void operator delete(void *p, size_t size) {
+        Alloc::deallocate(p, size);
+    }
+
+    // The big-endian value of the first four bytes of `key`, padded with
+    // zeroes. If the heads of two keys differ, they compare like the keys.
+    static uint32_t headOf(const uint8_t *key, unsigned length) {
+        uint8_t bytes[4] = {0, 0, 0, 0};
+        memcpy(bytes, key, std::min(length, 4u));
+        return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) |
+               (uint32_t(bytes[2]) << 8) | uint32_t(bytes[3]);
+    }
+
+    // Compare two byte strings like `memcmp`, with a shorter string ordered
+    // before the longer strings it is a prefix of.
+    static int compare(const uint8_t *a, unsigned aLength, const uint8_t *b,
+                       unsigned bLength) {
+        int c = memcmp(a, b, std::min(aLength, bLength));
+        if (c != 0) return c;
+        return (aLength > bLength) - (aLength < bLength);
+    }
+
+    // Returns true if the `length` bytes at `offset` lie within the page.
+    static bool inPage(unsigned offset, unsigned length) {
+        return offset + length <= dataSize;
+    }
+
+    // The size of the payload of each key.
+    unsigned payloadSize() const {
+        return type == PageType::BTreeLeaf ? sizeof(Value) : sizeof(NodeBase *);
+    }
+
+    // The number of keys, capped to what fits in the page. Safe for readers.
+    unsigned slotCount() const {
+        return count < maxSlots ? count : maxSlots;
+    }
+
+    // The number of bytes between the slots and the heap.
+    int freeSpace() const {
+        return int(heapStart) - int(sizeof(Slot) * count);
+    }
+
+    // The number of free bytes once the node is compacted.
+    int freeSpaceAfterCompaction() const { return freeSpace() + garbage; }
+
+    // Returns true if the node has room for another key `k`, possibly after
+    // compacting it. Safe for readers.
+    bool hasSpaceFor(const std::string &k) const {
+        unsigned length = k.size() > prefixLength ? k.size() - prefixLength : 0;
+        return int(sizeof(Slot) + length + payloadSize()) <=
+               freeSpaceAfterCompaction();
+    }
+
+    // Returns true if an inner node may not have room for another separator.
+    // It needs to be split before any of its children can be split. Safe for
+    // readers.
+    bool isFull() const {
+        return int(sizeof(Slot) + maxKeyLength + sizeof(NodeBase *)) >
+               freeSpaceAfterCompaction();
+    }
+
+    // Copy `bytes` to the bottom of the heap and return their offset.
+    uint16_t store(const void *bytes, unsigned length) {
+        assert(heapStart >= length);
+        heapStart -= length;
+        memcpy(data + heapStart, bytes, length);
+        return heapStart;
+    }
+
+    // The `length` bytes at `offset` as a string, or the empty string if they
+    // do not lie within the page. Safe for readers.
+    std::string bytesAt(unsigned offset, unsigned length) const {
+        if (!inPage(offset, length)) return std::string();
+        return std::string(reinterpret_cast<const char *>(data + offset),
+                           length);
+    }
+
+    std::string lowFence() const {
+        return bytesAt(lowFenceOffset, lowFenceLength);
+    }
+
+    std::string highFence() const {
+        return bytesAt(highFenceOffset, highFenceLength);
+    }
+
+    // The full key of slot `i`, prefix included.
+    std::string keyAt(unsigned i) const {
+        assert(i < count);
+        return bytesAt(lowFenceOffset, prefixLength) +
+               bytesAt(slots[i].offset, slots[i].keyLength);
+    }
+
+    // The payload of slot `i`, or null if the slot points outside of the
+    // page. Safe for readers.
+    const uint8_t *payloadAt(unsigned i) const {
+        if (i >= slotCount()) return nullptr;
+        const Slot &slot = slots[i];
+        if (!inPage(slot.offset + slot.keyLength, payloadSize())) {
+            return nullptr;
+        }
+        return data + slot.offset + slot.keyLength;
+    }
+
+    uint8_t *payloadAt(unsigned i) {
+        return const_cast<uint8_t *>(
+            static_cast<const BTreeNode *>(this)->payloadAt(i));
+    }
+
+    // The child of an inner node for the keys that `lowerBound` puts at
+    // `pos`, or null if it points outside of the page. Safe for readers.
+    NodeBase *childAt(unsigned pos) const {
+        if (pos >= count) return upper;
+        NodeBase *child = nullptr;
+        const uint8_t *payload = payloadAt(pos);
+        if (payload) memcpy(&child, payload, sizeof(child));
+        return child;
+    }
+
+    void setChild(unsigned pos, NodeBase *child) {
+        if (pos == count) {
+            upper = child;
+        } else {
+            memcpy(payloadAt(pos), &child, sizeof(child));
+        }
+    }
+
+    // Returns the index of the least key in this node that is greater than or
+    // equal to `k`, and sets `found` if it is equal. Safe for readers.
+    unsigned lowerBound(const std::string &k, bool &found) const {
+        found = false;
+        unsigned n = slotCount();
+        const uint8_t *key = reinterpret_cast<const uint8_t *>(k.data());
+        unsigned length = k.size();
+
+        // All keys in the node start with the prefix, so `k` only needs to be
+        // compared with it once.
+        if (!inPage(lowFenceOffset, prefixLength)) return 0;
+        int c = compare(key, std::min<unsigned>(length, prefixLength),
+                        data + lowFenceOffset, prefixLength);
+        if (c < 0) return 0;
+        if (c > 0) return n;
+        key += prefixLength;
+        length -= prefixLength;
+
+        uint32_t head = headOf(key, length);
+        unsigned lower = 0;
+        unsigned upper = n;
+        while (lower < upper) {
+            unsigned mid = (lower + upper) / 2;
+            const Slot &slot = slots[mid];
+            if (head < slot.head) {
+                c = -1;
+            } else if (head > slot.head) {
+                c = 1;
+            } else {
+                if (!inPage(slot.offset, slot.keyLength)) return mid;
+                c = compare(key, length, data + slot.offset, slot.keyLength);
+            }
+            if (c == 0) {
+                found = true;
+                return mid;
+            }
+            if (c < 0) {
+                upper = mid;
+            } else {
+                lower = mid + 1;
+            }
+        }
+        return lower;
+    }
+
+    // Insert key `k`, which must start with the prefix of this node, with the
+    // given payload at index `pos`. The caller should make sure that the node
+    // has space and split it if necessary.
+    void insertAt(unsigned pos, const std::string &k, const void *payload) {
+        assert(pos <= count);
+        assert(k.compare(0, prefixLength, lowFence(), 0, prefixLength) == 0);
+        assert(hasSpaceFor(k));
+        unsigned length = k.size() - prefixLength;
+        if (int(sizeof(Slot) + length + payloadSize()) > freeSpace()) {
+            compact();
+        }
+        memmove(slots + pos + 1, slots + pos, sizeof(Slot) * (count - pos));
+        heapStart -= length + payloadSize();
+        memcpy(data + heapStart, k.data() + prefixLength, length);
+        memcpy(data + heapStart + length, payload, payloadSize());
+        slots[pos].offset = heapStart;
+        slots[pos].keyLength = length;
+        slots[pos].head = headOf(data + heapStart, length);
+        count++;
+    }
+
+    // Remove the key at index `pos`.
+    void removeAt(unsigned pos) {
+        assert(pos < count);
+        garbage += slots[pos].keyLength + payloadSize();
+        memmove(slots + pos, slots + pos + 1,
+                sizeof(Slot) * (count - pos - 1));
+        count--;
+    }
+
+    // Append the keys of `[from, to)` with their payloads to `dst`, which
+    // must cover their range.
+    void copyEntries(BTreeNode &dst, unsigned from, unsigned to) const {
+        for (unsigned i = from; i < to; ++i) {
+            dst.insertAt(dst.count, keyAt(i), payloadAt(i));
+        }
+    }
+
+    // Overwrite this node with `other`, except for the lock.
+    void assign(const BTreeNode &other) {
+        memcpy(reinterpret_cast<char *>(this) + sizeof(OptLock),
+               reinterpret_cast<const char *>(&other) + sizeof(OptLock),
+               sizeof(BTreeNode) - sizeof(OptLock));
+    }
+
+    // Rewrite the heap without the garbage left by removed keys. The node is
+    // rebuilt in a scratch page from the node allocator, as a page can be too
+    // big for the stack.
+    void compact() {
+        std::unique_ptr<BTreeNode> tmp(
+            new BTreeNode(type, lowFence(), highFence(), rightmost));
+        tmp->upper = upper;
+        copyEntries(*tmp, 0, count);
+        assign(*tmp);
+    }
+
+    // Split this node, and return the new node, which comes _after_ this
+    // node. `sep` is set to the separator between the two.
+    //
+    // The node is split in the middle of its heap rather than of its keys, so
+    // that both halves have room for their new fences however long the keys
+    // on either side are. The left half is built in a scratch page, like in
+    // `compact`.
+    BTreeNode *split(std::string &sep) {
+        bool leaf = type == PageType::BTreeLeaf;
+        assert(count >= 3);
+        unsigned total = 0;
+        for (unsigned i = 0; i < count; ++i) {
+            total += slots[i].keyLength + payloadSize();
+        }
+        unsigned leftCount = 0;
+        unsigned leftSize = 0;
+        while (2 * leftSize < total) {
+            leftSize += slots[leftCount].keyLength + payloadSize();
+            leftCount++;
+        }
+        leftCount = std::max(1u, std::min(leftCount, count - (leaf ? 1u : 2u)));
+
+        // In a leaf, the separator is the max key of the left node. In an
+        // inner node, it moves up to the parent, and its child becomes the
+        // upper child of the left node.
+        sep = keyAt(leaf ? leftCount - 1 : leftCount);
+        std::unique_ptr<BTreeNode> left(
+            new BTreeNode(type, lowFence(), sep, false));
+        BTreeNode *right = new BTreeNode(type, sep, highFence(), rightmost);
+        copyEntries(*left, 0, leftCount);
+        if (leaf) {
+            copyEntries(*right, leftCount, count);
+        } else {
+            left->upper = childAt(leftCount);
+            copyEntries(*right, leftCount + 1, count);
+            right->upper = upper;
+        }
+        assign(*left);
+        return right;
+    }
+
+    // Insert separator `sep` into this inner node, which has `left` as the
+    // child for `sep`, and make `right` the child for the keys after `sep`.
+    // The caller should make sure that the node has space and split it if
+    // necessary.
+    void insertChild(const std::string &sep, NodeBase *left, NodeBase *right) {
+        bool found;
+        unsigned pos = lowerBound(sep, found);
+        assert(!found && childAt(pos) == left);
+        insertAt(pos, sep, &left);
+        setChild(pos + 1, right);
+    }
+};
+
+// A thread-safe btree using OLC that maps variable-length keys to values.
+// `Alloc` picks where nodes come from (see `alloc.h`), and `PageSize` is the
+// size of the nodes in bytes.
+template <class Value, class Alloc = common::alloc::Default,
+          uint64_t PageSize = pageSize>
+struct BTree final : public common::BTreeBase<std::string, Value> {
+    typedef BTreeNode<Value, Alloc, PageSize> Node;
+
+    // The max length of a key.
+    static const unsigned maxKeyLength = Node::maxKeyLength;
+
+private:
+    // The root node of the btree.
+    std::atomic<NodeBase *> root;
+
+    // Create a new root node with the two given nodes as children separated by
+    // the given key. Atomically replace the current root with the new one.
+    void makeRoot(const std::string &k, NodeBase *leftChild,
+                  NodeBase *rightChild) {
+        auto inner = new Node(PageType::BTreeInner, std::string(),
+                              std::string(), true);
+        inner->upper = leftChild;
+        inner->insertChild(k, leftChild, rightChild);
+        root = inner;
+    }
+
+    // Depending on the value of `count`, either yield the processor to the OS
+    // scheduler or inform the processor you are waiting for a spin lock.
+    void yield(int count) {
+        if (count > 3)
+            sched_yield();
+        else
+            _mm_pause();
+    }
+
+    // Split `node`, which was read-locked at `versionNode`, and insert the new
+    // separator into `parent`, which was read-locked at `versionParent`, or
+    // make a new root if `parent` is null. Does nothing if either of them
+    // changed in the meantime. The caller restarts either way.
+    void splitNode(Node *parent, uint64_t versionParent, Node *node,
+                   uint64_t versionNode) {
+        bool needRestart = false;
+        if (parent) {
+            parent->upgradeToWriteLockOrRestart(versionParent, needRestart);
+            if (needRestart) return;
+        }
+        node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+        if (needRestart) {
+            if (parent) parent->writeUnlock();
+            return;
+        }
+        if (!parent && (node != root)) {  // there's a new parent
+            node->writeUnlock();
+            return;
+        }
+        std::string sep;
+        Node *newNode = node->split(sep);
+        if (parent)
+            parent->insertChild(sep, node, newNode);
+        else
+            makeRoot(sep, node, newNode);
+        node->writeUnlock();
+        if (parent) parent->writeUnlock();
+    }
+
+    // Descend to the leaf for `k` with optimistic lock coupling. Returns the
+    // leaf read-locked at `versionNode`, and its parent (null if the leaf is
+    // the root) read-locked at `versionParent`. Sets `needRestart` if the
+    // caller needs to restart.
+    Node *findLeaf(const std::string &k, Node *&parent,
+                   uint64_t &versionParent, uint64_t &versionNode,
+                   bool &needRestart) {
+        Node *node = static_cast<Node *>(root.load());
+        versionNode = node->readLockOrRestart(needRestart);
+        if (needRestart || (node != root)) {
+            needRestart = true;
+            return nullptr;
+        }
+
+        parent = nullptr;
+        versionParent = 0;
+        while (node->type == PageType::BTreeInner) {
+            if (parent) {
+                parent->readUnlockOrRestart(versionParent, needRestart);
+                if (needRestart) return nullptr;
+            }
+
+            parent = node;
+            versionParent = versionNode;
+
+            bool found;
+            unsigned pos = node->lowerBound(k, found);
+            node = static_cast<Node *>(node->childAt(pos));
+            parent->checkOrRestart(versionParent, needRestart);
+            if (needRestart) return nullptr;
+            versionNode = node->readLockOrRestart(needRestart);
+            if (needRestart) return nullptr;
+        }
+        return node;
+    }
+
+    // Scan the leaf for `k` like `scan`, adding the number of values read to
+    // `read`. Returns true if there are leaves to the right of it, and sets
+    // `next` to the least key that they can hold.
+    bool scanLeaf(const std::string &k, uint64_t range, Value *output,
+                  uint64_t &read, std::string &next) {
+        int restartCount = 0;
+    restart:
+        if (restartCount++) yield(restartCount);
+        bool needRestart = false;
+
+        Node *parent;
+        uint64_t versionParent;
+        uint64_t versionNode;
+        Node *leaf = findLeaf(k, parent, versionParent, versionNode,
+                              needRestart);
+        if (needRestart) goto restart;
+
+        bool found;
+        unsigned pos = leaf->lowerBound(k, found);
+        uint64_t n = 0;
+        for (; n < range; ++n, ++pos) {
+            const uint8_t *payload = leaf->payloadAt(pos);
+            if (!payload) break;
+            memcpy(&output[n], payload, sizeof(Value));
+        }
+        bool more = !leaf->rightmost;
+        if (more) {
+            // The least key greater than the high fence.
+            next = leaf->highFence();
+            next.push_back('\0');
+        }
+
+        if (parent) {
+            parent->readUnlockOrRestart(versionParent, needRestart);
+            if (needRestart) goto restart;
+        }
+        leaf->readUnlockOrRestart(versionNode, needRestart);
+        if (needRestart) goto restart;
+
+        read += n;
+        return more;
+    }
+
+    // Free the subtree rooted at `node`. Only safe once no other thread can
+    // access the tree.
+    static void freeSubtree(NodeBase *node) {
+        auto n = static_cast<Node *>(node);
+        if (n->type == PageType::BTreeInner) {
+            for (unsigned i = 0; i <= n->count; ++i) {
+                freeSubtree(n->childAt(i));
+            }
+        }
+        delete n;
+    }
+
+public:
+    // Construct a new btree with exactly one node, which is an empty leaf node.
+    BTree() {
+        root = new Node(PageType::BTreeLeaf, std::string(), std::string(),
+                        true);
+    }
+
+    // Free all nodes. The caller must make sure no other thread is still
+    // using the tree.
+    ~BTree() { freeSubtree(root); }
+
+    // Insert the (k, v) pair into the tree.
+    void insert(std::string k, Value v) {
+        modify(k, [&v](bool, Value &value) {
+            value = v;
+            return true;
+        });
+    }
+
+    // Insert (k, v) unless `k` is in the tree already. Returns true if it
+    // was inserted.
+    bool insert_if_absent(std::string k, Value v) {
+        return modify(k, [&v](bool present, Value &value) {
+            if (!present) value = v;
+            return true;
+        });
+    }
+
+    // Set the value of `k` to `v` if `k` is in the tree. Returns true if it
+    // was.
+    bool update_if_present(std::string k, Value v) {
+        bool found = false;
+        modify(k, [&v, &found](bool present, Value &value) {
+            if (present) value = v;
+            found = present;
+            return false;
+        });
+        return found;
+    }
+
+    // Set `result` to the value of `k`, or insert (k, v) and set `result` to
+    // `v` if `k` is not in the tree. Returns true if (k, v) was inserted.
+    bool get_or_insert(std::string k, Value v, Value &result) {
+        return modify(k, [&v, &result](bool present, Value &value) {
+            if (!present) value = v;
+            result = value;
+            return true;
+        });
+    }
+
+    // Apply `fn` to the value of `k` in place, inserting `k` with a
+    // value-initialized value first if it is not in the tree. Returns true
+    // if `k` was inserted.
+    bool upsert(std::string k, const std::function<void(Value &)> &fn) {
+        return modify(k, [&fn](bool, Value &value) {
+            fn(value);
+            return true;
+        });
+    }
+
+    // The core of all inserts: call `fn(present, value)` exactly once, under
+    // the write lock of the leaf for `k`. If `k` is in the leaf, `present`
+    // is true and `value` is its value, which `fn` changes in place.
+    // Otherwise, `value` is value-initialized, and (k, value) is inserted if
+    // `fn` returns true. Returns true if it was.
+    template <class Fn>
+    bool modify(const std::string &k, Fn fn) {
+        assert(k.size() <= maxKeyLength);
+
+        int restartCount = 0;
+    restart:
+        if (restartCount++) yield(restartCount);
+        bool needRestart = false;
+
+        // Current node
+        Node *node = static_cast<Node *>(root.load());
+        uint64_t versionNode = node->readLockOrRestart(needRestart);
+        if (needRestart || (node != root)) goto restart;
+
+        // Parent of current node
+        Node *parent = nullptr;
+        uint64_t versionParent = 0;
+
+        while (node->type == PageType::BTreeInner) {
+            // Split eagerly if a separator might not fit, so that the parent
+            // of a node that is split always has room for the new separator.
+            if (node->isFull()) {
+                splitNode(parent, versionParent, node, versionNode);
+                goto restart;
+            }
+
+            if (parent) {
+                parent->readUnlockOrRestart(versionParent, needRestart);
+                if (needRestart) goto restart;
+            }
+
+            parent = node;
+            versionParent = versionNode;
+
+            bool found;
+            unsigned pos = node->lowerBound(k, found);
+            node = static_cast<Node *>(node->childAt(pos));
+            parent->checkOrRestart(versionParent, needRestart);
+            if (needRestart) goto restart;
+            versionNode = node->readLockOrRestart(needRestart);
+            if (needRestart) goto restart;
+        }
+
+        // Lock the leaf, and see whether `k` is there
+        node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+        if (needRestart) goto restart;
+        bool found;
+        unsigned pos = node->lowerBound(k, found);
+
+        // Split the leaf only if `k` may not fit and may be inserted. That
+        // needs the lock of the parent, too, before `fn` is asked.
+        if (!found && !node->hasSpaceFor(k)) {
+            if (parent) {
+                parent->upgradeToWriteLockOrRestart(versionParent, needRestart);
+                if (needRestart) {
+                    node->writeUnlock();
+                    goto restart;
+                }
+            } else if (node != root) {  // there's a new parent
+                node->writeUnlock();
+                goto restart;
+            }
+            Value value = Value();
+            bool inserted = fn(false, value);
+            if (inserted) {
+                // Split, and insert into the half for `k`
+                std::string sep;
+                Node *newNode = node->split(sep);
+                Node *half = k > sep ? newNode : node;
+                assert(half->hasSpaceFor(k));
+                half->insertAt(half->lowerBound(k, found), k, &value);
+                if (parent)
+                    parent->insertChild(sep, node, newNode);
+                else
+                    makeRoot(sep, node, newNode);
+            }
+            node->writeUnlock();
+            if (parent) parent->writeUnlock();
+            return inserted;
+        }
+
+        if (parent) {
+            parent->readUnlockOrRestart(versionParent, needRestart);
+            if (needRestart) {
+                node->writeUnlock();
+                goto restart;
+            }
+        }
+
+        bool inserted = false;
+        Value value = Value();
+        if (found) {
+            // Values are not aligned in the heap, so `fn` gets a copy.
+            memcpy(&value, node->payloadAt(pos), sizeof(Value));
+            fn(true, value);
+            memcpy(node->payloadAt(pos), &value, sizeof(Value));
+        } else if (fn(false, value)) {
+            node->insertAt(pos, k, &value);
+            inserted = true;
+        }
+        node->writeUnlock();
+        return inserted;
+    }
+
+    // Lookup key `k` in the btree. If `k` is in the btree, set `result` to the
+    // value associated with `k` and return true. If `k` is not in the btree,
+    // return false.
+    bool lookup(std::string k, Value &result) {
+        int restartCount = 0;
+    restart:
+        if (restartCount++) yield(restartCount);
+        bool needRestart = false;
+
+        Node *parent;
+        uint64_t versionParent;
+        uint64_t versionNode;
+        Node *leaf = findLeaf(k, parent, versionParent, versionNode,
+                              needRestart);
+        if (needRestart) goto restart;
+
+        bool found;
+        unsigned pos = leaf->lowerBound(k, found);
+        const uint8_t *payload = found ? leaf->payloadAt(pos) : nullptr;
+        Value value;
+        if (payload) memcpy(&value, payload, sizeof(Value));
+
+        if (parent) {
+            parent->readUnlockOrRestart(versionParent, needRestart);
+            if (needRestart) goto restart;
+        }
+        leaf->readUnlockOrRestart(versionNode, needRestart);
+        if (needRestart) goto restart;
+
+        if (payload) result = value;
+        return payload != nullptr;
+    }
+
+    // Remove key `k` and its value from the btree. Returns true if `k` was in
+    // the btree.
+    bool remove(std::string k) {
+        int restartCount = 0;
+    restart:
+        if (restartCount++) yield(restartCount);
+        bool needRestart = false;
+
+        Node *parent;
+        uint64_t versionParent;
+        uint64_t versionNode;
+        Node *leaf = findLeaf(k, parent, versionParent, versionNode,
+                              needRestart);
+        if (needRestart) goto restart;
+
+        // only lock leaf node
+        leaf->upgradeToWriteLockOrRestart(versionNode, needRestart);
+        if (needRestart) goto restart;
+        if (parent) {
+            parent->readUnlockOrRestart(versionParent, needRestart);
+            if (needRestart) {
+                leaf->writeUnlock();
+                goto restart;
+            }
+        }
+        bool found;
+        unsigned pos = leaf->lowerBound(k, found);
+        if (found) {
+            leaf->removeAt(pos);
+        }
+        leaf->writeUnlock();
+        return found;
+    }
+
+    // Do a range query on the btree. Starting with the least key greater than
+    // or equal to `k`, scan at most `range` values into the buffer pointed to
+    // by `output`, in key order. Return the number of elements read.
+    //
+    // Each leaf is read atomically, but the leaves are read one after the
+    // other, so a scan over several leaves may miss concurrent changes.
+    uint64_t scan(std::string k, int range, Value *output) {
+        uint64_t read = 0;
+        std::string next;
+        while (read < uint64_t(std::max(range, 0))) {
+            if (!scanLeaf(k, range - read, output + read, read, next)) break;
+            k = next;
+        }
+        return read;
+    }
+};
+
+}  // namespace btree_varkey
+
+#endif
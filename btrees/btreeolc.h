@@ -11,24 +11,86 @@
  * contention between cores, thus achieving higher performance and scalability.
  *
  * See the `OptLock` type for more on optimistic locking.
+ *
+ * On top of OLC, the tree follows the B-link protocol of Lehman and Yao
+ * ("Efficient Locking for Concurrent Operations on B-Trees", 1981). Every node
+ * has a pointer to its right sibling on the same level and a high key, the
+ * largest key that may be stored in its subtree. A split only locks the node
+ * being split: the new right node is first linked in as the right sibling,
+ * and the separator is posted to the parent level afterwards, after the lock
+ * on the split node has been released. In between, and whenever a reader
+ * reaches a node that was split after it read the parent, the reader sees a
+ * key greater than the high key and moves right along the sibling pointers
+ * instead of restarting from the root.
  */
 
+#include "alloc.h"
 #include "btree-base.h"
+#include "bulk-load.h"
+#include "epoch.h"
+#include "search.h"
+#include "split.h"
 
 #include <immintrin.h>
+#include <linux/futex.h>
 #include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <climits>
 #include <cstring>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
 
 namespace btreeolc {
 // Each page in the Btree can be either an inner node or a leaf node.
 enum class PageType : uint8_t { BTreeInner = 1, BTreeLeaf = 2 };
 
-// Use 4KB pages
+// The default size of a node. Each tree can be given different sizes for its
+// leaves and inner nodes.
 static const uint64_t pageSize = 4 * 1024;
 
+// The optional modes of the tree, picked at compile time by or-ing them into
+// the `Modes` argument of `BTree`. Leaves only hold the state of the modes
+// that are on, so that the others cost no space in the leaves.
+namespace mode {
+// Writers of a locked leaf let the lock holder do their insert (see
+// `BTree::flatCombining`).
+static const unsigned FlatCombining = 1;
+// Each thread starts at the leaf it used last (see `BTree::useFinger`).
+static const unsigned Finger = 2;
+// Lock-free appends to the rightmost leaf (see `BTree::appendMode`).
+static const unsigned Append = 4;
+// Splits of hot leaves (see `BTree::contentionSplits`).
+static const unsigned ContentionSplits = 8;
+// Spare leaves for the right edge (see `BTree::preallocate`).
+static const unsigned Preallocate = 16;
+}  // namespace mode
+
+// Sleep until `*addr` is woken up by `futexWake`, unless it is not equal to
+// `expected` any more. May also return spuriously.
+inline void futexWait(void *addr, uint32_t expected) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, nullptr, nullptr, 0);
+}
+
+// Wake up all threads sleeping on `addr`.
+inline void futexWake(void *addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+
+// A new id for a tree, different from the id of every other tree created by
+// the process.
+inline uint64_t newTreeId() {
+    static std::atomic<uint64_t> lastId{0};
+    return ++lastId;
+}
+
 // An optimistic lock implementation.
 //
 // An optimistic lock has two parts: a lock and a version counter. The lock is
@@ -42,6 +104,16 @@ static const uint64_t pageSize = 4 * 1024;
 //
 // This implementation comes more or less straight from the pseudo-code in
 // appendix A of this paper: https://db.in.tum.de/~leis/papers/artsync.pdf.
+//
+// When conflicts are not rare, e.g. when many threads insert into the same
+// leaf, restarting and retrying the CAS makes every writer hammer the lock
+// word, and tail latency goes through the roof. So each lock counts how
+// often writers found it taken. Once it is hot, writers line up in an MCS
+// queue instead (see `writeLockQueued`): only the head of the queue waits
+// for the lock word, and everyone waits by parking on a futex after a short
+// spin. The count decays with every uncontended acquisition, so the lock
+// goes back to purely optimistic writers when contention subsides. Readers
+// are always optimistic.
 struct OptLock {
     // In this implementation, both the lock and the version counter are
     // represented using this 64-bit word.
@@ -51,6 +123,40 @@ struct OptLock {
     // Bits 2-63 represent the version counter.
     std::atomic<uint64_t> typeVersionLockObsolete{0b100};
 
+    // Once `contention` reaches this value, writers queue up for the lock.
+    static const uint16_t hotThreshold = 8;
+
+    // The max value of `contention`, so that a lock cools down quickly.
+    static const uint16_t maxContention = 64;
+
+    // How long waiters spin before they park on a futex.
+    static const int spinsBeforePark = 256;
+
+    // A thread waiting in the queue of a lock. It lives on the stack of the
+    // waiting thread.
+    struct QueueNode {
+        // The next thread in the queue.
+        std::atomic<QueueNode *> next{nullptr};
+
+        // 0 while waiting, 1 once it is this thread's turn, or 2 while the
+        // thread is parked on it.
+        std::atomic<uint32_t> state{0};
+    };
+
+    // The last thread in the queue, or nullptr if nobody is queued.
+    std::atomic<QueueNode *> queueTail{nullptr};
+
+    // Roughly the number of recent attempts to write lock this lock that
+    // found it taken, minus the number that did not.
+    //
+    // The two counters come last, so that the fields of a node can go into
+    // the padding after them.
+    std::atomic<uint16_t> contention{0};
+
+    // The number of threads parked on the lock word (at most one per lock,
+    // the head of the queue).
+    std::atomic<uint16_t> parked{0};
+
     // Returns true if the given version represents a locked state.
     bool isLocked(uint64_t version) { return ((version & 0b10) == 0b10); }
 
@@ -95,17 +201,122 @@ struct OptLock {
         if (typeVersionLockObsolete.compare_exchange_strong(version,
                                                             version + 0b10)) {
             version = version + 0b10;
+            noteUncontended();
         } else {
             _mm_pause();
+            noteContention();
             needRestart = true;
         }
     }
 
+    // Record that a writer found the lock taken.
+    void noteContention() {
+        uint16_t c = contention.load(std::memory_order_relaxed);
+        if (c < maxContention) {
+            contention.store(c + 1, std::memory_order_relaxed);
+        }
+    }
+
+    // Record that a writer got the lock right away. Cold locks are never
+    // written to.
+    void noteUncontended() {
+        uint16_t c = contention.load(std::memory_order_relaxed);
+        if (c > 0) {
+            contention.store(c - 1, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns true if writers should queue up for this lock.
+    bool isHot() {
+        return contention.load(std::memory_order_relaxed) >= hotThreshold;
+    }
+
+    // Grab the write lock pessimistically: wait in line until it is free
+    // instead of restarting. Returns the locked version, or sets
+    // `needRestart` to true if the lock became obsolete. Since the caller
+    // does not know what happened to the node while it waited, it has to
+    // check that the node is still the right one.
+    uint64_t writeLockQueued(bool &needRestart) {
+        // Get in line, and wait until it is our turn.
+        QueueNode me;
+        QueueNode *pred = queueTail.exchange(&me);
+        if (pred) {
+            pred->next.store(&me);
+            for (int spins = 0; me.state.load() != 1; ++spins) {
+                if (spins < spinsBeforePark) {
+                    _mm_pause();
+                } else {
+                    uint32_t waiting = 0;
+                    if (me.state.compare_exchange_strong(waiting, 2) ||
+                        waiting == 2) {
+                        futexWait(&me.state, 2);
+                    }
+                }
+            }
+        }
+
+        // We are first in line. Wait for the lock itself.
+        uint64_t version;
+        for (int spins = 0;; ++spins) {
+            version = typeVersionLockObsolete.load();
+            if (isObsolete(version)) {
+                needRestart = true;
+                break;
+            }
+            if (!isLocked(version)) {
+                if (typeVersionLockObsolete.compare_exchange_strong(
+                        version, version + 0b10)) {
+                    version += 0b10;
+                    break;
+                }
+            } else if (spins < spinsBeforePark) {
+                _mm_pause();
+            } else {
+                // Only the low half of the word is watched, which has the
+                // lock bit (on x86, which is little-endian).
+                parked++;
+                if (typeVersionLockObsolete.load() == version) {
+                    futexWait(&typeVersionLockObsolete, uint32_t(version));
+                }
+                parked--;
+            }
+        }
+
+        // Let the next in line wait for the lock. If the queue is empty now,
+        // so was the lock's contention.
+        QueueNode *succ = me.next.load();
+        if (!succ) {
+            QueueNode *expected = &me;
+            if (queueTail.compare_exchange_strong(expected, nullptr)) {
+                noteUncontended();
+                return version;
+            }
+            while (!(succ = me.next.load())) {
+                _mm_pause();
+            }
+        }
+        noteContention();
+        if (succ->state.exchange(1) == 2) {
+            futexWake(&succ->state);
+        }
+        return version;
+    }
+
+    // Wake up the head of the queue if it is parked on the lock word.
+    void wakeParked() {
+        if (parked.load()) {
+            futexWake(&typeVersionLockObsolete);
+        }
+    }
+
     // Release the write lock.
     //
     // This should only be called if you successfully acquired the write
     // lock. This method releases the lock and increments the version.
-    void writeUnlock() { typeVersionLockObsolete.fetch_add(0b10); }
+    void writeUnlock() {
+        typeVersionLockObsolete.fetch_add(0b10);
+        wakeParked();
+    }
 
     // Return the obsolete bit of the given version.
     bool isObsolete(uint64_t version) { return (version & 1) == 1; }
@@ -128,7 +339,10 @@ struct OptLock {
     // Release the write lock _and_ set the obsolete bit.
     //
     // This is like `writeUnlock` except that it also sets the obsolete bit.
-    void writeUnlockObsolete() { typeVersionLockObsolete.fetch_add(0b11); }
+    void writeUnlockObsolete() {
+        typeVersionLockObsolete.fetch_add(0b11);
+        wakeParked();
+    }
 };
 
 // A base type for all btree nodes. Each node hasi an optimisitc lock.
@@ -136,8 +350,21 @@ struct NodeBase : public OptLock {
     // Leaf or inner?
     PageType type;
 
+    // The height of this node above the leaves (0 for leaves).
+    uint8_t level;
+
     // The number of entries in this btree node.
     uint16_t count;
+
+    // The right sibling of this node on the same level, or nullptr if this is
+    // the rightmost node of its level. The high key of the node (see the node
+    // types) is only valid if this is set.
+    NodeBase *next;
+
+    // Where the recent inserts into this node went. See `split.h`. It comes
+    // after `next`, so that a field of a leaf can go into the padding after
+    // it.
+    common::split::InsertHistory history;
 };
 
 // Leaf superclass so that we don't have to keep defining the type.
@@ -145,20 +372,381 @@ struct BTreeLeafBase : public NodeBase {
     static const PageType typeMarker = PageType::BTreeLeaf;
 };
 
+// The version words of the segments of a leaf (see `BTreeLeaf`), one per
+// segment. They work like the version of an `OptLock`, except that bit 0 is
+// the lock bit, and that there is no obsolete bit and no queue.
+template <uint64_t Count>
+struct SegmentVersions {
+    static const uint64_t segmentCount = Count;
+
+    std::atomic<uint32_t> segmentVersions[Count];
+
+    SegmentVersions() {
+        for (uint64_t i = 0; i < Count; ++i) {
+            segmentVersions[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Grab an optimistic read lock on segment `i`. If it is locked, set
+    // `needRestart` to true.
+    uint32_t readSegmentOrRestart(unsigned i, bool &needRestart) {
+        uint32_t version = segmentVersions[i].load();
+        if (version & 1) {
+            _mm_pause();
+            needRestart = true;
+        }
+        return version;
+    }
+
+    // Validate the read lock on segment `i` taken at `version`.
+    void checkSegmentOrRestart(unsigned i, uint32_t version,
+                               bool &needRestart) {
+        needRestart = segmentVersions[i].load() != version;
+    }
+
+    // Try to write lock segment `i`, and return its unlocked version. Sets
+    // `needRestart` to true if it is locked.
+    uint32_t lockSegmentOrRestart(unsigned i, bool &needRestart) {
+        uint32_t version = readSegmentOrRestart(i, needRestart);
+        if (needRestart) return version;
+        if (!segmentVersions[i].compare_exchange_strong(version,
+                                                        version + 1)) {
+            needRestart = true;
+        }
+        return version;
+    }
+
+    // Release the write lock on segment `i` after changing it.
+    void unlockSegment(unsigned i) { segmentVersions[i].fetch_add(1); }
+
+    // Release the write lock on segment `i`, which was at `version` before,
+    // without having changed it. Readers need not restart.
+    void abortSegment(unsigned i, uint32_t version) {
+        segmentVersions[i].store(version);
+    }
+
+    // Wait until no segment is write locked.
+    void waitForSegments() {
+        for (uint64_t i = 0; i < Count; ++i) {
+            for (int spins = 0; segmentVersions[i].load() & 1; ++spins) {
+                if (spins < 128) {
+                    _mm_pause();
+                } else {
+                    sched_yield();
+                }
+            }
+        }
+    }
+};
+
+// Leaves without segments have no version words. Readers never have to
+// restart because of a segment, and nobody ever locks one.
+template <>
+struct SegmentVersions<0> {
+    static const uint64_t segmentCount = 0;
+
+    uint32_t readSegmentOrRestart(unsigned, bool &) { return 0; }
+    void checkSegmentOrRestart(unsigned, uint32_t, bool &) {}
+    uint32_t lockSegmentOrRestart(unsigned, bool &) {
+        assert(false);
+        return 0;
+    }
+    void unlockSegment(unsigned) { assert(false); }
+    void abortSegment(unsigned, uint32_t) { assert(false); }
+    void waitForSegments() {}
+};
+
+// An insert that is waiting for the holder of the write lock of a leaf to
+// apply it (see `BTree::publishInsert`). It lives on the stack of the waiting
+// thread.
+template <class Key, class Payload>
+struct Publication {
+    enum Status : uint8_t { Pending, Done, Retry };
+
+    Key k;
+    Payload p;
+    Publication *next;
+
+    // Set by whoever takes the publication off the list. The taker does not
+    // touch the publication any more after setting it.
+    std::atomic<uint8_t> status;
+
+    // The `lowKeyVersion` of the leaf when the insert was published.
+    uint32_t lowKeyVersion = 0;
+};
+
+// The inserts published to a leaf by threads that found it locked, if `On`
+// (see `BTree::flatCombining`).
+template <class Key, class Payload, bool On>
+struct PublicationList {
+    typedef btreeolc::Publication<Key, Payload> Publication;
+
+    // The published inserts, most recent first.
+    std::atomic<Publication *> publications{nullptr};
+
+    // Add `pub` to the list.
+    void pushPublication(Publication *pub) {
+        pub->next = publications.load();
+        while (!publications.compare_exchange_weak(pub->next, pub)) {
+        }
+    }
+
+    // Take all inserts off the list, most recent first.
+    Publication *takePublications() { return publications.exchange(nullptr); }
+};
+
+// Without flat combining, nothing is ever published.
+template <class Key, class Payload>
+struct PublicationList<Key, Payload, false> {
+    typedef btreeolc::Publication<Key, Payload> Publication;
+
+    void pushPublication(Publication *) { assert(false); }
+    Publication *takePublications() { return nullptr; }
+};
+
+// Whether a leaf is a half of a split made because it was hot rather than
+// full, and how it has been written since, if `On` (see
+// `BTree::contentionSplits`).
+template <bool On>
+struct HotSplitState {
+    // Set on both halves of a hot split, until they are merged back.
+    bool hotSplit = false;
+
+    // The number of write locks of this leaf in a row that were granted
+    // without contention.
+    uint16_t calmWrites = 0;
+
+    // Mark this leaf as a half of a hot split, or not.
+    void setHotSplit(bool hot) {
+        hotSplit = hot;
+        calmWrites = 0;
+    }
+
+    // Returns true if this leaf is a half of a hot split.
+    bool isHotSplit() { return hotSplit; }
+
+    // Returns true if this leaf is a half of a hot split that was then write
+    // locked `writes` times in a row without contention.
+    bool hasCooled(uint16_t writes) { return hotSplit && calmWrites >= writes; }
+
+    // Record a write lock of this leaf by a writer that had to restart or
+    // wait for it if `contended` is set.
+    void noteWrite(bool contended) {
+        if (contended) {
+            calmWrites = 0;
+        } else if (calmWrites < UINT16_MAX) {
+            calmWrites++;
+        }
+    }
+};
+
+// Without contention splits, no leaf is ever a half of a hot split.
+template <>
+struct HotSplitState<false> {
+    void setHotSplit(bool hot) { assert(!hot); }
+    bool isHotSplit() { return false; }
+    bool hasCooled(uint16_t) { return false; }
+    void noteWrite(bool) {}
+};
+
+// The bookkeeping of the append region of a leaf, for up to `64 * Words`
+// slots, if `On` (see `BTreeLeaf` and `BTree::appendMode`).
+//
+// Appenders reserve the slot `appendTail` with a fetch-and-add and set its bit
+// in `appended` once they have written their entry, or in `abandoned` if they
+// found that they may not use it. The region is only open while `appendTail`
+// is less than `appendsClosed`.
+template <uint64_t Words, bool On>
+struct AppendRegion {
+    // The value of `appendTail` while the region is closed. Far from the end
+    // of the range, so that the increments of appenders that raced with
+    // closing it cannot wrap it around.
+    static const uint32_t appendsClosed = UINT32_MAX / 2;
+
+    std::atomic<uint32_t> appendTail{appendsClosed};
+    std::atomic<uint64_t> appended[Words];
+    std::atomic<uint64_t> abandoned[Words];
+
+    AppendRegion() {
+        for (uint64_t i = 0; i < Words; ++i) {
+            appended[i].store(0, std::memory_order_relaxed);
+            abandoned[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns true if the region is open.
+    bool appendsOpen() {
+        return appendTail.load(std::memory_order_relaxed) < appendsClosed;
+    }
+
+    // Open the region at slot `from`.
+    void openRegion(unsigned from) { appendTail.store(from); }
+
+    // Reserve a slot. Returns `capacity` or more if the region is full or
+    // closed.
+    unsigned reserveSlot(unsigned capacity) {
+        if (appendTail.load(std::memory_order_relaxed) >= capacity) {
+            return appendsClosed;
+        }
+        return appendTail.fetch_add(1);
+    }
+
+    // Make the entry written to the reserved `slot` visible to readers.
+    void publish(unsigned slot) {
+        appended[slot / 64].fetch_or(1ull << (slot % 64),
+                                     std::memory_order_release);
+    }
+
+    // Give up the reserved `slot` without writing it.
+    void abandon(unsigned slot) {
+        abandoned[slot / 64].fetch_or(1ull << (slot % 64),
+                                      std::memory_order_release);
+    }
+
+    // Returns true if the entry in `slot` has been written.
+    bool isAppended(unsigned slot) {
+        return appended[slot / 64].load(std::memory_order_acquire) &
+               (1ull << (slot % 64));
+    }
+
+    // The end of the slots that may be in use, at most `capacity`.
+    unsigned appendEnd(unsigned capacity) {
+        uint32_t tail = appendTail.load(std::memory_order_acquire);
+        return tail < capacity ? tail : capacity;
+    }
+
+    // Close the region, and return the end of the slots that may be in use,
+    // at most `capacity`.
+    unsigned closeRegion(unsigned capacity) {
+        uint32_t tail = appendTail.exchange(appendsClosed);
+        return tail < capacity ? tail : capacity;
+    }
+
+    // Wait until the appender of the reserved `slot` is done with it. Returns
+    // true if it wrote the slot, or false if it abandoned it.
+    bool waitForSlot(unsigned slot) {
+        uint64_t bit = 1ull << (slot % 64);
+        for (int spins = 0;
+             !((appended[slot / 64].load() | abandoned[slot / 64].load()) &
+               bit);
+             ++spins) {
+            if (spins < 128) {
+                _mm_pause();
+            } else {
+                sched_yield();
+            }
+        }
+        return appended[slot / 64].load(std::memory_order_relaxed) & bit;
+    }
+
+    // Clear the bits of the slots in `[from, to)` for the next time the
+    // region is opened.
+    void clearSlots(unsigned from, unsigned to) {
+        for (unsigned i = from / 64; i < (to + 63) / 64; ++i) {
+            appended[i].store(0, std::memory_order_relaxed);
+            abandoned[i].store(0, std::memory_order_relaxed);
+        }
+    }
+};
+
+// Without lock-free appends, the region is never open.
+template <uint64_t Words>
+struct AppendRegion<Words, false> {
+    static const uint32_t appendsClosed = UINT32_MAX / 2;
+
+    bool appendsOpen() { return false; }
+    void openRegion(unsigned) { assert(false); }
+    unsigned reserveSlot(unsigned) { return appendsClosed; }
+    void publish(unsigned) { assert(false); }
+    void abandon(unsigned) { assert(false); }
+    bool isAppended(unsigned) { return false; }
+    unsigned appendEnd(unsigned) { return 0; }
+    unsigned closeRegion(unsigned) { return 0; }
+    bool waitForSlot(unsigned) { return false; }
+    void clearSlots(unsigned, unsigned) {}
+};
+
+// The fixed part of a leaf (see `BTreeLeaf`), before its entries: the node
+// header, the state of the modes in `Modes` (see `mode`), and the segment
+// versions if `Segmented`. The state of modes that are off takes no space.
+template <class Key, class Payload, uint64_t PageSize, bool Segmented,
+          unsigned Modes>
+struct BTreeLeafHeader
+    : public BTreeLeafBase,
+      public SegmentVersions<
+          Segmented ? ((PageSize / (sizeof(Key) + sizeof(Payload))) +
+                       (sizeof(Key) < 64 ? 64 / sizeof(Key) : 1) - 1) /
+                          (sizeof(Key) < 64 ? 64 / sizeof(Key) : 1)
+                    : 0>,
+      public PublicationList<Key, Payload,
+                             (Modes & mode::FlatCombining) != 0>,
+      public HotSplitState<(Modes & mode::ContentionSplits) != 0>,
+      public AppendRegion<(PageSize / (sizeof(Key) + sizeof(Payload)) + 63) /
+                              64,
+                          (Modes & mode::Append) != 0> {
+    // Bumped whenever the least key that may go into this leaf goes up (see
+    // `BTreeLeaf::redistribute`). Writers that waited for the lock of the
+    // leaf, published inserts and fingers from before that are rejected.
+    uint32_t lowKeyVersion = 0;
+
+    // All keys in this leaf are less than or equal to the high key. Greater
+    // keys belong to the right siblings. Only valid if `next` is set.
+    Key highKey;
+};
+
 // A single leaf node in the btree. Note that anyone doing operations on these
 // nodes should already be holding a lock.
-template <class Key, class Payload>
-struct BTreeLeaf : public BTreeLeafBase {
+//
+// If `Segmented` is set, the entries are split into segments, one cache line
+// of keys each, with a version word each. Writes that don't move entries
+// around, i.e. updates of existing keys and appends after the last entry,
+// only lock their segment (see `BTree::trySegmentInsert`), and readers
+// validate the segments they read payloads from, besides the whole leaf.
+// Thus writers of different segments, and readers of other segments, do not
+// get in each other's way. Anyone who locks the whole leaf waits for the
+// writers of segments first (see `settle`).
+//
+// If `Modes` has `mode::Append`, the slots from `count` on are the append
+// region of the leaf (see `AppendRegion`). Its entries are greater than all
+// other entries in the leaf, but not sorted. It is closed and merged into the
+// sorted entries by anyone who write-locks the leaf (see `absorbAppends`).
+template <class Key, class Payload, class Search = common::search::Simd,
+          class Alloc = common::alloc::Default,
+          uint64_t PageSize = pageSize, bool Segmented = false,
+          unsigned Modes = 0>
+struct BTreeLeaf
+    : public BTreeLeafHeader<Key, Payload, PageSize, Segmented, Modes> {
+    typedef BTreeLeafHeader<Key, Payload, PageSize, Segmented, Modes> Header;
+    using Header::count;
+    using Header::highKey;
+    using Header::history;
+    using Header::next;
+
     // Represents a key and value associated with that key.
     struct Entry {
         Key k;
         Payload p;
     };
 
+    typedef btreeolc::Publication<Key, Payload> Publication;
+
+    // The number of entries in a segment. There are enough segments for any
+    // number of entries that fits into a page.
+    static const unsigned segmentEntries =
+        sizeof(Key) < 64 ? 64 / sizeof(Key) : 1;
+    typedef SegmentVersions<
+        Segmented ? ((PageSize / (sizeof(Key) + sizeof(Payload))) +
+                     segmentEntries - 1) /
+                        segmentEntries
+                  : 0>
+        Segments;
+
     // The max number of entries in a leaf node (based on the size of keys
-    // and pages). We also need to account for the space of the locks.
+    // and pages). We also need to account for the space of the header.
     static const uint64_t maxEntries =
-        (pageSize - sizeof(NodeBase)) / (sizeof(Key) + sizeof(Payload));
+        (PageSize - sizeof(Header)) / (sizeof(Key) + sizeof(Payload));
+    static_assert(maxEntries >= 4 && maxEntries <= UINT16_MAX,
+                  "a leaf must fit between 4 and 65535 entries");
 
     // The keys for each child.
     Key keys[maxEntries];
@@ -169,43 +757,36 @@ struct BTreeLeaf : public BTreeLeafBase {
     // Construct an empty leaf node.
     BTreeLeaf() {
         count = 0;
-        type = typeMarker;
+        this->type = Header::typeMarker;
+        this->level = 0;
+        next = nullptr;
+    }
+
+    // Nodes come from the node allocator (see `alloc.h`).
+    static void *operator new(size_t size) { return Alloc::allocate(size); }
+    static void operator delete(void *p, size_t size) {
+        Alloc::deallocate(p, size);
     }
 
     // Returns true if this leaf is full. It needs to be split before we can
     // take any more entries.
     bool isFull() { return count == maxEntries; };
 
-    // Returns the index into this node of the least key that is greater than
-    // or equal to `k`.
-    unsigned lowerBound(Key k) {
-        unsigned lower = 0;
-        unsigned upper = count;
-        do {
-            unsigned mid = ((upper - lower) / 2) + lower;
-            if (k < keys[mid]) {
-                upper = mid;
-            } else if (k > keys[mid]) {
-                lower = mid + 1;
-            } else {
-                return mid;
-            }
-        } while (lower < upper);
-        return lower;
-    }
+    // Returns true if this leaf is so empty that it should be merged with or
+    // take entries from a sibling.
+    bool isUnderfull() { return count < maxEntries / 4; };
 
-    // Alternate implementation of `lowerBound`. This function is not used anywhere.
-    unsigned lowerBoundBF(Key k) {
-        auto base = keys;
-        unsigned n = count;
-        while (n > 1) {
-            const unsigned half = n / 2;
-            base = (base[half] < k) ? (base + half) : base;
-            n -= half;
-        }
-        return (*base < k) + base - keys;
+    // Returns true if this leaf and `right` have few enough entries between
+    // them to be merged. We leave some slack so that the merged node does not
+    // have to be split again right away.
+    bool canMerge(BTreeLeaf *right) {
+        return (uint64_t)count + right->count <= maxEntries * 3 / 4;
     }
 
+    // Returns the index into this node of the least key that is greater than
+    // or equal to `k`. See `search.h` for the available search policies.
+    unsigned lowerBound(Key k) { return Search::lowerBound(keys, count, k); }
+
     // Insert the new (key, value) pair into this leaf. The caller should make
     // sure that the node has space and split it if necessary.
     void insert(Key k, Payload p) {
@@ -222,25 +803,213 @@ struct BTreeLeaf : public BTreeLeafBase {
                     sizeof(Payload) * (count - pos));
             keys[pos] = k;
             payloads[pos] = p;
+            history.note(pos);
         } else {
             keys[0] = k;
             payloads[0] = p;
+            history.note(0);
         }
         count++;
     }
 
-    // Split this leaf node in half, and return the new leaf node. The new node
-    // comes _after_ this node.
-    BTreeLeaf *split(Key &sep) {
-        BTreeLeaf *newLeaf = new BTreeLeaf();
-        newLeaf->count = count - (count / 2);
-        count = count - newLeaf->count;
+    // Open the append region. The caller must hold the write lock.
+    void openAppends() {
+        if (count < maxEntries) this->openRegion(count);
+    }
+
+    // Reserve a slot in the append region. Returns `maxEntries` or more if
+    // the region is full or closed. A reserved slot must be passed to
+    // `publish` or `abandon`, or whoever absorbs the region waits forever.
+    unsigned reserveSlot() { return Header::reserveSlot(maxEntries); }
+
+    // The end of the slots of the append region that may be in use.
+    unsigned appendEnd() { return Header::appendEnd(maxEntries); }
+
+    // If `k` is in the append region, set `p` to its value and return true.
+    // Called by optimistic readers, who have to validate the leaf version
+    // afterwards.
+    bool findAppended(Key k, Payload &p) {
+        if (!this->appendsOpen()) return false;
+        bool found = false;
+        for (unsigned i = count, end = appendEnd(); i < end; ++i) {
+            if (this->isAppended(i) && keys[i] == k) {
+                p = payloads[i];
+                found = true;
+            }
+        }
+        return found;
+    }
+
+    // Copy the entries of the append region whose keys are greater than
+    // `from` (or equal to it, unless `exclusive`) to `out`, sorted by key.
+    // Returns their number. Called by optimistic readers, who have to
+    // validate the leaf version afterwards.
+    unsigned collectAppended(Key from, bool exclusive, Entry *out) {
+        if (!this->appendsOpen()) return 0;
+        unsigned n = 0;
+        for (unsigned i = count, end = appendEnd(); i < end; ++i) {
+            if (this->isAppended(i) &&
+                (from < keys[i] || (!exclusive && keys[i] == from))) {
+                out[n].k = keys[i];
+                out[n].p = payloads[i];
+                n++;
+            }
+        }
+        std::sort(out, out + n,
+                  [](const Entry &a, const Entry &b) { return a.k < b.k; });
+        return n;
+    }
+
+    // Close the append region and merge its entries into the sorted ones.
+    // Waits for appenders that have reserved a slot to finish. The caller
+    // must hold the write lock.
+    //
+    // The entries are (almost) in order, so we merge them with an insertion
+    // sort. Of several entries with the same key, the one in the last slot
+    // wins.
+    void absorbAppends() {
+        if (!this->appendsOpen()) return;
+        unsigned end = this->closeRegion(maxEntries);
+
+        unsigned n = count;
+        for (unsigned i = count; i < end; ++i) {
+            if (!this->waitForSlot(i)) continue;
+
+            Key k = keys[i];
+            Payload p = payloads[i];
+            unsigned pos = n;
+            while (pos > count && k < keys[pos - 1]) pos--;
+            if (pos > count && keys[pos - 1] == k) {
+                payloads[pos - 1] = p;
+                continue;
+            }
+            memmove(keys + pos + 1, keys + pos, sizeof(Key) * (n - pos));
+            memmove(payloads + pos + 1, payloads + pos,
+                    sizeof(Payload) * (n - pos));
+            keys[pos] = k;
+            payloads[pos] = p;
+            history.note(pos);
+            n++;
+        }
+
+        this->clearSlots(count, end);
+        count = n;
+    }
+
+    // Get the write-locked leaf ready to be changed: wait for the writers of
+    // single segments, and merge the append region into the sorted entries.
+    // Anyone who write-locks the leaf calls this before touching its
+    // entries.
+    void settle() {
+        this->waitForSegments();
+        absorbAppends();
+    }
+
+    // Copy the payloads of the entries in `[from, to)` to `out`, and their
+    // keys to `outKeys` if given. Called by optimistic readers, who have to
+    // validate the leaf version afterwards. Returns false if a segment was
+    // written meanwhile, in which case the reader has to restart.
+    bool loadEntries(unsigned from, unsigned to, Payload *out, Key *outKeys) {
+        bool needRestart = false;
+        while (from < to) {
+            unsigned segment = from / segmentEntries;
+            unsigned end = to;
+            if (Segments::segmentCount) {
+                end = std::min(to, (segment + 1) * segmentEntries);
+            }
+            uint32_t version = this->readSegmentOrRestart(segment, needRestart);
+            if (needRestart) return false;
+            for (unsigned i = from; i < end; ++i) {
+                *out++ = payloads[i];
+                if (outKeys) *outKeys++ = keys[i];
+            }
+            this->checkSegmentOrRestart(segment, version, needRestart);
+            if (needRestart) return false;
+            from = end;
+        }
+        return true;
+    }
+
+    // The index at which `k` would be inserted. Used to pick a split point.
+    unsigned insertIndex(Key k) { return lowerBound(k); }
+
+    // Split this leaf node, keeping the first `leftCount` entries (at least
+    // one), and return the new leaf node with the rest. The new node comes
+    // _after_ this node and is linked in as its right sibling. `sep` is set
+    // to the new high key of this node. The new node is `spare`, an empty
+    // leaf, if given.
+    BTreeLeaf *split(Key &sep, unsigned leftCount,
+                     BTreeLeaf *spare = nullptr) {
+        assert(leftCount >= 1 && leftCount <= count);
+        BTreeLeaf *newLeaf = spare ? spare : new BTreeLeaf();
+        assert(newLeaf->count == 0);
+        newLeaf->count = count - leftCount;
+        count = leftCount;
         memcpy(newLeaf->keys, keys + count, sizeof(Key) * newLeaf->count);
         memcpy(newLeaf->payloads, payloads + count,
                sizeof(Payload) * newLeaf->count);
         sep = keys[count - 1];
+
+        newLeaf->highKey = highKey;
+        newLeaf->next = next;
+        highKey = sep;
+        next = newLeaf;
         return newLeaf;
     }
+
+    // Remove the entry at index `pos`.
+    void removeAt(unsigned pos) {
+        assert(pos < count);
+        memmove(keys + pos, keys + pos + 1, sizeof(Key) * (count - pos - 1));
+        memmove(payloads + pos, payloads + pos + 1,
+                sizeof(Payload) * (count - pos - 1));
+        count--;
+    }
+
+    // Move all entries of `right`, which comes directly _after_ this node, to
+    // the end of this node, and take over its high key and right sibling. The
+    // caller should check `canMerge` first.
+    void merge(BTreeLeaf *right) {
+        assert((uint64_t)count + right->count <= maxEntries);
+        assert(next == right);
+        memcpy(keys + count, right->keys, sizeof(Key) * right->count);
+        memcpy(payloads + count, right->payloads,
+               sizeof(Payload) * right->count);
+        count += right->count;
+        right->count = 0;
+        highKey = right->highKey;
+        next = right->next;
+    }
+
+    // Even out the number of entries in this node and `right`, which comes
+    // directly _after_ this node. `sep` is set to the new separator.
+    void redistribute(BTreeLeaf *right, Key &sep) {
+        unsigned leftCount = (count + right->count) / 2;
+        if (count > leftCount) {
+            // Move our last entries to the front of `right`.
+            unsigned n = count - leftCount;
+            memmove(right->keys + n, right->keys, sizeof(Key) * right->count);
+            memmove(right->payloads + n, right->payloads,
+                    sizeof(Payload) * right->count);
+            memcpy(right->keys, keys + leftCount, sizeof(Key) * n);
+            memcpy(right->payloads, payloads + leftCount, sizeof(Payload) * n);
+            right->count += n;
+        } else {
+            // Move the first entries of `right` to our end.
+            unsigned n = leftCount - count;
+            memcpy(keys + count, right->keys, sizeof(Key) * n);
+            memcpy(payloads + count, right->payloads, sizeof(Payload) * n);
+            memmove(right->keys, right->keys + n,
+                    sizeof(Key) * (right->count - n));
+            memmove(right->payloads, right->payloads + n,
+                    sizeof(Payload) * (right->count - n));
+            right->count -= n;
+            right->lowKeyVersion++;
+        }
+        count = leftCount;
+        sep = keys[count - 1];
+        highKey = sep;
+    }
 };
 
 // Inner node superclass so that we don't have to keep defining the type.
@@ -248,14 +1017,122 @@ struct BTreeInnerBase : public NodeBase {
     static const PageType typeMarker = PageType::BTreeInner;
 };
 
+// The message buffer of an inner node of a B-epsilon tree (see `BTree`): up
+// to `Capacity` inserts that have not been pushed down to the leaves yet,
+// sorted by key. Every message belongs to the subtree of the node.
+template <class Key, class Payload, uint64_t Capacity>
+struct MessageBuffer {
+    static const uint64_t bufferCapacity = Capacity;
+    static_assert(Capacity <= UINT16_MAX, "too many messages");
+
+    uint16_t messageCount = 0;
+    Key messageKeys[Capacity];
+    Payload messagePayloads[Capacity];
+
+    unsigned messages() { return messageCount; }
+    bool messagesFull() { return messageCount == Capacity; }
+    Key messageKey(unsigned i) { return messageKeys[i]; }
+    Payload messagePayload(unsigned i) { return messagePayloads[i]; }
+
+    // The index of the first message whose key is not less than `k`.
+    unsigned findMessage(Key k) {
+        return std::lower_bound(messageKeys, messageKeys + messageCount, k) -
+               messageKeys;
+    }
+
+    // Insert the message (k, p), or replace the payload of the message for
+    // `k`. There must be room, unless there is a message for `k` already.
+    void putMessage(Key k, Payload p) {
+        unsigned pos = findMessage(k);
+        if (pos < messageCount && messageKeys[pos] == k) {
+            messagePayloads[pos] = p;
+            return;
+        }
+        assert(messageCount < Capacity);
+        memmove(messageKeys + pos + 1, messageKeys + pos,
+                sizeof(Key) * (messageCount - pos));
+        memmove(messagePayloads + pos + 1, messagePayloads + pos,
+                sizeof(Payload) * (messageCount - pos));
+        messageKeys[pos] = k;
+        messagePayloads[pos] = p;
+        messageCount++;
+    }
+
+    // Remove the `n` messages starting at index `pos`.
+    void eraseMessages(unsigned pos, unsigned n) {
+        memmove(messageKeys + pos, messageKeys + pos + n,
+                sizeof(Key) * (messageCount - pos - n));
+        memmove(messagePayloads + pos, messagePayloads + pos + n,
+                sizeof(Payload) * (messageCount - pos - n));
+        messageCount -= n;
+    }
+
+    // Move the messages with keys greater than `sep` to the empty buffer
+    // `right`.
+    void splitMessages(Key sep, MessageBuffer *right) {
+        unsigned pos = std::upper_bound(messageKeys,
+                                        messageKeys + messageCount, sep) -
+                       messageKeys;
+        right->messageCount = messageCount - pos;
+        memcpy(right->messageKeys, messageKeys + pos,
+               sizeof(Key) * right->messageCount);
+        memcpy(right->messagePayloads, messagePayloads + pos,
+               sizeof(Payload) * right->messageCount);
+        messageCount = pos;
+    }
+};
+
+// Inner nodes of regular B-trees have no message buffer. This takes up no
+// space in the node; none of the functions are ever called.
+template <class Key, class Payload>
+struct MessageBuffer<Key, Payload, 0> {
+    static const uint64_t bufferCapacity = 0;
+
+    unsigned messages() { return 0; }
+    bool messagesFull() { return true; }
+    Key messageKey(unsigned) { return Key(); }
+    Payload messagePayload(unsigned) { return Payload(); }
+    unsigned findMessage(Key) { return 0; }
+    void putMessage(Key, Payload) { assert(false); }
+    void eraseMessages(unsigned, unsigned) { assert(false); }
+    void splitMessages(Key, MessageBuffer *) {}
+};
+
 // A single inner node in the btree. Note that anyone doing operations on these
 // nodes should already be holding a lock.
-template <class Key>
-struct BTreeInner : public BTreeInnerBase {
+//
+// If `BufferPercent` is not 0, that share of the node is taken up by a buffer
+// of messages with `Payload`s (see `MessageBuffer`).
+template <class Key, class Search = common::search::Simd,
+          class Alloc = common::alloc::Default,
+          uint64_t PageSize = pageSize, class Payload = Key,
+          unsigned BufferPercent = 0>
+struct BTreeInner
+    : public BTreeInnerBase,
+      public MessageBuffer<Key, Payload,
+                           (PageSize * BufferPercent / 100) /
+                               (sizeof(Key) + sizeof(Payload))> {
+    static_assert(BufferPercent < 100, "no room left for children");
+
+    typedef MessageBuffer<Key, Payload,
+                          (PageSize * BufferPercent / 100) /
+                              (sizeof(Key) + sizeof(Payload))>
+        Buffer;
+
     // The max number of entries in an inner node (based on the size of keys
-    // and pages). We also need to account for the space of the locks.
+    // and pages). We also need to account for the space of the locks, the
+    // high key, and the message buffer.
     static const uint64_t maxEntries =
-        (pageSize - sizeof(NodeBase)) / (sizeof(Key) + sizeof(NodeBase *));
+        (PageSize - sizeof(NodeBase) - sizeof(Key) -
+         (Buffer::bufferCapacity ? sizeof(Buffer) : 0)) /
+        (sizeof(Key) + sizeof(NodeBase *));
+    static_assert(maxEntries >= 4 && maxEntries <= UINT16_MAX,
+                  "a inner node must fit between 4 and 65535 entries");
+
+    // All keys in the subtree of this node are less than or equal to the high
+    // key. Greater keys belong to the right siblings. Only valid if `next` is
+    // set.
+    Key highKey;
 
     // Pointers to the child nodes.
     NodeBase *children[maxEntries];
@@ -263,56 +1140,61 @@ struct BTreeInner : public BTreeInnerBase {
     // The keys for each child.
     Key keys[maxEntries];
 
-    // Construct an empty inner node.
-    BTreeInner() {
+    // Construct an empty inner node at height `level` above the leaves.
+    explicit BTreeInner(uint8_t level = 1) {
         count = 0;
         type = typeMarker;
+        this->level = level;
+        next = nullptr;
+    }
+
+    // Nodes come from the node allocator (see `alloc.h`).
+    static void *operator new(size_t size) { return Alloc::allocate(size); }
+    static void operator delete(void *p, size_t size) {
+        Alloc::deallocate(p, size);
     }
 
     // Returns true if adding one more key would fill the node.
     bool isFull() { return count == (maxEntries - 1); };
 
-    // Returns the index into this node of the least key that is greater than
-    // or equal to `k`.
-    unsigned lowerBound(Key k) {
-        unsigned lower = 0;
-        unsigned upper = count;
-        do {
-            unsigned mid = ((upper - lower) / 2) + lower;
-            if (k < keys[mid]) {
-                upper = mid;
-            } else if (k > keys[mid]) {
-                lower = mid + 1;
-            } else {
-                return mid;
-            }
-        } while (lower < upper);
-        return lower;
-    }
+    // Returns true if this node is so empty that it should be merged with or
+    // take entries from a sibling.
+    bool isUnderfull() { return count < maxEntries / 4; };
 
-    // Alternate implementation of `lowerBound`. This function is not used anywhere.
-    unsigned lowerBoundBF(Key k) {
-        auto base = keys;
-        unsigned n = count;
-        while (n > 1) {
-            const unsigned half = n / 2;
-            base = (base[half] < k) ? (base + half) : base;
-            n -= half;
-        }
-        return (*base < k) + base - keys;
+    // Returns true if this node and `right` have few enough keys between them
+    // to be merged (counting the separator pulled down from the parent).
+    bool canMerge(BTreeInner *right) {
+        return (uint64_t)count + right->count + 1 <= (maxEntries - 1) * 3 / 4;
     }
 
-    // Split this inner node in half, and return the new inner node. The new
-    // node comes _after_ this node.
-    BTreeInner *split(Key &sep) {
-        BTreeInner *newInner = new BTreeInner();
-        newInner->count = count - (count / 2);
-        count = count - newInner->count - 1;
+    // Returns the index into this node of the least key that is greater than
+    // or equal to `k`. See `search.h` for the available search policies.
+    unsigned lowerBound(Key k) { return Search::lowerBound(keys, count, k); }
+
+    // The index of the child that a separator `k` would insert. Used to pick
+    // a split point.
+    unsigned insertIndex(Key k) { return lowerBound(k) + 1; }
+
+    // Split this inner node, keeping the first `leftChildren` children (at
+    // least one, and leaving at least one), and return the new inner node
+    // with the rest. The new node comes _after_ this node and is linked in as
+    // its right sibling. `sep` is set to the new high key of this node.
+    BTreeInner *split(Key &sep, unsigned leftChildren) {
+        assert(leftChildren >= 1 && leftChildren <= count);
+        BTreeInner *newInner = new BTreeInner(level);
+        newInner->count = count - leftChildren;
+        count = leftChildren - 1;
         sep = keys[count];
         memcpy(newInner->keys, keys + count + 1,
                sizeof(Key) * (newInner->count + 1));
         memcpy(newInner->children, children + count + 1,
                sizeof(NodeBase *) * (newInner->count + 1));
+        this->splitMessages(sep, newInner);
+
+        newInner->highKey = highKey;
+        newInner->next = next;
+        highKey = sep;
+        next = newInner;
         return newInner;
     }
 
@@ -328,161 +1210,1965 @@ struct BTreeInner : public BTreeInnerBase {
         children[pos] = child;
         std::swap(children[pos], children[pos + 1]);
         count++;
+        history.note(pos + 1);
+    }
+
+    // Remove the key at index `pos` together with the child to its right.
+    // This is the inverse of `insert`.
+    void removeAt(unsigned pos) {
+        assert(pos < count);
+        memmove(keys + pos, keys + pos + 1, sizeof(Key) * (count - pos - 1));
+        memmove(children + pos + 1, children + pos + 2,
+                sizeof(NodeBase *) * (count - pos - 1));
+        count--;
+    }
+
+    // Append separator `sep` and all keys and children of `right`, which
+    // comes directly _after_ this node, and take over its high key and right
+    // sibling. The caller should check `canMerge` first.
+    void merge(Key sep, BTreeInner *right) {
+        assert((uint64_t)count + right->count + 1 < maxEntries);
+        assert(next == right);
+        assert(!this->messages() && !right->messages());
+        keys[count] = sep;
+        memcpy(keys + count + 1, right->keys, sizeof(Key) * right->count);
+        memcpy(children + count + 1, right->children,
+               sizeof(NodeBase *) * (right->count + 1));
+        count += right->count + 1;
+        right->count = 0;
+        highKey = right->highKey;
+        next = right->next;
+    }
+
+    // Even out the number of keys in this node and `right`, which comes
+    // directly _after_ this node, rotating through the separator `sep` from
+    // the parent. `sep` is set to the new separator.
+    void redistribute(BTreeInner *right, Key &sep) {
+        assert(!this->messages() && !right->messages());
+
+        // Rotate entries through `sep`, moving them in place, so that the
+        // left node ends up with half of all keys.
+        unsigned leftCount = (count + 1 + right->count) / 2;
+        if (count > leftCount) {
+            // Move our last children, and the keys between them, to the
+            // front of `right`.
+            unsigned n = count - leftCount;
+            memmove(right->keys + n, right->keys, sizeof(Key) * right->count);
+            memmove(right->children + n, right->children,
+                    sizeof(NodeBase *) * (right->count + 1));
+            memcpy(right->keys, keys + leftCount + 1, sizeof(Key) * (n - 1));
+            right->keys[n - 1] = sep;
+            memcpy(right->children, children + leftCount + 1,
+                   sizeof(NodeBase *) * n);
+            sep = keys[leftCount];
+            right->count += n;
+        } else if (count < leftCount) {
+            // Move the first children of `right`, and the keys between them,
+            // to our end.
+            unsigned n = leftCount - count;
+            keys[count] = sep;
+            memcpy(keys + count + 1, right->keys, sizeof(Key) * (n - 1));
+            memcpy(children + count + 1, right->children,
+                   sizeof(NodeBase *) * n);
+            sep = right->keys[n - 1];
+            memmove(right->keys, right->keys + n,
+                    sizeof(Key) * (right->count - n));
+            memmove(right->children, right->children + n,
+                    sizeof(NodeBase *) * (right->count + 1 - n));
+            right->count -= n;
+        }
+        count = leftCount;
+        highKey = sep;
     }
 };
 
-// A generic, thread-safe btree using OLC.
-template <class Key, class Value>
-struct BTree : public common::BTreeBase<Key, Value> {
+// A generic, thread-safe btree using OLC. `Search` picks the search kernel
+// used inside of nodes (see `search.h`), `Split` picks where full nodes are
+// split (see `split.h`), and `Alloc` picks where nodes come from (see
+// `alloc.h`). `LeafSize` and `InnerSize` are the sizes of the nodes in bytes.
+//
+// If `InnerBufferPercent` is not 0, the tree is a B-epsilon tree: that share
+// of each inner node is a buffer of inserts on their way down to the leaves
+// (see `insertMessage`).
+//
+// If `SegmentedLeaves` is set, the entries of each leaf are split into
+// segments with their own versions (see `BTreeLeaf`).
+//
+// `Modes` turns on optional modes of the tree (see `mode`), e.g.
+// `mode::Append | mode::Finger`. By default, all of them are off.
+template <class Key, class Value, class Search = common::search::Simd,
+          class Split = common::split::PositionAware,
+          class Alloc = common::alloc::Default, uint64_t LeafSize = pageSize,
+          uint64_t InnerSize = pageSize, unsigned InnerBufferPercent = 0,
+          bool SegmentedLeaves = false, unsigned Modes = 0>
+struct BTree final : public common::BTreeBase<Key, Value> {
+    typedef BTreeLeaf<Key, Value, Search, Alloc, LeafSize, SegmentedLeaves,
+                      Modes>
+        Leaf;
+    typedef BTreeInner<Key, Search, Alloc, InnerSize, Value,
+                       InnerBufferPercent>
+        Inner;
+
+    // True for B-epsilon trees.
+    static const bool bEpsilon = Inner::bufferCapacity > 0;
+    static_assert(sizeof(Leaf) <= LeafSize && sizeof(Inner) <= InnerSize,
+                  "nodes must fit into their size");
+
     // The root node of the btree.
     std::atomic<NodeBase *> root;
 
+    // With `mode::FlatCombining`, an insert that finds its leaf write-locked
+    // publishes its entry to the leaf, and the lock holder applies it (flat
+    // combining), instead of retrying the insert. This keeps writers of a hot
+    // leaf, e.g. the rightmost one for increasing keys, from hammering its
+    // lock word.
+    static const bool flatCombining = (Modes & mode::FlatCombining) != 0;
+
+    // With `mode::Finger`, each thread remembers the leaf of its last insert
+    // or lookup (its finger), and the next insert or lookup first checks
+    // whether its key falls into that leaf before descending from the root.
+    // This saves the descent for workloads with locality, e.g. sequential
+    // inserts or lookups of nearby keys.
+    static const bool useFinger = (Modes & mode::Finger) != 0;
+
+    // With `mode::Append`, inserts of keys greater than all others in the
+    // rightmost leaf reserve a slot in its append region with a fetch-and-add
+    // and write their entry there without taking the lock (see `tryAppend`).
+    // Only the split of a full rightmost leaf, and any other insert, lock it.
+    // This lets concurrent writers of increasing keys, e.g. time stamps,
+    // append in parallel instead of fighting for the lock of the rightmost
+    // leaf.
+    static const bool appendMode = (Modes & mode::Append) != 0;
+
+    // If not 0, each thread collects its inserts in a private buffer of this
+    // many entries, sorted by key, and merges the buffer into the tree once
+    // it is full, locking each leaf once for all of its entries (see
+    // `flushBuffer`). Lookups, scans and removes also check the buffers of
+    // all threads. Set it before the tree is used.
+    //
+    // An insert of a key that is still in the buffer of another thread moves
+    // that older entry into the tree first, so that it cannot be flushed over
+    // the newer one later. If several threads insert the same key at the
+    // same time, it is unspecified which value wins.
+    unsigned insertBufferSize = 0;
+
+    // With `mode::ContentionSplits`, an insert that finds the lock of its
+    // leaf hot (see `OptLock`) splits the leaf in the middle even if it is
+    // not full, as long as it has at least a `hotSplitShare`th of its
+    // capacity. This spreads a hot key range over more locks, while cold
+    // ranges keep their full leaves. Once `coolWrites` inserts in a row have
+    // locked one of the halves without contention, it is merged back with
+    // its sibling if they fit into one leaf (see `mergeCooled`).
+    static const bool contentionSplits =
+        (Modes & mode::ContentionSplits) != 0;
+    static const unsigned hotSplitShare = 8;
+    static const uint16_t coolWrites = 128;
+
+    // With `mode::Preallocate`, the right edge of the tree is prepared for
+    // sequential inserts ahead of time (see `prepareRightEdge`). Once the
+    // rightmost leaf is half full, an empty spare leaf is allocated for it,
+    // and its parent is split if it has no room for another child. When the
+    // rightmost leaf is full and an insert goes past its end, it takes the
+    // spare as its new right sibling and keeps all of its entries, so that
+    // the split under the lock of the leaf neither allocates nor copies
+    // anything.
+    static const bool preallocate = (Modes & mode::Preallocate) != 0;
+
+    // The spare leaf for the right edge, if any.
+    std::atomic<Leaf *> spareLeaf{nullptr};
+
+    // The insert buffers of all threads that ever used this tree.
+    struct InsertBuffer;
+    std::atomic<InsertBuffer *> buffers{nullptr};
+
+    // Tells the fingers of this tree apart from those of other trees.
+    const uint64_t id = newTreeId();
+
     // Construct a new btree with exactly one node, which is an empty leaf node.
-    BTree() { root = new BTreeLeaf<Key, Value>(); }
+    BTree() { root = new Leaf(); }
+
+    // Construct a new btree from the (key, value) pairs in `[first, last)`,
+    // which must be sorted by key and free of duplicates. The tree is built
+    // bottom-up by `threads` threads (0 means one per core), and each node is
+    // filled to `fill` times its capacity. See `bulk-load.h`.
+    template <class It>
+    BTree(It first, It last, double fill = 1.0, unsigned threads = 0) {
+        root = common::bulk::build<NodeBase *, Key>(
+            first, last - first, Leaf::maxEntries, Inner::maxEntries, fill,
+            threads, packLeaf<It>, packInner, linkNodes);
+    }
 
-    // Create a new root node with the two given nodes as children separated by
-    // the given key. Atomically replace the current root with the new one.
-    void makeRoot(Key k, NodeBase *leftChild, NodeBase *rightChild) {
-        auto inner = new BTreeInner<Key>();
-        inner->count = 1;
-        inner->keys[0] = k;
-        inner->children[0] = leftChild;
-        inner->children[1] = rightChild;
-        root = inner;
+    // Free all nodes. The caller must make sure no other thread is still
+    // using the tree.
+    ~BTree() {
+        freeSubtree(root);
+        delete spareLeaf.load();
+        for (InsertBuffer *buffer = buffers; buffer;) {
+            InsertBuffer *next = buffer->next;
+            delete buffer;
+            buffer = next;
+        }
     }
 
-    // Depending on the value of `count`, either yield the processor to the OS
-    // scheduler or inform the processor you are waiting for a spin lock.
-    void yield(int count) {
-        if (count > 3)
-            sched_yield();
-        else
-            _mm_pause();
+    // A node built by the bulk loader, and the max key in its subtree.
+    typedef std::pair<NodeBase *, Key> Built;
+
+    // Pack the sorted (key, value) pairs in `[begin, end)` into a new leaf.
+    template <class It>
+    static Built packLeaf(It begin, It end) {
+        auto leaf = new Leaf();
+        for (It it = begin; it != end; ++it) {
+            assert(leaf->count < leaf->maxEntries);
+            assert(!leaf->count || leaf->keys[leaf->count - 1] < it->first);
+            leaf->keys[leaf->count] = it->first;
+            leaf->payloads[leaf->count] = it->second;
+            leaf->count++;
+        }
+        return Built(leaf, leaf->count ? leaf->keys[leaf->count - 1] : Key());
     }
 
-    // Insert the (k, v) pair into the tree.
-    void insert(Key k, Value v) {
-        int restartCount = 0;
-    restart:
-        if (restartCount++) yield(restartCount);
+    // Pack the children in `[begin, end)` into a new inner node. Each child
+    // is separated from the next one by its max key.
+    static Built packInner(const Built *begin, const Built *end) {
+        auto inner = new Inner(begin->first->level + 1);
+        assert(end - begin >= 2 &&
+               uint64_t(end - begin) <= inner->maxEntries);
+        inner->count = end - begin - 1;
+        for (unsigned i = 0; i <= inner->count; ++i) {
+            inner->children[i] = begin[i].first;
+            inner->keys[i] = begin[i].second;
+        }
+        return Built(inner, end[-1].second);
+    }
+
+    // Make the bulk loaded `right` the right sibling of `left`. The max key
+    // of `left` becomes its high key.
+    static void linkNodes(Built &left, const Built &right) {
+        left.first->next = right.first;
+        highKeyOf(left.first) = left.second;
+    }
+
+    // Free the subtree rooted at `node`. Only safe once no other thread can
+    // access the tree.
+    static void freeSubtree(NodeBase *node) {
+        if (node->type == PageType::BTreeInner) {
+            auto inner = static_cast<Inner *>(node);
+            for (unsigned i = 0; i <= inner->count; ++i) {
+                freeSubtree(inner->children[i]);
+            }
+        }
+        deleteNode(node);
+    }
+
+    // Free a single node of this tree. Used as the deleter for epoch-based
+    // reclamation.
+    static void deleteNode(void *p) {
+        NodeBase *node = static_cast<NodeBase *>(p);
+        if (node->type == PageType::BTreeInner) {
+            delete static_cast<Inner *>(node);
+        } else {
+            delete static_cast<Leaf *>(node);
+        }
+    }
+
+    // Retire `node`, which must already be unreachable from the root and
+    // marked obsolete. It is freed once no optimistic reader can still be
+    // looking at it.
+    void retireNode(NodeBase *node) {
+        common::epoch::retire(node, deleteNode);
+    }
+
+    // The high key of `node`, whichever type it is.
+    static Key &highKeyOf(NodeBase *node) {
+        if (node->type == PageType::BTreeInner) {
+            return static_cast<Inner *>(node)->highKey;
+        } else {
+            return static_cast<Leaf *>(node)->highKey;
+        }
+    }
+
+    // Returns true if `node` is an inner node with messages in its buffer.
+    static bool hasMessages(NodeBase *node) {
+        return bEpsilon && node->type == PageType::BTreeInner &&
+               static_cast<Inner *>(node)->messages() > 0;
+    }
+
+    // Returns true if `node` is underfull, whichever type it is.
+    static bool isUnderfull(NodeBase *node) {
+        if (node->type == PageType::BTreeInner) {
+            return static_cast<Inner *>(node)->isUnderfull();
+        } else {
+            return static_cast<Leaf *>(node)->isUnderfull();
+        }
+    }
+
+    // The low fence of a node: all keys in its subtree are greater than
+    // `key`. The leftmost node of each level has none.
+    struct LowFence {
+        bool leftmost = true;
+        Key key;
+
+        // Returns true if `k` is above the fence.
+        bool below(Key k) const { return leftmost || key < k; }
+    };
+
+    // The inner nodes on the way from the root down to a leaf, and the
+    // versions at which we read them, so that an operation that has to
+    // restart can resume from the deepest of them that has not changed since.
+    // The caller must stay in the same epoch, so that the nodes are not
+    // freed in between.
+    struct Path {
+        // Deeper nodes are not recorded. Trees that tall need tiny nodes and
+        // lots of keys.
+        static const unsigned maxDepth = 32;
+
+        NodeBase *nodes[maxDepth];
+        uint64_t versions[maxDepth];
+        LowFence fences[maxDepth];
+        unsigned depth = 0;
+
+        // The low fence of the node the last descent ended at.
+        LowFence fence;
+
+        // Record `node`, read at `version`, as the next node on the path.
+        void push(NodeBase *node, uint64_t version, const LowFence &fence) {
+            if (depth < maxDepth) {
+                nodes[depth] = node;
+                versions[depth] = version;
+                fences[depth] = fence;
+                depth++;
+            }
+        }
+
+        // Drop the nodes from the end of the path that have changed, and
+        // return the deepest one left that is at height `level` or above, with
+        // its version and low fence. It is dropped as well; the caller pushes
+        // it again. Returns nullptr if there is none.
+        //
+        // An unchanged version means that nobody has written the node since we
+        // reached it, so its key range still contains the key we are looking
+        // for, and it is not obsolete.
+        NodeBase *resume(uint8_t level, uint64_t &version, LowFence &fence) {
+            while (depth > 0) {
+                depth--;
+                NodeBase *node = nodes[depth];
+                if (node->level >= level &&
+                    node->typeVersionLockObsolete.load() == versions[depth]) {
+                    version = versions[depth];
+                    fence = fences[depth];
+                    return node;
+                }
+            }
+            return nullptr;
+        }
+    };
+
+    // The last leaf a thread used, with the low fence and `lowKeyVersion` it
+    // had then. It is only valid for the tree `tree` and only while the global
+    // epoch is still `epoch`: the leaf was not obsolete in that epoch, so it
+    // cannot have been freed before the epoch moves on twice, and a thread
+    // inside a `Guard` that sees the epoch unchanged keeps it from doing so.
+    struct Finger {
+        uint64_t tree = 0;
+        uint64_t epoch;
+        Leaf *leaf;
+        LowFence fence;
+        uint32_t lowKeyVersion;
+    };
+
+    // The finger of the calling thread. Each thread has one for all trees of
+    // the same type, so it only helps while a thread works on one tree.
+    static Finger &finger() {
+        static thread_local Finger f;
+        return f;
+    }
+
+    // Remember `leaf`, whose low fence and `lowKeyVersion` are `fence` and
+    // `lowKeyVersion`, as the finger of the calling thread. All three and
+    // `epoch`, the global epoch, must have been read while the leaf was
+    // write-locked, or before a read of it was validated.
+    void setFinger(Leaf *leaf, const LowFence &fence, uint32_t lowKeyVersion,
+                   uint64_t epoch) {
+        Finger &f = finger();
+        f.tree = id;
+        f.epoch = epoch;
+        f.leaf = leaf;
+        f.fence = fence;
+        f.lowKeyVersion = lowKeyVersion;
+    }
+
+    // If the finger of the calling thread is the leaf for `k`, return it,
+    // read-locked at `versionNode`, and set `fence` to its low fence.
+    // Otherwise, return nullptr. Must be called inside a `Guard`.
+    Leaf *tryFinger(Key k, uint64_t &versionNode, LowFence &fence) {
+        Finger &f = finger();
+        if (f.tree != id || f.epoch != common::epoch::manager().current()) {
+            return nullptr;
+        }
+
+        bool needRestart = false;
+        Leaf *leaf = f.leaf;
+        versionNode = leaf->readLockOrRestart(needRestart);
+        if (needRestart) return nullptr;
+        bool inRange = f.fence.below(k) &&
+                       leaf->lowKeyVersion == f.lowKeyVersion &&
+                       (!leaf->next || k <= leaf->highKey);
+        leaf->checkOrRestart(versionNode, needRestart);
+        if (needRestart || !inRange) return nullptr;
+
+        fence = f.fence;
+        return leaf;
+    }
+
+    // `node` was read at `versionNode`. While `k` is greater than the high key
+    // of `node`, `k` belongs to a right sibling that was split off `node`, so
+    // follow the sibling pointers. `node` and `versionNode` are updated to
+    // the node whose key range contains `k`, and `fence`, if given, to its
+    // low fence. Returns true if we moved right at all. If some version check
+    // fails, `needRestart` is set to true.
+    bool moveRight(NodeBase *&node, uint64_t &versionNode, Key k,
+                   bool &needRestart, LowFence *fence = nullptr) {
+        bool moved = false;
+        while (node->next && k > highKeyOf(node)) {
+            NodeBase *next = node->next;
+            Key highKey = highKeyOf(node);
+            node->checkOrRestart(versionNode, needRestart);
+            if (needRestart) return moved;
+            uint64_t versionNext = next->readLockOrRestart(needRestart);
+            if (needRestart) return moved;
+            node->readUnlockOrRestart(versionNode, needRestart);
+            if (needRestart) return moved;
+
+            node = next;
+            versionNode = versionNext;
+            if (fence) {
+                fence->leftmost = false;
+                fence->key = highKey;
+            }
+            moved = true;
+        }
+        return moved;
+    }
+
+    // Descend from the root to the node at height `level` whose key range
+    // contains `k`. Returns the node and sets `versionNode` to the version at
+    // which it was read. If some version check fails, `needRestart` is set to
+    // true instead, and the caller should restart.
+    //
+    // If `lowKeyVersion` is given, a leaf that is write-locked when we get to
+    // it from its parent is returned anyway, with its locked version, for the
+    // caller to publish an insert to (see `publishInsert`) or to wait for.
+    // Its key range contained `k` at some point, but the leaf may be in the
+    // middle of a split. `lowKeyVersion` is set to its `lowKeyVersion` from
+    // that point.
+    //
+    // If `path` is given, the inner nodes on the way down are recorded in it.
+    // When called again with the same path after a restart, the descent
+    // resumes from the deepest of them that has not changed since, rather
+    // than from the root. The low fence of the node we end up at is stored
+    // in `path->fence`.
+    NodeBase *findNode(Key k, uint8_t level, uint64_t &versionNode,
+                       bool &needRestart, uint32_t *lowKeyVersion = nullptr,
+                       Path *path = nullptr) {
+        LowFence fence;
+        NodeBase *node =
+            path ? path->resume(level, versionNode, fence) : nullptr;
+        if (!node) {
+            node = root;
+            versionNode = node->readLockOrRestart(needRestart);
+            if (needRestart || (node != root) || (node->level < level)) {
+                needRestart = true;
+                return nullptr;
+            }
+        }
+
+        while (true) {
+            moveRight(node, versionNode, k, needRestart, &fence);
+            if (needRestart) return nullptr;
+            if (node->level == level) {
+                if (path) path->fence = fence;
+                return node;
+            }
+            if (path) path->push(node, versionNode, fence);
+
+            auto inner = static_cast<Inner *>(node);
+            unsigned pos = inner->lowerBound(k);
+            NodeBase *child = inner->children[pos];
+            if (pos > 0) {
+                fence.leftmost = false;
+                fence.key = inner->keys[pos - 1];
+            }
+            inner->checkOrRestart(versionNode, needRestart);
+            if (needRestart) return nullptr;
+            bool childLocked = false;
+            uint64_t versionChild = child->readLockOrRestart(childLocked);
+            bool returnLocked = childLocked && lowKeyVersion &&
+                                child->level == 0 &&
+                                !child->isObsolete(versionChild);
+            if (childLocked && !returnLocked) {
+                needRestart = true;
+                return nullptr;
+            }
+            if (returnLocked) {
+                *lowKeyVersion = static_cast<Leaf *>(child)->lowKeyVersion;
+            }
+            inner->readUnlockOrRestart(versionNode, needRestart);
+            if (needRestart) return nullptr;
+
+            node = child;
+            versionNode = versionChild;
+
+            // We cannot move right from a locked node.
+            if (returnLocked) {
+                if (path) path->fence = fence;
+                return node;
+            }
+        }
+    }
+
+    // Merge or redistribute the underfull `node` with one of its siblings.
+    // `parent` is the parent of `node`, and `node` is the child at index
+    // `pos` of `parent`. `versionParent` and `versionNode` are the versions
+    // at which the caller read both nodes. The parent must have at least two
+    // children.
+    //
+    // Grabs the write locks of the parent, the node, and the sibling (in that
+    // order). If any of them cannot be grabbed, `needRestart` is set to true
+    // and nothing is changed. Otherwise, the caller should restart anyway
+    // because the tree has changed under it.
+    //
+    // Returns false without changing anything if the left node of the pair
+    // has been split and the separator has not been posted to `parent` yet;
+    // the right node of the pair is then not its right sibling. Likewise if
+    // the pair are inner nodes of a B-epsilon tree with messages, which
+    // would have to be sorted out between them.
+    //
+    // If `mergeOnly` is set, the leaf `node` is merged if possible and left
+    // alone otherwise, and is no longer marked as a hot split either way (see
+    // `mergeCooled`).
+    bool rebalance(Inner *parent, uint64_t versionParent, unsigned pos,
+                   NodeBase *node, uint64_t versionNode, bool &needRestart,
+                   bool mergeOnly = false) {
+        assert(!mergeOnly || node->type == PageType::BTreeLeaf);
+
+        // Lock. The caller's look at the parent's count was optimistic, so
+        // it only holds once the parent is locked at `versionParent`.
+        parent->upgradeToWriteLockOrRestart(versionParent, needRestart);
+        if (needRestart) return false;
+        assert(parent->count > 0);
+
+        // Always operate on a (left, right) pair of adjacent children. Use
+        // the right sibling unless `node` is the rightmost child.
+        unsigned leftPos = (pos < parent->count) ? pos : pos - 1;
+
+        node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+        if (needRestart) {
+            parent->writeUnlock();
+            return false;
+        }
+        NodeBase *left = parent->children[leftPos];
+        NodeBase *right = parent->children[leftPos + 1];
+        NodeBase *sibling = (left == node) ? right : left;
+        sibling->writeLockOrRestart(needRestart);
+        if (needRestart) {
+            node->writeUnlock();
+            parent->writeUnlock();
+            return false;
+        }
+        if (left->next != right || hasMessages(left) || hasMessages(right)) {
+            sibling->writeUnlock();
+            node->writeUnlock();
+            parent->writeUnlock();
+            return false;
+        }
+
+        // Merge the right node into the left one, or even them out.
+        bool merge;
+        if (node->type == PageType::BTreeLeaf) {
+            auto l = static_cast<Leaf *>(left);
+            auto r = static_cast<Leaf *>(right);
+            l->settle();
+            r->settle();
+            merge = l->canMerge(r);
+            if (merge) {
+                l->merge(r);
+                l->setHotSplit(false);
+            } else if (mergeOnly) {
+                static_cast<Leaf *>(node)->setHotSplit(false);
+            } else {
+                l->redistribute(r, parent->keys[leftPos]);
+            }
+        } else {
+            auto l = static_cast<Inner *>(left);
+            auto r = static_cast<Inner *>(right);
+            merge = l->canMerge(r);
+            if (merge) {
+                l->merge(parent->keys[leftPos], r);
+            } else {
+                l->redistribute(r, parent->keys[leftPos]);
+            }
+        }
+
+        // Unlock. A merged node is now unreachable, so it is marked obsolete
+        // to make concurrent readers restart, and retired.
+        if (merge) {
+            parent->removeAt(leftPos);
+            right->writeUnlockObsolete();
+            retireNode(right);
+        } else {
+            right->writeUnlock();
+        }
+        left->writeUnlock();
+        parent->writeUnlock();
+        return true;
+    }
+
+    // Create a new root node with the two given nodes as children separated by
+    // the given key. Atomically replace the current root with the new one.
+    void makeRoot(Key k, NodeBase *leftChild, NodeBase *rightChild) {
+        auto inner = new Inner(leftChild->level + 1);
+        inner->count = 1;
+        inner->keys[0] = k;
+        inner->children[0] = leftChild;
+        inner->children[1] = rightChild;
+        root = inner;
+    }
+
+    // Split the write-locked `node` to make room for key `k` and return the
+    // new right node. The split point is chosen by the `Split` policy. `sep`
+    // is set to the separator of the two nodes.
+    NodeBase *splitOff(NodeBase *node, Key k, Key &sep) {
+        unsigned run = node->history.run;
+        if (node->type == PageType::BTreeLeaf) {
+            auto leaf = static_cast<Leaf *>(node);
+            unsigned n = leaf->count;
+            unsigned index = leaf->insertIndex(k);
+            if (preallocate && !leaf->next && index == n) {
+                Leaf *spare = spareLeaf.exchange(nullptr);
+                if (spare) return leaf->split(sep, n, spare);
+            }
+            unsigned point = Split::splitPoint(n, index, run);
+            point = std::max(1u, std::min(point, n));
+            return leaf->split(sep, point);
+        } else {
+            auto inner = static_cast<Inner *>(node);
+            unsigned n = inner->count + 1;
+            unsigned point = Split::splitPoint(n, inner->insertIndex(k), run);
+            point = std::max(1u, std::min(point, n - 1));
+            return inner->split(sep, point);
+        }
+    }
+
+    // Split the full, write-locked `node` to make room for key `k` and unlock
+    // it. The split point is chosen by the `Split` policy.
+    //
+    // If `node` is the root, a new root is put on top of it right away.
+    // Otherwise, the separator is posted to the parent level only after
+    // `node` has been unlocked. Until then, the new node is reachable through
+    // the right sibling pointer of `node`.
+    void splitNode(NodeBase *node, Key k) {
+        Key sep;
+        NodeBase *newNode = splitOff(node, k, sep);
+        finishSplit(node, sep, newNode);
+    }
+
+    // Split the hot, write-locked `leaf` in the middle and unlock it (see
+    // `contentionSplits`). Both halves start out lukewarm: the left half must
+    // not be split again right away, but the right half should be split soon
+    // if the contention goes on. Neither has cooled down yet.
+    void splitHot(Leaf *leaf) {
+        Key sep;
+        Leaf *newLeaf = leaf->split(sep, leaf->count / 2);
+        leaf->setHotSplit(true);
+        newLeaf->setHotSplit(true);
+        leaf->contention.store(OptLock::hotThreshold / 2,
+                               std::memory_order_relaxed);
+        newLeaf->contention.store(OptLock::hotThreshold / 2,
+                                  std::memory_order_relaxed);
+        finishSplit(leaf, sep, newLeaf);
+    }
+
+    // Unlock `node`, which has just been split into itself and `newNode`
+    // with separator `sep`, and post the separator to the parent level.
+    void finishSplit(NodeBase *node, Key sep, NodeBase *newNode) {
+        if (node == root) {
+            makeRoot(sep, node, newNode);
+            node->writeUnlock();
+            return;
+        }
+
+        uint8_t parentLevel = node->level + 1;
+        node->writeUnlock();
+        insertSeparator(sep, newNode, parentLevel);
+    }
+
+    // Post the separator `sep` of the new node `child`, which was split off
+    // its left sibling, to the inner node at height `level` that covers
+    // `sep`. No other locks are held while we look for that node.
+    void insertSeparator(Key sep, NodeBase *child, uint8_t level) {
+        int restartCount = 0;
+    restart:
+        if (restartCount++) yield(restartCount);
+        bool needRestart = false;
+
+        uint64_t versionNode;
+        NodeBase *node = findNode(sep, level, versionNode, needRestart);
+        if (needRestart) goto restart;
+
+        auto inner = static_cast<Inner *>(node);
+        node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+        if (needRestart) goto restart;
+
+        // Make room first. The separator may end up in the new node, so we
+        // look for the right node again.
+        if (inner->isFull()) {
+            splitNode(inner, sep);
+            goto restart;
+        }
+
+        inner->insert(sep, child);
+        node->writeUnlock();
+    }
+
+    // Depending on the value of `count`, either yield the processor to the OS
+    // scheduler or inform the processor you are waiting for a spin lock.
+    void yield(int count) {
+        if (count > 3)
+            sched_yield();
+        else
+            _mm_pause();
+    }
+
+    // Insert the (k, v) pair into the tree.
+    //
+    // Only the leaf is ever locked. If it is full, it is split, and the split
+    // propagates up the tree as far as needed (see `splitNode`).
+    void insert(Key k, Value v) {
+        if (insertBufferSize) {
+            bufferInsert(k, v);
+            return;
+        }
+        insertIntoTree(k, v);
+    }
+
+    // Insert (k, v) unless `k` is in the tree already. Returns true if it
+    // was inserted.
+    bool insert_if_absent(Key k, Value v) {
+        return modify(k, [&v](bool present, Value &value) {
+            if (!present) value = v;
+            return true;
+        });
+    }
+
+    // Set the value of `k` to `v` if `k` is in the tree. Returns true if it
+    // was.
+    bool update_if_present(Key k, Value v) {
+        bool found = false;
+        modify(k, [&v, &found](bool present, Value &value) {
+            if (present) value = v;
+            found = present;
+            return false;
+        });
+        return found;
+    }
+
+    // Set `result` to the value of `k`, or insert (k, v) and set `result` to
+    // `v` if `k` is not in the tree. Returns true if (k, v) was inserted.
+    bool get_or_insert(Key k, Value v, Value &result) {
+        return modify(k, [&v, &result](bool present, Value &value) {
+            if (!present) value = v;
+            result = value;
+            return true;
+        });
+    }
+
+    // Apply `fn` to the value of `k` in place, inserting `k` with a
+    // value-initialized value first if it is not in the tree. Returns true
+    // if `k` was inserted.
+    bool upsert(Key k, const std::function<void(Value &)> &fn) {
+        return modify(k, [&fn](bool, Value &value) {
+            fn(value);
+            return true;
+        });
+    }
+
+    // The core of the read-modify-write operations: call `fn(present,
+    // value)` exactly once, under the write lock of the node that holds the
+    // newest value of `k`. If `k` is there, `present` is true and `value` is
+    // that value, and whatever `fn` leaves in it is stored. Otherwise,
+    // `value` is value-initialized, and (k, value) is inserted if `fn`
+    // returns true. Returns true if it was.
+    //
+    // The tree is descended once. In a B-epsilon tree, the newest value may
+    // be a message on the way down, which is then changed in place. Entries
+    // for `k` in the insert buffers are moved into the tree first.
+    template <class Fn>
+    bool modify(Key k, Fn fn) {
+        common::epoch::Guard guard;
+        if (buffers.load()) drainBuffered(k);
+
+        int restartCount = 0;
+    restart:
+        if (restartCount++) yield(restartCount);
         bool needRestart = false;
 
-        // Current node
-        NodeBase *node = root;
-        uint64_t versionNode = node->readLockOrRestart(needRestart);
-        if (needRestart || (node != root)) goto restart;
+        NodeBase *node = root;
+        uint64_t versionNode = node->readLockOrRestart(needRestart);
+        if (needRestart || (node != root)) goto restart;
+
+        while (true) {
+            moveRight(node, versionNode, k, needRestart);
+            if (needRestart) goto restart;
+            if (node->type == PageType::BTreeLeaf) break;
+
+            auto inner = static_cast<Inner *>(node);
+            unsigned pos = inner->findMessage(k);
+            if (pos < inner->messages() && inner->messageKey(pos) == k) {
+                node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+                if (needRestart) goto restart;
+                Value v = inner->messagePayload(pos);
+                fn(true, v);
+                inner->putMessage(k, v);
+                node->writeUnlock();
+                return false;
+            }
+
+            NodeBase *child = inner->children[inner->lowerBound(k)];
+            inner->checkOrRestart(versionNode, needRestart);
+            if (needRestart) goto restart;
+            uint64_t versionChild = child->readLockOrRestart(needRestart);
+            if (needRestart) goto restart;
+            inner->readUnlockOrRestart(versionNode, needRestart);
+            if (needRestart) goto restart;
+
+            node = child;
+            versionNode = versionChild;
+        }
+
+        auto leaf = static_cast<Leaf *>(node);
+        node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+        if (needRestart) goto restart;
+        leaf->settle();
+
+        bool inserted = false;
+        unsigned pos = leaf->lowerBound(k);
+        if (pos < leaf->count && leaf->keys[pos] == k) {
+            fn(true, leaf->payloads[pos]);
+        } else {
+            Value v = Value();
+            if (fn(false, v)) {
+                // Only a real insert splits a full leaf. Nobody can get to
+                // the new leaf before `leaf` is unlocked, so (k, v) goes into
+                // the half for `k` right away.
+                if (leaf->isFull()) {
+                    Key sep;
+                    NodeBase *newNode = splitOff(leaf, k, sep);
+                    Leaf *half = k > sep ? static_cast<Leaf *>(newNode) : leaf;
+                    assert(!half->isFull());
+                    half->insert(k, v);
+                    finishSplit(leaf, sep, newNode);
+                    return true;
+                }
+                leaf->insert(k, v);
+                inserted = true;
+            }
+        }
+        if (flatCombining) combine(leaf);
+        if (appendMode && !leaf->next) leaf->openAppends();
+        node->writeUnlock();
+        return inserted;
+    }
+
+    // `insert` into the tree itself, bypassing the insert buffers.
+    void insertIntoTree(Key k, Value v) {
+        common::epoch::Guard guard;
+        if (bEpsilon && insertMessage(k, v)) return;
+
+        Path path;
+        int restartCount = 0;
+    restart:
+        if (restartCount++) yield(restartCount);
+        bool needRestart = false;
+
+        uint64_t versionNode;
+        uint32_t lowKeyVersion = 0;
+        NodeBase *node = nullptr;
+        if (useFinger && !bEpsilon && restartCount == 1) {
+            node = tryFinger(k, versionNode, path.fence);
+        }
+        if (!node) {
+            node = findNode(k, 0, versionNode, needRestart, &lowKeyVersion,
+                            &path);
+        }
+        if (needRestart) goto restart;
+
+        auto leaf = static_cast<Leaf *>(node);
+        if (appendMode && !node->isLocked(versionNode) &&
+            tryAppend(leaf, versionNode, path.fence, k, v)) {
+            return;
+        }
+        if (SegmentedLeaves && !node->isLocked(versionNode) &&
+            trySegmentInsert(leaf, versionNode, path.fence, k, v)) {
+            return;
+        }
+        if (node->isLocked(versionNode)) {
+            node->noteContention();
+
+            // If someone else is writing the leaf, let them do our insert,
+            // too.
+            if (flatCombining) {
+                if (publishInsert(leaf, lowKeyVersion, k, v)) return;
+                goto restart;
+            }
+
+            // If the leaf is hot, wait in line for its lock instead of
+            // restarting, and check that it is still the leaf for `k`.
+            if (!node->isHot()) goto restart;
+            versionNode = node->writeLockQueued(needRestart);
+            if (needRestart) goto restart;
+            if ((leaf->next && k > leaf->highKey) ||
+                leaf->lowKeyVersion != lowKeyVersion) {
+                node->writeUnlock();
+                goto restart;
+            }
+        } else {
+            node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+            if (needRestart) goto restart;
+        }
+        leaf->settle();
+        leaf->noteWrite(restartCount > 1);
+
+        // Split leaf if full, or if it is hot
+        if (leaf->isFull()) {
+            splitNode(leaf, k);
+            goto restart;
+        }
+        if (contentionSplits && leaf->isHot() && leaf->count >= 2 &&
+            leaf->count >= Leaf::maxEntries / hotSplitShare) {
+            splitHot(leaf);
+            goto restart;
+        }
+
+        leaf->insert(k, v);
+        if (flatCombining) combine(leaf);
+        if (useFinger) {
+            setFinger(leaf, path.fence, leaf->lowKeyVersion,
+                      common::epoch::manager().current());
+        }
+        if (appendMode && !leaf->next) leaf->openAppends();
+        bool cooled = contentionSplits && leaf->hasCooled(coolWrites);
+        bool prepare = needsPreparing(leaf, leaf->count);
+        node->writeUnlock();
+        if (cooled) mergeCooled(k);
+        if (prepare) prepareRightEdge(k);
+    }
+
+    // Returns true if `leaf`, which has `count` sorted and appended entries,
+    // is the rightmost leaf and needs a spare (see `preallocate`).
+    bool needsPreparing(Leaf *leaf, unsigned count) {
+        return preallocate && !leaf->next && count >= Leaf::maxEntries / 2 &&
+               !spareLeaf.load(std::memory_order_relaxed);
+    }
+
+    // Get the right edge ready for the split of the rightmost leaf, which
+    // holds `k` (see `preallocate`): allocate the spare leaf, and split the
+    // parent of the leaf if it is full, keeping all but its last child. This
+    // is only an optimization, so we give up instead of restarting.
+    void prepareRightEdge(Key k) {
+        if (!spareLeaf.load()) {
+            Leaf *spare = new Leaf();
+            Leaf *expected = nullptr;
+            if (!spareLeaf.compare_exchange_strong(expected, spare)) {
+                delete spare;
+            }
+        }
+
+        bool needRestart = false;
+        uint64_t versionNode;
+        NodeBase *node = findNode(k, 1, versionNode, needRestart);
+        if (needRestart) return;
+        auto inner = static_cast<Inner *>(node);
+        if (inner->next || !inner->isFull()) return;
+        node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+        if (needRestart) return;
+
+        Key sep;
+        NodeBase *newInner = inner->split(sep, inner->count);
+        finishSplit(inner, sep, newInner);
+    }
+
+    // Merge the leaf for `k`, a half of a hot split that has cooled down
+    // since (see `contentionSplits`), with a sibling if they fit into one
+    // leaf. This is only an optimization, so we give up instead of
+    // restarting.
+    void mergeCooled(Key k) {
+        bool needRestart = false;
+        uint64_t versionParent;
+        NodeBase *node = findNode(k, 1, versionParent, needRestart);
+        if (needRestart) return;
+
+        auto parent = static_cast<Inner *>(node);
+        if (parent->count == 0) return;
+        unsigned pos = parent->lowerBound(k);
+        NodeBase *child = parent->children[pos];
+        parent->checkOrRestart(versionParent, needRestart);
+        if (needRestart) return;
+        uint64_t versionChild = child->readLockOrRestart(needRestart);
+        if (needRestart || !static_cast<Leaf *>(child)->isHotSplit()) return;
+
+        rebalance(parent, versionParent, pos, child, versionChild, needRestart,
+                  true);
+    }
+
+    // Append (k, v) to the append region of `leaf` (see `appendMode`), which
+    // was read at the unlocked version `versionNode` and whose low fence is
+    // `fence`. Returns false if that is not possible, because `leaf` is not
+    // the rightmost leaf, `k` is not greater than its sorted entries, its
+    // region is closed or full, or it has changed since `versionNode`.
+    //
+    // All checks are done on `leaf` as of `versionNode`, so we validate it
+    // after reserving the slot. Until then, whoever locks the leaf closes the
+    // region and waits for our slot. If the leaf has changed, the slot might
+    // be in a region that was opened again after that, so we abandon it.
+    bool tryAppend(Leaf *leaf, uint64_t versionNode, const LowFence &fence,
+                   Key k, Value v) {
+        if (leaf->next || !leaf->appendsOpen() ||
+            (leaf->count && !(leaf->keys[leaf->count - 1] < k))) {
+            return false;
+        }
+        uint64_t epoch = useFinger ? common::epoch::manager().current() : 0;
+        uint32_t lowKeyVersion = leaf->lowKeyVersion;
+        bool needRestart = false;
+        leaf->checkOrRestart(versionNode, needRestart);
+        if (needRestart) return false;
+
+        unsigned slot = leaf->reserveSlot();
+        if (slot >= Leaf::maxEntries) return false;
+        leaf->checkOrRestart(versionNode, needRestart);
+        if (needRestart) {
+            leaf->abandon(slot);
+            return false;
+        }
+        leaf->keys[slot] = k;
+        leaf->payloads[slot] = v;
+        leaf->publish(slot);
+
+        if (useFinger) setFinger(leaf, fence, lowKeyVersion, epoch);
+        if (needsPreparing(leaf, slot + 1)) prepareRightEdge(k);
+        return true;
+    }
+
+    // Insert (k, v) into the segmented `leaf`, which was read at the
+    // unlocked version `versionNode` and whose low fence is `fence`, while
+    // only holding the lock of a single segment. That works if `k` is in the
+    // leaf already, or if it goes right after the last entry and there is
+    // room for it. Returns false if it does not work, or if the leaf has
+    // changed since `versionNode`.
+    //
+    // The leaf version is checked after locking the segment, and whoever
+    // locks the leaf waits for the segments after that (see
+    // `BTreeLeaf::settle`), so one of us always sees the other. Entries
+    // never move while a segment is locked, and only appenders change
+    // `count`, while holding the lock of the segment at index `count`.
+    bool trySegmentInsert(Leaf *leaf, uint64_t versionNode,
+                          const LowFence &fence, Key k, Value v) {
+        unsigned count = leaf->count;
+        unsigned pos = leaf->lowerBound(k);
+        bool update = pos < count && leaf->keys[pos] == k;
+        if (!update && (pos != count || count == Leaf::maxEntries ||
+                        leaf->appendsOpen())) {
+            return false;
+        }
+        uint64_t epoch = useFinger ? common::epoch::manager().current() : 0;
+        uint32_t lowKeyVersion = leaf->lowKeyVersion;
+
+        bool needRestart = false;
+        unsigned segment = pos / Leaf::segmentEntries;
+        uint32_t version = leaf->lockSegmentOrRestart(segment, needRestart);
+        if (needRestart) return false;
+        leaf->checkOrRestart(versionNode, needRestart);
+        if (needRestart || leaf->count != count) {
+            leaf->abortSegment(segment, version);
+            return false;
+        }
+
+        if (update) {
+            leaf->payloads[pos] = v;
+        } else {
+            leaf->keys[pos] = k;
+            leaf->payloads[pos] = v;
+            leaf->history.note(pos);
+
+            // Readers that see the new count must see the new entry.
+            std::atomic_thread_fence(std::memory_order_release);
+            leaf->count = count + 1;
+        }
+        leaf->unlockSegment(segment);
+
+        if (useFinger) setFinger(leaf, fence, lowKeyVersion, epoch);
+        if (!update && needsPreparing(leaf, count + 1)) prepareRightEdge(k);
+        return true;
+    }
+
+    // In a B-epsilon tree, put the insert of (k, v) into the buffer of the
+    // highest inner node on the way down that is not full or already has a
+    // message for `k`, and flush that buffer if it is full then (see
+    // `flushMessages`). Returns false if there is no such node; the caller
+    // inserts into the leaf then. Must be called inside a `Guard`.
+    //
+    // Messages only move down, or right when a node is split, so the newest
+    // entry for a key is always the one closest to the root. That's why we
+    // must not skip a buffer that has `k`, and why lookups go top-down.
+    bool insertMessage(Key k, Value v) {
+        int restartCount = 0;
+    restart:
+        if (restartCount++) yield(restartCount);
+        bool needRestart = false;
+
+        NodeBase *node = root;
+        uint64_t versionNode = node->readLockOrRestart(needRestart);
+        if (needRestart || (node != root)) goto restart;
+
+        while (node->type == PageType::BTreeInner) {
+            moveRight(node, versionNode, k, needRestart);
+            if (needRestart) goto restart;
+
+            auto inner = static_cast<Inner *>(node);
+            unsigned pos = inner->findMessage(k);
+            bool present =
+                pos < inner->messages() && inner->messageKey(pos) == k;
+            if (present || !inner->messagesFull()) {
+                node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+                if (needRestart) goto restart;
+                inner->putMessage(k, v);
+                if (inner->messagesFull()) {
+                    flushMessages(inner);
+                } else {
+                    node->writeUnlock();
+                }
+                return true;
+            }
+
+            NodeBase *child = inner->children[inner->lowerBound(k)];
+            inner->checkOrRestart(versionNode, needRestart);
+            if (needRestart) goto restart;
+            uint64_t versionChild = child->readLockOrRestart(needRestart);
+            if (needRestart) goto restart;
+            inner->readUnlockOrRestart(versionNode, needRestart);
+            if (needRestart) goto restart;
+
+            node = child;
+            versionNode = versionChild;
+        }
+        return false;
+    }
+
+    // Push the messages in the buffer of the write-locked inner `node` down
+    // to its children, and unlock it. Each child is locked once for all of
+    // its messages. A leaf takes as many as it has room for, after being
+    // split if it is full; an inner node takes as many as its buffer has
+    // room for. Children whose buffers are full afterwards are flushed in
+    // turn, once `node` is unlocked.
+    //
+    // If `node` has no room for the separator of a split child, it is split
+    // instead, which leaves both halves with room for more messages.
+    //
+    // We wait for the locks of the children while holding the lock of
+    // `node`. That is fine, as nobody waits for a lock while holding the
+    // lock of a child of its node.
+    //
+    // A child that turns out to be obsolete is on its way out of `node`,
+    // which only its merge can finish. We then unlock `node` and flush it
+    // again, so that its messages go to the node that took the child's
+    // entries over.
+    void flushMessages(Inner *node) {
+        std::vector<Inner *> full;
+        std::vector<std::pair<Key, Value>> entries;
+        bool retry = false;
+        unsigned i = 0;
+        while (i < node->messages()) {
+            // The messages routed to the same child.
+            Key k = node->messageKey(i);
+            unsigned pos = node->lowerBound(k);
+            unsigned end = i + 1;
+            while (end < node->messages() &&
+                   (pos == node->count ||
+                    !(node->keys[pos] < node->messageKey(end)))) {
+                end++;
+            }
+
+            NodeBase *child = node->children[pos];
+            bool needRestart = false;
+            child->writeLockQueued(needRestart);
+            if (needRestart) {
+                retry = true;
+                break;
+            }
+
+            // Messages for a right sibling that was split off the child but
+            // has no separator in `node` yet have to wait.
+            unsigned last = end;
+            if (child->next) {
+                last = i;
+                while (last < end &&
+                       !(highKeyOf(child) < node->messageKey(last))) {
+                    last++;
+                }
+            }
+
+            unsigned moved = 0;
+            if (child->type == PageType::BTreeLeaf) {
+                auto leaf = static_cast<Leaf *>(child);
+                leaf->settle();
+                if (leaf->isFull() && last > i) {
+                    if (node->isFull()) {
+                        child->writeUnlock();
+                        splitNode(node, k);
+                        node = nullptr;
+                        break;
+                    }
+                    Key sep;
+                    NodeBase *newNode = splitOff(leaf, k, sep);
+                    node->insert(sep, newNode);
+                    child->writeUnlock();
+                    continue;
+                }
+                moved = std::min<unsigned>(last - i,
+                                           Leaf::maxEntries - leaf->count);
+                entries.clear();
+                for (unsigned j = i; j < i + moved; ++j) {
+                    entries.push_back(std::make_pair(node->messageKey(j),
+                                                     node->messagePayload(j)));
+                }
+                mergeEntries(leaf, entries.data(), moved);
+            } else {
+                auto inner = static_cast<Inner *>(child);
+                while (i + moved < last) {
+                    Key key = node->messageKey(i + moved);
+                    unsigned at = inner->findMessage(key);
+                    if (inner->messagesFull() &&
+                        !(at < inner->messages() &&
+                          inner->messageKey(at) == key)) {
+                        break;
+                    }
+                    inner->putMessage(key, node->messagePayload(i + moved));
+                    moved++;
+                }
+                if (inner->messagesFull()) full.push_back(inner);
+            }
+            child->writeUnlock();
+
+            node->eraseMessages(i, moved);
+            i = end - moved;
+        }
+        if (node) node->writeUnlock();
+
+        if (retry) {
+            bool needRestart = false;
+            sched_yield();
+            node->writeLockOrRestart(needRestart);
+            if (!needRestart) {
+                if (node->messagesFull()) {
+                    flushMessages(node);
+                } else {
+                    node->writeUnlock();
+                }
+            }
+        }
+
+        for (Inner *child : full) {
+            bool needRestart = false;
+            child->writeLockOrRestart(needRestart);
+            if (needRestart) continue;
+            if (child->messagesFull()) {
+                flushMessages(child);
+            } else {
+                child->writeUnlock();
+            }
+        }
+    }
+
+    // The insert buffer of a thread (see `insertBufferSize`). Only the thread
+    // that owns it and `flushInsertBuffers` write it, while holding `writer`.
+    // Readers read it optimistically and validate `version`, which is bumped
+    // whenever the entries change. Entries are only removed from the buffer
+    // once they are in the tree, so readers check the buffers first.
+    struct InsertBuffer {
+        OptLock version;
+        std::mutex writer;
+
+        // The thread that owns the buffer. A thread that later gets the same
+        // id takes the buffer over.
+        const std::thread::id owner;
+
+        // The next buffer of the tree. Never changes once the buffer is
+        // visible.
+        InsertBuffer *next = nullptr;
+
+        // The entries, sorted by key.
+        const unsigned capacity;
+        unsigned count = 0;
+        std::pair<Key, Value> *entries;
+
+        explicit InsertBuffer(unsigned capacity)
+            : owner(std::this_thread::get_id()),
+              capacity(capacity),
+              entries(new std::pair<Key, Value>[capacity]) {}
+        ~InsertBuffer() { delete[] entries; }
+
+        // The index of the first entry whose key is not less than `k`.
+        unsigned lowerBound(Key k) {
+            return std::lower_bound(entries, entries + count, k,
+                                    [](const std::pair<Key, Value> &e,
+                                       Key k) { return e.first < k; }) -
+                   entries;
+        }
+    };
+
+    // The buffer the calling thread used last, and its tree.
+    struct BufferSlot {
+        uint64_t tree = 0;
+        InsertBuffer *buffer;
+    };
+
+    static BufferSlot &bufferSlot() {
+        static thread_local BufferSlot slot;
+        return slot;
+    }
+
+    // The insert buffer of the calling thread. It is created on first use.
+    InsertBuffer *ownBuffer() {
+        BufferSlot &slot = bufferSlot();
+        if (slot.tree == id) return slot.buffer;
+
+        std::thread::id self = std::this_thread::get_id();
+        InsertBuffer *buffer = buffers.load();
+        while (buffer && buffer->owner != self) buffer = buffer->next;
+        if (!buffer) {
+            buffer = new InsertBuffer(insertBufferSize);
+            buffer->next = buffers.load();
+            while (!buffers.compare_exchange_weak(buffer->next, buffer)) {
+            }
+        }
+        slot.tree = id;
+        slot.buffer = buffer;
+        return buffer;
+    }
+
+    // Add (k, v) to the insert buffer of the calling thread, and merge the
+    // buffer into the tree if that fills it up.
+    void bufferInsert(Key k, Value v) {
+        InsertBuffer *buffer = ownBuffer();
+
+        // The buffers are flushed in no particular order, so an older entry
+        // for `k` in another buffer could end up in the tree after ours.
+        // Move it into the tree now. It only leaves its buffer once it is in
+        // the tree, so lookups see one of the values all along.
+        for (InsertBuffer *other = buffers; other; other = other->next) {
+            Value old;
+            if (other != buffer && findBuffered(other, k, old)) {
+                drainBuffered(k);
+                break;
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(buffer->writer);
+
+        bool needRestart = false;
+        buffer->version.writeLockOrRestart(needRestart);
+        assert(!needRestart);
+        unsigned pos = buffer->lowerBound(k);
+        if (pos < buffer->count && buffer->entries[pos].first == k) {
+            buffer->entries[pos].second = v;
+        } else {
+            std::move_backward(buffer->entries + pos,
+                               buffer->entries + buffer->count,
+                               buffer->entries + buffer->count + 1);
+            buffer->entries[pos] = std::make_pair(k, v);
+            buffer->count++;
+        }
+        buffer->version.writeUnlock();
+
+        if (buffer->count == buffer->capacity) flushBuffer(buffer);
+    }
+
+    // Merge all entries of `buffer` into the tree and empty it. The caller
+    // must hold the `writer` lock of the buffer.
+    //
+    // In a B-epsilon tree, the entries have to go through the message
+    // buffers like any other insert.
+    void flushBuffer(InsertBuffer *buffer) {
+        common::epoch::Guard guard;
+
+        for (unsigned i = 0; i < buffer->count;) {
+            if (bEpsilon) {
+                insertIntoTree(buffer->entries[i].first,
+                               buffer->entries[i].second);
+                i++;
+            } else {
+                i += mergeIntoLeaf(buffer->entries + i, buffer->count - i);
+            }
+        }
+
+        bool needRestart = false;
+        buffer->version.writeLockOrRestart(needRestart);
+        assert(!needRestart);
+        buffer->count = 0;
+        buffer->version.writeUnlock();
+    }
+
+    // Merge the first of the `n` entries starting at `first`, which are
+    // sorted by key, into the leaf for its key, together with as many of the
+    // following ones as fit into that leaf. Returns how many were merged.
+    // The leaf is split first if it is full.
+    unsigned mergeIntoLeaf(const std::pair<Key, Value> *first, unsigned n) {
+        Path path;
+        int restartCount = 0;
+    restart:
+        if (restartCount++) yield(restartCount);
+        bool needRestart = false;
+
+        uint64_t versionNode;
+        NodeBase *node =
+            findNode(first->first, 0, versionNode, needRestart, nullptr, &path);
+        if (needRestart) goto restart;
+        auto leaf = static_cast<Leaf *>(node);
+        node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+        if (needRestart) goto restart;
+        leaf->settle();
+
+        if (leaf->isFull()) {
+            splitNode(leaf, first->first);
+            goto restart;
+        }
+
+        unsigned m = 0;
+        unsigned room = Leaf::maxEntries - leaf->count;
+        while (m < n && m < room &&
+               (!leaf->next || !(leaf->highKey < first[m].first))) {
+            m++;
+        }
+
+        mergeEntries(leaf, first, m);
+        node->writeUnlock();
+        return m;
+    }
+
+    // Merge the `n` entries starting at `first`, which are sorted by key,
+    // into the write-locked `leaf`, which must cover their keys and have
+    // room for them.
+    void mergeEntries(Leaf *leaf, const std::pair<Key, Value> *first,
+                      unsigned n) {
+        if (!n) return;
+
+        // Let the split policy know about entries appended to the end.
+        unsigned oldCount = leaf->count;
+        bool append = !oldCount || leaf->keys[oldCount - 1] < first->first;
+        leaf->count = common::bulk::mergeFromEnd(leaf->keys, leaf->payloads,
+                                                 oldCount, first, n);
+        if (append) {
+            for (unsigned pos = oldCount; pos < leaf->count; ++pos) {
+                leaf->history.note(pos);
+            }
+        }
+    }
+
+    // Merge the insert buffers of all threads into the tree. Entries that
+    // are inserted concurrently may stay in the buffers.
+    void flushInsertBuffers() {
+        for (InsertBuffer *buffer = buffers; buffer; buffer = buffer->next) {
+            std::lock_guard<std::mutex> lock(buffer->writer);
+            flushBuffer(buffer);
+        }
+    }
+
+    // If `k` is in some insert buffer, set `result` to its value and return
+    // true.
+    bool lookupBuffered(Key k, Value &result) {
+        for (InsertBuffer *buffer = buffers; buffer; buffer = buffer->next) {
+            if (findBuffered(buffer, k, result)) return true;
+        }
+        return false;
+    }
+
+    // If `k` is in `buffer`, set `result` to its value and return true. The
+    // buffer is read optimistically.
+    bool findBuffered(InsertBuffer *buffer, Key k, Value &result) {
+        while (true) {
+            bool needRestart = false;
+            uint64_t version = buffer->version.readLockOrRestart(needRestart);
+            if (needRestart) continue;
+            unsigned pos = buffer->lowerBound(k);
+            bool found =
+                pos < buffer->count && buffer->entries[pos].first == k;
+            if (found) result = buffer->entries[pos].second;
+            buffer->version.readUnlockOrRestart(version, needRestart);
+            if (!needRestart) return found;
+        }
+    }
+
+    // Remove `k` from all insert buffers. Returns true if it was in any.
+    bool removeBuffered(Key k) {
+        bool found = false;
+        for (InsertBuffer *buffer = buffers; buffer; buffer = buffer->next) {
+            std::lock_guard<std::mutex> lock(buffer->writer);
+            unsigned pos = buffer->lowerBound(k);
+            if (pos == buffer->count || buffer->entries[pos].first != k) {
+                continue;
+            }
+            eraseBuffered(buffer, pos);
+            found = true;
+        }
+        return found;
+    }
 
-        //if (node->type == PageType::BTreeInner && node->count > 0) {
-        //    auto inner = static_cast<BTreeInner<Key> *>(node);
+    // Move the entries for `k` from all insert buffers into the tree, so
+    // that the tree has its newest value. Each entry is inserted into the
+    // tree before it leaves its buffer, so that lookups always find one of
+    // them.
+    void drainBuffered(Key k) {
+        for (InsertBuffer *buffer = buffers; buffer; buffer = buffer->next) {
+            std::lock_guard<std::mutex> lock(buffer->writer);
+            unsigned pos = buffer->lowerBound(k);
+            if (pos == buffer->count || buffer->entries[pos].first != k) {
+                continue;
+            }
+            insertIntoTree(k, buffer->entries[pos].second);
+            eraseBuffered(buffer, pos);
+        }
+    }
 
-        //    std::cout << "root ";
-        //    for (int i = 0; i < node->count; ++i) {
-        //        std::cout << inner->keys[i] << " ";
-        //    }
-        //    std::cout << std::endl;
+    // Remove the entry at index `pos` from `buffer`. The caller must hold
+    // the `writer` lock of the buffer.
+    void eraseBuffered(InsertBuffer *buffer, unsigned pos) {
+        bool needRestart = false;
+        buffer->version.writeLockOrRestart(needRestart);
+        assert(!needRestart);
+        std::move(buffer->entries + pos + 1, buffer->entries + buffer->count,
+                  buffer->entries + pos);
+        buffer->count--;
+        buffer->version.writeUnlock();
+    }
 
-        //    std::cout << inner->keys[0] << std::endl;
-        //    std::cout << inner->keys[1] << std::endl;
-        //    std::cout << inner->keys[inner->count - 1] << std::endl;
-        //} else {
-        //    std::cout << "no children" << std::endl;
-        //}
+    // The (at most) `range` least entries with keys not less than `k` in all
+    // insert buffers, sorted by key.
+    std::vector<std::pair<Key, Value>> scanBuffered(Key k, int range) {
+        std::vector<std::pair<Key, Value>> result;
+        std::vector<std::pair<Key, Value>> entries;
+        for (InsertBuffer *buffer = buffers; buffer; buffer = buffer->next) {
+            while (true) {
+                bool needRestart = false;
+                uint64_t version = buffer->version.readLockOrRestart(needRestart);
+                if (needRestart) continue;
+                // `count` may change under us, but must not drop below `pos`.
+                unsigned pos = buffer->lowerBound(k);
+                unsigned end =
+                    std::max(pos, std::min(buffer->count, pos + range));
+                entries.assign(buffer->entries + pos, buffer->entries + end);
+                buffer->version.readUnlockOrRestart(version, needRestart);
+                if (!needRestart) break;
+            }
 
-        // Parent of current node
-        BTreeInner<Key> *parent = nullptr;
-        uint64_t versionParent = 0;
+            size_t mid = result.size();
+            result.insert(result.end(), entries.begin(), entries.end());
+            std::inplace_merge(result.begin(), result.begin() + mid,
+                               result.end(),
+                               [](const std::pair<Key, Value> &a,
+                                  const std::pair<Key, Value> &b) {
+                                   return a.first < b.first;
+                               });
+            if (result.size() > size_t(range)) result.resize(range);
+        }
+        return result;
+    }
 
-        while (node->type == PageType::BTreeInner) {
-            auto inner = static_cast<BTreeInner<Key> *>(node);
-
-            // Split eagerly if full
-            if (inner->isFull()) {
-                // Lock
-                if (parent) {
-                    parent->upgradeToWriteLockOrRestart(versionParent,
-                                                        needRestart);
-                    if (needRestart) goto restart;
-                }
-                node->upgradeToWriteLockOrRestart(versionNode, needRestart);
-                if (needRestart) {
-                    if (parent) parent->writeUnlock();
-                    goto restart;
+    // The max number of times the holder of a leaf lock goes through the
+    // publication list of the leaf before it lets go of the lock.
+    static const int combineRounds = 4;
+
+    // Apply the inserts published to the write-locked `leaf`. Inserts that
+    // cannot be applied are rejected, and their threads retry them.
+    void combine(Leaf *leaf) {
+        typedef typename Leaf::Publication Publication;
+        for (int round = 0; round < combineRounds; ++round) {
+            Publication *pub = leaf->takePublications();
+            if (!pub) return;
+            while (pub) {
+                Publication *next = pub->next;
+
+                // The key must still be in the range of the leaf, and the
+                // leaf must have room for it. Splits are left to the normal
+                // insert path.
+                bool fits = (!leaf->next || pub->k <= leaf->highKey) &&
+                            pub->lowKeyVersion == leaf->lowKeyVersion &&
+                            !leaf->isFull();
+                if (fits) {
+                    leaf->insert(pub->k, pub->p);
                 }
-                if (!parent && (node != root)) {  // there's a new parent
-                    node->writeUnlock();
-                    goto restart;
+                pub->status.store(fits ? Publication::Done
+                                       : Publication::Retry);
+                pub = next;
+            }
+        }
+    }
+
+    // Reject all inserts published to `leaf`, which is obsolete.
+    void rejectPublications(Leaf *leaf) {
+        typedef typename Leaf::Publication Publication;
+        Publication *pub = leaf->takePublications();
+        while (pub) {
+            Publication *next = pub->next;
+            pub->status.store(Publication::Retry);
+            pub = next;
+        }
+    }
+
+    // Publish the insert of (k, v) to `leaf` and wait for a holder of the
+    // write lock to apply it. `lowKeyVersion` is the `lowKeyVersion` of the
+    // leaf when `k` was known to be in its range. Returns false if the insert
+    // was rejected and needs to be retried.
+    //
+    // If the lock is released without our insert being applied, we grab it
+    // and apply the published inserts ourselves. If the leaf becomes
+    // obsolete, nobody will ever apply them, so we reject them all.
+    bool publishInsert(Leaf *leaf, uint32_t lowKeyVersion, Key k, Value v) {
+        typedef typename Leaf::Publication Publication;
+        Publication pub;
+        pub.k = k;
+        pub.p = v;
+        pub.lowKeyVersion = lowKeyVersion;
+        pub.status.store(Publication::Pending, std::memory_order_relaxed);
+        leaf->pushPublication(&pub);
+
+        for (int spins = 0;; ++spins) {
+            uint8_t status = pub.status.load();
+            if (status != Publication::Pending) {
+                return status == Publication::Done;
+            }
+
+            uint64_t version = leaf->typeVersionLockObsolete.load();
+            if (leaf->isObsolete(version)) {
+                rejectPublications(leaf);
+            } else if (!leaf->isLocked(version)) {
+                bool needRestart = false;
+                leaf->upgradeToWriteLockOrRestart(version, needRestart);
+                if (!needRestart) {
+                    leaf->settle();
+                    combine(leaf);
+                    leaf->writeUnlock();
                 }
-                // Split
-                Key sep;
-                BTreeInner<Key> *newInner = inner->split(sep);
-                if (parent)
-                    parent->insert(sep, newInner);
-                else
-                    makeRoot(sep, inner, newInner);
-                // Unlock and restart
-                node->writeUnlock();
-                if (parent) parent->writeUnlock();
-                goto restart;
+            } else if (spins < 128) {
+                _mm_pause();
+            } else {
+                sched_yield();
             }
+        }
+    }
+
+    // Remove key `k` and its value from the btree. Returns true if `k` was in
+    // the btree.
+    bool remove(Key k) {
+        // The buffers go first, as entries leave them only once they are in
+        // the tree. Likewise, messages go before the leaves.
+        bool buffered = buffers.load() && removeBuffered(k);
+        bool message = bEpsilon && removeMessages(k);
+        return removeFromTree(k) || buffered || message;
+    }
+
+    // Remove the messages for `k` from the buffers of a B-epsilon tree,
+    // top-down. Returns true if there were any.
+    bool removeMessages(Key k) {
+        common::epoch::Guard guard;
+
+        bool found = false;
+        int restartCount = 0;
+    restart:
+        if (restartCount++) yield(restartCount);
+        bool needRestart = false;
+
+        NodeBase *node = root;
+        uint64_t versionNode = node->readLockOrRestart(needRestart);
+        if (needRestart || (node != root)) goto restart;
+
+        while (node->type == PageType::BTreeInner) {
+            moveRight(node, versionNode, k, needRestart);
+            if (needRestart) goto restart;
 
-            if (parent) {
-                parent->readUnlockOrRestart(versionParent, needRestart);
+            // Start over after each removal, as the message may have been
+            // pushed down again in the meantime.
+            auto inner = static_cast<Inner *>(node);
+            unsigned pos = inner->findMessage(k);
+            if (pos < inner->messages() && inner->messageKey(pos) == k) {
+                node->upgradeToWriteLockOrRestart(versionNode, needRestart);
                 if (needRestart) goto restart;
+                inner->eraseMessages(pos, 1);
+                node->writeUnlock();
+                found = true;
+                goto restart;
             }
 
-            parent = inner;
-            versionParent = versionNode;
-
-            node = inner->children[inner->lowerBound(k)];
+            NodeBase *child = inner->children[inner->lowerBound(k)];
             inner->checkOrRestart(versionNode, needRestart);
             if (needRestart) goto restart;
-            versionNode = node->readLockOrRestart(needRestart);
+            uint64_t versionChild = child->readLockOrRestart(needRestart);
             if (needRestart) goto restart;
+            inner->readUnlockOrRestart(versionNode, needRestart);
+            if (needRestart) goto restart;
+
+            node = child;
+            versionNode = versionChild;
         }
+        return found;
+    }
+
+    // Remove key `k` and its value from the tree itself, ignoring the insert
+    // buffers.
+    //
+    // Underfull nodes are merged (or redistributed) eagerly on the way down.
+    // This guarantees that the parent of the leaf never underflows as a
+    // result of the removal, so we only ever hold the locks of one parent and
+    // two children.
+    bool removeFromTree(Key k) {
+        common::epoch::Guard guard;
 
-        auto leaf = static_cast<BTreeLeaf<Key, Value> *>(node);
+        // Cleared if a rebalance had to be skipped because of a split that
+        // has not been posted to the parent yet. We don't wait for it.
+        bool allowRebalance = true;
 
-        // Split leaf if full
-        if (leaf->count == leaf->maxEntries) {
-            // Lock
-            if (parent) {
-                parent->upgradeToWriteLockOrRestart(versionParent, needRestart);
-                if (needRestart) goto restart;
-            }
+        int restartCount = 0;
+    restart:
+        if (restartCount++) yield(restartCount);
+        bool needRestart = false;
+
+        // Current node
+        NodeBase *node = root;
+        uint64_t versionNode = node->readLockOrRestart(needRestart);
+        if (needRestart || (node != root)) goto restart;
+
+        // If the root is an inner node with a single child, that child
+        // becomes the new root. Not while the child has a right sibling,
+        // though: its separator still has to be posted to the root.
+        if (node->type == PageType::BTreeInner && node->count == 0) {
             node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+            if (needRestart) goto restart;
+            if (node != root) {  // there's a new root
+                node->writeUnlock();
+                goto restart;
+            }
+            // The messages of the root go down to the child first.
+            if (hasMessages(node)) {
+                flushMessages(static_cast<Inner *>(node));
+                goto restart;
+            }
+            NodeBase *child = static_cast<Inner *>(node)->children[0];
+            child->writeLockOrRestart(needRestart);
             if (needRestart) {
-                if (parent) parent->writeUnlock();
+                node->writeUnlock();
                 goto restart;
             }
-            if (!parent && (node != root)) {  // there's a new parent
+            if (child->next) {
+                child->writeUnlock();
                 node->writeUnlock();
                 goto restart;
             }
-            // Split
-            Key sep;
-            BTreeLeaf<Key, Value> *newLeaf = leaf->split(sep);
-            if (parent)
-                parent->insert(sep, newLeaf);
-            else
-                makeRoot(sep, leaf, newLeaf);
-            // Unlock and restart
-            node->writeUnlock();
-            if (parent) parent->writeUnlock();
+            root = child;
+            child->writeUnlock();
+            node->writeUnlockObsolete();
+            retireNode(node);
             goto restart;
-        } else {
-            // only lock leaf node
-            node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+        }
+
+        // Parent of current node
+        Inner *parent = nullptr;
+        uint64_t versionParent = 0;
+        unsigned pos = 0;
+
+        while (true) {
+            bool movedRight = moveRight(node, versionNode, k, needRestart);
             if (needRestart) goto restart;
-            if (parent) {
-                parent->readUnlockOrRestart(versionParent, needRestart);
-                if (needRestart) {
-                    node->writeUnlock();
-                    goto restart;
+
+            // Rebalance eagerly if underfull. If we had to move right, `node`
+            // is not a child of `parent` yet.
+            if (parent && !movedRight && allowRebalance &&
+                parent->count > 0 && isUnderfull(node)) {
+                if (!rebalance(parent, versionParent, pos, node, versionNode,
+                               needRestart) &&
+                    !needRestart) {
+                    allowRebalance = false;
+                }
+                goto restart;
+            }
+
+            if (node->type == PageType::BTreeLeaf) break;
+
+            auto inner = static_cast<Inner *>(node);
+            pos = inner->lowerBound(k);
+            NodeBase *child = inner->children[pos];
+            inner->checkOrRestart(versionNode, needRestart);
+            if (needRestart) goto restart;
+            uint64_t versionChild = child->readLockOrRestart(needRestart);
+            if (needRestart) goto restart;
+            inner->readUnlockOrRestart(versionNode, needRestart);
+            if (needRestart) goto restart;
+
+            parent = inner;
+            versionParent = versionNode;
+            node = child;
+            versionNode = versionChild;
+        }
+
+        // only lock leaf node
+        auto leaf = static_cast<Leaf *>(node);
+        node->upgradeToWriteLockOrRestart(versionNode, needRestart);
+        if (needRestart) goto restart;
+        leaf->settle();
+        unsigned leafPos = leaf->lowerBound(k);
+        bool found = (leafPos < leaf->count) && (leaf->keys[leafPos] == k);
+        if (found) {
+            leaf->removeAt(leafPos);
+        }
+        node->writeUnlock();
+        return found;
+    }
+
+    // The number of lookups that `lookup_batch` interleaves.
+    static const size_t batchGroupSize = 16;
+
+    // The state of one lookup in `lookup_batch`: the node we are about to
+    // visit (already prefetched) and the node we came from, either its parent
+    // or its left sibling.
+    struct BatchLookup {
+        NodeBase *node;
+        NodeBase *prev;
+        uint64_t versionPrev;
+        bool done;
+    };
+
+    // Prefetch the cache lines of `node` that a search is going to touch
+    // first: the header and the middle of the keys. We don't know yet whether
+    // `node` is a leaf or an inner node, so we prefetch the middle of both.
+    static void prefetchNode(NodeBase *node) {
+        auto leaf = static_cast<Leaf *>(node);
+        auto inner = static_cast<Inner *>(node);
+        __builtin_prefetch(node);
+        __builtin_prefetch(&leaf->keys[leaf->maxEntries / 2]);
+        __builtin_prefetch(&inner->keys[inner->maxEntries / 2]);
+    }
+
+    // (Re)start the lookup `s` at the root.
+    void batchRestart(BatchLookup &s) {
+        s.node = root;
+        s.prev = nullptr;
+        s.versionPrev = 0;
+        prefetchNode(s.node);
+    }
+
+    // Advance the lookup `s` for key `k` by one node. The node of `s` should
+    // have been prefetched by the previous step. If the lookup reaches its
+    // leaf, set `result` and `found` and mark it done. If some version check
+    // fails, the lookup is restarted from the root.
+    void batchStep(BatchLookup &s, Key k, Value &result, bool &found) {
+        bool needRestart = false;
+        NodeBase *node = s.node;
+        uint64_t versionNode = node->readLockOrRestart(needRestart);
+        if (needRestart || (!s.prev && node != root)) {
+            batchRestart(s);
+            return;
+        }
+
+        // Make sure `node` was still reachable from the previous node when we
+        // read its version.
+        if (s.prev) {
+            s.prev->readUnlockOrRestart(s.versionPrev, needRestart);
+            if (needRestart) {
+                batchRestart(s);
+                return;
+            }
+        }
+
+        // Move right if `node` was split after we read the pointer to it, or
+        // descend.
+        NodeBase *next = nullptr;
+        if (node->next && k > highKeyOf(node)) {
+            next = node->next;
+        } else if (node->type == PageType::BTreeInner) {
+            auto inner = static_cast<Inner *>(node);
+            next = inner->children[inner->lowerBound(k)];
+        }
+        if (next) {
+            node->checkOrRestart(versionNode, needRestart);
+            if (needRestart) {
+                batchRestart(s);
+                return;
+            }
+            prefetchNode(next);
+            s.prev = node;
+            s.versionPrev = versionNode;
+            s.node = next;
+            return;
+        }
+
+        auto leaf = static_cast<Leaf *>(node);
+        unsigned pos = leaf->lowerBound(k);
+        bool success = false;
+        Value v = Value();
+        if ((pos < leaf->count) && (leaf->keys[pos] == k)) {
+            success = true;
+            if (!leaf->loadEntries(pos, pos + 1, &v, nullptr)) {
+                batchRestart(s);
+                return;
+            }
+        } else {
+            success = leaf->findAppended(k, v);
+        }
+        node->readUnlockOrRestart(versionNode, needRestart);
+        if (needRestart) {
+            batchRestart(s);
+            return;
+        }
+
+        found = success;
+        if (success) result = v;
+        s.done = true;
+    }
+
+    // Lookup the `n` keys in `keys`. For each `i`, set `found[i]` and
+    // `results[i]` as `lookup(keys[i], results[i])` would.
+    //
+    // The lookups are done in groups of `batchGroupSize`. Within a group, we
+    // advance each lookup by one level in a round-robin fashion and prefetch
+    // the next node of each one before moving on to the next lookup. Thus,
+    // the cache misses of all lookups in a group overlap instead of being
+    // serialized. Each lookup still validates versions like `lookup` does and
+    // restarts on its own when a validation fails.
+    void lookup_batch(const Key *keys, size_t n, Value *results, bool *found) {
+        if (buffers.load() || bEpsilon) {
+            for (size_t i = 0; i < n; ++i) {
+                found[i] = lookup(keys[i], results[i]);
+            }
+            return;
+        }
+
+        common::epoch::Guard guard;
+
+        BatchLookup state[batchGroupSize];
+        for (size_t start = 0; start < n; start += batchGroupSize) {
+            const size_t m =
+                n - start < batchGroupSize ? n - start : batchGroupSize;
+            for (size_t i = 0; i < m; ++i) {
+                state[i].done = false;
+                batchRestart(state[i]);
+            }
+
+            size_t remaining = m;
+            while (remaining > 0) {
+                for (size_t i = 0; i < m; ++i) {
+                    if (state[i].done) continue;
+                    batchStep(state[i], keys[start + i], results[start + i],
+                              found[start + i]);
+                    if (state[i].done) remaining--;
                 }
             }
-            leaf->insert(k, v);
-            node->writeUnlock();
-            return;  // success
         }
     }
 
@@ -490,6 +3176,53 @@ struct BTree : public common::BTreeBase<Key, Value> {
     // value associated with `k` and return true. If `k` is not in the btree,
     // return false.
     bool lookup(Key k, Value &result) {
+        if (buffers.load() && lookupBuffered(k, result)) return true;
+        if (bEpsilon) return lookupMessages(k, result);
+
+        common::epoch::Guard guard;
+
+        Path path;
+        int restartCount = 0;
+    restart:
+        if (restartCount++) yield(restartCount);
+        bool needRestart = false;
+
+        uint64_t versionNode;
+        NodeBase *node = nullptr;
+        if (useFinger && restartCount == 1) {
+            node = tryFinger(k, versionNode, path.fence);
+        }
+        if (!node) {
+            node = findNode(k, 0, versionNode, needRestart, nullptr, &path);
+        }
+        if (needRestart) goto restart;
+
+        Leaf *leaf = static_cast<Leaf *>(node);
+        unsigned pos = leaf->lowerBound(k);
+        bool success = false;
+        if ((pos < leaf->count) && (leaf->keys[pos] == k)) {
+            success = true;
+            if (!leaf->loadEntries(pos, pos + 1, &result, nullptr)) {
+                goto restart;
+            }
+        } else {
+            success = leaf->findAppended(k, result);
+        }
+        uint64_t epoch = useFinger ? common::epoch::manager().current() : 0;
+        uint32_t lowKeyVersion = leaf->lowKeyVersion;
+        node->readUnlockOrRestart(versionNode, needRestart);
+        if (needRestart) goto restart;
+
+        if (useFinger) setFinger(leaf, path.fence, lowKeyVersion, epoch);
+        return success;
+    }
+
+    // `lookup` in a B-epsilon tree: the first message for `k` on the way
+    // down is the newest entry for it, and if there is none, the leaf has
+    // it.
+    bool lookupMessages(Key k, Value &result) {
+        common::epoch::Guard guard;
+
         int restartCount = 0;
     restart:
         if (restartCount++) yield(restartCount);
@@ -499,98 +3232,264 @@ struct BTree : public common::BTreeBase<Key, Value> {
         uint64_t versionNode = node->readLockOrRestart(needRestart);
         if (needRestart || (node != root)) goto restart;
 
-        // Parent of current node
-        BTreeInner<Key> *parent = nullptr;
-        uint64_t versionParent = 0;
-
-        while (node->type == PageType::BTreeInner) {
-            auto inner = static_cast<BTreeInner<Key> *>(node);
+        while (true) {
+            moveRight(node, versionNode, k, needRestart);
+            if (needRestart) goto restart;
+            if (node->type == PageType::BTreeLeaf) break;
 
-            if (parent) {
-                parent->readUnlockOrRestart(versionParent, needRestart);
+            auto inner = static_cast<Inner *>(node);
+            unsigned pos = inner->findMessage(k);
+            if (pos < inner->messages() && inner->messageKey(pos) == k) {
+                Value v = inner->messagePayload(pos);
+                inner->readUnlockOrRestart(versionNode, needRestart);
                 if (needRestart) goto restart;
+                result = v;
+                return true;
             }
 
-            parent = inner;
-            versionParent = versionNode;
-
-            node = inner->children[inner->lowerBound(k)];
+            NodeBase *child = inner->children[inner->lowerBound(k)];
             inner->checkOrRestart(versionNode, needRestart);
             if (needRestart) goto restart;
-            versionNode = node->readLockOrRestart(needRestart);
+            uint64_t versionChild = child->readLockOrRestart(needRestart);
             if (needRestart) goto restart;
+            inner->readUnlockOrRestart(versionNode, needRestart);
+            if (needRestart) goto restart;
+
+            node = child;
+            versionNode = versionChild;
         }
 
-        BTreeLeaf<Key, Value> *leaf =
-            static_cast<BTreeLeaf<Key, Value> *>(node);
+        Leaf *leaf = static_cast<Leaf *>(node);
         unsigned pos = leaf->lowerBound(k);
-        bool success;
+        bool success = false;
+        Value v = Value();
         if ((pos < leaf->count) && (leaf->keys[pos] == k)) {
             success = true;
-            result = leaf->payloads[pos];
-        }
-        if (parent) {
-            parent->readUnlockOrRestart(versionParent, needRestart);
-            if (needRestart) goto restart;
+            if (!leaf->loadEntries(pos, pos + 1, &v, nullptr)) goto restart;
+        } else {
+            success = leaf->findAppended(k, v);
         }
         node->readUnlockOrRestart(versionNode, needRestart);
         if (needRestart) goto restart;
 
+        if (success) result = v;
         return success;
     }
 
     // Do a range query on the btree. Starting with the least key greater than
     // or equal to `k`, scan at most `range` values into the buffer pointed to
-    // by `output`. Return the number of elements read. Note that we may read
-    // fewer than `range` elements even if there are more elements that we
-    // could scan.  The caller should keep calling `scan` until no records are
-    // read.
+    // by `output`. Return the number of elements read. The scan follows the
+    // right sibling pointers across leaves, so fewer than `range` elements
+    // are only read if the end of the tree is reached.
+    //
+    // What was read from leaves that have been validated is kept across
+    // restarts; the scan resumes after the high key of the last of them.
     uint64_t scan(Key k, int range, Value *output) {
+        if (!buffers.load() && !bEpsilon) {
+            return scanLeaves(k, range, output, nullptr);
+        }
+
+        // The buffers go first, as entries leave them only once they are in
+        // the tree. Of entries with the same key, the one in a buffer is
+        // newer.
+        std::vector<std::pair<Key, Value>> entries;
+        if (buffers.load()) entries = scanBuffered(k, range);
+        mergeOlder(entries, scanTree(k, range), range);
+        for (size_t i = 0; i < entries.size(); ++i) {
+            output[i] = entries[i].second;
+        }
+        return entries.size();
+    }
+
+    // Merge the `older` entries into `entries`, keeping at most the first
+    // `range`. Both are sorted by key. Of entries with the same key, only
+    // the first one in `entries`, or else in `older`, is kept.
+    static void mergeOlder(std::vector<std::pair<Key, Value>> &entries,
+                           const std::vector<std::pair<Key, Value>> &older,
+                           int range) {
+        std::vector<std::pair<Key, Value>> merged;
+        size_t i = 0, j = 0;
+        while (merged.size() < size_t(range) &&
+               (i < entries.size() || j < older.size())) {
+            bool newer = j == older.size() ||
+                         (i < entries.size() &&
+                          !(older[j].first < entries[i].first));
+            const std::pair<Key, Value> &e = newer ? entries[i++] : older[j++];
+            if (merged.empty() || merged.back().first < e.first) {
+                merged.push_back(e);
+            }
+        }
+        entries.swap(merged);
+    }
+
+    // `scan` on the tree itself, ignoring the insert buffers. Returns the
+    // entries, sorted by key.
+    //
+    // In a B-epsilon tree, the messages of each level are merged with the
+    // entries of the levels below. Messages only move down (or right), so
+    // reading the levels top-down, and the leaves last, we see every entry
+    // that was in the tree when we started. The leaves are scanned once
+    // before, too: there is no need to look at messages beyond the last key
+    // we got from them. If the leaves have lost entries by the time we look
+    // again, and we end up beyond that key after all, we start over.
+    std::vector<std::pair<Key, Value>> scanTree(Key k, int range) {
+        if (!bEpsilon) return leafEntries(k, range);
+
+        while (true) {
+            auto first = leafEntries(k, range);
+            bool bounded = !first.empty() && first.size() == size_t(range);
+            const Key *bound = bounded ? &first.back().first : nullptr;
+
+            std::vector<std::pair<Key, Value>> entries;
+            for (int level = root.load()->level; level > 0; --level) {
+                mergeOlder(entries, scanMessages(k, range, level, bound),
+                           range);
+            }
+            mergeOlder(entries, leafEntries(k, range), range);
+
+            if (!bounded || entries.empty() ||
+                !(*bound < entries.back().first)) {
+                return entries;
+            }
+        }
+    }
+
+    // The (at most) `range` least messages with keys not less than `k` in
+    // the buffers of the inner nodes at height `level`, sorted by key. If
+    // `bound` is given, we stop at the first node that covers it.
+    std::vector<std::pair<Key, Value>> scanMessages(Key k, int range,
+                                                    int level,
+                                                    const Key *bound) {
+        common::epoch::Guard guard;
+
+        std::vector<std::pair<Key, Value>> result;
         int restartCount = 0;
     restart:
         if (restartCount++) yield(restartCount);
         bool needRestart = false;
+        result.clear();
 
-        NodeBase *node = root;
-        uint64_t versionNode = node->readLockOrRestart(needRestart);
-        if (needRestart || (node != root)) goto restart;
-
-        // Parent of current node
-        BTreeInner<Key> *parent = nullptr;
-        uint64_t versionParent = 0;
-
-        while (node->type == PageType::BTreeInner) {
-            auto inner = static_cast<BTreeInner<Key> *>(node);
+        // The tree may have shrunk since the caller looked.
+        if (root.load()->level < level) return result;
+        uint64_t versionNode;
+        NodeBase *node = findNode(k, level, versionNode, needRestart);
+        if (needRestart) goto restart;
 
-            if (parent) {
-                parent->readUnlockOrRestart(versionParent, needRestart);
-                if (needRestart) goto restart;
+        while (true) {
+            auto inner = static_cast<Inner *>(node);
+            for (unsigned i = inner->findMessage(k);
+                 i < inner->messages() && result.size() < size_t(range);
+                 ++i) {
+                result.push_back(std::make_pair(inner->messageKey(i),
+                                                inner->messagePayload(i)));
             }
 
-            parent = inner;
-            versionParent = versionNode;
-
-            node = inner->children[inner->lowerBound(k)];
+            NodeBase *next = node->next;
+            if (result.size() == size_t(range) || !next ||
+                (bound && !(inner->highKey < *bound))) {
+                break;
+            }
             inner->checkOrRestart(versionNode, needRestart);
             if (needRestart) goto restart;
-            versionNode = node->readLockOrRestart(needRestart);
+            uint64_t versionNext = next->readLockOrRestart(needRestart);
             if (needRestart) goto restart;
+            inner->readUnlockOrRestart(versionNode, needRestart);
+            if (needRestart) goto restart;
+
+            node = next;
+            versionNode = versionNext;
         }
 
-        BTreeLeaf<Key, Value> *leaf =
-            static_cast<BTreeLeaf<Key, Value> *>(node);
-        unsigned pos = leaf->lowerBound(k);
-        int count = 0;
-        for (unsigned i = pos; i < leaf->count; i++) {
-            if (count == range) break;
-            output[count++] = leaf->payloads[i];
+        node->readUnlockOrRestart(versionNode, needRestart);
+        if (needRestart) goto restart;
+        return result;
+    }
+
+    // `scanLeaves` into a vector of entries.
+    std::vector<std::pair<Key, Value>> leafEntries(Key k, int range) {
+        std::vector<Key> keys(range);
+        std::vector<Value> values(range);
+        uint64_t n = scanLeaves(k, range, values.data(), keys.data());
+        std::vector<std::pair<Key, Value>> entries;
+        for (uint64_t i = 0; i < n; ++i) {
+            entries.push_back(std::make_pair(keys[i], values[i]));
+        }
+        return entries;
+    }
+
+    // `scan` on the leaves only, ignoring the insert buffers and messages.
+    // If `keys` is given, the keys of the values are stored there.
+    uint64_t scanLeaves(Key k, int range, Value *output, Key *keys) {
+        common::epoch::Guard guard;
+
+        Path path;
+        std::vector<typename Leaf::Entry> appended;
+        int done = 0;
+        Key from = k;
+        bool fromExclusive = false;
+        int restartCount = 0;
+    restart:
+        if (restartCount++) yield(restartCount);
+        bool needRestart = false;
+
+        // The resumed scan looks for a greater key than the path was built
+        // for, which is fine: the descent moves right as needed.
+        uint64_t versionNode;
+        NodeBase *node =
+            findNode(from, 0, versionNode, needRestart, nullptr, &path);
+        if (needRestart) goto restart;
+
+        Leaf *leaf = static_cast<Leaf *>(node);
+        unsigned pos = leaf->lowerBound(from);
+        if (fromExclusive && pos < leaf->count && leaf->keys[pos] == from) {
+            pos++;
         }
+        int count = done;
+        while (true) {
+            unsigned end = std::min<unsigned>(leaf->count, pos + range - count);
+            if (pos < end) {
+                if (!leaf->loadEntries(pos, end, output + count,
+                                       keys ? keys + count : nullptr)) {
+                    goto restart;
+                }
+                count += end - pos;
+            }
+
+            // Only the rightmost leaf has an append region. What we read
+            // from it is kept in `appended` until the leaf is validated.
+            NodeBase *next = leaf->next;
+            if (!next && count < range && leaf->appendsOpen()) {
+                appended.resize(Leaf::maxEntries);
+                unsigned n = leaf->collectAppended(from, fromExclusive,
+                                                   appended.data());
+                for (unsigned i = 0; i < n && count < range; i++) {
+                    if (keys) keys[count] = appended[i].k;
+                    output[count++] = appended[i].p;
+                }
+            }
 
-        if (parent) {
-            parent->readUnlockOrRestart(versionParent, needRestart);
+            // Continue with the right sibling, coupling the optimistic locks
+            // like on the way down.
+            if (count == range || !next) break;
+            Key highKey = leaf->highKey;
+            leaf->checkOrRestart(versionNode, needRestart);
+            if (needRestart) goto restart;
+            uint64_t versionNext = next->readLockOrRestart(needRestart);
+            if (needRestart) goto restart;
+            leaf->readUnlockOrRestart(versionNode, needRestart);
             if (needRestart) goto restart;
+
+            // Everything up to the high key of the leaf is final.
+            done = count;
+            from = highKey;
+            fromExclusive = true;
+
+            leaf = static_cast<Leaf *>(next);
+            versionNode = versionNext;
+            pos = 0;
         }
-        node->readUnlockOrRestart(versionNode, needRestart);
+
+        leaf->readUnlockOrRestart(versionNode, needRestart);
         if (needRestart) goto restart;
 
         return count;
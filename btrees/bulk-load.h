@@ -0,0 +1,240 @@
+#ifndef _BTREE_BULK_LOAD_H_
+#define _BTREE_BULK_LOAD_H_
+
+/*
+ * Bottom-up bulk loading of B-trees from sorted input.
+ *
+ * Inserting n sorted keys one at a time walks the tree n times and splits
+ * every node on the way. When all keys are known up front, we can instead
+ * build the tree level by level:
+ * - Cut the input into consecutive runs, one per leaf, and pack each run into
+ *   a leaf.
+ * - Cut the resulting leaves into consecutive runs, one per inner node, and
+ *   pack each run into an inner node, separating the children by their max
+ *   keys.
+ * - Repeat until a single node, the root, is left.
+ *
+ * Every node is written exactly once, and nodes of the same level are
+ * independent of each other, so each level is built in parallel.
+ *
+ * The fill factor sets how full the nodes are packed. A fill factor of 1 gives
+ * the smallest tree, but the first insert into any node splits it. A lower
+ * fill factor leaves room for later inserts.
+ *
+ * The trees themselves only provide the callbacks that pack a single node;
+ * see the range constructors of the trees.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace common {
+
+namespace bulk {
+
+// The number of threads used for bulk loading if the caller does not care.
+inline unsigned defaultThreads() {
+    unsigned n = std::thread::hardware_concurrency();
+    return n ? n : 1;
+}
+
+// Split `[0, n)` into at most `threads` consecutive chunks, and call
+// `fn(begin, end)` on each of them from its own thread.
+template <class Fn>
+void parallelFor(size_t n, unsigned threads, Fn fn) {
+    if (threads == 0) threads = defaultThreads();
+    if (n < threads) threads = n ? n : 1;
+
+    if (threads == 1) {
+        fn(size_t(0), n);
+        return;
+    }
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        size_t begin = n * t / threads;
+        size_t end = n * (t + 1) / threads;
+        workers.push_back(std::thread(fn, begin, end));
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+}
+
+// Sort `items` with `less` using up to `threads` threads: each thread sorts a
+// chunk, and then neighbouring chunks are merged pairwise in parallel.
+template <class T, class Less>
+void parallelSort(std::vector<T> &items, unsigned threads, Less less) {
+    if (threads == 0) threads = defaultThreads();
+    const size_t n = items.size();
+    const size_t chunks = std::max<size_t>(1, std::min<size_t>(threads, n));
+    auto bound = [n, chunks](size_t i) {
+        return n * std::min(i, chunks) / chunks;
+    };
+
+    parallelFor(chunks, threads, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            std::sort(items.begin() + bound(i), items.begin() + bound(i + 1),
+                      less);
+        }
+    });
+
+    for (size_t width = 1; width < chunks; width *= 2) {
+        size_t merges = (chunks + 2 * width - 1) / (2 * width);
+        parallelFor(merges, threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                size_t lo = 2 * width * i;
+                std::inplace_merge(items.begin() + bound(lo),
+                                   items.begin() + bound(lo + width),
+                                   items.begin() + bound(lo + 2 * width), less);
+            }
+        });
+    }
+}
+
+// The number of nodes needed to hold `n` items if each node gets at most
+// `capacity * fill` items, but never less than `minItems`.
+inline size_t nodeCount(size_t n, size_t capacity, double fill,
+                        size_t minItems) {
+    size_t perNode = static_cast<size_t>(capacity * fill);
+    perNode = std::min(capacity, std::max(perNode, minItems));
+    return std::max<size_t>(1, (n + perNode - 1) / perNode);
+}
+
+// Merge the `n` (key, payload) pairs starting at `first`, which are sorted by
+// key and free of duplicates, into the `count` entries in `keys` and
+// `payloads`, which are sorted by key and have room for `n` more. A pair whose
+// key is already there replaces its payload instead of taking up a new entry.
+// Returns the new number of entries.
+//
+// The entries are merged from the end, so that each one is moved at most once
+// and always into free space, and entries before the least new key are not
+// touched at all.
+template <class Key, class Payload, class It>
+size_t mergeFromEnd(Key *keys, Payload *payloads, size_t count, It first,
+                    size_t n) {
+    // Keys that are already there don't need a new entry.
+    size_t dups = 0;
+    for (It it = first; it != first + n; ++it) {
+        if (std::binary_search(keys, keys + count, it->first)) dups++;
+    }
+
+    // `dst` is the next entry to fill, from the end.
+    size_t total = count + n - dups;
+    size_t dst = total;
+    size_t existing = count;
+    It end = first + n;
+    while (end != first) {
+        const Key &k = (end - 1)->first;
+        if (existing > 0 && !(keys[existing - 1] < k)) {
+            if (!(k < keys[existing - 1])) {
+                // Same key: the new payload wins.
+                --end;
+                keys[dst - 1] = end->first;
+                payloads[dst - 1] = end->second;
+                --existing;
+            } else {
+                keys[dst - 1] = keys[existing - 1];
+                payloads[dst - 1] = payloads[existing - 1];
+                --existing;
+            }
+        } else {
+            --end;
+            keys[dst - 1] = end->first;
+            payloads[dst - 1] = end->second;
+        }
+        --dst;
+    }
+    return total;
+}
+
+// A `link` callback for `build` that does nothing.
+struct NoLink {
+    template <class Built>
+    void operator()(Built &, const Built &) const {}
+};
+
+// Build a tree bottom-up from the `n` items starting at `first` and return
+// its root.
+//
+// The items must be sorted by key, without duplicates, and `first` must be a
+// random access iterator. Items are spread as evenly as possible over the
+// nodes of each level.
+//
+// - `makeLeaf(begin, end)` packs the items in `[begin, end)` into a new leaf
+//   and returns the leaf and the max key in it. It is called with an empty
+//   range only if `n == 0`.
+// - `makeInner(begin, end)` packs the children in `[begin, end)`, which are
+//   (node, max key) pairs, into a new inner node and returns the node and its
+//   max key. It is always called with at least two children.
+// - `link(left, right)` is called for each pair of adjacent nodes on the same
+//   level, for trees that link siblings.
+// - `leafCapacity` and `innerCapacity` are the max number of items in a leaf
+//   and the max number of children of an inner node.
+//
+// The callbacks are called concurrently from up to `threads` threads (0 means
+// `defaultThreads()`).
+template <class NodePtr, class Key, class It, class MakeLeaf, class MakeInner,
+          class Link = NoLink>
+NodePtr build(It first, size_t n, size_t leafCapacity, size_t innerCapacity,
+              double fill, unsigned threads, MakeLeaf makeLeaf,
+              MakeInner makeInner, Link link = Link()) {
+    typedef std::pair<NodePtr, Key> Built;
+
+    assert(fill > 0 && fill <= 1);
+    assert(innerCapacity >= 2);
+
+    if (n == 0) {
+        return makeLeaf(first, first).first;
+    }
+
+    // Link the nodes of a finished level.
+    auto linkLevel = [&](std::vector<Built> &level) {
+        parallelFor(level.size() - 1, threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                link(level[i], level[i + 1]);
+            }
+        });
+    };
+
+    // Pack the leaves.
+    size_t leaves = nodeCount(n, leafCapacity, fill, 1);
+    std::vector<Built> level(leaves);
+    parallelFor(leaves, threads, [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            level[i] = makeLeaf(first + n * i / leaves,
+                                first + n * (i + 1) / leaves);
+        }
+    });
+    linkLevel(level);
+
+    // Pack inner nodes on top of the previous level until there is only the
+    // root left. There are at most half as many parents as children, so every
+    // inner node gets at least two of them, and this terminates.
+    while (level.size() > 1) {
+        size_t m = level.size();
+        size_t parents = nodeCount(m, innerCapacity, fill, 2);
+        parents = std::min(parents, m / 2);
+        std::vector<Built> next(parents);
+        parallelFor(parents, threads, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                next[i] = makeInner(level.data() + m * i / parents,
+                                    level.data() + m * (i + 1) / parents);
+            }
+        });
+        linkLevel(next);
+        level.swap(next);
+    }
+
+    return level[0].first;
+}
+
+}  // namespace bulk
+
+}  // namespace common
+
+#endif
@@ -0,0 +1,267 @@
+#ifndef _BTREE_EPOCH_H_
+#define _BTREE_EPOCH_H_
+
+/*
+ * Epoch-based memory reclamation (EBR) for B-tree nodes.
+ *
+ * With optimistic lock coupling, readers never grab a lock, so a writer that
+ * unlinks a node (e.g. with `writeUnlockObsolete`) cannot know whether some
+ * reader is still looking at it. Freeing the node right away would be a
+ * use-after-free. Instead, the writer _retires_ the node, and it is freed
+ * later, once no thread can still hold a reference to it.
+ *
+ * The scheme is the classic three-epoch one (see Fraser, "Practical
+ * Lock-Freedom", 2004):
+ * - There is a global epoch counter.
+ * - Every operation on a tree runs inside a `Guard`, which announces the global
+ *   epoch the thread observed in a per-thread slot.
+ * - A retired node is tagged with the global epoch at the time it was retired
+ *   and placed on the retiring thread's limbo list.
+ * - The global epoch may only advance from `e` to `e + 1` once every thread
+ *   that is inside a `Guard` has announced `e`.
+ * - Thus, once the global epoch reaches `e + 2`, no thread can still hold a
+ *   pointer to a node retired in epoch `e`, and it is freed.
+ *
+ * Limbo lists are processed in batches of `BatchSize` so that the cost of
+ * scanning all thread slots is amortized over many retirements.
+ *
+ * All trees share the single `Manager` returned by `manager()`.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <vector>
+
+namespace common {
+
+namespace epoch {
+
+// A node that has been retired but not yet freed.
+struct Retired {
+    // The retired object.
+    void *ptr;
+
+    // Frees `ptr`.
+    void (*deleter)(void *);
+
+    // The global epoch at the time the object was retired.
+    uint64_t epoch;
+};
+
+class Manager {
+public:
+    // The max number of threads that may be registered at the same time.
+    static const size_t MaxThreads = 256;
+
+    // The number of retired objects a thread accumulates before it tries to
+    // advance the epoch and free them.
+    static const size_t BatchSize = 64;
+
+    // The announced epoch of a thread that is not inside a `Guard`.
+    static const uint64_t Quiescent = ~0ull;
+
+private:
+    // Per-thread state. Each record gets its own cache line because the
+    // announced epoch is written on every operation.
+    struct alignas(64) ThreadRecord {
+        // The epoch this thread observed when it entered its outermost
+        // `Guard`, or `Quiescent`.
+        std::atomic<uint64_t> localEpoch{Quiescent};
+
+        // True iff some thread owns this record.
+        std::atomic<bool> inUse{false};
+
+        // How many `Guard`s the owning thread is currently inside of. Only
+        // touched by the owner.
+        unsigned nesting = 0;
+
+        // Objects retired by the owner that have not been freed yet. Only
+        // touched by the owner.
+        std::vector<Retired> limbo;
+    };
+
+    // Registers the calling thread on first use and deregisters it when the
+    // thread exits.
+    struct ThreadHandle {
+        Manager *mgr;
+        ThreadRecord *rec;
+
+        ThreadHandle(Manager *m) : mgr(m), rec(m->registerThread()) {}
+        ~ThreadHandle() { mgr->deregisterThread(rec); }
+    };
+
+    std::atomic<uint64_t> globalEpoch{0};
+
+    ThreadRecord records[MaxThreads];
+
+    // Objects left over by threads that exited before they could be freed.
+    std::vector<Retired> orphans;
+    std::mutex orphansLock;
+
+    // Claim a free thread record for the calling thread.
+    ThreadRecord *registerThread() {
+        for (size_t i = 0; i < MaxThreads; ++i) {
+            bool expected = false;
+            if (!records[i].inUse.load() &&
+                records[i].inUse.compare_exchange_strong(expected, true)) {
+                return &records[i];
+            }
+        }
+
+        // Too many threads.
+        assert(false);
+        abort();
+    }
+
+    // Hand the limbo list of an exiting thread over to the orphan list and
+    // release its record.
+    void deregisterThread(ThreadRecord *rec) {
+        assert(rec->nesting == 0);
+        if (!rec->limbo.empty()) {
+            std::lock_guard<std::mutex> guard(orphansLock);
+            orphans.insert(orphans.end(), rec->limbo.begin(), rec->limbo.end());
+            rec->limbo.clear();
+        }
+        rec->localEpoch.store(Quiescent);
+        rec->inUse.store(false);
+    }
+
+    // The record of the calling thread.
+    ThreadRecord *self() {
+        static thread_local ThreadHandle handle(this);
+        return handle.rec;
+    }
+
+    // Free everything in `list` that was retired at least two epochs before
+    // `global`.
+    static void freeExpired(std::vector<Retired> &list, uint64_t global) {
+        auto expired = std::partition(
+            list.begin(), list.end(),
+            [global](const Retired &r) { return r.epoch + 2 > global; });
+        for (auto it = expired; it != list.end(); ++it) {
+            it->deleter(it->ptr);
+        }
+        list.erase(expired, list.end());
+    }
+
+    // Free all expired objects on the caller's limbo list and the orphan list.
+    void collect(ThreadRecord *rec) {
+        uint64_t global = globalEpoch.load();
+        freeExpired(rec->limbo, global);
+
+        std::unique_lock<std::mutex> guard(orphansLock, std::try_to_lock);
+        if (guard.owns_lock() && !orphans.empty()) {
+            freeExpired(orphans, global);
+        }
+    }
+
+public:
+    Manager() {}
+
+    // Only runs at program exit, when no thread can be inside a `Guard`.
+    ~Manager() {
+        for (auto &r : orphans) {
+            r.deleter(r.ptr);
+        }
+    }
+
+    // Announce that the calling thread is about to access shared nodes.
+    // Nestable.
+    void enter() {
+        ThreadRecord *rec = self();
+        if (rec->nesting++ == 0) {
+            // seq_cst: the announcement must be visible before we read any
+            // node pointer.
+            rec->localEpoch.store(globalEpoch.load());
+        }
+    }
+
+    // Announce that the calling thread no longer holds pointers to shared
+    // nodes.
+    void exit() {
+        ThreadRecord *rec = self();
+        assert(rec->nesting > 0);
+        if (--rec->nesting == 0) {
+            rec->localEpoch.store(Quiescent, std::memory_order_release);
+        }
+    }
+
+    // Retire `ptr`, which must already be unreachable for threads that enter
+    // from now on. It is freed with `deleter` once no thread can hold a
+    // reference to it anymore.
+    void retire(void *ptr, void (*deleter)(void *)) {
+        ThreadRecord *rec = self();
+        rec->limbo.push_back(Retired{ptr, deleter, globalEpoch.load()});
+        if (rec->limbo.size() % BatchSize == 0) {
+            tryAdvance();
+            collect(rec);
+        }
+    }
+
+    // Attempt to advance the global epoch. Returns true if it was advanced
+    // (by us or someone else).
+    bool tryAdvance() {
+        uint64_t global = globalEpoch.load();
+        for (size_t i = 0; i < MaxThreads; ++i) {
+            if (!records[i].inUse.load()) continue;
+            uint64_t local = records[i].localEpoch.load();
+            if (local != Quiescent && local != global) {
+                return false;
+            }
+        }
+        // If the CAS fails, somebody else already advanced the epoch.
+        globalEpoch.compare_exchange_strong(global, global + 1);
+        return true;
+    }
+
+    // Wait until every object retired by the calling thread so far has been
+    // freed. This spins until all other threads leave the epochs they are in,
+    // so it must not be called while inside a `Guard`. Mostly useful for
+    // tests and for shutting down.
+    void synchronize() {
+        ThreadRecord *rec = self();
+        assert(rec->nesting == 0);
+        uint64_t target = globalEpoch.load() + 2;
+        while (globalEpoch.load() < target) {
+            tryAdvance();
+        }
+        collect(rec);
+
+        std::lock_guard<std::mutex> guard(orphansLock);
+        freeExpired(orphans, globalEpoch.load());
+    }
+
+    // The current global epoch.
+    uint64_t current() const { return globalEpoch.load(); }
+};
+
+// The manager shared by all trees.
+inline Manager &manager() {
+    static Manager m;
+    return m;
+}
+
+// RAII helper: the calling thread is inside an epoch for the lifetime of the
+// guard. Every tree operation that dereferences shared nodes should hold one.
+struct Guard {
+    Guard() { manager().enter(); }
+    ~Guard() { manager().exit(); }
+
+    Guard(const Guard &) = delete;
+    Guard &operator=(const Guard &) = delete;
+};
+
+// Retire `ptr`, which will be freed with `deleter` once it is safe.
+inline void retire(void *ptr, void (*deleter)(void *)) {
+    manager().retire(ptr, deleter);
+}
+
+}  // namespace epoch
+
+}  // namespace common
+
+#endif
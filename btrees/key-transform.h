@@ -0,0 +1,59 @@
+#ifndef _BTREE_KEY_TRANSFORM_H_
+#define _BTREE_KEY_TRANSFORM_H_
+
+/*
+ * Key transforms: how a tree maps the keys it is given to the keys it stores.
+ *
+ * The byte-reordering tree spreads monotonically increasing keys over the
+ * leaves by swapping their high and low bytes. Without that, it is a plain
+ * lock-coupling tree, so the transform is a template argument of the tree:
+ * - `Identity`: store keys as they are.
+ * - `ByteReorder`: swap the first and last two bytes of each key.
+ *
+ * A transform provides `apply(k)` and `preservesOrder`, which tells whether
+ * `apply` keeps keys in order, i.e. whether scans return keys in order. Both
+ * transforms are their own inverse.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace common {
+
+namespace key {
+
+// Store keys as they are.
+struct Identity {
+    static const bool preservesOrder = true;
+
+    template <class Key>
+    static Key apply(Key k) {
+        return k;
+    }
+};
+
+// Swap the first two and last two bytes of each key.
+struct ByteReorder {
+    static const bool preservesOrder = false;
+
+    // A page has 4KB, so even for an 1B key, we can have at most 4KB entries
+    // per page. Thus, to avoid hot pages, we can swap the first two and last
+    // two bytes (16 bits == 32K entries).
+    template <class Key>
+    static Key apply(Key k) {
+        static_assert(sizeof(Key) >= 4, "keys must have at least 4 bytes");
+        uint8_t *bytes = reinterpret_cast<uint8_t *>(&k);
+        uint8_t tmp[2];
+        memcpy(tmp, bytes + sizeof(Key) - 2, 2);
+        memcpy(bytes + sizeof(Key) - 2, bytes, 2);
+        memcpy(bytes, tmp, 2);
+        return k;
+    }
+};
+
+}  // namespace key
+
+}  // namespace common
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef _BTREE_LAYOUT_H_
+#define _BTREE_LAYOUT_H_
+
+/*
+ * Leaf layouts: how the entries of a leaf are laid out after its header.
+ *
+ * By default, the header of a leaf (the lock word, type and count) is
+ * directly followed by an array of keys and then an array of payloads. That
+ * has two costs:
+ * - The header shares a cache line with the first keys. Every writer's CAS on
+ *   the lock word invalidates that line in the caches of the readers that are
+ *   searching the leaf at the same time, i.e. the lock and the keys are
+ *   falsely shared.
+ * - A hit touches two distant cache lines: one for its key, and one for its
+ *   payload.
+ *
+ * The byte-reordering tree takes one of the following policies as a template
+ * argument:
+ * - `Separate`: key and payload arrays right after the header.
+ * - `PaddedHeader`: key and payload arrays, starting on the cache line after
+ *   the header.
+ * - `Interleaved`: (key, payload) pairs, starting on the cache line after the
+ *   header. The key of a hit and its payload share a line, but keys are
+ *   strided, so they are searched with a scalar binary search instead of the
+ *   tree's search policy.
+ * - `BySize`: `Interleaved` if a payload is no bigger than a key,
+ *   `PaddedHeader` otherwise.
+ *
+ * The hybrid tree shares the leaves of the byte-reordering tree, but always
+ * uses `Separate` (see `olc-nodes.h`). The OLC tree has leaves of its own,
+ * which do not take a layout: their key and payload arrays directly follow
+ * the header, so the lock and the first keys still share a cache line there.
+ *
+ * Padding costs a leaf a few entries. It only puts the header on its own
+ * line if the leaf itself is aligned to a cache line, which is the case for
+ * the default allocator (see `alloc.h`).
+ *
+ * Each policy provides the type of the entries of a leaf with room for `N`
+ * entries, the size of an entry, and the alignment of the entries.
+ */
+
+#include <cstddef>
+#include <cstring>
+#include <type_traits>
+
+namespace common {
+
+namespace layout {
+
+static const size_t cacheLineSize = 64;
+
+// Keys and payloads in separate arrays.
+template <class Key, class Payload, size_t N>
+struct SeparateEntries {
+    // The keys of the entries.
+    Key keys[N];
+
+    // The payloads of the entries.
+    Payload payloads[N];
+
+    Key &key(unsigned i) { return keys[i]; }
+    Payload &payload(unsigned i) { return payloads[i]; }
+
+    // Returns the index of the least of the first `count` keys that is
+    // greater than or equal to `k`, using the `Search` policy.
+    template <class Search>
+    unsigned lowerBound(unsigned count, Key k) const {
+        return Search::lowerBound(keys, count, k);
+    }
+
+    // Move the `n` entries starting at `from` to start at `to`.
+    void move(unsigned to, unsigned from, unsigned n) {
+        memmove(keys + to, keys + from, sizeof(Key) * n);
+        memmove(payloads + to, payloads + from, sizeof(Payload) * n);
+    }
+
+    // Copy the `n` entries starting at `from` to the front of `dst`.
+    void copyTo(SeparateEntries &dst, unsigned from, unsigned n) const {
+        memcpy(dst.keys, keys + from, sizeof(Key) * n);
+        memcpy(dst.payloads, payloads + from, sizeof(Payload) * n);
+    }
+};
+
+// (key, payload) pairs in a single array.
+template <class Key, class Payload, size_t N>
+struct InterleavedEntries {
+    struct Entry {
+        Key k;
+        Payload p;
+    };
+
+    Entry entries[N];
+
+    Key &key(unsigned i) { return entries[i].k; }
+    Payload &payload(unsigned i) { return entries[i].p; }
+
+    // Returns the index of the least of the first `count` keys that is
+    // greater than or equal to `k`. The search policies need contiguous keys,
+    // so this is always a branch-free binary search.
+    template <class Search>
+    unsigned lowerBound(unsigned count, Key k) const {
+        if (count == 0) return 0;
+        const Entry *base = entries;
+        unsigned n = count;
+        while (n > 1) {
+            unsigned half = n / 2;
+            base = (base[half].k < k) ? base + half : base;
+            n -= half;
+        }
+        return (base - entries) + (base->k < k);
+    }
+
+    void move(unsigned to, unsigned from, unsigned n) {
+        memmove(entries + to, entries + from, sizeof(Entry) * n);
+    }
+
+    void copyTo(InterleavedEntries &dst, unsigned from, unsigned n) const {
+        memcpy(dst.entries, entries + from, sizeof(Entry) * n);
+    }
+};
+
+// Key and payload arrays right after the header.
+struct Separate {
+    template <class Key, class Payload, size_t N>
+    using Entries = SeparateEntries<Key, Payload, N>;
+
+    template <class Key, class Payload>
+    static constexpr size_t entrySize() {
+        return sizeof(Key) + sizeof(Payload);
+    }
+
+    template <class Key, class Payload>
+    static constexpr size_t alignment() {
+        return alignof(SeparateEntries<Key, Payload, 1>);
+    }
+};
+
+// Key and payload arrays on the cache line after the header.
+struct PaddedHeader : public Separate {
+    template <class Key, class Payload>
+    static constexpr size_t alignment() {
+        return cacheLineSize;
+    }
+};
+
+// (key, payload) pairs on the cache line after the header.
+struct Interleaved {
+    template <class Key, class Payload, size_t N>
+    using Entries = InterleavedEntries<Key, Payload, N>;
+
+    template <class Key, class Payload>
+    static constexpr size_t entrySize() {
+        return sizeof(typename InterleavedEntries<Key, Payload, 1>::Entry);
+    }
+
+    template <class Key, class Payload>
+    static constexpr size_t alignment() {
+        return cacheLineSize;
+    }
+};
+
+// `Interleaved` for payloads no bigger than the keys, `PaddedHeader` for
+// bigger ones.
+struct BySize {
+    template <class Key, class Payload>
+    using Pick = typename std::conditional<sizeof(Payload) <= sizeof(Key),
+                                           Interleaved, PaddedHeader>::type;
+
+    template <class Key, class Payload, size_t N>
+    using Entries = typename Pick<Key, Payload>::template Entries<Key, Payload,
+                                                                  N>;
+
+    template <class Key, class Payload>
+    static constexpr size_t entrySize() {
+        return Pick<Key, Payload>::template entrySize<Key, Payload>();
+    }
+
+    template <class Key, class Payload>
+    static constexpr size_t alignment() {
+        return Pick<Key, Payload>::template alignment<Key, Payload>();
+    }
+};
+
+// The offset of the entries in a node whose header has `headerSize` bytes,
+// if they are aligned to `alignment` bytes.
+constexpr size_t entriesOffset(size_t headerSize, size_t alignment) {
+    return (headerSize + alignment - 1) / alignment * alignment;
+}
+
+}  // namespace layout
+
+}  // namespace common
+
+#endif
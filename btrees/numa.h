@@ -0,0 +1,101 @@
+#ifndef _BTREE_NUMA_H_
+#define _BTREE_NUMA_H_
+
+/*
+ * NUMA topology and memory placement at runtime.
+ *
+ * `alloc::HugePages<NumaNode>` binds memory to a NUMA node that is fixed at
+ * compile time. Data that is replicated per NUMA node needs to pick the node
+ * at runtime instead, based on where the calling thread runs. The topology is
+ * read from sysfs once; without NUMA support, everything is on node 0.
+ *
+ * Only the first `maxNodes` nodes get memory of their own. Higher nodes share
+ * the memory of node `node % maxNodes`.
+ */
+
+#include "alloc.h"
+
+#include <sched.h>
+#include <unistd.h>
+#include <cstddef>
+#include <cstdio>
+#include <vector>
+
+namespace common {
+
+namespace numa {
+
+// The number of NUMA nodes that have their own memory pool.
+static const int maxNodes = 8;
+
+// Read the NUMA node of each CPU from sysfs.
+inline std::vector<int> readCpuNodes() {
+    std::vector<int> nodes;
+    char path[64];
+    for (int cpu = 0;; ++cpu) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+        if (access(path, F_OK) != 0) break;
+        int node = 0;
+        for (int n = 0; n < 1024; ++n) {
+            snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d",
+                     cpu, n);
+            if (access(path, F_OK) == 0) {
+                node = n;
+                break;
+            }
+        }
+        nodes.push_back(node);
+    }
+    return nodes;
+}
+
+// The NUMA node of each CPU.
+inline const std::vector<int> &cpuNodes() {
+    static const std::vector<int> nodes = readCpuNodes();
+    return nodes;
+}
+
+// The number of NUMA nodes, capped to `maxNodes`.
+inline int nodeCount() {
+    int count = 1;
+    for (int node : cpuNodes()) {
+        if (node + 1 > count) count = node + 1;
+    }
+    return count < maxNodes ? count : maxNodes;
+}
+
+// The NUMA node of the CPU the calling thread runs on, in `[0, maxNodes)`.
+inline int currentNode() {
+    int cpu = sched_getcpu();
+    const std::vector<int> &nodes = cpuNodes();
+    if (cpu < 0 || size_t(cpu) >= nodes.size()) return 0;
+    return nodes[cpu] % maxNodes;
+}
+
+// Allocate `size` bytes on NUMA node `node`.
+inline void *allocate(int node, size_t size) {
+    typedef void *(*Allocate)(size_t);
+    static const Allocate fns[maxNodes] = {
+        alloc::HugePages<0>::allocate, alloc::HugePages<1>::allocate,
+        alloc::HugePages<2>::allocate, alloc::HugePages<3>::allocate,
+        alloc::HugePages<4>::allocate, alloc::HugePages<5>::allocate,
+        alloc::HugePages<6>::allocate, alloc::HugePages<7>::allocate};
+    return fns[node % maxNodes](size);
+}
+
+// Free `size` bytes allocated on NUMA node `node` by `allocate`.
+inline void deallocate(int node, void *p, size_t size) {
+    typedef void (*Deallocate)(void *, size_t);
+    static const Deallocate fns[maxNodes] = {
+        alloc::HugePages<0>::deallocate, alloc::HugePages<1>::deallocate,
+        alloc::HugePages<2>::deallocate, alloc::HugePages<3>::deallocate,
+        alloc::HugePages<4>::deallocate, alloc::HugePages<5>::deallocate,
+        alloc::HugePages<6>::deallocate, alloc::HugePages<7>::deallocate};
+    fns[node % maxNodes](p, size);
+}
+
+}  // namespace numa
+
+}  // namespace common
+
+#endif
@@ -0,0 +1,221 @@
+#ifndef _BTREE_OLC_NODES_H_
+#define _BTREE_OLC_NODES_H_
+
+/*
+ * The nodes shared by the lock-coupling trees over fixed-size keys: the
+ * hybrid and byte reordering trees. Each node starts with an optimistic lock
+ * (see `optlock.h`), and the trees differ only in how they traverse and fill
+ * these nodes.
+ *
+ * Only the nodes are shared, not the traversals. The hybrid tree has its own
+ * insert, lookup and modify paths, because its cache is woven through them,
+ * so a change to those paths in one tree does not reach the other. A common
+ * core with the cache as a policy is still to be written.
+ *
+ * The OLC tree has its own nodes, with B-link pointers, fence keys and a lock
+ * that queues writers (see `btreeolc.h`).
+ */
+
+#include "alloc.h"
+#include "layout.h"
+#include "optlock.h"
+#include "search.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+namespace common {
+
+namespace node {
+
+// Each page in the Btree can be either an inner node or a leaf node.
+enum class PageType : uint8_t { BTreeInner = 1, BTreeLeaf = 2 };
+
+// The default size of a node. Each tree can be given different sizes for its
+// leaves and inner nodes.
+static const uint64_t pageSize = 4 * 1024;
+
+// A base type for all btree nodes. Each node has an optimistic lock.
+struct NodeBase : public OptLock {
+    // Leaf or inner?
+    PageType type;
+
+    // The number of entries in this btree node.
+    uint16_t count;
+};
+
+// Leaf superclass so that we don't have to keep defining the type.
+struct BTreeLeafBase : public NodeBase {
+    static const PageType typeMarker = PageType::BTreeLeaf;
+};
+
+// A single leaf node in the btree. Note that anyone doing operations on these
+// nodes should already be holding a lock.
+template <class Key, class Payload, class Search = common::search::Simd,
+          class Alloc = common::alloc::Default,
+          uint64_t PageSize = pageSize,
+          class Layout = common::layout::Separate>
+struct BTreeLeaf : public BTreeLeafBase {
+    // The alignment of the entries. See `layout.h` for the available layouts.
+    static const uint64_t entriesAlignment =
+        Layout::template alignment<Key, Payload>();
+
+    // The max number of entries in a leaf node (based on the size of keys
+    // and pages). We also need to account for the space of the locks, and of
+    // the padding after them.
+    static const uint64_t maxEntries =
+        (PageSize -
+         common::layout::entriesOffset(sizeof(NodeBase), entriesAlignment)) /
+        Layout::template entrySize<Key, Payload>();
+    static_assert(maxEntries >= 4 && maxEntries <= UINT16_MAX,
+                  "a leaf must fit between 4 and 65535 entries");
+
+    // The (key, value) pairs inserted into the tree.
+    alignas(entriesAlignment) typename Layout::template Entries<
+        Key, Payload, maxEntries> entries;
+
+    // Construct an empty leaf node.
+    BTreeLeaf() {
+        count = 0;
+        type = typeMarker;
+    }
+
+    // Nodes come from the node allocator (see `alloc.h`).
+    static void *operator new(size_t size) { return Alloc::allocate(size); }
+    static void operator delete(void *p, size_t size) {
+        Alloc::deallocate(p, size);
+    }
+
+    // The key and the payload of the entry at index `i`.
+    Key &key(unsigned i) { return entries.key(i); }
+    Payload &payload(unsigned i) { return entries.payload(i); }
+
+    // Returns true if this leaf is full. It needs to be split before we can
+    // take any more entries.
+    bool isFull() { return count == maxEntries; };
+
+    // Returns the index into this node of the least key that is greater than
+    // or equal to `k`. See `search.h` for the available search policies.
+    unsigned lowerBound(Key k) {
+        return entries.template lowerBound<Search>(count, k);
+    }
+
+    // Insert the new (key, value) pair into this leaf. The caller should make
+    // sure that the node has space and split it if necessary.
+    void insert(Key k, Payload p) {
+        assert(count < maxEntries);
+        if (count) {
+            unsigned pos = lowerBound(k);
+            if ((pos < count) && (key(pos) == k)) {
+                // Upsert
+                payload(pos) = p;
+                return;
+            }
+            entries.move(pos + 1, pos, count - pos);
+            key(pos) = k;
+            payload(pos) = p;
+        } else {
+            key(0) = k;
+            payload(0) = p;
+        }
+        count++;
+    }
+
+    // Split this leaf node in half, and return the new leaf node. The new node
+    // comes _after_ this node.
+    BTreeLeaf *split(Key &sep) {
+        BTreeLeaf *newLeaf = new BTreeLeaf();
+        newLeaf->count = count - (count / 2);
+        count = count - newLeaf->count;
+        entries.copyTo(newLeaf->entries, count, newLeaf->count);
+        sep = key(count - 1);
+        return newLeaf;
+    }
+
+    // Remove the entry at index `pos`.
+    void removeAt(unsigned pos) {
+        assert(pos < count);
+        entries.move(pos, pos + 1, count - pos - 1);
+        count--;
+    }
+};
+
+// Inner node superclass so that we don't have to keep defining the type.
+struct BTreeInnerBase : public NodeBase {
+    static const PageType typeMarker = PageType::BTreeInner;
+};
+
+// A single inner node in the btree. Note that anyone doing operations on these
+// nodes should already be holding a lock.
+template <class Key, class Search = common::search::Simd,
+          class Alloc = common::alloc::Default,
+          uint64_t PageSize = pageSize>
+struct BTreeInner : public BTreeInnerBase {
+    // The max number of entries in an inner node (based on the size of keys
+    // and pages). We also need to account for the space of the locks.
+    static const uint64_t maxEntries =
+        (PageSize - sizeof(NodeBase)) / (sizeof(Key) + sizeof(NodeBase *));
+    static_assert(maxEntries >= 4 && maxEntries <= UINT16_MAX,
+                  "a inner node must fit between 4 and 65535 entries");
+
+    // Pointers to the child nodes.
+    NodeBase *children[maxEntries];
+
+    // The keys for each child.
+    Key keys[maxEntries];
+
+    // Construct an empty inner node.
+    BTreeInner() {
+        count = 0;
+        type = typeMarker;
+    }
+
+    // Nodes come from the node allocator (see `alloc.h`).
+    static void *operator new(size_t size) { return Alloc::allocate(size); }
+    static void operator delete(void *p, size_t size) {
+        Alloc::deallocate(p, size);
+    }
+
+    // Returns true if adding one more key would fill the node.
+    bool isFull() { return count == (maxEntries - 1); };
+
+    // Returns the index into this node of the least key that is greater than
+    // or equal to `k`. See `search.h` for the available search policies.
+    unsigned lowerBound(Key k) { return Search::lowerBound(keys, count, k); }
+
+    // Split this inner node in half, and return the new inner node. The new
+    // node comes _after_ this node.
+    BTreeInner *split(Key &sep) {
+        BTreeInner *newInner = new BTreeInner();
+        newInner->count = count - (count / 2);
+        count = count - newInner->count - 1;
+        sep = keys[count];
+        memcpy(newInner->keys, keys + count + 1,
+               sizeof(Key) * (newInner->count + 1));
+        memcpy(newInner->children, children + count + 1,
+               sizeof(NodeBase *) * (newInner->count + 1));
+        return newInner;
+    }
+
+    // Insert the new child with the given key into this inner node. The caller
+    // should make sure that the node has space and split it if necessary.
+    void insert(Key k, NodeBase *child) {
+        assert(count < maxEntries - 1);
+        unsigned pos = lowerBound(k);
+        memmove(keys + pos + 1, keys + pos, sizeof(Key) * (count - pos + 1));
+        memmove(children + pos + 1, children + pos,
+                sizeof(NodeBase *) * (count - pos + 1));
+        keys[pos] = k;
+        children[pos] = child;
+        std::swap(children[pos], children[pos + 1]);
+        count++;
+    }
+};
+
+}  // namespace node
+
+}  // namespace common
+
+#endif
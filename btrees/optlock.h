@@ -0,0 +1,120 @@
+#ifndef _BTREE_OPTLOCK_H_
+#define _BTREE_OPTLOCK_H_
+
+/*
+ * The optimistic lock shared by the lock-coupling trees: the hybrid, byte
+ * reordering and variable-length key trees. The OLC tree has its own variant
+ * that queues writers on hot locks (see `btreeolc.h`).
+ */
+
+#include <immintrin.h>
+#include <atomic>
+#include <cstdint>
+
+namespace common {
+
+// An optimistic lock implementation.
+//
+// An optimistic lock has two parts: a lock and a version counter. The lock is
+// acquired by all writers, as in a normal RW-locking scheme. However, a reader
+// only waits for the lock to be free and gets the version number. On a
+// WriteUnlock, we increment the version number. On a ReadUnlock, we check that
+// the version number has not changed since we acquired the lock. If it has, we
+// restart.
+//
+// Optimistic locking works best when conflicts are rare.
+//
+// This implementation comes more or less straight from the pseudo-code in
+// appendix A of this paper: https://db.in.tum.de/~leis/papers/artsync.pdf.
+struct OptLock {
+    // In this implementation, both the lock and the version counter are
+    // represented using this 64-bit word.
+    //
+    // Bit 0 represents that the locked value is obsolete (1 = obsolete).
+    // Bit 1 represents that the value is locked (1 = locked).
+    // Bits 2-63 represent the version counter.
+    std::atomic<uint64_t> typeVersionLockObsolete{0b100};
+
+    // Returns true if the given version represents a locked state.
+    bool isLocked(uint64_t version) { return ((version & 0b10) == 0b10); }
+
+    // Grab an optimistic read lock.
+    //
+    // If the current version is locked, set `needRestart` to true and return
+    // the current version. The reader should restart if `needRestart` is set to
+    // true after calling this method.
+    uint64_t readLockOrRestart(bool &needRestart) {
+        uint64_t version;
+        version = typeVersionLockObsolete.load();
+        if (isLocked(version) || isObsolete(version)) {
+            // PAUSE compiler intrinsic. See
+            // https://software.intel.com/en-us/node/524249.
+            _mm_pause();
+            needRestart = true;
+        }
+        return version;
+    }
+
+    // Grab the write lock.
+    //
+    // This is done by first grabbing the optimistic read lock, and then
+    // attempting to upgrade it to a write lock. If this attempt fails,
+    // `needRestart` is set to true, and the caller needs to restart.
+    void writeLockOrRestart(bool &needRestart) {
+        uint64_t version;
+        version = readLockOrRestart(needRestart);
+        if (needRestart) return;
+
+        upgradeToWriteLockOrRestart(version, needRestart);
+        if (needRestart) return;
+    }
+
+    // Upgrade the given read lock to a write lock.
+    //
+    // `version` should be the version at the time a read lock was acquired.
+    //
+    // If the version has changed since the read lock was acquired,
+    // `needRestart` is set to true, and the caller needs to restart.
+    void upgradeToWriteLockOrRestart(uint64_t &version, bool &needRestart) {
+        if (typeVersionLockObsolete.compare_exchange_strong(version,
+                                                            version + 0b10)) {
+            version = version + 0b10;
+        } else {
+            _mm_pause();
+            needRestart = true;
+        }
+    }
+
+    // Release the write lock.
+    //
+    // This should only be called if you successfully acquired the write
+    // lock. This method releases the lock and increments the version.
+    void writeUnlock() { typeVersionLockObsolete.fetch_add(0b10); }
+
+    // Return the obsolete bit of the given version.
+    bool isObsolete(uint64_t version) { return (version & 1) == 1; }
+
+    // The same as `readUnlockOrRestart`.
+    void checkOrRestart(uint64_t startRead, bool &needRestart) const {
+        readUnlockOrRestart(startRead, needRestart);
+    }
+
+    // Release the read lock.
+    //
+    // `startRead` is the version at the time the read lock was acquired.
+    //
+    // If the version has changed since the read lock was acquired,
+    // `needRestart` is set to true, and the caller should restart.
+    void readUnlockOrRestart(uint64_t startRead, bool &needRestart) const {
+        needRestart = (startRead != typeVersionLockObsolete.load());
+    }
+
+    // Release the write lock _and_ set the obsolete bit.
+    //
+    // This is like `writeUnlock` except that it also sets the obsolete bit.
+    void writeUnlockObsolete() { typeVersionLockObsolete.fetch_add(0b11); }
+};
+
+}  // namespace common
+
+#endif
@@ -0,0 +1,357 @@
+#ifndef _BTREE_SEARCH_H_
+#define _BTREE_SEARCH_H_
+
+/*
+ * Search kernels for finding the lower bound of a key in a sorted node.
+ *
+ * Every operation on every tree calls `lowerBound` once per level, so this is
+ * the hottest code in the project. A B-tree node holds ~255 keys, and a plain
+ * binary search over that many keys mispredicts about half of its branches.
+ *
+ * The trees take one of the following policies as a template argument:
+ * - `Binary`: the original branchy binary search.
+ * - `BranchFree`: a binary search that uses conditional moves instead of
+ *   branches.
+ * - `Simd`: a branch-free binary search that narrows the range down to a
+ *   window of two cache lines, which is then scanned with SIMD compares. The
+ *   instruction set (SSE4.2, AVX2, or AVX-512) is chosen at runtime based on
+ *   what the CPU supports. Only 32- and 64-bit integer keys are vectorized;
+ *   other key types fall back to `BranchFree`.
+ *
+ * All kernels return the index of the least key that is greater than or equal
+ * to `k`, or `count` if there is no such key.
+ *
+ * The kernels are compiled with function-level `target` attributes, so the
+ * tree headers do not need to be built with `-mavx2` and friends.
+ */
+
+#include <immintrin.h>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+
+namespace common {
+
+namespace search {
+
+// The instruction sets we have kernels for, in order of preference.
+enum class Isa { Scalar = 0, Sse42 = 1, Avx2 = 2, Avx512 = 3 };
+
+// Returns the best instruction set supported by this CPU.
+inline Isa detectIsa() {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return Isa::Avx512;
+    if (__builtin_cpu_supports("avx2")) return Isa::Avx2;
+    if (__builtin_cpu_supports("sse4.2")) return Isa::Sse42;
+    return Isa::Scalar;
+}
+
+// Returns the best instruction set supported by this CPU. The CPU is only
+// queried once.
+inline Isa bestIsa() {
+    static const Isa isa = detectIsa();
+    return isa;
+}
+
+namespace detail {
+
+// Each kernel counts the number of elements of `p[0..n)` that are less than
+// `k`. `n` must be a multiple of the number of lanes of the kernel. Keys are
+// compared as signed integers after XOR-ing them with `bias`, which lets us
+// compare unsigned keys with signed instructions.
+
+__attribute__((target("sse4.2")))
+inline unsigned countLess64Sse42(const void *p, unsigned n, int64_t k,
+                                 int64_t bias) {
+    const __m128i kv = _mm_set1_epi64x(k ^ bias);
+    const __m128i bv = _mm_set1_epi64x(bias);
+    const __m128i *v = static_cast<const __m128i *>(p);
+    unsigned c = 0;
+    for (unsigned i = 0; i < n / 2; ++i) {
+        __m128i x = _mm_xor_si128(_mm_loadu_si128(v + i), bv);
+        __m128i lt = _mm_cmpgt_epi64(kv, x);
+        c += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(lt)));
+    }
+    return c;
+}
+
+__attribute__((target("sse4.2")))
+inline unsigned countLess32Sse42(const void *p, unsigned n, int32_t k,
+                                 int32_t bias) {
+    const __m128i kv = _mm_set1_epi32(k ^ bias);
+    const __m128i bv = _mm_set1_epi32(bias);
+    const __m128i *v = static_cast<const __m128i *>(p);
+    unsigned c = 0;
+    for (unsigned i = 0; i < n / 4; ++i) {
+        __m128i x = _mm_xor_si128(_mm_loadu_si128(v + i), bv);
+        __m128i lt = _mm_cmpgt_epi32(kv, x);
+        c += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(lt)));
+    }
+    return c;
+}
+
+__attribute__((target("avx2")))
+inline unsigned countLess64Avx2(const void *p, unsigned n, int64_t k,
+                                int64_t bias) {
+    const __m256i kv = _mm256_set1_epi64x(k ^ bias);
+    const __m256i bv = _mm256_set1_epi64x(bias);
+    const __m256i *v = static_cast<const __m256i *>(p);
+    unsigned c = 0;
+    for (unsigned i = 0; i < n / 4; ++i) {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256(v + i), bv);
+        __m256i lt = _mm256_cmpgt_epi64(kv, x);
+        c += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(lt)));
+    }
+    return c;
+}
+
+__attribute__((target("avx2")))
+inline unsigned countLess32Avx2(const void *p, unsigned n, int32_t k,
+                                int32_t bias) {
+    const __m256i kv = _mm256_set1_epi32(k ^ bias);
+    const __m256i bv = _mm256_set1_epi32(bias);
+    const __m256i *v = static_cast<const __m256i *>(p);
+    unsigned c = 0;
+    for (unsigned i = 0; i < n / 8; ++i) {
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256(v + i), bv);
+        __m256i lt = _mm256_cmpgt_epi32(kv, x);
+        c += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(lt)));
+    }
+    return c;
+}
+
+__attribute__((target("avx512f")))
+inline unsigned countLess64Avx512(const void *p, unsigned n, int64_t k,
+                                  int64_t bias) {
+    const __m512i kv = _mm512_set1_epi64(k ^ bias);
+    const __m512i bv = _mm512_set1_epi64(bias);
+    const int64_t *v = static_cast<const int64_t *>(p);
+    unsigned c = 0;
+    for (unsigned i = 0; i < n; i += 8) {
+        __m512i x = _mm512_xor_si512(_mm512_loadu_si512(v + i), bv);
+        c += __builtin_popcount(_mm512_cmplt_epi64_mask(x, kv));
+    }
+    return c;
+}
+
+__attribute__((target("avx512f")))
+inline unsigned countLess32Avx512(const void *p, unsigned n, int32_t k,
+                                  int32_t bias) {
+    const __m512i kv = _mm512_set1_epi32(k ^ bias);
+    const __m512i bv = _mm512_set1_epi32(bias);
+    const int32_t *v = static_cast<const int32_t *>(p);
+    unsigned c = 0;
+    for (unsigned i = 0; i < n; i += 16) {
+        __m512i x = _mm512_xor_si512(_mm512_loadu_si512(v + i), bv);
+        c += __builtin_popcount(_mm512_cmplt_epi32_mask(x, kv));
+    }
+    return c;
+}
+
+// Signed keys are compared as they are; unsigned keys have their sign bit
+// flipped first.
+template <class Key, class Int>
+inline Int bias() {
+    return std::is_signed<Key>::value ? 0 : std::numeric_limits<Int>::min();
+}
+
+// The kernel for instruction set `I` and keys of `KeySize` bytes. `lanes` is
+// the number of keys per vector.
+template <Isa I, size_t KeySize>
+struct Kernel;
+
+template <>
+struct Kernel<Isa::Sse42, 8> {
+    static const unsigned lanes = 2;
+    template <class Key>
+    static unsigned countLess(const Key *p, unsigned n, Key k) {
+        return countLess64Sse42(p, n, (int64_t)k, bias<Key, int64_t>());
+    }
+};
+
+template <>
+struct Kernel<Isa::Sse42, 4> {
+    static const unsigned lanes = 4;
+    template <class Key>
+    static unsigned countLess(const Key *p, unsigned n, Key k) {
+        return countLess32Sse42(p, n, (int32_t)k, bias<Key, int32_t>());
+    }
+};
+
+template <>
+struct Kernel<Isa::Avx2, 8> {
+    static const unsigned lanes = 4;
+    template <class Key>
+    static unsigned countLess(const Key *p, unsigned n, Key k) {
+        return countLess64Avx2(p, n, (int64_t)k, bias<Key, int64_t>());
+    }
+};
+
+template <>
+struct Kernel<Isa::Avx2, 4> {
+    static const unsigned lanes = 8;
+    template <class Key>
+    static unsigned countLess(const Key *p, unsigned n, Key k) {
+        return countLess32Avx2(p, n, (int32_t)k, bias<Key, int32_t>());
+    }
+};
+
+template <>
+struct Kernel<Isa::Avx512, 8> {
+    static const unsigned lanes = 8;
+    template <class Key>
+    static unsigned countLess(const Key *p, unsigned n, Key k) {
+        return countLess64Avx512(p, n, (int64_t)k, bias<Key, int64_t>());
+    }
+};
+
+template <>
+struct Kernel<Isa::Avx512, 4> {
+    static const unsigned lanes = 16;
+    template <class Key>
+    static unsigned countLess(const Key *p, unsigned n, Key k) {
+        return countLess32Avx512(p, n, (int32_t)k, bias<Key, int32_t>());
+    }
+};
+
+// True iff we have SIMD kernels for `Key`.
+template <class Key>
+struct IsVectorizable
+    : std::integral_constant<bool, std::is_integral<Key>::value &&
+                                       (sizeof(Key) == 8 ||
+                                        sizeof(Key) == 4)> {};
+
+}  // namespace detail
+
+// The original binary search. It returns as soon as it finds `k`.
+struct Binary {
+    template <class Key>
+    static unsigned lowerBound(const Key *keys, unsigned count, Key k) {
+        unsigned lower = 0;
+        unsigned upper = count;
+        while (lower < upper) {
+            unsigned mid = ((upper - lower) / 2) + lower;
+            if (k < keys[mid]) {
+                upper = mid;
+            } else if (k > keys[mid]) {
+                lower = mid + 1;
+            } else {
+                return mid;
+            }
+        }
+        return lower;
+    }
+};
+
+// Binary search without branches on the keys. Each step halves the search
+// range with a conditional move, so it always takes log2(count) steps.
+struct BranchFree {
+    template <class Key>
+    static unsigned lowerBound(const Key *keys, unsigned count, Key k) {
+        const Key *base = keys;
+        unsigned n = count;
+        while (n > 1) {
+            const unsigned half = n / 2;
+            base = (base[half] < k) ? (base + half) : base;
+            n -= half;
+        }
+        return (base - keys) + (n > 0 && *base < k);
+    }
+};
+
+namespace detail {
+
+// Lower bound search with the kernel for instruction set `I`.
+template <Isa I, class Key>
+unsigned lowerBoundSimd(const Key *keys, unsigned count, Key k) {
+    typedef Kernel<I, sizeof(Key)> K;
+
+    // Narrow the range down to a window of two cache lines, branch free. The
+    // lower bound is always in [base, base + n].
+    const unsigned window = 128 / sizeof(Key);
+    const Key *base = keys;
+    unsigned n = count;
+    while (n > window) {
+        const unsigned half = n / 2;
+        base = (base[half] < k) ? (base + half) : base;
+        n -= half;
+    }
+
+    // Count the keys in the window that are less than `k`. The window is
+    // sorted, so that is the offset of the lower bound in the window.
+    const unsigned vec = n - (n % K::lanes);
+    unsigned c = K::countLess(base, vec, k);
+    for (unsigned i = vec; i < n; ++i) {
+        c += base[i] < k;
+    }
+    return (base - keys) + c;
+}
+
+// A pointer to a lower bound search function.
+template <class Key>
+struct SearchFn {
+    typedef unsigned (*type)(const Key *, unsigned, Key);
+};
+
+// Returns the search function for `isa`.
+template <class Key>
+typename SearchFn<Key>::type kernelFor(Isa isa, std::true_type) {
+    switch (isa) {
+        case Isa::Sse42:
+            return &lowerBoundSimd<Isa::Sse42, Key>;
+        case Isa::Avx2:
+            return &lowerBoundSimd<Isa::Avx2, Key>;
+        case Isa::Avx512:
+            return &lowerBoundSimd<Isa::Avx512, Key>;
+        default:
+            return &BranchFree::lowerBound<Key>;
+    }
+}
+
+// Keys we have no SIMD kernels for.
+template <class Key>
+typename SearchFn<Key>::type kernelFor(Isa, std::false_type) {
+    return &BranchFree::lowerBound<Key>;
+}
+
+template <class Key>
+inline unsigned simdLowerBound(const Key *keys, unsigned count, Key k,
+                               std::true_type) {
+    // Picked once per key type, so the hot path is a single indirect call.
+    static const typename SearchFn<Key>::type fn =
+        kernelFor<Key>(bestIsa(), std::true_type());
+    return fn(keys, count, k);
+}
+
+template <class Key>
+inline unsigned simdLowerBound(const Key *keys, unsigned count, Key k,
+                               std::false_type) {
+    return BranchFree::lowerBound(keys, count, k);
+}
+
+}  // namespace detail
+
+// A lower bound search using the given instruction set. The caller must make
+// sure that the CPU supports `isa`. Exposed for tests and benchmarks; trees
+// should use the `Simd` policy instead.
+template <class Key>
+inline unsigned lowerBoundIsa(Isa isa, const Key *keys, unsigned count,
+                              Key k) {
+    return detail::kernelFor<Key>(isa, detail::IsVectorizable<Key>())(
+        keys, count, k);
+}
+
+// SIMD search with runtime dispatch to the best instruction set available.
+struct Simd {
+    template <class Key>
+    static unsigned lowerBound(const Key *keys, unsigned count, Key k) {
+        return detail::simdLowerBound(keys, count, k,
+                                      detail::IsVectorizable<Key>());
+    }
+};
+
+}  // namespace search
+
+}  // namespace common
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef _BTREE_SPLIT_H_
+#define _BTREE_SPLIT_H_
+
+/*
+ * Split policies: where to split a full node.
+ *
+ * Splitting every node in half is the right thing for random inserts. For
+ * monotonically increasing keys (time stamps, sequence numbers, ids from a
+ * counter), however, all inserts go to the rightmost leaf, so every leaf to
+ * the left of it is left half empty forever, and the tree is twice as big as
+ * it needs to be.
+ *
+ * The trees take one of the following policies as a template argument:
+ * - `Halve`: always split in the middle.
+ * - `Append`: if the new entry goes to the very end of the node, leave the
+ *   node full and start a new, empty right node. Otherwise, split in the
+ *   middle.
+ * - `PositionAware`: if the recent inserts into the node formed a run (each
+ *   entry close to the previous one), split at the position of the new
+ *   entry, so that the node keeps everything before it. This covers appends
+ *   at the right edge as well as a sequential stream into the middle of the
+ *   key space. Otherwise, split in the middle.
+ *
+ * To detect runs, nodes remember the position of their last insert and the
+ * length of the current run (see `InsertHistory`). A node created by a split
+ * starts without history; since a node takes many inserts before it is split
+ * again, a run is detected again long before that.
+ *
+ * A policy returns how many of the `n` entries of the node stay in the left
+ * node, given the index `insertIndex` at which the new entry would be placed
+ * and the length `run` of the current run. The caller clamps the result to
+ * what the node type can do.
+ */
+
+#include <cstdint>
+
+namespace common {
+
+namespace split {
+
+// Tracks the positions of inserts into a node to detect ascending runs.
+//
+// Concurrent writers of increasing keys do not quite insert in order, so an
+// insert continues a run if it lands at most `slack` slots after the previous
+// one (or in the same slot, i.e. right before the previous entry).
+struct InsertHistory {
+    // How far apart two inserts may be to count as a run.
+    static const unsigned slack = 2;
+
+    // The index of the last insert into the node. Initially "-1", so that
+    // a run can start at the front of a new node.
+    uint16_t lastInsert = UINT16_MAX;
+
+    // The number of consecutive inserts that continued the run.
+    uint16_t run = 0;
+
+    // Record an insert at `index`.
+    void note(unsigned index) {
+        uint16_t distance = static_cast<uint16_t>(index - lastInsert);
+        if (distance <= slack) {
+            if (run < UINT16_MAX) run++;
+        } else {
+            run = 0;
+        }
+        lastInsert = static_cast<uint16_t>(index);
+    }
+};
+
+// Always split in the middle.
+struct Halve {
+    static unsigned splitPoint(unsigned n, unsigned insertIndex, unsigned run) {
+        (void)insertIndex;
+        (void)run;
+        return n / 2;
+    }
+};
+
+// Leave the node full if the new entry goes to its end.
+struct Append {
+    static unsigned splitPoint(unsigned n, unsigned insertIndex, unsigned run) {
+        (void)run;
+        return insertIndex == n ? n : n / 2;
+    }
+};
+
+// Split at the position of the new entry if it continues an ascending run.
+struct PositionAware {
+    // The length of a run after which we consider it a pattern.
+    static const unsigned minRun = 4;
+
+    static unsigned splitPoint(unsigned n, unsigned insertIndex, unsigned run) {
+        return run >= minRun ? insertIndex : n / 2;
+    }
+};
+
+}  // namespace split
+
+}  // namespace common
+
+#endif
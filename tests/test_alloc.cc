@@ -0,0 +1,172 @@
+#include "test-utils.h"
+
+#include "alloc.h"
+#include "btreeolc.h"
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <set>
+#include <thread>
+#include <vector>
+
+using Key = int64_t;
+using Value = int64_t;
+
+void test_alloc_alignment();
+void test_alloc_reuse();
+void test_alloc_concurrent();
+void test_alloc_thread_exit();
+void test_alloc_btree();
+
+int main() {
+    test_alloc_alignment();
+    test_alloc_reuse();
+    test_alloc_concurrent();
+    test_alloc_thread_exit();
+    test_alloc_btree();
+
+    std::cout << "SUCCESS :)" << std::endl;
+}
+
+// Nodes are aligned to their size class, up to a page, and do not overlap.
+void test_alloc_alignment() {
+    std::cout << "test_alloc_alignment" << std::endl;
+
+    using Alloc = common::alloc::HugePages<>;
+
+    for (size_t size : {64, 100, 256, 4096, 5000, 16384, 65536}) {
+        size_t align = 64;
+        while (align < size && align < 4096) align *= 2;
+
+        std::vector<char *> ptrs;
+        for (int i = 0; i < 1000; ++i) {
+            char *p = static_cast<char *>(Alloc::allocate(size));
+            assert(reinterpret_cast<uintptr_t>(p) % align == 0);
+            memset(p, i, size);
+            ptrs.push_back(p);
+        }
+        for (int i = 0; i < 1000; ++i) {
+            for (size_t j = 0; j < size; ++j) {
+                assert(ptrs[i][j] == static_cast<char>(i));
+            }
+        }
+        for (char *p : ptrs) {
+            Alloc::deallocate(p, size);
+        }
+    }
+}
+
+// Freed nodes are handed out again for the same size class.
+void test_alloc_reuse() {
+    std::cout << "test_alloc_reuse" << std::endl;
+
+    using Alloc = common::alloc::HugePages<>;
+
+    std::set<void *> freed;
+    for (int i = 0; i < 100; ++i) {
+        void *p = Alloc::allocate(32768);
+        freed.insert(p);
+    }
+    for (void *p : freed) {
+        Alloc::deallocate(p, 32768);
+    }
+    for (int i = 0; i < 100; ++i) {
+        void *p = Alloc::allocate(32768);
+        assert(freed.count(p) == 1);
+    }
+}
+
+// Threads allocating and freeing at the same time never get the same node,
+// and nodes freed by one thread can be used by another.
+void test_alloc_concurrent() {
+    std::cout << "test_alloc_concurrent" << std::endl;
+
+    using Alloc = common::alloc::HugePages<>;
+    constexpr int N_THREADS = 8;
+    constexpr int N = 20000;
+
+    // Each thread writes its id into its nodes and checks them before
+    // handing every other one to its neighbour to free.
+    std::vector<std::vector<void *>> handoff(N_THREADS);
+    auto f = [&handoff](int id) {
+        std::vector<void *> mine;
+        for (int i = 0; i < N; ++i) {
+            int *p = static_cast<int *>(Alloc::allocate(1024));
+            *p = id;
+            mine.push_back(p);
+        }
+        for (void *p : mine) {
+            assert(*static_cast<int *>(p) == id);
+        }
+        for (size_t i = 0; i < mine.size(); i += 2) {
+            Alloc::deallocate(mine[i], 1024);
+            handoff[id].push_back(mine[i + 1]);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_THREADS; ++i) {
+        threads.push_back(std::thread(f, i));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (int i = 0; i < N_THREADS; ++i) {
+        for (void *p : handoff[(i + 1) % N_THREADS]) {
+            Alloc::deallocate(p, 1024);
+        }
+    }
+}
+
+// The nodes cached by a thread are available to others after it exits.
+void test_alloc_thread_exit() {
+    std::cout << "test_alloc_thread_exit" << std::endl;
+
+    // A separate pool, so that no other test's nodes are around.
+    using Alloc = common::alloc::HugePages<0>;
+
+    std::set<void *> freed;
+    std::thread([&freed]() {
+        for (int i = 0; i < 10; ++i) {
+            freed.insert(Alloc::allocate(2048));
+        }
+        for (void *p : freed) {
+            Alloc::deallocate(p, 2048);
+        }
+    }).join();
+
+    for (int i = 0; i < 10; ++i) {
+        assert(freed.count(Alloc::allocate(2048)) == 1);
+    }
+}
+
+// The trees work with both allocators.
+template <class Alloc>
+void check_btree() {
+    constexpr int N = 100000;
+    btreeolc::BTree<Key, Value, common::search::Simd,
+                    common::split::PositionAware, Alloc>
+        btree;
+
+    const auto pairs = gen_data<Key, Value>(N);
+    for (const auto &pair : pairs) {
+        btree.insert(pair.first, pair.second);
+    }
+    for (const auto &pair : pairs) {
+        Value v;
+        assert(btree.lookup(pair.first, v) && v == pair.second);
+    }
+    for (const auto &pair : pairs) {
+        assert(btree.remove(pair.first));
+    }
+}
+
+void test_alloc_btree() {
+    std::cout << "test_alloc_btree" << std::endl;
+
+    check_btree<common::alloc::Malloc>();
+    check_btree<common::alloc::HugePages<>>();
+}
@@ -8,10 +8,14 @@
 #include "btreeolc.h"
 #include "btree-hybrid.h"
 #include "btree-bytereorder.h"
+#include "btree-partitioned.h"
 
 #include <unistd.h>
 #include <cassert>
+#include <algorithm>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <string.h>
 #include <thread>
 
@@ -20,12 +24,19 @@ enum class BTreeType {
     BTreeOLC = 1,
     BTreeHybrid = 2,
     BTreeByteReorder = 3,
+    BTreePartitioned = 4,
 };
 
 // All tests use the same type, for simplicity.
 using Key = int64_t;
 using Value = int64_t;
 
+// A forest of OLC trees, with a few partitions to begin with.
+typedef btree_partitioned::PartitionedBTree<
+    Key, Value, btreeolc::BTree<Key, btree_partitioned::Entry<Key, Value>>>
+    Forest;
+const std::vector<Key> forestBounds = {1000, 1 << 20, 1 << 28};
+
 // Test prototypes
 void test_simple_insert_read(common::BTreeBase<Key, Value> *btree);
 void test_insert_read(common::BTreeBase<Key, Value> *btree);
@@ -33,10 +44,19 @@ void test_insert_read_over(common::BTreeBase<Key, Value> *btree);
 void test_insert_read_concurrent_seq(common::BTreeBase<Key, Value> *btree);
 void test_insert_read_concurrent_rand(common::BTreeBase<Key, Value> *btree);
 void test_insert_read_concurrent_contend(common::BTreeBase<Key, Value> *btree);
+void test_insert_remove(common::BTreeBase<Key, Value> *btree);
+void test_insert_remove_concurrent(common::BTreeBase<Key, Value> *btree);
+void test_lookup_batch(common::BTreeBase<Key, Value> *btree);
+void test_lookup_batch_concurrent(common::BTreeBase<Key, Value> *btree);
+void test_read_modify_write(common::BTreeBase<Key, Value> *btree);
+void test_upsert_concurrent(common::BTreeBase<Key, Value> *btree);
+void test_bulk_load(
+    std::function<common::BTreeBase<Key, Value> *(
+        const std::vector<std::pair<Key, Value>> &, double)> new_bulk_btree_fn);
 
 void usage_and_exit() {
     std::cout << "Usage: ./test <TREE TYPE>\n"
-        << "<TREE TYPE> := olc|hybrid|br"
+        << "<TREE TYPE> := olc|hybrid|br|part"
         << std::endl;
     exit(1);
 }
@@ -58,6 +78,9 @@ int main(int argc, char **argv) {
     } else if (strncmp("br", argv[1], 3) == 0) {
         std::cout << "Testing Byte Reordering" << std::endl;
         type = BTreeType::BTreeByteReorder;
+    } else if (strncmp("part", argv[1], 5) == 0) {
+        std::cout << "Testing Partitioned" << std::endl;
+        type = BTreeType::BTreePartitioned;
     } else {
         usage_and_exit();
     }
@@ -71,6 +94,32 @@ int main(int argc, char **argv) {
                 return new btree_hybrid::BTree<Key, Value>();
             case BTreeType::BTreeByteReorder:
                 return new btree_bytereorder::BTree<Key, Value>();
+            case BTreeType::BTreePartitioned:
+                return new Forest(forestBounds);
+            default:
+                // should never happen
+                assert(false);
+                return nullptr;
+        }
+    };
+
+    // Construct the btree implementation we want to test from sorted pairs.
+    auto new_bulk_btree_fn =
+        [type](const std::vector<std::pair<Key, Value>> &pairs,
+               double fill) -> common::BTreeBase<Key, Value> * {
+        switch (type) {
+            case BTreeType::BTreeOLC:
+                return new btreeolc::BTree<Key, Value>(
+                    pairs.begin(), pairs.end(), fill);
+            case BTreeType::BTreeHybrid:
+                return new btree_hybrid::BTree<Key, Value>(
+                    pairs.begin(), pairs.end(), fill);
+            case BTreeType::BTreeByteReorder:
+                return new btree_bytereorder::BTree<Key, Value>(
+                    pairs.begin(), pairs.end(), fill);
+            case BTreeType::BTreePartitioned:
+                return new Forest(pairs.begin(), pairs.end(), forestBounds,
+                                  fill);
             default:
                 // should never happen
                 assert(false);
@@ -85,6 +134,13 @@ int main(int argc, char **argv) {
     test_insert_read_concurrent_contend(new_btree_fn());
     test_insert_read_concurrent_seq(new_btree_fn());
     test_insert_read_concurrent_rand(new_btree_fn());
+    test_insert_remove(new_btree_fn());
+    test_insert_remove_concurrent(new_btree_fn());
+    test_lookup_batch(new_btree_fn());
+    test_lookup_batch_concurrent(new_btree_fn());
+    test_read_modify_write(new_btree_fn());
+    test_upsert_concurrent(new_btree_fn());
+    test_bulk_load(new_bulk_btree_fn);
 
     // Done!
     std::cout << "SUCCESS :)" << std::endl;
@@ -247,3 +303,291 @@ void test_insert_read_concurrent_contend(common::BTreeBase<Key, Value> *btree) {
         thread.join();
     }
 }
+
+// Insert a large number of random k,v pairs, remove most of them again, and
+// check that exactly the remaining ones can be read back. Then reinsert.
+void test_insert_remove(common::BTreeBase<Key, Value> *btree) {
+    std::cout << "test_insert_remove" << std::endl;
+
+    constexpr int TEST_SIZE = 100000;
+
+    const auto pairs = gen_data<Key, Value>(TEST_SIZE);
+    for (const auto& pair : pairs) {
+        btree->insert(pair);
+    }
+
+    // Remove all but every tenth pair.
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        if (i % 10 != 0) {
+            assert(btree->remove(pairs[i].first));
+        }
+    }
+
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        Value v;
+        bool found = btree->lookup(pairs[i].first, v);
+        assert(found == (i % 10 == 0));
+        if (found) {
+            assert(v == pairs[i].second);
+        }
+        assert(!btree->remove(pairs[i].first) == (i % 10 != 0));
+    }
+
+    // The tree is empty now. Make sure it still works.
+    for (const auto& pair : pairs) {
+        btree->insert(pair);
+    }
+    for (const auto& pair : pairs) {
+        Value v;
+        bool found = btree->lookup(pair.first, v);
+        assert(found);
+        assert(v == pair.second);
+    }
+}
+
+// Concurrently insert and remove disjoint ranges of sequential keys, while
+// keeping some keys around. Check that all kept keys can be read back.
+void test_insert_remove_concurrent(common::BTreeBase<Key, Value> *btree) {
+    std::cout << "test_insert_remove_concurrent" << std::endl;
+
+    constexpr int TEST_SIZE = 100000;
+    constexpr int N_THREADS = 10;
+    constexpr int N_ROUNDS = 3;
+
+    // Each thread owns keys equal to its id mod N_THREADS.
+    auto f = [btree](int id) {
+        for (int round = 0; round < N_ROUNDS; ++round) {
+            for (Key k = id; k < TEST_SIZE; k += N_THREADS) {
+                btree->insert(k, k);
+            }
+            for (Key k = id; k < TEST_SIZE; k += N_THREADS) {
+                // Keep every 100th key.
+                if (k % 100 != 0) {
+                    bool removed = btree->remove(k);
+                    assert(removed);
+                }
+            }
+        }
+    };
+
+    // Start threads.
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_THREADS; ++i) {
+        threads.push_back(std::thread(f, i));
+    }
+
+    // Wait for threads to complete
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    for (Key k = 0; k < TEST_SIZE; ++k) {
+        Value v;
+        bool found = btree->lookup(k, v);
+        assert(found == (k % 100 == 0));
+        if (found) {
+            assert(v == k);
+        }
+    }
+}
+
+// Insert the even keys, and look up all keys in batches of various sizes.
+void test_lookup_batch(common::BTreeBase<Key, Value> *btree) {
+    std::cout << "test_lookup_batch" << std::endl;
+
+    constexpr int TEST_SIZE = 100000;
+
+    for (Key k = 0; k < TEST_SIZE; k += 2) {
+        btree->insert(k, k * 3);
+    }
+
+    std::vector<Key> keys;
+    for (Key k = -10; k < TEST_SIZE + 10; ++k) {
+        keys.push_back(k);
+    }
+    std::random_shuffle(keys.begin(), keys.end());
+
+    std::vector<Value> results(keys.size());
+    std::unique_ptr<bool[]> found(new bool[keys.size()]);
+    for (size_t batch : {1, 7, 16, 100, 4096}) {
+        for (size_t i = 0; i < keys.size(); i += batch) {
+            size_t n = std::min(batch, keys.size() - i);
+            btree->lookup_batch(&keys[i], n, &results[i], &found[i]);
+        }
+
+        for (size_t i = 0; i < keys.size(); ++i) {
+            Key k = keys[i];
+            bool present = k >= 0 && k < TEST_SIZE && k % 2 == 0;
+            assert(found[i] == present);
+            if (present) {
+                assert(results[i] == k * 3);
+            }
+        }
+    }
+}
+
+// Look up keys in batches while other threads keep inserting and splitting
+// nodes. Keys inserted before the readers started must always be found.
+void test_lookup_batch_concurrent(common::BTreeBase<Key, Value> *btree) {
+    std::cout << "test_lookup_batch_concurrent" << std::endl;
+
+    constexpr int TEST_SIZE = 1000000;
+    constexpr int N_THREADS = 4;
+    constexpr int BATCH = 64;
+
+    // Multiples of N_THREADS are there from the beginning.
+    for (Key k = 0; k < TEST_SIZE; k += N_THREADS) {
+        btree->insert(k, k);
+    }
+
+    auto writer = [btree](int id) {
+        for (Key k = id; k < TEST_SIZE; k += N_THREADS) {
+            btree->insert(k, k);
+        }
+    };
+
+    auto reader = [btree]() {
+        Key keys[BATCH];
+        Value results[BATCH];
+        bool found[BATCH];
+        for (Key start = 0; start < TEST_SIZE; start += BATCH) {
+            for (int i = 0; i < BATCH; ++i) {
+                keys[i] = start + i;
+            }
+            btree->lookup_batch(keys, BATCH, results, found);
+            for (int i = 0; i < BATCH; ++i) {
+                if (keys[i] % N_THREADS == 0) {
+                    assert(found[i]);
+                }
+                if (found[i]) {
+                    assert(results[i] == keys[i]);
+                }
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < N_THREADS; ++i) {
+        threads.push_back(std::thread(writer, i));
+        threads.push_back(std::thread(reader));
+    }
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// The conditional inserts and updates tell present keys from absent ones.
+void test_read_modify_write(common::BTreeBase<Key, Value> *btree) {
+    std::cout << "test_read_modify_write" << std::endl;
+
+    constexpr int TEST_SIZE = 100000;
+
+    // Even keys are there from the beginning.
+    for (Key k = 0; k < TEST_SIZE; k += 2) {
+        btree->insert(k, k);
+    }
+
+    for (Key k = 0; k < TEST_SIZE; ++k) {
+        bool present = k % 2 == 0;
+        Value v;
+        assert(btree->insert_if_absent(k, -k) == !present);
+        assert(btree->lookup(k, v) && v == (present ? k : -k));
+        assert(btree->update_if_present(k, k + 1));
+        assert(!btree->update_if_present(k + TEST_SIZE, 0));
+        assert(!btree->lookup(k + TEST_SIZE, v));
+        assert(!btree->get_or_insert(k, 0, v) && v == k + 1);
+        assert(btree->get_or_insert(k + TEST_SIZE, k, v) && v == k);
+        assert(!btree->upsert(k, [](Value &value) { value *= 2; }));
+        assert(btree->lookup(k, v) && v == 2 * (k + 1));
+    }
+
+    // A counter starts at zero.
+    Key k = 2 * TEST_SIZE;
+    assert(btree->upsert(k, [](Value &value) { value++; }));
+    assert(!btree->upsert(k, [](Value &value) { value++; }));
+    Value v;
+    assert(btree->lookup(k, v) && v == 2);
+}
+
+// Concurrent increments of the same counters are not lost.
+void test_upsert_concurrent(common::BTreeBase<Key, Value> *btree) {
+    std::cout << "test_upsert_concurrent" << std::endl;
+
+    constexpr int TEST_SIZE = 1000000;
+    constexpr int N_THREADS = 4;
+    constexpr int N_KEYS = 5000;
+
+    // Half of the counters are inserted on first use.
+    for (Key k = 0; k < N_KEYS; k += 2) {
+        btree->insert(k, 0);
+    }
+
+    auto f = [btree](int id) {
+        for (int i = 0; i < TEST_SIZE / N_THREADS; ++i) {
+            Key k = (i * 7919 + id) % N_KEYS;
+            btree->upsert(k, [](Value &value) { value++; });
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_THREADS; ++i) {
+        threads.push_back(std::thread(f, i));
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    Value total = 0;
+    for (Key k = 0; k < N_KEYS; ++k) {
+        Value v;
+        assert(btree->lookup(k, v));
+        total += v;
+    }
+    assert(total == TEST_SIZE);
+}
+
+// Bulk load trees of various sizes and fill factors, read everything back,
+// and make sure the trees still take inserts and removes afterwards.
+void test_bulk_load(
+    std::function<common::BTreeBase<Key, Value> *(
+        const std::vector<std::pair<Key, Value>> &, double)> new_bulk_btree_fn) {
+    std::cout << "test_bulk_load" << std::endl;
+
+    for (size_t size : {0, 1, 2, 100, 1000, 1000000}) {
+        for (double fill : {1.0, 0.7, 0.1}) {
+            // Even keys are bulk loaded, odd keys are inserted later.
+            std::vector<std::pair<Key, Value>> pairs;
+            for (size_t i = 0; i < size; ++i) {
+                pairs.push_back({Key(2 * i), Value(i)});
+            }
+
+            auto btree = new_bulk_btree_fn(pairs, fill);
+
+            for (const auto& pair : pairs) {
+                Value v;
+                assert(btree->lookup(pair.first, v));
+                assert(v == pair.second);
+                assert(!btree->lookup(pair.first + 1, v));
+            }
+            Value v;
+            assert(!btree->lookup(-1, v));
+
+            for (size_t i = 0; i < size; ++i) {
+                btree->insert(2 * i + 1, i);
+            }
+            for (size_t i = 0; i < size; i += 2) {
+                assert(btree->remove(2 * i));
+            }
+            for (size_t i = 0; i < 2 * size; ++i) {
+                bool present = i % 2 == 1 || i % 4 == 2;
+                assert(btree->lookup(i, v) == present);
+                if (present) {
+                    assert(v == Value(i / 2));
+                }
+            }
+
+            delete btree;
+        }
+    }
+}
@@ -0,0 +1,1301 @@
+#include "test-utils.h"
+
+#include "btreeolc.h"
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using Key = int64_t;
+using Value = int64_t;
+
+void test_btree_olc_scan_across_leaves();
+void test_btree_olc_scan_bulk_loaded();
+void test_btree_olc_scan_concurrent_split();
+void test_btree_olc_split_policy();
+void test_btree_olc_node_sizes();
+void test_btree_olc_flat_combining();
+void test_btree_olc_queued_lock();
+void test_btree_olc_path_resume();
+void test_btree_olc_finger();
+void test_btree_olc_append();
+void test_btree_olc_insert_buffers();
+void test_btree_olc_bepsilon();
+void test_btree_olc_segments();
+void test_btree_olc_contention_splits();
+void test_btree_olc_preallocate();
+void test_btree_olc_read_modify_write();
+void test_btree_olc_redistribute_inner();
+
+int main() {
+    test_btree_olc_scan_across_leaves();
+    test_btree_olc_scan_bulk_loaded();
+    test_btree_olc_scan_concurrent_split();
+    test_btree_olc_split_policy();
+    test_btree_olc_node_sizes();
+    test_btree_olc_flat_combining();
+    test_btree_olc_queued_lock();
+    test_btree_olc_path_resume();
+    test_btree_olc_finger();
+    test_btree_olc_append();
+    test_btree_olc_insert_buffers();
+    test_btree_olc_bepsilon();
+    test_btree_olc_segments();
+    test_btree_olc_contention_splits();
+    test_btree_olc_preallocate();
+    test_btree_olc_read_modify_write();
+    test_btree_olc_redistribute_inner();
+
+    std::cout << "SUCCESS :)" << std::endl;
+}
+
+// A scan is not cut short at the end of a leaf.
+void test_btree_olc_scan_across_leaves() {
+    std::cout << "test_btree_olc_scan_across_leaves" << std::endl;
+
+    constexpr int N = 100000;
+    constexpr int RANGE = 1000;
+    btreeolc::BTree<Key, Value> btree;
+
+    const auto pairs = gen_data<Key, Value>(N);
+    for (const auto &pair : pairs) {
+        btree.insert(pair.first, pair.first);
+    }
+
+    std::vector<Value> output(RANGE);
+    Key k = 0;
+    size_t total = 0;
+    while (true) {
+        uint64_t count = btree.scan(k, RANGE, output.data());
+        for (uint64_t i = 1; i < count; ++i) {
+            assert(output[i - 1] < output[i]);
+        }
+        total += count;
+        if (count < RANGE) break;
+        assert(output[0] >= k);
+        k = output[count - 1] + 1;
+    }
+    assert(total == pairs.size());
+}
+
+// Bulk loaded trees have their siblings linked.
+void test_btree_olc_scan_bulk_loaded() {
+    std::cout << "test_btree_olc_scan_bulk_loaded" << std::endl;
+
+    constexpr int N = 1000000;
+    auto pairs = gen_data_seq<Key, Value>(N);
+    btreeolc::BTree<Key, Value> btree(pairs.begin(), pairs.end(), 0.5);
+
+    std::vector<Value> output(N);
+    assert(btree.scan(0, N, output.data()) == N);
+    for (int i = 0; i < N; ++i) {
+        assert(output[i] == i);
+    }
+    assert(btree.scan(N / 2, N, output.data()) == N / 2);
+    assert(output[0] == N / 2);
+}
+
+// Scans and lookups see every key that was inserted before they started,
+// while other threads keep splitting nodes to the right of them.
+void test_btree_olc_scan_concurrent_split() {
+    std::cout << "test_btree_olc_scan_concurrent_split" << std::endl;
+
+    constexpr int N = 200000;
+    constexpr int N_WRITERS = 4;
+    constexpr int RANGE = 500;
+    btreeolc::BTree<Key, Value> btree;
+
+    // Even keys are there from the beginning.
+    for (Key k = 0; k < 2 * N; k += 2) {
+        btree.insert(k, k);
+    }
+
+    std::atomic<int> writersDone{0};
+    auto writer = [&btree, &writersDone](int id) {
+        for (Key k = 2 * id + 1; k < 2 * N; k += 2 * N_WRITERS) {
+            btree.insert(k, k);
+        }
+        writersDone++;
+    };
+
+    auto reader = [&btree, &writersDone]() {
+        std::vector<Value> output(RANGE);
+        while (writersDone < N_WRITERS) {
+            for (Key k = 0; k < 2 * N; k += 2 * RANGE) {
+                uint64_t count = btree.scan(k, RANGE, output.data());
+                assert(count == RANGE);
+                assert(output[0] == k);
+                for (uint64_t i = 1; i < count; ++i) {
+                    assert(output[i - 1] < output[i]);
+                }
+
+                // All even keys in between must be there.
+                Key even = k;
+                for (uint64_t i = 0; i < count; ++i) {
+                    if (output[i] % 2 == 0) {
+                        assert(output[i] == even);
+                        even += 2;
+                    }
+                }
+
+                Value v;
+                assert(btree.lookup(k, v) && v == k);
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_WRITERS; ++i) {
+        threads.push_back(std::thread(writer, i));
+        threads.push_back(std::thread(reader));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (Key k = 0; k < 2 * N; ++k) {
+        Value v;
+        assert(btree.lookup(k, v) && v == k);
+    }
+}
+
+// An OLC tree with the default parameters but `Split`, and the modes `Modes`
+// on (see `btreeolc::mode`).
+template <unsigned Modes, class Split = common::split::PositionAware>
+using ModeTree =
+    btreeolc::BTree<Key, Value, common::search::Simd, Split,
+                    common::alloc::Default, btreeolc::pageSize,
+                    btreeolc::pageSize, 0, false, Modes>;
+
+// The number of leaves of `btree`, counted along the sibling pointers.
+template <class BTree>
+size_t count_leaves(BTree &btree) {
+    btreeolc::NodeBase *node = btree.root;
+    while (node->type == btreeolc::PageType::BTreeInner) {
+        node = static_cast<typename BTree::Inner *>(node)->children[0];
+    }
+    size_t leaves = 0;
+    for (; node; node = node->next) {
+        leaves++;
+    }
+    return leaves;
+}
+
+// Insert `keys` into a new tree with split policy `Split` from `n_threads`
+// threads, check that they are all there, and return the number of leaves.
+template <class Split>
+size_t leaves_after_insert(const std::vector<Key> &keys, int n_threads) {
+    btreeolc::BTree<Key, Value, common::search::Simd, Split> btree;
+
+    // The threads take the keys in order from a shared counter, like the
+    // writers in the benchmark do.
+    std::atomic<size_t> next{0};
+    auto f = [&btree, &keys, &next]() {
+        for (size_t i = next++; i < keys.size(); i = next++) {
+            btree.insert(keys[i], keys[i]);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n_threads; ++i) {
+        threads.push_back(std::thread(f));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (Key k : keys) {
+        Value v;
+        assert(btree.lookup(k, v) && v == k);
+    }
+    return count_leaves(btree);
+}
+
+// Appending increasing keys leaves full leaves behind with the append-aware
+// policies, and half full ones when halving. Random keys are split in the
+// middle by all of them.
+void test_btree_olc_split_policy() {
+    std::cout << "test_btree_olc_split_policy" << std::endl;
+
+    constexpr size_t N = 1000000;
+    const size_t minLeaves = N / btreeolc::BTree<Key, Value>::Leaf::maxEntries;
+
+    std::vector<Key> seq;
+    for (size_t i = 0; i < N; ++i) {
+        seq.push_back(i);
+    }
+
+    using namespace common::split;
+    size_t halve = leaves_after_insert<Halve>(seq, 1);
+    size_t append = leaves_after_insert<Append>(seq, 1);
+    size_t aware = leaves_after_insert<PositionAware>(seq, 1);
+    assert(halve >= 2 * minLeaves - 1);
+    assert(append <= minLeaves + 1);
+    assert(aware <= minLeaves + 1);
+
+    // Concurrent appends arrive slightly out of order.
+    size_t awareConcurrent = leaves_after_insert<PositionAware>(seq, 4);
+    assert(awareConcurrent < halve * 3 / 4);
+
+    // Random keys.
+    std::vector<Key> rand;
+    for (const auto &pair : gen_data<Key, Value>(N)) {
+        rand.push_back(pair.first);
+    }
+    size_t halveRand = leaves_after_insert<Halve>(rand, 1);
+    size_t awareRand = leaves_after_insert<PositionAware>(rand, 1);
+    assert(awareRand <= halveRand * 11 / 10);
+}
+
+// Insert, look up, scan and remove with leaves of `LeafSize` and inner nodes
+// of `InnerSize` bytes, from several threads at once.
+template <uint64_t LeafSize, uint64_t InnerSize>
+void check_node_sizes() {
+    using BTree = btreeolc::BTree<Key, Value, common::search::Simd,
+                                  common::split::PositionAware,
+                                  common::alloc::Default, LeafSize, InnerSize>;
+    static_assert(sizeof(typename BTree::Leaf) <= LeafSize, "leaf too big");
+    static_assert(sizeof(typename BTree::Inner) <= InnerSize, "inner too big");
+
+    constexpr int N = 200000;
+    constexpr int N_THREADS = 4;
+    BTree btree;
+
+    const auto pairs = gen_data<Key, Value>(N);
+    auto insert = [&btree, &pairs](int id) {
+        for (size_t i = id; i < pairs.size(); i += N_THREADS) {
+            btree.insert(pairs[i].first, pairs[i].second);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_THREADS; ++i) {
+        threads.push_back(std::thread(insert, i));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (const auto &pair : pairs) {
+        Value v;
+        assert(btree.lookup(pair.first, v) && v == pair.second);
+    }
+    std::vector<Value> output(N);
+    assert(btree.scan(0, N, output.data()) == pairs.size());
+
+    // Remove the odd keys.
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        if (pairs[i].first % 2) {
+            assert(btree.remove(pairs[i].first));
+        }
+    }
+    for (const auto &pair : pairs) {
+        Value v;
+        assert(btree.lookup(pair.first, v) == (pair.first % 2 == 0));
+    }
+
+    // Bulk loading packs nodes of the same sizes.
+    const auto seq = gen_data_seq<Key, Value>(N);
+    BTree bulk(seq.begin(), seq.end());
+    assert(bulk.scan(0, N, output.data()) == N);
+    for (int i = 0; i < N; ++i) {
+        assert(output[i] == i);
+    }
+}
+
+// Trees work with the smallest and largest node sizes, for leaves and inner
+// nodes independently.
+void test_btree_olc_node_sizes() {
+    std::cout << "test_btree_olc_node_sizes" << std::endl;
+
+    check_node_sizes<256, 256>();
+    check_node_sizes<256, 64 * 1024>();
+    check_node_sizes<64 * 1024, 256>();
+    check_node_sizes<64 * 1024, 64 * 1024>();
+
+    // With all modes off, the fixed part of a leaf is just the node header
+    // and the high key: none of the modes takes space. A 4KB leaf of 8-byte
+    // keys and values holds 253 entries, two less than without the sibling
+    // pointer and high key of the B-link protocol and the writer queue of
+    // `OptLock`.
+    using Leaf = btreeolc::BTree<Key, Value>::Leaf;
+    static_assert(sizeof(Leaf::Header) ==
+                      sizeof(btreeolc::NodeBase) + sizeof(Key),
+                  "a leaf without modes has no mode state");
+    static_assert(Leaf::maxEntries == 253, "the default leaf capacity");
+
+    // Each mode only takes space when it is on.
+    using btreeolc::mode::Append;
+    using btreeolc::mode::ContentionSplits;
+    using btreeolc::mode::FlatCombining;
+    using btreeolc::mode::Finger;
+    using btreeolc::mode::Preallocate;
+    static_assert(ModeTree<Finger | Preallocate>::Leaf::maxEntries ==
+                      Leaf::maxEntries,
+                  "fingers and spare leaves keep no state in leaves");
+    static_assert(ModeTree<FlatCombining>::Leaf::maxEntries <
+                          Leaf::maxEntries &&
+                      ModeTree<ContentionSplits>::Leaf::maxEntries <
+                          Leaf::maxEntries &&
+                      ModeTree<Append>::Leaf::maxEntries < Leaf::maxEntries,
+                  "the other modes keep state in leaves");
+}
+
+// With flat combining, concurrent appends, inserts into the middle, and
+// removes (which merge and redistribute leaves) all take effect exactly once.
+void test_btree_olc_flat_combining() {
+    std::cout << "test_btree_olc_flat_combining" << std::endl;
+
+    constexpr Key N = 400000;
+    constexpr int N_THREADS = 8;
+    ModeTree<btreeolc::mode::FlatCombining> btree;
+
+    // Everyone appends to the rightmost leaf.
+    std::atomic<Key> next{0};
+    auto append = [&btree, &next]() {
+        for (Key k = next++; k < N; k = next++) {
+            btree.insert(k, k);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_THREADS; ++i) {
+        threads.push_back(std::thread(append));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+
+    std::vector<Value> output(2 * N);
+    assert(btree.scan(0, N, output.data()) == N);
+    for (Key k = 0; k < N; ++k) {
+        assert(output[k] == k);
+    }
+
+    // Half of the threads remove most of the keys, so that leaves are merged
+    // and redistributed, while the other half keep appending and fill in
+    // every tenth key in the middle.
+    next = N;
+    auto remove = [&btree](int id) {
+        for (Key k = id; k < N; k += N_THREADS / 2) {
+            if (k % 10) {
+                assert(btree.remove(k));
+            }
+        }
+    };
+    auto insert = [&btree, &next](int id) {
+        for (Key k = next++; k < 2 * N; k = next++) {
+            btree.insert(k, k);
+        }
+        for (Key k = 10 * id; k < N; k += 10 * N_THREADS / 2) {
+            btree.insert(k, k + 1);
+        }
+    };
+    for (int i = 0; i < N_THREADS / 2; ++i) {
+        threads.push_back(std::thread(remove, i));
+        threads.push_back(std::thread(insert, i));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (Key k = 0; k < 2 * N; ++k) {
+        Value v;
+        bool found = btree.lookup(k, v);
+        if (k >= N) {
+            assert(found && v == k);
+        } else if (k % 10 == 0) {
+            assert(found && v == k + 1);
+        } else {
+            assert(!found);
+        }
+    }
+    assert(btree.scan(0, 2 * N, output.data()) == N + N / 10);
+}
+
+// Writers that queue up for a lock and writers that grab it optimistically
+// exclude each other, and queued writers are told when the lock becomes
+// obsolete.
+void test_btree_olc_queued_lock() {
+    std::cout << "test_btree_olc_queued_lock" << std::endl;
+
+    constexpr int N = 20000;
+    constexpr int N_THREADS = 8;
+    btreeolc::OptLock lock;
+    uint64_t counter = 0;
+
+    // Even threads queue, odd ones retry optimistically. Some of them take a
+    // nap while holding the lock, so that the others have to park.
+    auto f = [&lock, &counter](int id) {
+        for (int i = 0; i < N; ++i) {
+            bool needRestart = false;
+            if (id % 2 == 0) {
+                lock.writeLockQueued(needRestart);
+                assert(!needRestart);
+            } else {
+                do {
+                    needRestart = false;
+                    lock.writeLockOrRestart(needRestart);
+                } while (needRestart);
+            }
+            counter++;
+            if (i % 1000 == 0) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+            lock.writeUnlock();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_THREADS; ++i) {
+        threads.push_back(std::thread(f, i));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    threads.clear();
+    assert(counter == uint64_t(N) * N_THREADS);
+    assert(lock.typeVersionLockObsolete == 0b100 + 4 * counter);
+    assert(lock.queueTail == nullptr);
+
+    // Queue up behind a lock that is then made obsolete.
+    bool needRestart = false;
+    lock.writeLockOrRestart(needRestart);
+    assert(!needRestart);
+    std::atomic<int> restarted{0};
+    for (int i = 0; i < N_THREADS; ++i) {
+        threads.push_back(std::thread([&lock, &restarted]() {
+            bool needRestart = false;
+            lock.writeLockQueued(needRestart);
+            assert(needRestart);
+            restarted++;
+        }));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    lock.writeUnlockObsolete();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    assert(restarted == N_THREADS);
+}
+
+// A descent that has to restart resumes from the deepest inner node on its
+// path that has not changed.
+void test_btree_olc_path_resume() {
+    std::cout << "test_btree_olc_path_resume" << std::endl;
+
+    using BTree = btreeolc::BTree<Key, Value>;
+    constexpr int N = 1000000;
+    const auto pairs = gen_data_seq<Key, Value>(N);
+    BTree btree(pairs.begin(), pairs.end(), 0.5);
+    const unsigned height = btree.root.load()->level;
+    assert(height >= 2);
+
+    common::epoch::Guard guard;
+    BTree::Path path;
+    uint64_t version;
+    BTree::LowFence fence;
+    bool needRestart = false;
+    btreeolc::NodeBase *leaf =
+        btree.findNode(N / 2, 0, version, needRestart, nullptr, &path);
+    assert(!needRestart && leaf->level == 0);
+    assert(path.depth == height);
+    btreeolc::NodeBase *parent = path.nodes[height - 1];
+    assert(parent->level == 1);
+
+    // Changing the leaf does not change its parent, so we resume there.
+    btree.insert(N / 2, 0);
+    assert(btree.findNode(N / 2, 0, version, needRestart, nullptr, &path) ==
+           leaf);
+    assert(!needRestart && path.depth == height);
+    assert(path.resume(0, version, fence) == parent);
+    assert(path.depth == height - 1);
+
+    // Changing the parent makes us resume from the grandparent.
+    btree.findNode(N / 2, 0, version, needRestart, nullptr, &path);
+    bool locked = false;
+    parent->writeLockOrRestart(locked);
+    assert(!locked);
+    parent->writeUnlock();
+    assert(path.resume(0, version, fence) == path.nodes[height - 2]);
+
+    // The lookup still finds everything.
+    for (Key k = 0; k < N; ++k) {
+        Value v;
+        assert(btree.lookup(k, v) && v == (k == N / 2 ? 0 : k));
+    }
+}
+
+// With fingers, inserts and lookups of nearby keys skip the descent, and a
+// finger is never used for a key outside of its leaf, for another tree, or
+// after its leaf may have been freed.
+void test_btree_olc_finger() {
+    std::cout << "test_btree_olc_finger" << std::endl;
+
+    using BTree = ModeTree<btreeolc::mode::Finger>;
+    constexpr int N = 1000000;
+    constexpr int N_THREADS = 4;
+
+    // Sequential inserts and lookups, alternating between two trees.
+    BTree a, b;
+    for (Key k = 0; k < N; ++k) {
+        a.insert(k, k);
+        b.insert(N - k, k);
+    }
+    for (Key k = 0; k < N; ++k) {
+        Value v;
+        assert(a.lookup(k, v) && v == k);
+        assert(b.lookup(N - k, v) && v == k);
+        assert(!a.lookup(N + k, v));
+    }
+
+    // The finger is the leaf of the last key, and it is used for the keys
+    // next to it, but not for keys of other leaves.
+    {
+        common::epoch::Guard guard;
+        Value v;
+        assert(a.lookup(N / 2, v));
+        uint64_t version;
+        BTree::LowFence fence;
+        auto leaf = a.tryFinger(N / 2, version, fence);
+        assert(leaf && leaf == BTree::finger().leaf);
+        assert(leaf->keys[0] <= N / 2 && N / 2 <= leaf->keys[leaf->count - 1]);
+        assert(a.tryFinger(leaf->keys[0], version, fence) == leaf);
+        assert(!a.tryFinger(leaf->keys[0] - 1, version, fence));
+        assert(!a.tryFinger(leaf->highKey + 1, version, fence));
+        assert(!b.tryFinger(N / 2, version, fence));
+    }
+
+    // Once the epoch moves on, the finger is not used anymore.
+    {
+        Value v;
+        assert(a.lookup(N / 2, v));
+        common::epoch::manager().tryAdvance();
+        common::epoch::Guard guard;
+        uint64_t version;
+        BTree::LowFence fence;
+        assert(!a.tryFinger(N / 2, version, fence));
+    }
+
+    // Concurrent inserts, lookups and removes of interleaved ranges, so that
+    // leaves are split and merged under the fingers of other threads.
+    BTree c;
+    auto f = [&c](int id) {
+        for (Key k = id; k < N; k += N_THREADS) {
+            c.insert(k, k);
+        }
+        for (Key k = id; k < N; k += N_THREADS) {
+            Value v;
+            assert(c.lookup(k, v) && v == k);
+            if (k % 3 == 0) assert(c.remove(k));
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_THREADS; ++i) {
+        threads.push_back(std::thread(f, i));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    for (Key k = 0; k < N; ++k) {
+        Value v;
+        assert(c.lookup(k, v) == (k % 3 != 0));
+    }
+}
+
+// In append mode, increasing keys go to the append region of the rightmost
+// leaf without locking it, and they are visible to lookups and scans before
+// and after the region is merged into the leaf.
+void test_btree_olc_append() {
+    std::cout << "test_btree_olc_append" << std::endl;
+
+    using BTree = ModeTree<btreeolc::mode::Append>;
+    constexpr int N = 1000000;
+    constexpr int N_THREADS = 4;
+
+    // The first insert locks the leaf and opens its region, the others are
+    // appended. Anything that locks the leaf merges them.
+    {
+        BTree btree;
+        for (Key k = 0; k < 10; ++k) {
+            btree.insert(k, k);
+        }
+        auto leaf = static_cast<BTree::Leaf *>(btree.root.load());
+        assert(leaf->count == 1 && leaf->appendsOpen());
+        Value v;
+        std::vector<Value> output(20);
+        for (Key k = 0; k < 10; ++k) {
+            assert(btree.lookup(k, v) && v == k);
+            assert(btree.scan(k, 20, output.data()) == uint64_t(10 - k));
+            for (Key i = k; i < 10; ++i) assert(output[i - k] == i);
+        }
+        btree.insert(5, 50);
+        assert(btree.lookup(5, v) && v == 50);
+        assert(btree.remove(3) && !btree.lookup(3, v));
+        assert(leaf->count == 9 && !leaf->appendsOpen());
+        assert(btree.lookup(5, v) && v == 50);
+    }
+
+    // Writers take increasing keys from a shared counter, while a reader
+    // scans the tail of the tree.
+    BTree btree;
+    std::atomic<Key> counter(0);
+    std::atomic<bool> writing(true);
+    auto writer = [&btree, &counter]() {
+        for (Key k = counter++; k < N; k = counter++) {
+            btree.insert(k, k);
+        }
+    };
+    auto reader = [&btree, &counter, &writing]() {
+        std::vector<Value> output(1000);
+        while (writing) {
+            Value v;
+            Key from = counter > 500 ? counter - 500 : 0;
+            uint64_t count = btree.scan(from, 1000, output.data());
+            for (uint64_t i = 0; i < count; ++i) {
+                assert(btree.lookup(output[i], v) && v == output[i]);
+                if (i > 0) assert(output[i - 1] < output[i]);
+            }
+        }
+    };
+    std::thread readerThread(reader);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_THREADS; ++i) {
+        threads.push_back(std::thread(writer));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    writing = false;
+    readerThread.join();
+
+    std::vector<Value> output(N + 1);
+    assert(btree.scan(0, N + 1, output.data()) == N);
+    for (Key k = 0; k < N; ++k) {
+        Value v;
+        assert(btree.lookup(k, v) && v == k);
+        assert(output[k] == k);
+    }
+
+    // The leaves are left (almost) full by the split policy.
+    assert(count_leaves(btree) < N / BTree::Leaf::maxEntries * 11 / 10);
+}
+
+// With insert buffers, inserts are visible to lookups, scans and removes both
+// while they are buffered and after they have been merged into the tree.
+void test_btree_olc_insert_buffers() {
+    std::cout << "test_btree_olc_insert_buffers" << std::endl;
+
+    using BTree = btreeolc::BTree<Key, Value>;
+    constexpr int N = 1000000;
+    constexpr int N_THREADS = 4;
+
+    {
+        BTree btree;
+        btree.insertBufferSize = 64;
+        for (Key k = 0; k < 1000; ++k) {
+            btree.insert(k, k);
+        }
+        auto buffer = btree.buffers.load();
+        assert(buffer && !buffer->next && buffer->count == 1000 % 64);
+
+        // Newer values replace older ones, in the buffer and in the tree.
+        Value v;
+        btree.insert(999, 0);
+        btree.insert(0, 0);
+        assert(btree.lookup(999, v) && v == 0);
+        assert(btree.lookup(0, v) && v == 0);
+        std::vector<Value> output(2000);
+        assert(btree.scan(0, 2000, output.data()) == 1000);
+        for (Key k = 1; k < 999; ++k) {
+            assert(output[k] == k);
+        }
+
+        assert(btree.remove(998) && btree.remove(10));
+        assert(!btree.lookup(998, v) && !btree.lookup(10, v));
+        btree.flushInsertBuffers();
+        assert(buffer->count == 0);
+        assert(btree.scanLeaves(0, 2000, output.data(), nullptr) == 998);
+        assert(btree.lookup(0, v) && v == 0);
+        assert(btree.lookup(999, v) && v == 0);
+    }
+
+    // One thread inserts a key after another thread did. The second value
+    // wins, even if the second thread's buffer is flushed first. The first
+    // thread stays alive throughout, so that the two do not share a buffer.
+    {
+        BTree btree;
+        btree.insertBufferSize = 64;
+        std::atomic<int> step(0);
+        std::thread first([&btree, &step]() {
+            btree.insert(7, 1);
+            step = 1;
+            while (step != 2) {
+            }
+        });
+        std::thread second([&btree, &step]() {
+            while (step != 1) {
+            }
+            btree.insert(7, 2);
+            for (Key k = 100; k < 100 + 64; ++k) {
+                btree.insert(k, k);
+            }
+            step = 2;
+        });
+        first.join();
+        second.join();
+
+        Value v;
+        assert(btree.lookup(7, v) && v == 2);
+        btree.flushInsertBuffers();
+        assert(btree.lookup(7, v) && v == 2);
+    }
+
+    // Writers take increasing keys from a shared counter, while a reader
+    // scans the tail of the tree.
+    BTree btree;
+    btree.insertBufferSize = 256;
+    std::atomic<Key> counter(0);
+    std::atomic<bool> writing(true);
+    auto writer = [&btree, &counter]() {
+        for (Key k = counter++; k < N; k = counter++) {
+            btree.insert(k, k);
+        }
+    };
+    auto reader = [&btree, &counter, &writing]() {
+        std::vector<Value> output(1000);
+        while (writing) {
+            Key from = counter > 5000 ? counter - 5000 : 0;
+            uint64_t count = btree.scan(from, 1000, output.data());
+            for (uint64_t i = 0; i < count; ++i) {
+                Value v;
+                assert(btree.lookup(output[i], v) && v == output[i]);
+                if (i > 0) assert(output[i - 1] < output[i]);
+            }
+        }
+    };
+    std::thread readerThread(reader);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_THREADS; ++i) {
+        threads.push_back(std::thread(writer));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    writing = false;
+    readerThread.join();
+
+    std::vector<Value> output(N + 1);
+    assert(btree.scan(0, N + 1, output.data()) == N);
+    for (Key k = 0; k < N; ++k) {
+        Value v;
+        assert(btree.lookup(k, v) && v == k);
+        assert(output[k] == k);
+    }
+    btree.flushInsertBuffers();
+    assert(btree.scanLeaves(0, N + 1, output.data(), nullptr) == N);
+    assert(count_leaves(btree) < N / BTree::Leaf::maxEntries * 11 / 10);
+}
+
+// A B-epsilon tree with small nodes, so that there are a few levels of
+// buffers: newer values win over older ones on their way down, and scans see
+// everything, while other threads keep pushing messages down.
+void test_btree_olc_bepsilon() {
+    std::cout << "test_btree_olc_bepsilon" << std::endl;
+
+    using BTree =
+        btreeolc::BTree<Key, Value, common::search::Simd,
+                        common::split::PositionAware, common::alloc::Default,
+                        256, 512, 50>;
+    constexpr int N = 100000;
+    constexpr int N_WRITERS = 4;
+    constexpr int RANGE = 500;
+
+    {
+        // All keys in `[0, N)`, in a scattered order.
+        BTree btree;
+        for (Key i = 0; i < N; ++i) {
+            Key k = i * 7919 % N;
+            btree.insert(k, k);
+        }
+        for (Key k = 0; k < N; k += 3) {
+            btree.insert(k, -k);
+        }
+        // Some of the entries are still on their way down.
+        std::vector<Value> output(N + 1);
+        assert(btree.root.load()->level >= 2);
+        assert(btree.scanLeaves(0, N + 1, output.data(), nullptr) < N);
+
+        auto expected = [](Key k) { return k % 3 ? k : -k; };
+        assert(btree.scan(0, N + 1, output.data()) == N);
+        for (Key k = 0; k < N; ++k) {
+            Value v;
+            assert(btree.lookup(k, v) && v == expected(k));
+            assert(output[k] == expected(k));
+        }
+        assert(btree.scan(N / 2, RANGE, output.data()) == RANGE);
+        for (int i = 0; i < RANGE; ++i) {
+            assert(output[i] == expected(N / 2 + i));
+        }
+
+        for (Key k = 0; k < N; k += 2) {
+            assert(btree.remove(k));
+        }
+        for (Key k = 0; k < N; ++k) {
+            Value v;
+            assert(btree.lookup(k, v) == (k % 2 == 1));
+        }
+        assert(btree.scan(0, N + 1, output.data()) == N / 2);
+    }
+
+    // Even keys are there from the beginning, while writers insert the odd
+    // ones.
+    BTree btree;
+    for (Key k = 0; k < 2 * N; k += 2) {
+        btree.insert(k, k);
+    }
+    std::atomic<int> writersDone{0};
+    auto writer = [&btree, &writersDone](int id) {
+        for (Key k = 2 * id + 1; k < 2 * N; k += 2 * N_WRITERS) {
+            btree.insert(k, k);
+        }
+        writersDone++;
+    };
+    auto reader = [&btree, &writersDone]() {
+        std::vector<Value> output(RANGE);
+        while (writersDone < N_WRITERS) {
+            for (Key k = 0; k < 2 * N; k += 37 * RANGE) {
+                uint64_t count = btree.scan(k, RANGE, output.data());
+                assert(count == RANGE && output[0] == k);
+                Key even = k;
+                for (uint64_t i = 0; i < count; ++i) {
+                    if (i > 0) assert(output[i - 1] < output[i]);
+                    if (output[i] % 2 == 0) {
+                        assert(output[i] == even);
+                        even += 2;
+                    }
+                }
+                Value v;
+                assert(btree.lookup(k, v) && v == k);
+            }
+        }
+    };
+    std::thread readerThread(reader);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_WRITERS; ++i) {
+        threads.push_back(std::thread(writer, i));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+    readerThread.join();
+
+    std::vector<Value> output(2 * N);
+    assert(btree.scan(0, 2 * N, output.data()) == 2 * N);
+    for (Key k = 0; k < 2 * N; ++k) {
+        Value v;
+        assert(btree.lookup(k, v) && v == k);
+        assert(output[k] == k);
+    }
+}
+
+// In segmented leaves, updates and appends only lock their segment, so they
+// leave the version of the leaf alone. Readers still never see a torn or
+// stale value while writers update and append to the same leaves.
+void test_btree_olc_segments() {
+    std::cout << "test_btree_olc_segments" << std::endl;
+
+    using BTree =
+        btreeolc::BTree<Key, Value, common::search::Simd,
+                        common::split::PositionAware, common::alloc::Default,
+                        btreeolc::pageSize, btreeolc::pageSize, 0, true>;
+    constexpr int N = 100000;
+    constexpr int N_WRITERS = 4;
+    constexpr int HOT = 200;
+
+    {
+        BTree btree;
+        for (Key k = 0; k < 100; k += 2) {
+            btree.insert(k, k);
+        }
+        auto leaf = static_cast<BTree::Leaf *>(btree.root.load());
+        uint64_t version = leaf->typeVersionLockObsolete;
+        btree.insert(10, -10);
+        btree.insert(98, -98);
+        btree.insert(100, 100);
+        assert(leaf->typeVersionLockObsolete == version);
+        assert(leaf->count == 51);
+
+        // Inserts into the middle shift entries, so they lock the leaf.
+        btree.insert(11, 11);
+        assert(leaf->typeVersionLockObsolete != version);
+
+        Value v;
+        assert(btree.lookup(10, v) && v == -10);
+        assert(btree.lookup(98, v) && v == -98);
+        assert(btree.lookup(100, v) && v == 100);
+        std::vector<Value> output(100);
+        assert(btree.scan(10, 3, output.data()) == 3);
+        assert(output[0] == -10 && output[1] == 11 && output[2] == 12);
+    }
+
+    // The values of each key are `k` plus multiples of `N`. Writers update
+    // a few hot keys and append new ones, while readers check what they see.
+    BTree btree;
+    for (Key k = 0; k < HOT; ++k) {
+        btree.insert(k, k);
+    }
+    std::atomic<Key> counter(HOT);
+    std::atomic<int> writersDone{0};
+    auto writer = [&btree, &counter, &writersDone](int id) {
+        for (Key k = counter++; k < N; k = counter++) {
+            btree.insert(k, k);
+            Key hot = (k * 7 + id) % HOT;
+            btree.insert(hot, hot + N * (k % 100));
+        }
+        writersDone++;
+    };
+    auto reader = [&btree, &counter, &writersDone]() {
+        std::vector<Value> output(HOT);
+        while (writersDone < N_WRITERS) {
+            uint64_t count = btree.scan(0, HOT, output.data());
+            assert(count == HOT);
+            for (Key k = 0; k < HOT; ++k) {
+                assert(output[k] % N == k);
+            }
+            Key k = counter - 1;
+            Value v;
+            if (btree.lookup(k, v)) assert(v == k);
+            assert(btree.lookup(k % HOT, v) && v % N == k % HOT);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_WRITERS; ++i) {
+        threads.push_back(std::thread(writer, i));
+        threads.push_back(std::thread(reader));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    std::vector<Value> output(N);
+    assert(btree.scan(0, N, output.data()) == N);
+    for (Key k = 0; k < N; ++k) {
+        assert(output[k] % N == k);
+    }
+}
+
+// Hot leaves are split before they are full, and merged back once they have
+// cooled down.
+void test_btree_olc_contention_splits() {
+    std::cout << "test_btree_olc_contention_splits" << std::endl;
+
+    using BTree = ModeTree<btreeolc::mode::ContentionSplits>;
+    constexpr int N = 100000;
+    constexpr int N_WRITERS = 4;
+    constexpr int HOT = 1000;
+
+    {
+        BTree btree;
+        for (Key k = 0; k < 100; ++k) {
+            btree.insert(k, k);
+        }
+        auto leaf = static_cast<BTree::Leaf *>(btree.root.load());
+        assert(leaf->count == 100);
+
+        // Cold leaves are left alone until they are full.
+        btree.insert(100, 100);
+        assert(btree.root.load() == leaf);
+
+        // Taking the lock right away takes the edge off, too.
+        leaf->contention = btreeolc::OptLock::hotThreshold + 1;
+        btree.insert(101, 101);
+        auto root = static_cast<BTree::Inner *>(btree.root.load());
+        assert(root->type == btreeolc::PageType::BTreeInner);
+        assert(root->count == 1);
+        assert(leaf->count == 50 && leaf->isHotSplit());
+        assert(leaf->next->count == 52 && !leaf->isHot());
+
+        // Uncontended writes cool the left half down.
+        for (int i = 0; i < BTree::coolWrites; ++i) {
+            btree.insert(i % 50, i);
+        }
+        assert(root->count == 0 && leaf->count == 102 &&
+               !leaf->isHotSplit());
+        for (Key k = 0; k < 102; ++k) {
+            Value v;
+            assert(btree.lookup(k, v));
+        }
+    }
+
+    // Writers fight over a few leaves of hot keys, while most keys are
+    // cold.
+    BTree btree;
+    for (Key k = 0; k < N; ++k) {
+        btree.insert(k, k);
+    }
+
+    auto f = [&btree](int id) {
+        for (int i = 0; i < N; ++i) {
+            Key k = (i % 10 == 0) ? N + id * N + i : (i * 7919) % HOT;
+            btree.insert(k, k);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_WRITERS; ++i) {
+        threads.push_back(std::thread(f, i));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (Key k = 0; k < N; ++k) {
+        Value v;
+        assert(btree.lookup(k, v) && v == k);
+    }
+    for (int id = 0; id < N_WRITERS; ++id) {
+        for (int i = 0; i < N; i += 10) {
+            Key k = N + id * N + i;
+            Value v;
+            assert(btree.lookup(k, v) && v == k);
+        }
+    }
+    std::vector<Value> output(N);
+    assert(btree.scan(0, N, output.data()) == N);
+    for (int i = 0; i < N; ++i) {
+        assert(output[i] == i);
+    }
+}
+
+// Concurrent writers of increasing keys into a tree with spare leaves fill
+// every leaf but the last.
+template <class BTree>
+void check_preallocate_concurrent() {
+    constexpr int N = 200000;
+    constexpr int N_WRITERS = 4;
+    constexpr int MAX = BTree::Leaf::maxEntries;
+
+    BTree btree;
+    std::atomic<Key> next{0};
+    auto f = [&btree, &next]() {
+        for (int i = 0; i < N; ++i) {
+            Key k = next++;
+            btree.insert(k, k);
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_WRITERS; ++i) {
+        threads.push_back(std::thread(f));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    std::vector<Value> output(N * N_WRITERS);
+    assert(btree.scan(0, N * N_WRITERS, output.data()) == N * N_WRITERS);
+    for (int i = 0; i < N * N_WRITERS; ++i) {
+        assert(output[i] == i);
+    }
+    assert(count_leaves(btree) < (N * N_WRITERS) / (MAX * 3 / 4));
+}
+
+// The rightmost leaf takes a spare leaf when it is split for an append, and
+// stays full even if the split policy says otherwise.
+void test_btree_olc_preallocate() {
+    std::cout << "test_btree_olc_preallocate" << std::endl;
+
+    using Halve = common::split::Halve;
+    using BTree = ModeTree<btreeolc::mode::Preallocate, Halve>;
+    constexpr int MAX = BTree::Leaf::maxEntries;
+    constexpr int INNER_MAX = BTree::Inner::maxEntries;
+
+    {
+        BTree btree;
+        for (Key k = 0; k < MAX / 2 - 1; ++k) {
+            btree.insert(k, k);
+        }
+        assert(!btree.spareLeaf.load());
+        btree.insert(MAX / 2 - 1, 0);
+        BTree::Leaf *spare = btree.spareLeaf;
+        assert(spare);
+
+        for (Key k = MAX / 2; k <= MAX; ++k) {
+            btree.insert(k, k);
+        }
+        auto root = static_cast<BTree::Inner *>(btree.root.load());
+        assert(root->count == 1 && root->children[1] == spare);
+        assert(root->children[0]->count == MAX && spare->count == 1);
+
+        // Inserts into the middle still split in the middle.
+        for (Key k = MAX + 1; k < 3 * MAX; ++k) {
+            btree.insert(k, k);
+        }
+        btree.insert(-1, -1);
+        assert(root->count == 3 && root->children[0]->count == MAX / 2 + 1);
+
+        // The parents on the right edge are split ahead of time, keeping
+        // all but their last child.
+        for (Key k = 3 * MAX; k < 2 * INNER_MAX * MAX; ++k) {
+            btree.insert(k, k);
+        }
+        auto parent = static_cast<BTree::Inner *>(btree.root.load());
+        parent = static_cast<BTree::Inner *>(parent->children[0]);
+        assert(parent->level == 1 && parent->next);
+        for (; parent->next;
+             parent = static_cast<BTree::Inner *>(parent->next)) {
+            assert(parent->count == INNER_MAX - 2);
+        }
+    }
+
+    check_preallocate_concurrent<BTree>();
+    check_preallocate_concurrent<
+        ModeTree<btreeolc::mode::Preallocate | btreeolc::mode::Append,
+                 Halve>>();
+}
+
+// Counters are incremented by concurrent upserts, while other threads insert
+// around them, with the newest values in any place the tree can keep them.
+template <class BTree>
+void check_read_modify_write(BTree &btree) {
+    constexpr int N = 200000;
+    constexpr int N_THREADS = 4;
+    constexpr int N_KEYS = 1000;
+
+    // The counters are every tenth key; the others are overwritten.
+    for (Key k = 0; k < 10 * N_KEYS; ++k) {
+        btree.insert(k, k % 10 ? -1 : 0);
+    }
+
+    auto f = [&btree](int id) {
+        for (int i = 0; i < N; ++i) {
+            Key k = (i * 7919 + id) % N_KEYS;
+            if (id % 2) {
+                btree.upsert(10 * k, [](Value &value) { value++; });
+            } else {
+                btree.insert(10 * k + 1 + id, 10 * k + 1 + id);
+            }
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_THREADS; ++i) {
+        threads.push_back(std::thread(f, i));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    Value total = 0;
+    for (Key k = 0; k < 10 * N_KEYS; k += 10) {
+        Value v;
+        assert(btree.lookup(k, v));
+        total += v;
+        assert(!btree.insert_if_absent(k, 0));
+        assert(btree.update_if_present(k + 1, 0));
+        assert(btree.get_or_insert(k + 1, -1, v) == false && v == 0);
+    }
+    assert(total == N * (N_THREADS / 2));
+}
+
+void test_btree_olc_read_modify_write() {
+    std::cout << "test_btree_olc_read_modify_write" << std::endl;
+
+    using Default = common::alloc::Default;
+    using Split = common::split::PositionAware;
+    using Simd = common::search::Simd;
+    {
+        ModeTree<btreeolc::mode::FlatCombining | btreeolc::mode::Append>
+            btree;
+        check_read_modify_write(btree);
+    }
+    {
+        btreeolc::BTree<Key, Value> btree;
+        btree.insertBufferSize = 64;
+        check_read_modify_write(btree);
+    }
+    {
+        btreeolc::BTree<Key, Value, Simd, Split, Default, 256, 512, 50> btree;
+        check_read_modify_write(btree);
+    }
+    {
+        btreeolc::BTree<Key, Value, Simd, Split, Default, btreeolc::pageSize,
+                        btreeolc::pageSize, 0, true>
+            btree;
+        check_read_modify_write(btree);
+    }
+
+    // Only real inserts split full leaves.
+    {
+        std::vector<std::pair<Key, Value>> pairs;
+        for (Key k = 0; k < 100000; ++k) {
+            pairs.push_back(std::make_pair(2 * k, k));
+        }
+        btreeolc::BTree<Key, Value> btree(pairs.begin(), pairs.end());
+        size_t leaves = count_leaves(btree);
+        for (Key k = 0; k < 100000; k += 100) {
+            Value v;
+            assert(!btree.update_if_present(2 * k + 1, 0));
+            assert(!btree.get_or_insert(2 * k, -1, v) && v == k);
+            assert(!btree.insert_if_absent(2 * k, -1));
+        }
+        assert(count_leaves(btree) == leaves);
+        Value v;
+        assert(btree.insert_if_absent(1, -1));
+        assert(btree.get_or_insert(3, -3, v) && v == -3);
+        assert(count_leaves(btree) == leaves + 1);
+        assert(btree.lookup(1, v) && v == -1);
+        assert(btree.lookup(3, v) && v == -3);
+    }
+}
+
+// Redistributing two inner nodes keeps all keys and children in order, in
+// either direction.
+void test_btree_olc_redistribute_inner() {
+    std::cout << "test_btree_olc_redistribute_inner" << std::endl;
+
+    typedef btreeolc::BTree<Key, Value>::Inner Inner;
+    auto child = [](unsigned i) {
+        return reinterpret_cast<btreeolc::NodeBase *>(uintptr_t(i + 1) * 64);
+    };
+    // Keys 0, 2, 4, ... with child `i` left of key `2 * i`, split after
+    // `leftKeys` keys, for every possible split.
+    const unsigned total = 41;
+    for (unsigned leftKeys = 0; leftKeys < total; ++leftKeys) {
+        Inner *left = new Inner();
+        Inner *right = new Inner();
+        left->next = right;
+        left->count = leftKeys;
+        for (unsigned i = 0; i < leftKeys; ++i) {
+            left->keys[i] = 2 * i;
+        }
+        for (unsigned i = 0; i <= leftKeys; ++i) {
+            left->children[i] = child(i);
+        }
+        Key sep = 2 * leftKeys;
+        right->count = total - leftKeys - 1;
+        for (unsigned i = 0; i < right->count; ++i) {
+            right->keys[i] = 2 * (leftKeys + 1 + i);
+        }
+        for (unsigned i = 0; i <= right->count; ++i) {
+            right->children[i] = child(leftKeys + 1 + i);
+        }
+
+        left->redistribute(right, sep);
+        assert(left->count == total / 2);
+        assert(left->count + 1 + right->count == total);
+        assert(sep == Key(2 * left->count) && left->highKey == sep);
+        for (unsigned i = 0; i < left->count; ++i) {
+            assert(left->keys[i] == Key(2 * i));
+        }
+        for (unsigned i = 0; i <= left->count; ++i) {
+            assert(left->children[i] == child(i));
+        }
+        for (unsigned i = 0; i < right->count; ++i) {
+            assert(right->keys[i] == Key(2 * (left->count + 1 + i)));
+        }
+        for (unsigned i = 0; i <= right->count; ++i) {
+            assert(right->children[i] == child(left->count + 1 + i));
+        }
+        delete left;
+        delete right;
+    }
+}
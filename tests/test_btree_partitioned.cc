@@ -0,0 +1,214 @@
+#include "test-utils.h"
+
+#include "btree-bytereorder.h"
+#include "btree-hybrid.h"
+#include "btree-partitioned.h"
+#include "btreeolc.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using Key = int64_t;
+using Value = int64_t;
+using Entry = btree_partitioned::Entry<Key, Value>;
+
+typedef btree_partitioned::PartitionedBTree<Key, Value,
+                                            btreeolc::BTree<Key, Entry>>
+    OLCForest;
+
+template <class Tree>
+void test_partitioned_routing(const char *name, bool scans);
+void test_partitioned_split();
+void test_partitioned_split_concurrent();
+void test_partitioned_hot_appends();
+
+int main() {
+    test_partitioned_routing<btreeolc::BTree<Key, Entry>>("olc", true);
+    test_partitioned_routing<btree_hybrid::BTree<Key, Entry>>("hybrid", false);
+    test_partitioned_routing<btree_bytereorder::BTree<
+        Key, Entry, common::search::Simd, common::alloc::Default,
+        btree_bytereorder::pageSize, btree_bytereorder::pageSize,
+        common::key::Identity>>("br", true);
+    test_partitioned_split();
+    test_partitioned_split_concurrent();
+    test_partitioned_hot_appends();
+
+    std::cout << "SUCCESS :)" << std::endl;
+}
+
+// Check that `forest` has exactly the entries in `pairs`, which are sorted,
+// and that scans return them in order across partitions.
+template <class Forest>
+void check_contents(Forest &forest,
+                    const std::vector<std::pair<Key, Value>> &pairs,
+                    bool scans) {
+    for (const auto &pair : pairs) {
+        Value v;
+        assert(forest.lookup(pair.first, v) && v == pair.second);
+    }
+    if (!scans) return;
+
+    constexpr int RANGE = 500;
+    std::vector<Value> output(RANGE);
+    for (size_t i = 0; i < pairs.size(); i += 997) {
+        size_t j = i;
+        while (j < pairs.size()) {
+            uint64_t n = forest.scan(pairs[j].first, RANGE, output.data());
+            assert(n > 0 && j + n <= pairs.size());
+            for (uint64_t l = 0; l < n; ++l) {
+                assert(output[l] == pairs[j + l].second);
+            }
+            j += n;
+            if (j - i > 5000) break;
+        }
+    }
+}
+
+// Each kind of tree works in a forest with fixed partitions.
+template <class Tree>
+void test_partitioned_routing(const char *name, bool scans) {
+    std::cout << "test_partitioned_routing<" << name << ">" << std::endl;
+
+    constexpr int N = 100000;
+    const std::vector<Key> bounds = {1 << 20, 1 << 24, 1 << 28, 1 << 30};
+    btree_partitioned::PartitionedBTree<Key, Value, Tree> forest(bounds);
+    forest.splitHot = false;
+
+    auto pairs = gen_data<Key, Value>(N);
+    for (const auto &pair : pairs) {
+        forest.insert(pair.first, pair.second);
+    }
+    std::sort(pairs.begin(), pairs.end());
+    check_contents(forest, pairs, scans);
+    assert(forest.bounds() == bounds);
+
+    // Read-modify-writes and removes go to the right partition, too.
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        Value result;
+        assert(!forest.get_or_insert(pairs[i].first, -1, result) &&
+               result == pairs[i].second);
+        if (i % 2) {
+            assert(forest.remove(pairs[i].first));
+        } else {
+            forest.upsert(pairs[i].first, [](Value &v) { v++; });
+        }
+    }
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        Value v;
+        assert(forest.lookup(pairs[i].first, v) == (i % 2 == 0));
+        assert(i % 2 || v == pairs[i].second + 1);
+    }
+}
+
+// A split moves the entries from the split key on into a new partition.
+void test_partitioned_split() {
+    std::cout << "test_partitioned_split" << std::endl;
+
+    constexpr size_t N = 100000;
+    auto pairs = gen_data_seq<Key, Value>(N);
+    OLCForest forest(pairs.begin(), pairs.end(), {50000});
+    forest.splitHot = false;
+    check_contents(forest, pairs, true);
+
+    assert(forest.split(25000));
+    assert(forest.split(75000));
+    assert(forest.split(75001));
+    assert(forest.split(-5));
+    assert(forest.split(N + 10));
+    assert(!forest.split(50000));
+    assert(!forest.split(75001));
+    assert(forest.bounds() ==
+           std::vector<Key>({-5, 25000, 50000, 75000, 75001, N + 10}));
+    check_contents(forest, pairs, true);
+
+    // Each entry is in one partition only: removing it once removes it.
+    for (const auto &pair : pairs) {
+        assert(forest.remove(pair.first));
+        Value v;
+        assert(!forest.lookup(pair.first, v));
+    }
+    Value output[10];
+    assert(forest.scan(0, 10, output) == 0);
+}
+
+// Operations see all entries while partitions are split under them.
+void test_partitioned_split_concurrent() {
+    std::cout << "test_partitioned_split_concurrent" << std::endl;
+
+    constexpr int W = 4;
+    constexpr Key N = 50000;
+    OLCForest forest;
+    forest.splitHot = false;
+
+    // Keys below N are there from the start, the others are inserted while
+    // the forest is split.
+    for (Key k = 0; k < N; ++k) {
+        forest.insert(k, k);
+    }
+    std::atomic<bool> done{false};
+    std::vector<std::thread> threads;
+    for (int w = 0; w < W; ++w) {
+        threads.push_back(std::thread([&forest, &done, w]() {
+            for (Key k = N + w; k < 3 * N; k += W) {
+                forest.insert(k, k);
+                Value v;
+                Key old = k % N;
+                assert(forest.lookup(old, v) && v == old);
+                assert(forest.update_if_present(old, old));
+            }
+            while (!done) {
+            }
+        }));
+    }
+    for (Key sep = 1000; sep < 3 * N; sep += 5000) {
+        assert(forest.split(sep));
+    }
+    done = true;
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    std::vector<std::pair<Key, Value>> pairs;
+    for (Key k = 0; k < 3 * N; ++k) {
+        pairs.push_back(std::make_pair(k, k));
+    }
+    check_contents(forest, pairs, true);
+}
+
+// Concurrent appends past cold data split the forest on their own, and the
+// cold data stays in the first partition.
+void test_partitioned_hot_appends() {
+    std::cout << "test_partitioned_hot_appends" << std::endl;
+
+    constexpr int W = 4;
+    constexpr Key N = 100000;
+    constexpr Key M = 200000;
+    auto pairs = gen_data_seq<Key, Value>(N);
+    OLCForest forest(pairs.begin(), pairs.end());
+
+    std::atomic<Key> counter{N};
+    std::vector<std::thread> threads;
+    for (int w = 0; w < W; ++w) {
+        threads.push_back(std::thread([&forest, &counter]() {
+            for (Key k = counter++; k < N + M; k = counter++) {
+                forest.insert(k, k);
+            }
+        }));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    std::vector<Key> bounds = forest.bounds();
+    assert(!bounds.empty());
+    assert(bounds.size() < forest.maxPartitions);
+    assert(bounds.front() > N);
+    for (Key k = N; k < N + M; ++k) {
+        pairs.push_back(std::make_pair(k, k));
+    }
+    check_contents(forest, pairs, true);
+}
@@ -0,0 +1,330 @@
+#include "test-utils.h"
+
+#include "btree-varkey.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Value = int64_t;
+using BTree = btree_varkey::BTree<Value>;
+
+void test_btree_varkey_insert_lookup();
+void test_btree_varkey_edge_keys();
+void test_btree_varkey_scan();
+void test_btree_varkey_remove();
+void test_btree_varkey_read_modify_write();
+void test_btree_varkey_split_on_insert();
+void test_btree_varkey_concurrent();
+
+int main() {
+    test_btree_varkey_insert_lookup();
+    test_btree_varkey_edge_keys();
+    test_btree_varkey_scan();
+    test_btree_varkey_remove();
+    test_btree_varkey_read_modify_write();
+    test_btree_varkey_split_on_insert();
+    test_btree_varkey_concurrent();
+
+    std::cout << "SUCCESS :)" << std::endl;
+}
+
+// A string key with a long shared prefix, as in a path or a composite key.
+std::string make_key(int i) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "tenant/%03d/user/%08d", i % 7, i);
+    return buf;
+}
+
+// Random keys of random lengths, mapped to their index.
+std::map<std::string, Value> gen_string_data(size_t n) {
+    std::map<std::string, Value> pairs;
+    srand(0);
+    while (pairs.size() < n) {
+        std::string k = make_key(rand());
+        k.append(rand() % 40, 'a' + rand() % 26);
+        pairs[k] = pairs.size();
+    }
+    return pairs;
+}
+
+void test_btree_varkey_insert_lookup() {
+    std::cout << "test_btree_varkey_insert_lookup" << std::endl;
+
+    constexpr size_t N = 100000;
+    BTree btree;
+
+    const auto pairs = gen_string_data(N);
+    for (const auto &pair : pairs) {
+        btree.insert(pair.first, pair.second);
+    }
+    for (const auto &pair : pairs) {
+        Value v;
+        assert(btree.lookup(pair.first, v) && v == pair.second);
+    }
+
+    // Keys that are not there, including prefixes and extensions of keys
+    // that are.
+    for (const auto &pair : pairs) {
+        Value v;
+        if (!pairs.count(pair.first + "!")) {
+            assert(!btree.lookup(pair.first + "!", v));
+        }
+        std::string shorter = pair.first.substr(0, pair.first.size() - 1);
+        if (!pairs.count(shorter)) {
+            assert(!btree.lookup(shorter, v));
+        }
+    }
+
+    // Overwrite
+    for (const auto &pair : pairs) {
+        btree.insert(pair.first, -pair.second);
+    }
+    for (const auto &pair : pairs) {
+        Value v;
+        assert(btree.lookup(pair.first, v) && v == -pair.second);
+    }
+}
+
+// Keys that differ only in their length, in zero bytes or in bytes past the
+// head, keys of the max length, and the empty key.
+void test_btree_varkey_edge_keys() {
+    std::cout << "test_btree_varkey_edge_keys" << std::endl;
+
+    BTree btree;
+    std::map<std::string, Value> pairs;
+    std::string zero(1, '\0');
+    for (const std::string &k :
+         {std::string(), zero, zero + zero, std::string("a"), "a" + zero,
+          std::string("ab"), std::string("abcd"), "abcd" + zero,
+          std::string("abcde"), std::string("\xff\xff"),
+          std::string("\x7f\x80")}) {
+        pairs[k] = pairs.size();
+    }
+    std::string prefix(BTree::maxKeyLength - 8, 'p');
+    for (int i = 0; i < 10000; ++i) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%08d", i);
+        pairs[prefix + buf] = i;
+        pairs[std::string(buf) + prefix] = i;
+    }
+
+    for (const auto &pair : pairs) {
+        btree.insert(pair.first, pair.second);
+    }
+    for (const auto &pair : pairs) {
+        Value v;
+        assert(btree.lookup(pair.first, v) && v == pair.second);
+    }
+    Value v;
+    assert(!btree.lookup("abc", v));
+    assert(!btree.lookup(prefix, v));
+
+    // All of them come back in order.
+    std::vector<Value> output(pairs.size() + 1);
+    assert(btree.scan(std::string(), output.size(), output.data()) ==
+           pairs.size());
+    size_t i = 0;
+    for (const auto &pair : pairs) {
+        assert(output[i++] == pair.second);
+    }
+}
+
+// Scans return values in key order, across leaves, from any start key.
+void test_btree_varkey_scan() {
+    std::cout << "test_btree_varkey_scan" << std::endl;
+
+    constexpr size_t N = 50000;
+    constexpr int RANGE = 1000;
+    BTree btree;
+
+    const auto pairs = gen_string_data(N);
+    std::vector<std::string> keys;
+    std::vector<Value> values;
+    for (const auto &pair : pairs) {
+        btree.insert(pair.first, pair.second);
+        keys.push_back(pair.first);
+        values.push_back(pair.second);
+    }
+
+    std::vector<Value> output(RANGE);
+    for (size_t i = 0; i < N; i += 997) {
+        // From a key in the tree, and from right before it.
+        for (const std::string &start :
+             {keys[i], keys[i].substr(0, keys[i].size() - 1)}) {
+            uint64_t n = btree.scan(start, RANGE, output.data());
+            assert(n == std::min<uint64_t>(RANGE, N - i));
+            for (uint64_t j = 0; j < n; ++j) {
+                assert(output[j] == values[i + j]);
+            }
+        }
+    }
+
+    // Past the end
+    assert(btree.scan("~", RANGE, output.data()) == 0);
+}
+
+// Removed keys are gone, and their space is reused.
+void test_btree_varkey_remove() {
+    std::cout << "test_btree_varkey_remove" << std::endl;
+
+    constexpr size_t N = 50000;
+    BTree btree;
+
+    const auto pairs = gen_string_data(N);
+    for (int round = 0; round < 3; ++round) {
+        for (const auto &pair : pairs) {
+            btree.insert(pair.first, pair.second);
+        }
+        bool odd = false;
+        for (const auto &pair : pairs) {
+            if ((odd = !odd)) {
+                assert(btree.remove(pair.first));
+                assert(!btree.remove(pair.first));
+            }
+        }
+        odd = false;
+        for (const auto &pair : pairs) {
+            Value v;
+            odd = !odd;
+            assert(btree.lookup(pair.first, v) == !odd);
+            assert(odd || v == pair.second);
+        }
+    }
+
+    for (const auto &pair : pairs) {
+        btree.remove(pair.first);
+    }
+    Value v;
+    assert(btree.scan(std::string(), 1, &v) == 0);
+}
+
+void test_btree_varkey_read_modify_write() {
+    std::cout << "test_btree_varkey_read_modify_write" << std::endl;
+
+    BTree btree;
+    Value v;
+
+    assert(btree.insert_if_absent("key", 1));
+    assert(!btree.insert_if_absent("key", 2));
+    assert(btree.lookup("key", v) && v == 1);
+
+    assert(btree.update_if_present("key", 3));
+    assert(!btree.update_if_present("other", 4));
+    assert(btree.lookup("key", v) && v == 3);
+    assert(!btree.lookup("other", v));
+
+    assert(!btree.get_or_insert("key", 5, v) && v == 3);
+    assert(btree.get_or_insert("other", 6, v) && v == 6);
+
+    assert(btree.upsert("count", [](Value &value) { value += 10; }));
+    assert(!btree.upsert("count", [](Value &value) { value += 10; }));
+    assert(btree.lookup("count", v) && v == 20);
+}
+
+// Plain `new` and `delete` that keep count of the nodes in use.
+struct CountingAlloc {
+    static std::atomic<long> nodes;
+
+    static void *allocate(size_t size) {
+        nodes++;
+        return common::alloc::Malloc::allocate(size);
+    }
+    static void deallocate(void *p, size_t size) {
+        nodes--;
+        common::alloc::Malloc::deallocate(p, size);
+    }
+};
+std::atomic<long> CountingAlloc::nodes{0};
+
+// Leaves are split only for keys that are inserted: misses that insert
+// nothing leave the tree as it is, however full its leaves are.
+void test_btree_varkey_split_on_insert() {
+    std::cout << "test_btree_varkey_split_on_insert" << std::endl;
+
+    // Insert in random order, so that leaves are left at all fill levels.
+    btree_varkey::BTree<Value, CountingAlloc> btree;
+    auto pairs = gen_string_data(20000);
+    std::vector<std::pair<std::string, Value>> shuffled(pairs.begin(),
+                                                        pairs.end());
+    std::shuffle(shuffled.begin(), shuffled.end(), std::mt19937(0));
+    for (const auto &pair : shuffled) {
+        btree.insert(pair.first, pair.second);
+    }
+    long nodes = CountingAlloc::nodes;
+
+    // Keys just after each key in the tree land in every leaf, full or not.
+    Value v;
+    for (const auto &pair : pairs) {
+        std::string k = pair.first + '!';
+        assert(!btree.update_if_present(k, 1));
+        assert(!btree.update_if_present(k + "0123456789abcdef", 1));
+        assert(btree.update_if_present(pair.first, pair.second + 1));
+    }
+    assert(CountingAlloc::nodes == nodes);
+    for (const auto &pair : pairs) {
+        assert(btree.lookup(pair.first, v) && v == pair.second + 1);
+        assert(!btree.lookup(pair.first + '!', v));
+    }
+
+    // A real insert into a full leaf still splits it, and the key goes to
+    // the right half.
+    for (const auto &pair : pairs) {
+        std::string k = pair.first + '!';
+        assert(btree.insert_if_absent(k, pair.second));
+        assert(btree.lookup(k, v) && v == pair.second);
+    }
+    assert(CountingAlloc::nodes > nodes);
+    for (const auto &pair : pairs) {
+        assert(btree.lookup(pair.first, v) && v == pair.second + 1);
+        assert(btree.lookup(pair.first + '!', v) && v == pair.second);
+    }
+}
+
+// Writers of disjoint keys and of shared counters, with concurrent readers.
+void test_btree_varkey_concurrent() {
+    std::cout << "test_btree_varkey_concurrent" << std::endl;
+
+    constexpr int N_THREADS = 8;
+    constexpr int N = 20000;
+    constexpr int COUNTERS = 10;
+    BTree btree;
+
+    auto f = [&btree](int id) {
+        for (int i = id; i < N * N_THREADS; i += N_THREADS) {
+            btree.insert(make_key(i), i);
+            btree.upsert("counter/" + std::to_string(i % COUNTERS),
+                         [](Value &value) { value++; });
+
+            // Our own keys are there, whatever the others are doing.
+            Value v;
+            int j = i - N_THREADS * (i % 5);
+            assert(j < 0 || (btree.lookup(make_key(j), v) && v == j));
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_THREADS; ++i) {
+        threads.push_back(std::thread(f, i));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (int i = 0; i < N * N_THREADS; ++i) {
+        Value v;
+        assert(btree.lookup(make_key(i), v) && v == i);
+    }
+    for (int i = 0; i < COUNTERS; ++i) {
+        Value v;
+        assert(btree.lookup("counter/" + std::to_string(i), v));
+        assert(v == N * N_THREADS / COUNTERS);
+    }
+}
@@ -0,0 +1,132 @@
+#include "epoch.h"
+
+#include <atomic>
+#include <cassert>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+void test_retire_synchronize();
+void test_guard_blocks_free();
+void test_nested_guards();
+void test_retire_concurrent();
+
+int main() {
+    test_retire_synchronize();
+    test_guard_blocks_free();
+    test_nested_guards();
+    test_retire_concurrent();
+
+    std::cout << "SUCCESS :)" << std::endl;
+}
+
+// The number of objects freed by `count_free`.
+std::atomic<size_t> freed{0};
+
+void count_free(void *p) {
+    delete static_cast<uint64_t *>(p);
+    freed++;
+}
+
+// Retired objects are freed after `synchronize`.
+void test_retire_synchronize() {
+    std::cout << "test_retire_synchronize" << std::endl;
+
+    freed = 0;
+    for (int i = 0; i < 10; ++i) {
+        common::epoch::retire(new uint64_t(i), count_free);
+    }
+
+    common::epoch::manager().synchronize();
+    assert(freed == 10);
+}
+
+// A thread inside a guard prevents the epoch from advancing, so nothing
+// retired after it entered can be freed.
+void test_guard_blocks_free() {
+    std::cout << "test_guard_blocks_free" << std::endl;
+
+    freed = 0;
+    std::atomic<bool> entered{false};
+    std::atomic<bool> done{false};
+
+    std::thread reader([&]() {
+        common::epoch::Guard guard;
+        entered = true;
+        while (!done) {
+        }
+    });
+
+    while (!entered) {
+    }
+
+    auto &mgr = common::epoch::manager();
+    for (size_t i = 0; i < 4 * common::epoch::Manager::BatchSize; ++i) {
+        mgr.retire(new uint64_t(i), count_free);
+    }
+
+    // The reader pins the epoch it entered in, so we can advance at most once.
+    mgr.tryAdvance();
+    mgr.tryAdvance();
+    assert(freed == 0);
+
+    done = true;
+    reader.join();
+
+    mgr.synchronize();
+    assert(freed == 4 * common::epoch::Manager::BatchSize);
+}
+
+// Only the outermost guard announces and clears the epoch.
+void test_nested_guards() {
+    std::cout << "test_nested_guards" << std::endl;
+
+    auto &mgr = common::epoch::manager();
+    {
+        common::epoch::Guard outer;
+        {
+            common::epoch::Guard inner;
+        }
+
+        // Still inside `outer`, so the epoch can advance at most once more.
+        uint64_t e = mgr.current();
+        mgr.tryAdvance();
+        mgr.tryAdvance();
+        mgr.tryAdvance();
+        assert(mgr.current() <= e + 1);
+    }
+
+    uint64_t e = mgr.current();
+    assert(mgr.tryAdvance());
+    assert(mgr.current() == e + 1);
+}
+
+// Many threads retire objects while others read. Everything is freed exactly
+// once in the end.
+void test_retire_concurrent() {
+    std::cout << "test_retire_concurrent" << std::endl;
+
+    constexpr int N_THREADS = 8;
+    constexpr int N_RETIRE = 10000;
+
+    freed = 0;
+
+    auto f = []() {
+        for (int i = 0; i < N_RETIRE; ++i) {
+            common::epoch::Guard guard;
+            common::epoch::retire(new uint64_t(i), count_free);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < N_THREADS; ++i) {
+        threads.push_back(std::thread(f));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    // Exited threads leave their limbo lists behind as orphans.
+    common::epoch::manager().synchronize();
+    assert(freed == N_THREADS * N_RETIRE);
+}
@@ -0,0 +1,106 @@
+#include "test-utils.h"
+
+#include "btree-bytereorder.h"
+#include "layout.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+using Key = int64_t;
+using Value = int64_t;
+
+template <class Layout>
+void test_layout(const char *name);
+
+int main() {
+    test_layout<common::layout::Separate>("Separate");
+    test_layout<common::layout::PaddedHeader>("PaddedHeader");
+    test_layout<common::layout::Interleaved>("Interleaved");
+    test_layout<common::layout::BySize>("BySize");
+
+    std::cout << "SUCCESS :)" << std::endl;
+}
+
+// Where the entries are, and how many fit.
+template <class Layout>
+void check_leaf(bool padded, bool interleaved) {
+    typedef btree_bytereorder::BTreeLeaf<Key, Value, common::search::Simd,
+                                         common::alloc::Default,
+                                         btree_bytereorder::pageSize, Layout>
+        Leaf;
+
+    static_assert(sizeof(Leaf) <= btree_bytereorder::pageSize,
+                  "a leaf must fit in a page");
+
+    Leaf *leaf = new Leaf();
+    size_t offset = reinterpret_cast<char *>(&leaf->key(0)) -
+                    reinterpret_cast<char *>(leaf);
+    if (padded) {
+        assert(offset == common::layout::cacheLineSize);
+        assert(reinterpret_cast<uintptr_t>(&leaf->key(0)) %
+                   common::layout::cacheLineSize ==
+               0);
+    } else {
+        assert(offset < common::layout::cacheLineSize);
+    }
+
+    // A key and its payload are next to each other only if interleaved.
+    ptrdiff_t distance = reinterpret_cast<char *>(&leaf->payload(1)) -
+                         reinterpret_cast<char *>(&leaf->key(1));
+    assert((distance == ptrdiff_t(sizeof(Key))) == interleaved);
+    delete leaf;
+}
+
+// The leaves of a tree with each layout behave the same.
+template <class Layout>
+void test_layout(const char *name) {
+    std::cout << "test_layout<" << name << ">" << std::endl;
+
+    using common::layout::BySize;
+    using common::layout::Interleaved;
+    using common::layout::Separate;
+    check_leaf<Layout>(!std::is_same<Layout, Separate>::value,
+                       std::is_same<Layout, Interleaved>::value ||
+                           std::is_same<Layout, BySize>::value);
+
+    constexpr int N = 100000;
+    constexpr int RANGE = 500;
+    btree_bytereorder::BTree<Key, Value, common::search::Simd,
+                             common::alloc::Default,
+                             btree_bytereorder::pageSize,
+                             btree_bytereorder::pageSize,
+                             common::key::Identity, Layout>
+        btree;
+
+    auto pairs = gen_data<Key, Value>(N);
+    for (const auto &pair : pairs) {
+        btree.insert(pair.first, pair.second);
+    }
+    for (const auto &pair : pairs) {
+        Value v;
+        assert(btree.lookup(pair.first, v) && v == pair.second);
+    }
+
+    // Scans of a tree without byte reordering are in key order.
+    std::sort(pairs.begin(), pairs.end());
+    std::vector<Value> output(RANGE);
+    for (size_t i = 0; i < pairs.size(); i += 1009) {
+        uint64_t n = btree.scan(pairs[i].first, RANGE, output.data());
+        assert(n > 0 && i + n <= pairs.size());
+        for (uint64_t j = 0; j < n; ++j) {
+            assert(output[j] == pairs[i + j].second);
+        }
+    }
+
+    for (size_t i = 0; i < pairs.size(); i += 2) {
+        assert(btree.remove(pairs[i].first));
+    }
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        Value v;
+        assert(btree.lookup(pairs[i].first, v) == (i % 2 == 1));
+    }
+}
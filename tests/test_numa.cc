@@ -0,0 +1,175 @@
+#include "test-utils.h"
+
+#include "btree-bytereorder.h"
+#include "numa.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using Key = int64_t;
+using Value = int64_t;
+
+// Small nodes, so that the trees are tall.
+typedef btree_bytereorder::BTree<Key, Value, common::search::Simd,
+                                 common::alloc::Default, 256, 256,
+                                 common::key::Identity>
+    BTree;
+
+void test_numa_topology();
+void test_numa_allocate();
+void test_numa_replicated_levels(unsigned levels);
+void test_numa_replicated_concurrent(unsigned levels);
+void test_numa_replicated_bulk_load();
+
+int main() {
+    test_numa_topology();
+    test_numa_allocate();
+    for (unsigned levels = 1; levels <= 3; ++levels) {
+        test_numa_replicated_levels(levels);
+        test_numa_replicated_concurrent(levels);
+    }
+    test_numa_replicated_bulk_load();
+
+    std::cout << "SUCCESS :)" << std::endl;
+}
+
+// Every CPU is on a node, and every thread is on one of the first nodes.
+void test_numa_topology() {
+    std::cout << "test_numa_topology" << std::endl;
+
+    int count = common::numa::nodeCount();
+    assert(count >= 1 && count <= common::numa::maxNodes);
+    assert(!common::numa::cpuNodes().empty());
+    for (int node : common::numa::cpuNodes()) {
+        assert(node >= 0);
+    }
+    int node = common::numa::currentNode();
+    assert(node >= 0 && node < common::numa::maxNodes);
+}
+
+// Memory of each node can be used and freed.
+void test_numa_allocate() {
+    std::cout << "test_numa_allocate" << std::endl;
+
+    std::vector<char *> ps;
+    for (int node = 0; node < common::numa::maxNodes; ++node) {
+        char *p = static_cast<char *>(common::numa::allocate(node, 4096));
+        memset(p, node, 4096);
+        ps.push_back(p);
+    }
+    for (int node = 0; node < common::numa::maxNodes; ++node) {
+        assert(ps[node][0] == node && ps[node][4095] == node);
+        common::numa::deallocate(node, ps[node], 4096);
+    }
+}
+
+// A tree with replicated levels grows through all of them and keeps all
+// entries.
+void test_numa_replicated_levels(unsigned levels) {
+    std::cout << "test_numa_replicated_levels(" << levels << ")" << std::endl;
+
+    constexpr int N = 100000;
+    constexpr int RANGE = 100;
+    BTree btree;
+    btree.replicatedLevels = levels;
+
+    // Lookups after every insert keep the replicas busy while the top levels
+    // change.
+    auto pairs = gen_data<Key, Value>(N);
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        btree.insert(pairs[i].first, pairs[i].second);
+        Value v;
+        assert(btree.lookup(pairs[i / 2].first, v) &&
+               v == pairs[i / 2].second);
+    }
+    for (const auto &pair : pairs) {
+        Value v;
+        assert(btree.lookup(pair.first, v) && v == pair.second);
+    }
+
+    std::sort(pairs.begin(), pairs.end());
+    std::vector<Value> output(RANGE);
+    for (size_t i = 0; i < pairs.size(); i += 1009) {
+        uint64_t n = btree.scan(pairs[i].first, RANGE, output.data());
+        assert(n > 0 && i + n <= pairs.size());
+        for (uint64_t j = 0; j < n; ++j) {
+            assert(output[j] == pairs[i + j].second);
+        }
+    }
+
+    for (size_t i = 0; i < pairs.size(); i += 2) {
+        assert(btree.remove(pairs[i].first));
+    }
+    for (size_t i = 0; i < pairs.size(); ++i) {
+        Value v;
+        assert(btree.lookup(pairs[i].first, v) == (i % 2 == 1));
+    }
+}
+
+// Concurrent writers split the replicated levels while readers go through
+// the replicas.
+void test_numa_replicated_concurrent(unsigned levels) {
+    std::cout << "test_numa_replicated_concurrent(" << levels << ")"
+              << std::endl;
+
+    constexpr int W = 4;
+    constexpr int R = 4;
+    constexpr Key N = 20000;
+    BTree btree;
+    btree.replicatedLevels = levels;
+
+    // Writer `w` inserts the keys that are `w` modulo `W`, so that all of
+    // them split the same nodes.
+    std::vector<std::thread> threads;
+    for (int w = 0; w < W; ++w) {
+        threads.push_back(std::thread([&btree, w]() {
+            for (Key k = w; k < N * W; k += W) {
+                btree.insert(k, k + 1);
+            }
+        }));
+    }
+    // Readers only ever see the right values.
+    for (int r = 0; r < R; ++r) {
+        threads.push_back(std::thread([&btree, r]() {
+            for (Key k = r; k < N * W; k += R) {
+                Value v;
+                if (btree.lookup(k, v)) assert(v == k + 1);
+            }
+        }));
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (Key k = 0; k < N * W; ++k) {
+        Value v;
+        assert(btree.lookup(k, v) && v == k + 1);
+    }
+}
+
+// A bulk-loaded tree is replicated on first use.
+void test_numa_replicated_bulk_load() {
+    std::cout << "test_numa_replicated_bulk_load" << std::endl;
+
+    constexpr size_t N = 100000;
+    auto pairs = gen_data_seq<Key, Value>(N);
+    BTree btree(pairs.begin(), pairs.end(), 0.5);
+    btree.replicatedLevels = 2;
+
+    for (const auto &pair : pairs) {
+        Value v;
+        assert(btree.lookup(pair.first, v) && v == pair.second);
+    }
+    for (const auto &pair : pairs) {
+        btree.insert(pair.first + N, pair.second);
+    }
+    for (const auto &pair : pairs) {
+        Value v;
+        assert(btree.lookup(pair.first, v) && v == pair.second);
+        assert(btree.lookup(pair.first + N, v) && v == pair.second);
+    }
+}
@@ -0,0 +1,78 @@
+#include "search.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+template <typename Key>
+void test_lower_bound(const char *name);
+
+int main() {
+    std::cout << "best ISA: " << static_cast<int>(common::search::bestIsa())
+              << std::endl;
+
+    test_lower_bound<int64_t>("int64_t");
+    test_lower_bound<uint64_t>("uint64_t");
+    test_lower_bound<unsigned long long>("unsigned long long");
+    test_lower_bound<int32_t>("int32_t");
+    test_lower_bound<uint32_t>("uint32_t");
+    test_lower_bound<double>("double");
+
+    std::cout << "SUCCESS :)" << std::endl;
+}
+
+// Check a single search against `std::lower_bound` with all policies and all
+// instruction sets this CPU supports.
+template <typename Key>
+void check(const std::vector<Key> &keys, Key k) {
+    const unsigned count = keys.size();
+    const unsigned expected =
+        std::lower_bound(keys.begin(), keys.end(), k) - keys.begin();
+
+    assert(common::search::Binary::lowerBound(keys.data(), count, k) ==
+           expected);
+    assert(common::search::BranchFree::lowerBound(keys.data(), count, k) ==
+           expected);
+    assert(common::search::Simd::lowerBound(keys.data(), count, k) ==
+           expected);
+
+    const int best = static_cast<int>(common::search::bestIsa());
+    for (int isa = 0; isa <= best; ++isa) {
+        assert(common::search::lowerBoundIsa(
+                   static_cast<common::search::Isa>(isa), keys.data(), count,
+                   k) == expected);
+    }
+}
+
+// Search for present keys, absent keys, and keys at the extremes of the
+// domain in sorted arrays of all sizes up to a little more than a node.
+template <typename Key>
+void test_lower_bound(const char *name) {
+    std::cout << "test_lower_bound<" << name << ">" << std::endl;
+
+    srand(0);
+
+    for (unsigned n = 0; n <= 300; ++n) {
+        // Spread keys over the whole domain, including negative values for
+        // signed types, to catch signedness bugs in the kernels.
+        std::vector<Key> keys;
+        for (unsigned i = 0; i < n; ++i) {
+            uint64_t r = ((uint64_t)rand() << 33) ^ ((uint64_t)rand() << 2);
+            keys.push_back(static_cast<Key>(r));
+        }
+        std::sort(keys.begin(), keys.end());
+        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+        for (const auto &k : keys) {
+            check(keys, k);
+            check(keys, static_cast<Key>(k + 1));
+            check(keys, static_cast<Key>(k - 1));
+        }
+        check(keys, static_cast<Key>(0));
+        check(keys, std::numeric_limits<Key>::lowest());
+        check(keys, std::numeric_limits<Key>::max());
+    }
+}
@@ -1,14 +1,18 @@
 
+#include "key-transform.h"
 #include "util.h"
 
+#include <cstdint>
 #include <iostream>
 
 void test_maybe();
 void test_range_map_simple();
+void test_key_transform();
 
 int main() {
     test_maybe();
     test_range_map_simple();
+    test_key_transform();
 
     std::cout << "SUCCESS :)" << std::endl;
 }
@@ -69,3 +73,26 @@ void test_range_map_simple() {
     assert(!rm.find(30));
     assert(rm.size() == 0);
 }
+
+void test_key_transform() {
+    std::cout << "test_key_transform" << std::endl;
+
+    using common::key::ByteReorder;
+    using common::key::Identity;
+
+    assert(Identity::apply<int64_t>(1234) == 1234);
+    assert(ByteReorder::apply<uint64_t>(0x0102030405060708ull) ==
+           0x0708030405060102ull);
+    assert(ByteReorder::apply<uint32_t>(0x01020304u) == 0x03040102u);
+
+    // Both are their own inverse, and only `Identity` keeps keys in order.
+    bool ordered = true;
+    for (uint64_t k = 0; k < 100000; k += 7) {
+        assert(Identity::apply(Identity::apply(k)) == k);
+        assert(ByteReorder::apply(ByteReorder::apply(k)) == k);
+        ordered = ordered &&
+                  ByteReorder::apply(k) < ByteReorder::apply(k + 7);
+    }
+    assert(!ordered && !ByteReorder::preservesOrder);
+    assert(Identity::preservesOrder);
+}